@@ -83,6 +83,10 @@ pub enum HfShare {
     /// Retain ownership and access but additionally allow access to the
     /// recipient.
     Share = 2,
+
+    /// As `Give`, but return before the memory is cleared. The recipient has the memory cleared as
+    /// it first accesses it, and the hypervisor clears the rest while the primary VM is idle.
+    GiveLazy = 3,
 }
 
 impl HfVCpuRunReturn {
@@ -103,6 +107,27 @@ impl HfVCpuRunReturn {
     }
 }
 
+/// A direct switch from one secondary vCPU to another on a physical CPU, without going through the
+/// primary VM. The primary VM retrieves these with HF_VCPU_HANDOFF_GET to account for the time the
+/// vCPUs ran.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct HfVCpuHandoff {
+    pub from_vm_id: spci_vm_id_t,
+    pub from_vcpu: spci_vcpu_index_t,
+    pub to_vm_id: spci_vm_id_t,
+    pub to_vcpu: spci_vcpu_index_t,
+}
+
+impl HfVCpuHandoff {
+    /// Encode an HfVCpuHandoff struct in the 64-bit packing ABI.
+    pub fn into_raw(self) -> u64 {
+        (u64::from(self.from_vm_id) << 48)
+            | (u64::from(self.from_vcpu) << 32)
+            | (u64::from(self.to_vm_id) << 16)
+            | u64::from(self.to_vcpu)
+    }
+}
+
 impl TryFrom<usize> for HfShare {
     type Error = ();
 
@@ -111,6 +136,7 @@ impl TryFrom<usize> for HfShare {
             0 => Ok(Self::Give),
             1 => Ok(Self::Lend),
             2 => Ok(Self::Share),
+            3 => Ok(Self::GiveLazy),
             _ => Err(()),
         }
     }
@@ -195,4 +221,16 @@ mod test {
         let res = HfVCpuRunReturn::Aborted;
         assert_eq!(res.into_raw(), 7);
     }
+
+    /// Encode a handoff without leaking.
+    #[test]
+    fn abi_hf_vcpu_handoff_encode() {
+        let handoff = HfVCpuHandoff {
+            from_vm_id: 0x1234,
+            from_vcpu: 0xabcd,
+            to_vm_id: 0x5678,
+            to_vcpu: 0xef01,
+        };
+        assert_eq!(handoff.into_raw(), 0x1234abcd5678ef01);
+    }
 }
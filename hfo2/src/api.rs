@@ -28,7 +28,11 @@ use crate::types::*;
 // To eliminate the risk of deadlocks, we define a partial order for the acquisition of locks held
 // concurrently by the same physical CPU. Our current ordering requirements are as follows:
 //
-// vcpu::execution_lock -> vm::lock -> vcpu::interrupts_lock -> mm_stage1_lock -> dlog sl
+// vcpu::execution_lock -> vm::mailbox -> vm::memory -> vcpu::interrupts_lock -> mm_stage1_lock
+//     -> ownership -> vm::log_buffer -> dlog sl
+//
+// The mailbox, memory and log buffer of a VM are locked separately, so e.g. sending a message to a
+// VM doesn't wait for a concurrent update of its memory.
 //
 // Locks of the same kind require the lock of lowest address to be locked first, see
 // `sl_lock_both()`.
@@ -52,6 +56,42 @@ pub unsafe extern "C" fn api_wait_for_interrupt(current: *const VCpu) -> *const
     hypervisor().wait_for_interrupt(&mut current)
 }
 
+/// The number of pages zeroed in advance each time the primary VM's vCPU traps on WFI.
+const ZEROED_REFILL_BATCH: usize = 4;
+
+/// Zeroes free pages of the hypervisor's page pool in advance while the primary VM is idle, so
+/// that page tables can later be allocated without initialising them. Returns whether any page was
+/// zeroed.
+#[no_mangle]
+pub extern "C" fn api_refill_zeroed_pages() -> bool {
+    hypervisor().mpool.refill_zeroed(ZEROED_REFILL_BATCH) != 0
+}
+
+/// Returns whether the hypervisor's page pool holds fewer zeroed pages than its target, that is,
+/// whether the primary VM's WFI should be trapped to call `api_refill_zeroed_pages()`.
+#[no_mangle]
+pub extern "C" fn api_zeroed_pages_wanted() -> bool {
+    hypervisor().mpool.zeroed_wanted()
+}
+
+/// The number of pages of memory given lazily to VMs cleared each time the primary VM's vCPU traps
+/// on WFI.
+const UNCLEARED_DRAIN_BATCH: usize = 64;
+
+/// Clears memory given lazily to VMs that they have not accessed yet while the primary VM is idle,
+/// so that VMs fault on less of it. Returns whether any page was cleared.
+#[no_mangle]
+pub extern "C" fn api_clear_uncleared_memory() -> bool {
+    hypervisor().clear_uncleared_pending(UNCLEARED_DRAIN_BATCH) != 0
+}
+
+/// Returns whether any memory given lazily to VMs may still be uncleared, that is, whether the
+/// primary VM's WFI should be trapped to call `api_clear_uncleared_memory()`.
+#[no_mangle]
+pub extern "C" fn api_uncleared_memory_pending() -> bool {
+    hypervisor().uncleared_pending()
+}
+
 /// Puts the current vCPU in off mode, and returns to the primary VM.
 #[no_mangle]
 pub unsafe extern "C" fn api_vcpu_off(current: *const VCpu) -> *const VCpu {
@@ -124,9 +164,16 @@ pub unsafe extern "C" fn api_vcpu_get_count(
 /// and can therefore be used by other pcpus.
 #[no_mangle]
 pub unsafe extern "C" fn api_regs_state_saved(current: *const VCpu) {
+    let vm = (*current).vm();
     let mut current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
-    if (*current).vm().id != HF_PRIMARY_VM_ID {
+    if vm.id != HF_PRIMARY_VM_ID {
+        // A vCPU that aborted itself is only counted once it no longer runs, so that its VM is not
+        // reclaimed under it.
+        let aborted = current.get_inner().state == VCpuStatus::Aborted;
         ManuallyDrop::drop(&mut current);
+        if aborted {
+            hypervisor().vcpu_aborted(vm);
+        }
     }
 }
 
@@ -150,6 +197,17 @@ pub unsafe extern "C" fn api_vcpu_run(
     HfVCpuRunReturn::Preempted.into_raw()
 }
 
+/// Retrieves the next direct handoff between secondary vCPUs on the calling pCPU.
+///
+/// Returns -1 if there are none or the caller is not the primary VM, or the encoded handoff.
+#[no_mangle]
+pub unsafe extern "C" fn api_vcpu_handoff_get(current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    let handoff = some_or!(hypervisor().vcpu_handoff_get(&current), return -1);
+
+    handoff.into_raw() as i64
+}
+
 /// Configures the VM to send/receive data through the specified pages. The
 /// pages must not be shared.
 ///
@@ -342,6 +400,18 @@ pub unsafe extern "C" fn api_share_memory(
     }
 }
 
+/// Returns the ID of the VM owning the page at the given address, 0 if the hypervisor owns it, or
+/// -1 if no one does or the caller is not the primary VM.
+#[no_mangle]
+pub unsafe extern "C" fn api_memory_owner_get(addr: ipaddr_t, current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+
+    match hypervisor().memory_owner_get(addr, &current) {
+        Ok(vm_id) => vm_id as i64,
+        Err(_) => -1,
+    }
+}
+
 /// Returns the version of the implemented SPCI specification.
 #[no_mangle]
 pub extern "C" fn api_spci_version() -> i32 {
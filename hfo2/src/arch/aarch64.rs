@@ -18,9 +18,13 @@
 #![allow(non_camel_case_types)]
 
 use core::mem;
+use core::sync::atomic::AtomicU64;
 
 use crate::cpu::*;
 use crate::types::*;
+use crate::vm::*;
+
+pub mod mm;
 
 const FLOAT_REG_BYTES: usize = 16;
 
@@ -55,11 +59,10 @@ const_assert_eq!(mem::size_of::<float_reg>(), FLOAT_REG_BYTES);
 /// Arch-specific information about a VM.
 #[repr(C)]
 pub struct ArchVm {
-    /// The index of the last vCPU of this VM which ran on each pCPU. Each
-    /// element of this array should only be read or written by code running
-    /// on that CPU, which avoids contention and so no lock is needed to
-    /// access this field.
-    last_vcpu_on_cpu: [spci_vcpu_index_t; MAX_CPUS],
+    /// The generation and VMID allocated to each vCPU of the VM, by vCPU
+    /// index, with the VMID in the low 16 bits. See
+    /// src/arch/aarch64/hypervisor/vmid.c.
+    vmid: [AtomicU64; MAX_CPUS],
 }
 
 /// Type to represent the register state of a vCPU.
@@ -82,6 +85,7 @@ pub struct ArchRegs {
     // TODO: 'hikey' environment has GIC version 2.
     //#[cfg(any(feature = "GIC_VERSION=3", feature = "GIC_VERSION=4"))]
     gic_ich_hcr_el2: uintreg_t,
+    gic_icc_sre_el2: uintreg_t,
 
     /// Peripheral registers, handled separately from other system registers.
     peripherals: ArchPeriRegs,
@@ -91,11 +95,13 @@ pub struct ArchRegs {
 // Note: always keep this constants same as ones in offset.h
 const CPU_ID: usize = 0;
 const CPU_STACK_BOTTOM: usize = 8;
+const VCPU_VM: usize = 0;
 const VCPU_REGS: usize = 32;
 const REGS_LAZY: usize = 264;
 const REGS_FREGS: usize = REGS_LAZY + 248;
 //#[cfg(any(feature = "GIC_VERSION=3", feature = "GIC_VERSION=4"))]
 const REGS_GIC: usize = REGS_FREGS + 528;
+const VM_ID: usize = 0;
 
 /// Checks above constants are correct.
 /// HfO2: This checking was originally done in compile time in C. But it was
@@ -105,6 +111,7 @@ const REGS_GIC: usize = REGS_FREGS + 528;
 pub fn arch_cpu_module_init() {
     assert_eq!(offset_of!(Cpu, id), CPU_ID);
     assert_eq!(offset_of!(Cpu, stack_bottom), CPU_STACK_BOTTOM);
+    assert_eq!(offset_of!(VCpu, vm), VCPU_VM);
     // assert_eq!(
     //     offset_of!(VCpu, inner)
     //     + 8 // expected value of offset_of!(SpinLock<VCpuState>, data), but it
@@ -115,6 +122,7 @@ pub fn arch_cpu_module_init() {
     assert_eq!(offset_of!(ArchRegs, lazy), REGS_LAZY);
     assert_eq!(offset_of!(ArchRegs, fp), REGS_FREGS);
     assert_eq!(offset_of!(ArchRegs, gic_ich_hcr_el2), REGS_GIC);
+    assert_eq!(offset_of!(Vm, id), VM_ID);
 }
 
 #[repr(C)]
@@ -150,6 +158,7 @@ pub struct ArchSysRegs {
     cnthctl_el2: uintreg_t,
     vttbr_el2: uintreg_t,
     mdcr_el2: uintreg_t,
+    mdscr_el1: uintreg_t,
 }
 
 #[repr(C)]
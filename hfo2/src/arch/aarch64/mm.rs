@@ -0,0 +1,396 @@
+/*
+ * Copyright 2019 Sanguk Park.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Encoding of aarch64 page table entries.
+//!
+//! These are called once per entry when walking page tables, so they are implemented here to be
+//! inlined into `mm.rs` rather than called across the FFI boundary. The `arch_mm_*` functions
+//! declared in `inc/hf/arch/mm.h` are thin exports of them for the C code.
+
+use crate::addr::*;
+use crate::page::*;
+
+use super::pte_t;
+
+// from src/arch/aarch64/mm.c
+// Note: always keep this constants same as ones in mm.c
+const PTE_VALID: u64 = 1 << 0;
+const PTE_LEVEL0_BLOCK: u64 = 1 << 1;
+const PTE_TABLE: u64 = 1 << 1;
+
+const STAGE1_XN: u64 = 1 << 54;
+const STAGE1_PXN: u64 = 1 << 53;
+const STAGE1_CONTIGUOUS: u64 = 1 << 52;
+const STAGE1_AP2: u64 = 1 << 7;
+const STAGE1_AP1: u64 = 1 << 6;
+const STAGE1_NS: u64 = 1 << 5;
+
+const TABLE_NSTABLE: u64 = 1 << 63;
+const TABLE_APTABLE1: u64 = 1 << 62;
+const TABLE_APTABLE0: u64 = 1 << 61;
+const TABLE_XNTABLE: u64 = 1 << 60;
+const TABLE_PXNTABLE: u64 = 1 << 59;
+
+const TABLE_SW_DIRTY: u64 = 1 << 58;
+const TABLE_SW_UNIFORM: u64 = 1 << 57;
+
+/// The number of present entries of the referenced table is kept in bits 11:2, which are ignored
+/// by the hardware in table descriptors. The tables of the larger granules have more entries, so
+/// the high bits of the count are kept in bits 56:52, which are ignored as well.
+///
+/// Every ignored bit of a table descriptor is in use, so the count can't avoid the bits that mean
+/// something else in block descriptors, such as the contiguous hint in bit 52 and
+/// `STAGE2_SW_OWNED` in bit 55. These bits are reinterpreted in table entries, so the functions
+/// reading them from a block must check that the entry is a block first.
+const TABLE_SW_COUNT_LOW_SHIFT: u64 = 2;
+const TABLE_SW_COUNT_LOW_BITS: u64 = 10;
+const TABLE_SW_COUNT_LOW_MASK: u64 =
+    ((1 << TABLE_SW_COUNT_LOW_BITS) - 1) << TABLE_SW_COUNT_LOW_SHIFT;
+const TABLE_SW_COUNT_HIGH_SHIFT: u64 = 52;
+const TABLE_SW_COUNT_HIGH_MASK: u64 = 0x1f << TABLE_SW_COUNT_HIGH_SHIFT;
+
+// A table of the 64KiB granule has 8192 entries, so the count takes 14 bits.
+const_assert!(PAGE_LEVEL_BITS < 15);
+
+const STAGE2_CONTIGUOUS: u64 = 1 << 52;
+const STAGE2_SW_OWNED: u64 = 1 << 55;
+
+/// Mask for the address bits of the pte.
+const PTE_ADDR_MASK: u64 = ((1 << 48) - 1) & !((1 << PAGE_BITS) - 1);
+
+/// The contiguous hint is the same bit in both stages.
+const PTE_CONTIGUOUS: u64 = STAGE1_CONTIGUOUS;
+const_assert_eq!(STAGE1_CONTIGUOUS, STAGE2_CONTIGUOUS);
+
+/// Mask for the attribute bits of the pte. The contiguous hint is not an attribute of the memory,
+/// but of how the entry is laid out in the table.
+const PTE_ATTR_MASK: u64 = !(PTE_ADDR_MASK | PTE_CONTIGUOUS | (1 << 1));
+
+/// The number of entries in a contiguous run. With the 4KiB granule it is 16 at every level, with
+/// the 16KiB granule it is 128 for pages, and with the 64KiB granule it is 32 at every level.
+#[cfg(not(any(feature = "granule-16k", feature = "granule-64k")))]
+pub const CONTIGUOUS_ENTRIES: usize = 16;
+#[cfg(feature = "granule-16k")]
+pub const CONTIGUOUS_ENTRIES: usize = 128;
+#[cfg(feature = "granule-64k")]
+pub const CONTIGUOUS_ENTRIES: usize = 32;
+
+/// Returns the encoding of a page table entry that isn't present.
+#[inline]
+pub fn absent_pte(_level: u8) -> pte_t {
+    0
+}
+
+/// Converts a physical address to a table PTE.
+///
+/// The spec says that 'Table descriptors for stage 2 translations do not include any attribute
+/// field', so we don't take any attributes as arguments.
+#[inline]
+pub fn table_pte(_level: u8, pa: paddr_t) -> pte_t {
+    // This is the same for all levels on aarch64.
+    pa_addr(pa) as u64 | PTE_TABLE | PTE_VALID
+}
+
+/// Converts a physical address to a block PTE.
+///
+/// The level must allow block entries.
+#[inline]
+pub fn block_pte(level: u8, pa: paddr_t, attrs: u64) -> pte_t {
+    let pte = pa_addr(pa) as u64 | attrs;
+
+    if level == 0 {
+        // A level 0 'block' is actually a page entry.
+        pte | PTE_LEVEL0_BLOCK
+    } else {
+        pte
+    }
+}
+
+/// Specifies whether block mappings are acceptable at the given level.
+///
+/// Level 0 must allow block entries. The 4KiB granule has blocks of 2MiB and 1GiB, while the larger
+/// granules only have blocks at level 1, of 32MiB or 512MiB.
+#[inline]
+pub fn is_block_allowed(level: u8) -> bool {
+    if PAGE_BITS == 12 {
+        level <= 2
+    } else {
+        level <= 1
+    }
+}
+
+/// Determines if the given pte is present, i.e., if it is valid or it is invalid but still holds
+/// state about the memory so needs to be present in the table.
+#[inline]
+pub fn pte_is_present(pte: pte_t, level: u8) -> bool {
+    pte_is_valid(pte, level) || (pte & STAGE2_SW_OWNED) != 0
+}
+
+/// Determines if the given pte is valid, i.e., if it points to another table, to a page, or a
+/// block of pages that can be accessed.
+#[inline]
+pub fn pte_is_valid(pte: pte_t, _level: u8) -> bool {
+    (pte & PTE_VALID) != 0
+}
+
+/// Determines if the given pte references a block of pages.
+#[inline]
+pub fn pte_is_block(pte: pte_t, level: u8) -> bool {
+    // We count pages at level 0 as blocks.
+    is_block_allowed(level)
+        && if level == 0 {
+            (pte & PTE_LEVEL0_BLOCK) != 0
+        } else {
+            pte_is_present(pte, level) && !pte_is_table(pte, level)
+        }
+}
+
+/// Determines if the given pte references another table.
+#[inline]
+pub fn pte_is_table(pte: pte_t, level: u8) -> bool {
+    level != 0 && pte_is_valid(pte, level) && (pte & PTE_TABLE) != 0
+}
+
+/// Determines if the given table pte is marked dirty. The mark is kept in a bit that is ignored by
+/// the hardware in table descriptors.
+#[inline]
+pub fn table_pte_is_dirty(pte: pte_t, _level: u8) -> bool {
+    (pte & TABLE_SW_DIRTY) != 0
+}
+
+/// Sets or clears the dirty mark of the given table pte.
+#[inline]
+pub fn table_pte_set_dirty(pte: pte_t, _level: u8, dirty: bool) -> pte_t {
+    if dirty {
+        pte | TABLE_SW_DIRTY
+    } else {
+        pte & !TABLE_SW_DIRTY
+    }
+}
+
+/// Returns the number of present entries in the table referenced by the given table pte, as
+/// recorded in the pte.
+#[inline]
+pub fn table_pte_present_count(pte: pte_t, _level: u8) -> usize {
+    let low = (pte & TABLE_SW_COUNT_LOW_MASK) >> TABLE_SW_COUNT_LOW_SHIFT;
+    let high = (pte & TABLE_SW_COUNT_HIGH_MASK) >> TABLE_SW_COUNT_HIGH_SHIFT;
+    (low | (high << TABLE_SW_COUNT_LOW_BITS)) as usize
+}
+
+/// Records the number of present entries in the table referenced by the given table pte.
+#[inline]
+pub fn table_pte_set_present_count(pte: pte_t, _level: u8, count: usize) -> pte_t {
+    let count = count as u64;
+    let low = (count << TABLE_SW_COUNT_LOW_SHIFT) & TABLE_SW_COUNT_LOW_MASK;
+    let high = ((count >> TABLE_SW_COUNT_LOW_BITS) << TABLE_SW_COUNT_HIGH_SHIFT)
+        & TABLE_SW_COUNT_HIGH_MASK;
+    (pte & !(TABLE_SW_COUNT_LOW_MASK | TABLE_SW_COUNT_HIGH_MASK)) | low | high
+}
+
+/// Determines if the given table pte is marked uniform, i.e., if all the entries of the table it
+/// references are blocks with the same attributes, or are all absent.
+#[inline]
+pub fn table_pte_is_uniform(pte: pte_t, _level: u8) -> bool {
+    (pte & TABLE_SW_UNIFORM) != 0
+}
+
+/// Sets or clears the uniform mark of the given table pte.
+#[inline]
+pub fn table_pte_set_uniform(pte: pte_t, _level: u8, uniform: bool) -> pte_t {
+    if uniform {
+        pte | TABLE_SW_UNIFORM
+    } else {
+        pte & !TABLE_SW_UNIFORM
+    }
+}
+
+/// Specifies whether the contiguous hint may be used at the given level. It is allowed for pages
+/// and for all block sizes, except with the 16KiB granule whose runs of blocks have a different
+/// length than its runs of pages, so the hint is only used for pages.
+#[inline]
+pub fn is_contiguous_allowed(level: u8) -> bool {
+    if cfg!(feature = "granule-16k") {
+        level == 0
+    } else {
+        is_block_allowed(level)
+    }
+}
+
+/// Determines if the given pte is a block with the contiguous hint, i.e., it is one of an aligned
+/// run of `CONTIGUOUS_ENTRIES` entries that the TLB may cache as one. The hint is in the bits of a
+/// table entry that hold the count of its present entries, so tables never have it.
+#[inline]
+pub fn pte_is_contiguous(pte: pte_t, level: u8) -> bool {
+    pte_is_block(pte, level) && (pte & PTE_CONTIGUOUS) != 0
+}
+
+/// Sets or clears the contiguous hint of the given block pte.
+#[inline]
+pub fn pte_set_contiguous(pte: pte_t, _level: u8, contiguous: bool) -> pte_t {
+    if contiguous {
+        pte | PTE_CONTIGUOUS
+    } else {
+        pte & !PTE_CONTIGUOUS
+    }
+}
+
+#[inline]
+fn pte_addr(pte: pte_t) -> u64 {
+    pte & PTE_ADDR_MASK
+}
+
+/// Clears the given physical address, i.e., clears the bits of the address that are not used in
+/// the pte.
+#[inline]
+pub fn clear_pa(pa: paddr_t) -> paddr_t {
+    pa_init(pte_addr(pa_addr(pa) as u64) as usize)
+}
+
+/// Extracts the physical address of the block referred to by the given page table entry.
+#[inline]
+pub fn block_from_pte(pte: pte_t, _level: u8) -> paddr_t {
+    pa_init(pte_addr(pte) as usize)
+}
+
+/// Extracts the physical address of the page table referred to by the given page table entry.
+#[inline]
+pub fn table_from_pte(pte: pte_t, _level: u8) -> paddr_t {
+    pa_init(pte_addr(pte) as usize)
+}
+
+/// Extracts the architecture specific attributes applies to the given page table entry.
+#[inline]
+pub fn pte_attrs(pte: pte_t, _level: u8) -> u64 {
+    pte & PTE_ATTR_MASK
+}
+
+/// Given the attrs from a table at some level and the attrs from all the blocks in that table,
+/// returns equivalent attrs to use for a block which will replace the entire table.
+#[inline]
+pub fn combine_table_entry_attrs(table_attrs: u64, block_attrs: u64) -> u64 {
+    let mut block_attrs = block_attrs;
+
+    // Only stage 1 table descriptors have attributes, but the bits are res0 for stage 2 table
+    // descriptors so this code is safe for both.
+    if table_attrs & TABLE_NSTABLE != 0 {
+        block_attrs |= STAGE1_NS;
+    }
+    if table_attrs & TABLE_APTABLE1 != 0 {
+        block_attrs |= STAGE1_AP2;
+    }
+    if table_attrs & TABLE_APTABLE0 != 0 {
+        block_attrs &= !STAGE1_AP1;
+    }
+    if table_attrs & TABLE_XNTABLE != 0 {
+        block_attrs |= STAGE1_XN;
+    }
+    if table_attrs & TABLE_PXNTABLE != 0 {
+        block_attrs |= STAGE1_PXN;
+    }
+    block_attrs
+}
+
+// Exports for the C code.
+
+#[no_mangle]
+pub extern "C" fn arch_mm_absent_pte(level: u8) -> pte_t {
+    absent_pte(level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte(level: u8, pa: paddr_t) -> pte_t {
+    table_pte(level, pa)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_block_pte(level: u8, pa: paddr_t, attrs: u64) -> pte_t {
+    block_pte(level, pa, attrs)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_is_block_allowed(level: u8) -> bool {
+    is_block_allowed(level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_present(pte: pte_t, level: u8) -> bool {
+    pte_is_present(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_valid(pte: pte_t, level: u8) -> bool {
+    pte_is_valid(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_block(pte: pte_t, level: u8) -> bool {
+    pte_is_block(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_table(pte: pte_t, level: u8) -> bool {
+    pte_is_table(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_is_dirty(pte: pte_t, level: u8) -> bool {
+    table_pte_is_dirty(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_set_dirty(pte: pte_t, level: u8, dirty: bool) -> pte_t {
+    table_pte_set_dirty(pte, level, dirty)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_present_count(pte: pte_t, level: u8) -> usize {
+    table_pte_present_count(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_is_uniform(pte: pte_t, level: u8) -> bool {
+    table_pte_is_uniform(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_contiguous(pte: pte_t, level: u8) -> bool {
+    pte_is_contiguous(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_clear_pa(pa: paddr_t) -> paddr_t {
+    clear_pa(pa)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_block_from_pte(pte: pte_t, level: u8) -> paddr_t {
+    block_from_pte(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_from_pte(pte: pte_t, level: u8) -> paddr_t {
+    table_from_pte(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_attrs(pte: pte_t, level: u8) -> u64 {
+    pte_attrs(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_combine_table_entry_attrs(table_attrs: u64, block_attrs: u64) -> u64 {
+    combine_table_entry_attrs(table_attrs, block_attrs)
+}
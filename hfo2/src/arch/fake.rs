@@ -19,6 +19,8 @@
 
 use crate::types::*;
 
+pub mod mm;
+
 /// The integer type corresponding to the native register size.
 pub type uintreg_t = u64;
 
@@ -0,0 +1,286 @@
+/*
+ * Copyright 2019 Sanguk Park.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Encoding of page table entries of the fake architecture.
+//!
+//! These are called once per entry when walking page tables, so they are implemented here to be
+//! inlined into `mm.rs` rather than called across the FFI boundary. The `arch_mm_*` functions
+//! declared in `inc/hf/arch/mm.h` are thin exports of them for the C code.
+
+use crate::addr::*;
+use crate::mm::Mode;
+use crate::page::*;
+
+use super::pte_t;
+
+/// The fake architecture uses the mode flags to represent the attributes applied to memory. The
+/// flags are shifted to avoid equality of modes and attributes.
+const PTE_ATTR_MODE_SHIFT: usize = 48;
+const PTE_ATTR_MODE_MASK: u64 = (Mode::all().bits() as u64) << PTE_ATTR_MODE_SHIFT;
+
+/// The bit to distinguish a table from a block is the highest of the page bits.
+const PTE_TABLE: u64 = 1 << (PAGE_BITS - 1);
+
+/// The dirty mark of a table is the next highest of the page bits.
+const PTE_TABLE_DIRTY: u64 = 1 << (PAGE_BITS - 2);
+
+/// The contiguous hint of a block is the third highest of the page bits.
+const PTE_CONTIGUOUS: u64 = 1 << (PAGE_BITS - 3);
+
+/// The number of entries in a contiguous run.
+pub const CONTIGUOUS_ENTRIES: usize = 16;
+
+/// The number of present entries of the referenced table, and its uniform mark, are kept in the top
+/// bits of a table entry. They are not offset by level, as the offset address of a table never
+/// reaches them. The tables of the larger granules have more entries, so the high bits of the
+/// count are kept in the bottom bits, which the offset flags of a table never reach either.
+const PTE_TABLE_COUNT_LOW_SHIFT: u64 = 53;
+const PTE_TABLE_COUNT_LOW_BITS: u64 = 10;
+const PTE_TABLE_COUNT_LOW_MASK: u64 =
+    ((1 << PTE_TABLE_COUNT_LOW_BITS) - 1) << PTE_TABLE_COUNT_LOW_SHIFT;
+const PTE_TABLE_COUNT_HIGH_MASK: u64 = 0xf;
+const PTE_TABLE_UNIFORM: u64 = 1 << 63;
+
+/// Mask for the address part of an entry.
+const PTE_ADDR_MASK: u64 = ((1 << PTE_ATTR_MODE_SHIFT) - 1) & !((1 << PAGE_BITS) - 1);
+
+/// Offset the bits of each level so they can't be misued.
+#[inline]
+const fn pte_level_shift(level: u8) -> u64 {
+    level as u64 * 2
+}
+
+#[inline]
+pub fn absent_pte(level: u8) -> pte_t {
+    ((Mode::INVALID | Mode::UNOWNED | Mode::SHARED).bits() as u64) << PTE_ATTR_MODE_SHIFT
+        >> pte_level_shift(level)
+}
+
+#[inline]
+pub fn table_pte(level: u8, pa: paddr_t) -> pte_t {
+    (pa_addr(pa) as u64 | PTE_TABLE) >> pte_level_shift(level)
+}
+
+#[inline]
+pub fn block_pte(level: u8, pa: paddr_t, attrs: u64) -> pte_t {
+    (pa_addr(pa) as u64 | attrs) >> pte_level_shift(level)
+}
+
+#[inline]
+pub fn is_block_allowed(_level: u8) -> bool {
+    true
+}
+
+#[inline]
+pub fn pte_is_present(pte: pte_t, level: u8) -> bool {
+    pte_is_valid(pte, level)
+        || ((pte << pte_level_shift(level)) >> PTE_ATTR_MODE_SHIFT) & Mode::UNOWNED.bits() as u64
+            == 0
+}
+
+#[inline]
+pub fn pte_is_valid(pte: pte_t, level: u8) -> bool {
+    ((pte << pte_level_shift(level)) >> PTE_ATTR_MODE_SHIFT) & Mode::INVALID.bits() as u64 == 0
+}
+
+#[inline]
+pub fn pte_is_block(pte: pte_t, level: u8) -> bool {
+    pte_is_present(pte, level) && !pte_is_table(pte, level)
+}
+
+#[inline]
+pub fn pte_is_table(pte: pte_t, level: u8) -> bool {
+    (pte << pte_level_shift(level)) & PTE_TABLE != 0
+}
+
+#[inline]
+pub fn table_pte_is_dirty(pte: pte_t, level: u8) -> bool {
+    (pte << pte_level_shift(level)) & PTE_TABLE_DIRTY != 0
+}
+
+#[inline]
+pub fn table_pte_set_dirty(pte: pte_t, level: u8, dirty: bool) -> pte_t {
+    if dirty {
+        pte | (PTE_TABLE_DIRTY >> pte_level_shift(level))
+    } else {
+        pte & !(PTE_TABLE_DIRTY >> pte_level_shift(level))
+    }
+}
+
+#[inline]
+pub fn table_pte_present_count(pte: pte_t, _level: u8) -> usize {
+    let low = (pte & PTE_TABLE_COUNT_LOW_MASK) >> PTE_TABLE_COUNT_LOW_SHIFT;
+    let high = pte & PTE_TABLE_COUNT_HIGH_MASK;
+    (low | (high << PTE_TABLE_COUNT_LOW_BITS)) as usize
+}
+
+#[inline]
+pub fn table_pte_set_present_count(pte: pte_t, _level: u8, count: usize) -> pte_t {
+    let count = count as u64;
+    let low = (count << PTE_TABLE_COUNT_LOW_SHIFT) & PTE_TABLE_COUNT_LOW_MASK;
+    let high = (count >> PTE_TABLE_COUNT_LOW_BITS) & PTE_TABLE_COUNT_HIGH_MASK;
+    (pte & !(PTE_TABLE_COUNT_LOW_MASK | PTE_TABLE_COUNT_HIGH_MASK)) | low | high
+}
+
+#[inline]
+pub fn table_pte_is_uniform(pte: pte_t, _level: u8) -> bool {
+    pte & PTE_TABLE_UNIFORM != 0
+}
+
+#[inline]
+pub fn table_pte_set_uniform(pte: pte_t, _level: u8, uniform: bool) -> pte_t {
+    if uniform {
+        pte | PTE_TABLE_UNIFORM
+    } else {
+        pte & !PTE_TABLE_UNIFORM
+    }
+}
+
+#[inline]
+pub fn is_contiguous_allowed(_level: u8) -> bool {
+    true
+}
+
+#[inline]
+pub fn pte_is_contiguous(pte: pte_t, level: u8) -> bool {
+    pte_is_block(pte, level) && (pte << pte_level_shift(level)) & PTE_CONTIGUOUS != 0
+}
+
+#[inline]
+pub fn pte_set_contiguous(pte: pte_t, level: u8, contiguous: bool) -> pte_t {
+    if contiguous {
+        pte | (PTE_CONTIGUOUS >> pte_level_shift(level))
+    } else {
+        pte & !(PTE_CONTIGUOUS >> pte_level_shift(level))
+    }
+}
+
+#[inline]
+pub fn clear_pa(pa: paddr_t) -> paddr_t {
+    pa_init((pa_addr(pa) as u64 & PTE_ADDR_MASK) as usize)
+}
+
+#[inline]
+pub fn block_from_pte(pte: pte_t, level: u8) -> paddr_t {
+    pa_init(((pte << pte_level_shift(level)) & PTE_ADDR_MASK) as usize)
+}
+
+#[inline]
+pub fn table_from_pte(pte: pte_t, level: u8) -> paddr_t {
+    pa_init(((pte << pte_level_shift(level)) & PTE_ADDR_MASK) as usize)
+}
+
+#[inline]
+pub fn pte_attrs(pte: pte_t, level: u8) -> u64 {
+    (pte << pte_level_shift(level)) & PTE_ATTR_MODE_MASK
+}
+
+#[inline]
+pub fn combine_table_entry_attrs(table_attrs: u64, block_attrs: u64) -> u64 {
+    table_attrs | block_attrs
+}
+
+// Exports for the C code.
+
+#[no_mangle]
+pub extern "C" fn arch_mm_absent_pte(level: u8) -> pte_t {
+    absent_pte(level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte(level: u8, pa: paddr_t) -> pte_t {
+    table_pte(level, pa)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_block_pte(level: u8, pa: paddr_t, attrs: u64) -> pte_t {
+    block_pte(level, pa, attrs)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_is_block_allowed(level: u8) -> bool {
+    is_block_allowed(level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_present(pte: pte_t, level: u8) -> bool {
+    pte_is_present(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_valid(pte: pte_t, level: u8) -> bool {
+    pte_is_valid(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_block(pte: pte_t, level: u8) -> bool {
+    pte_is_block(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_table(pte: pte_t, level: u8) -> bool {
+    pte_is_table(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_is_dirty(pte: pte_t, level: u8) -> bool {
+    table_pte_is_dirty(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_set_dirty(pte: pte_t, level: u8, dirty: bool) -> pte_t {
+    table_pte_set_dirty(pte, level, dirty)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_present_count(pte: pte_t, level: u8) -> usize {
+    table_pte_present_count(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_pte_is_uniform(pte: pte_t, level: u8) -> bool {
+    table_pte_is_uniform(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_is_contiguous(pte: pte_t, level: u8) -> bool {
+    pte_is_contiguous(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_clear_pa(pa: paddr_t) -> paddr_t {
+    clear_pa(pa)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_block_from_pte(pte: pte_t, level: u8) -> paddr_t {
+    block_from_pte(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_table_from_pte(pte: pte_t, level: u8) -> paddr_t {
+    table_from_pte(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_pte_attrs(pte: pte_t, level: u8) -> u64 {
+    pte_attrs(pte, level)
+}
+
+#[no_mangle]
+pub extern "C" fn arch_mm_combine_table_entry_attrs(table_attrs: u64, block_attrs: u64) -> u64 {
+    combine_table_entry_attrs(table_attrs, block_attrs)
+}
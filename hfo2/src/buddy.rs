@@ -0,0 +1,387 @@
+/*
+ * Copyright 2019 Jeehoon Kang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Buddy-system allocator of pages.
+//!
+//! Free memory is kept as naturally aligned blocks of `2^order` pages. Freeing a block merges it
+//! with its buddy, the other half of the block of the next order, as long as the buddy is free.
+//!
+//! The allocator keeps no metadata outside of the free memory itself, so that every page given to
+//! it can be handed out again. The free blocks of each order are nodes of a treap keyed by their
+//! address, which is stored in the blocks. Hence finding out whether a buddy is free, allocating
+//! and freeing take `O(log n)` expected time per order.
+
+use core::cmp;
+use core::mem;
+use core::ptr;
+
+use crate::page::*;
+use crate::types::*;
+use crate::utils::*;
+
+/// The number of block orders. The largest block is `2^(BUDDY_ORDERS - 1)` pages, i.e., 8MiB with
+/// 4KiB pages. Larger ranges are kept as multiple blocks.
+pub const BUDDY_ORDERS: usize = 12;
+
+/// A free block, i.e., a node of the treap of free blocks of its order.
+#[repr(C)]
+struct Block {
+    left: *mut Block,
+    right: *mut Block,
+}
+const_assert!(mem::size_of::<Block>() <= mem::size_of::<RawPage>());
+
+/// Returns the treap priority of the block at the given address. It is derived from the address,
+/// so that it need not be stored. A poor spread only makes a treap deeper, i.e., slower, as none of
+/// the treap operations recurse.
+fn priority(block: *const Block) -> u64 {
+    let x = ((block as usize >> PAGE_BITS) as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    x ^ (x >> 29)
+}
+
+/// Merges two treaps, where all blocks in `left` are below those in `right`.
+///
+/// The treap operations loop rather than recurse, as the hypervisor's stacks are small and the
+/// depth of a treap is only logarithmic in expectation.
+unsafe fn merge(mut left: *mut Block, mut right: *mut Block) -> *mut Block {
+    let mut root = ptr::null_mut();
+    let mut link = &mut root as *mut *mut Block;
+
+    loop {
+        if left.is_null() {
+            *link = right;
+            return root;
+        }
+
+        if right.is_null() {
+            *link = left;
+            return root;
+        }
+
+        if priority(left) > priority(right) {
+            *link = left;
+            link = &mut (*left).right;
+            left = *link;
+        } else {
+            *link = right;
+            link = &mut (*right).left;
+            right = *link;
+        }
+    }
+}
+
+/// Splits a treap into the blocks below `addr` and the others.
+unsafe fn split(root: *mut Block, addr: usize) -> (*mut Block, *mut Block) {
+    let mut left = ptr::null_mut();
+    let mut right = ptr::null_mut();
+    let mut left_link = &mut left as *mut *mut Block;
+    let mut right_link = &mut right as *mut *mut Block;
+    let mut node = root;
+
+    while !node.is_null() {
+        if (node as usize) < addr {
+            *left_link = node;
+            left_link = &mut (*node).right;
+            node = *left_link;
+        } else {
+            *right_link = node;
+            right_link = &mut (*node).left;
+            node = *right_link;
+        }
+    }
+
+    *left_link = ptr::null_mut();
+    *right_link = ptr::null_mut();
+    (left, right)
+}
+
+/// Inserts a block into a treap.
+unsafe fn insert(root: &mut *mut Block, block: *mut Block) {
+    let mut link = root as *mut *mut Block;
+
+    while !(*link).is_null() && priority(*link) > priority(block) {
+        let node = *link;
+        link = if (block as usize) < (node as usize) {
+            &mut (*node).left
+        } else {
+            &mut (*node).right
+        };
+    }
+
+    let (left, right) = split(*link, block as usize);
+    (*block).left = left;
+    (*block).right = right;
+    *link = block;
+}
+
+/// Removes the block at the given address from a treap. Returns whether it was found.
+unsafe fn remove(root: &mut *mut Block, addr: usize) -> bool {
+    let mut link = root as *mut *mut Block;
+
+    while !(*link).is_null() {
+        let node = *link;
+        if node as usize == addr {
+            *link = merge((*node).left, (*node).right);
+            return true;
+        }
+
+        link = if addr < node as usize {
+            &mut (*node).left
+        } else {
+            &mut (*node).right
+        };
+    }
+
+    false
+}
+
+/// Returns whether the block at the given address is in a treap.
+unsafe fn contains(root: *mut Block, addr: usize) -> bool {
+    let mut node = root;
+
+    while !node.is_null() {
+        if node as usize == addr {
+            return true;
+        }
+
+        node = if addr < node as usize {
+            (*node).left
+        } else {
+            (*node).right
+        };
+    }
+
+    false
+}
+
+/// Calls `f` on the address of each block of a treap in increasing order, until it returns `Some`.
+///
+/// Each block is found by a search from the root for the first block after the previous one, so
+/// that no stack of ancestors is needed and the treap is left untouched while `f` runs.
+unsafe fn find_map<R, F>(root: *mut Block, f: &mut F) -> Option<R>
+where
+    F: FnMut(usize) -> Option<R>,
+{
+    let mut prev: Option<usize> = None;
+
+    loop {
+        let mut node = root;
+        let mut next = ptr::null_mut();
+
+        while !node.is_null() {
+            if prev.map_or(true, |prev| node as usize > prev) {
+                next = node;
+                node = (*node).left;
+            } else {
+                node = (*node).right;
+            }
+        }
+
+        if next.is_null() {
+            return None;
+        }
+
+        if let Some(result) = f(next as usize) {
+            return Some(result);
+        }
+
+        prev = Some(next as usize);
+    }
+}
+
+/// Returns the size in bytes of a block of the given order.
+const fn block_size(order: usize) -> usize {
+    PAGE_SIZE << order
+}
+
+/// Buddy-system allocator of pages.
+#[repr(C)]
+pub struct Buddy {
+    /// Free blocks of each order.
+    free: [*mut Block; BUDDY_ORDERS],
+}
+
+impl Buddy {
+    /// Creates a new, empty allocator.
+    pub const fn new() -> Self {
+        Self {
+            free: [ptr::null_mut(); BUDDY_ORDERS],
+        }
+    }
+
+    /// Allocates `count` contiguous pages aligned to `align` pages, returning the address of the
+    /// first page.
+    pub fn alloc(&mut self, count: usize, align: usize) -> Option<usize> {
+        if count == 0 || !align.is_power_of_two() {
+            return None;
+        }
+
+        let order = cmp::max(
+            count.next_power_of_two().trailing_zeros(),
+            align.trailing_zeros(),
+        ) as usize;
+
+        let found = (order..BUDDY_ORDERS).find(|&found| !self.free[found].is_null());
+        let found = some_or!(found, return self.alloc_spanning(count, align));
+
+        let block = self.free[found];
+        let addr = block as usize;
+        unsafe {
+            self.free[found] = merge((*block).left, (*block).right);
+
+            // Split the block, giving back the upper halves.
+            for split in (order..found).rev() {
+                insert(
+                    &mut self.free[split],
+                    (addr + block_size(split)) as *mut Block,
+                );
+            }
+
+            // Give back the pages beyond the requested ones.
+            self.free(addr + count * PAGE_SIZE, (1 << order) - count);
+        }
+
+        Some(addr)
+    }
+
+    /// Allocates `count` contiguous pages aligned to `align` pages, spanning several free blocks.
+    ///
+    /// This is the slow path of `alloc()`, taken when no single free block is big enough, e.g. when
+    /// the request is larger than the largest block or when free memory was added in ranges that
+    /// are not aligned to a power of two. It scans all free blocks, taking `O(n log n)` time.
+    fn alloc_spanning(&mut self, count: usize, align: usize) -> Option<usize> {
+        let size = count * PAGE_SIZE;
+        let start = (0..BUDDY_ORDERS).find_map(|order| unsafe {
+            find_map(self.free[order], &mut |addr| {
+                let start = round_up(addr, align * PAGE_SIZE);
+                if self.is_free(start, start + size) {
+                    Some(start)
+                } else {
+                    None
+                }
+            })
+        })?;
+
+        // Remove the blocks covering the range, giving back their parts outside of it.
+        let end = start + size;
+        let mut addr = start;
+        while addr < end {
+            let (base, order) = self.find_block(addr).unwrap();
+            let limit = base + block_size(order);
+
+            unsafe {
+                remove(&mut self.free[order], base);
+                if base < start {
+                    self.free(base, (start - base) / PAGE_SIZE);
+                }
+                if end < limit {
+                    self.free(end, (limit - end) / PAGE_SIZE);
+                }
+            }
+
+            addr = limit;
+        }
+
+        Some(start)
+    }
+
+    /// Returns the base address and the order of the free block containing the given page.
+    fn find_block(&self, addr: usize) -> Option<(usize, usize)> {
+        (0..BUDDY_ORDERS).find_map(|order| {
+            let base = round_down(addr, block_size(order));
+            if unsafe { contains(self.free[order], base) } {
+                Some((base, order))
+            } else {
+                None
+            }
+        })
+    }
+
+    /// Returns whether all pages in `[begin, end)` are free.
+    fn is_free(&self, begin: usize, end: usize) -> bool {
+        let mut addr = begin;
+        while addr < end {
+            let (base, order) = some_or!(self.find_block(addr), return false);
+            addr = base + block_size(order);
+        }
+
+        true
+    }
+
+    /// Frees `count` contiguous pages starting at `begin`, merging them with free neighbours.
+    ///
+    /// # Safety
+    ///
+    /// The pages should be owned by the caller, and are written to.
+    pub unsafe fn free(&mut self, begin: usize, count: usize) {
+        let end = begin + count * PAGE_SIZE;
+        let mut addr = begin;
+
+        // Split the range into the largest naturally aligned blocks.
+        while addr < end {
+            let align = (addr >> PAGE_BITS).trailing_zeros() as usize;
+            let fit = mem::size_of::<usize>() * 8
+                - 1
+                - ((end - addr) >> PAGE_BITS).leading_zeros() as usize;
+            let order = cmp::min(cmp::min(align, fit), BUDDY_ORDERS - 1);
+
+            self.free_block(addr, order);
+            addr += block_size(order);
+        }
+    }
+
+    /// Frees a naturally aligned block, merging it with its buddy as long as the buddy is free.
+    unsafe fn free_block(&mut self, mut addr: usize, mut order: usize) {
+        while order < BUDDY_ORDERS - 1 {
+            let buddy = addr ^ block_size(order);
+            if !remove(&mut self.free[order], buddy) {
+                break;
+            }
+
+            addr = cmp::min(addr, buddy);
+            order += 1;
+        }
+
+        insert(&mut self.free[order], addr as *mut Block);
+    }
+
+    /// Calls `f` with the address and the number of pages of each free block.
+    pub fn for_each_block<F>(&self, mut f: F)
+    where
+        F: FnMut(usize, usize),
+    {
+        for order in 0..BUDDY_ORDERS {
+            unsafe {
+                find_map(self.free[order], &mut |addr| -> Option<()> {
+                    f(addr, 1 << order);
+                    None
+                })
+            };
+        }
+    }
+
+    /// Removes any free block, returning its address and the number of pages in it.
+    pub fn pop(&mut self) -> Option<(usize, usize)> {
+        let order = (0..BUDDY_ORDERS).find(|&order| !self.free[order].is_null())?;
+        let block = self.free[order];
+
+        unsafe {
+            self.free[order] = merge((*block).left, (*block).right);
+        }
+
+        Some((block as usize, 1 << order))
+    }
+}
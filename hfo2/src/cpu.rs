@@ -18,6 +18,7 @@ use core::mem::{self, ManuallyDrop, MaybeUninit};
 use core::ops::Deref;
 use core::ptr;
 
+use crate::abi::*;
 use crate::addr::*;
 use crate::arch::*;
 use crate::init::*;
@@ -59,6 +60,9 @@ extern "C" {
     /// This function must only be called on an arch_regs that is known not be in use
     /// by any other physical CPU.
     fn arch_regs_set_retval(r: *mut ArchRegs, v: uintreg_t);
+
+    /// The stack to be used by the CPUs.
+    pub static callstacks: [[u8; STACK_SIZE]; MAX_CPUS];
 }
 
 pub const STACK_SIZE: usize = PAGE_SIZE;
@@ -66,6 +70,10 @@ pub const STACK_SIZE: usize = PAGE_SIZE;
 /// The number of bits in each element of the interrupt bitfields.
 pub const INTERRUPT_REGISTER_BITS: usize = 32;
 
+/// The number of direct handoffs a pCPU records before the primary VM must retrieve them. Further
+/// switches between secondary vCPUs go through the primary VM until it does.
+const MAX_HANDOFFS: usize = 8;
+
 #[repr(C)]
 #[derive(PartialEq)]
 pub enum VCpuStatus {
@@ -287,7 +295,8 @@ impl VCpuInner {
 
 #[repr(C)]
 pub struct VCpu {
-    vm: *mut Vm,
+    /// `pub` here is only required by `arch_cpu_module_init`.
+    pub vm: *mut Vm,
 
     /// If a vCPU of secondary VMs is running, its lock is logically held by the running pCPU.
     pub inner: SpinLock<VCpuInner>,
@@ -374,6 +383,10 @@ pub struct Cpu {
 
     /// Determines whether or not the cpu is currently on.
     is_on: SpinLock<bool>,
+
+    /// Direct handoffs between secondary vCPUs on this cpu, oldest first, that the primary VM has
+    /// not retrieved yet.
+    handoffs: SpinLock<ArrayVec<[HfVCpuHandoff; MAX_HANDOFFS]>>,
 }
 
 impl Cpu {
@@ -382,7 +395,28 @@ impl Cpu {
             id,
             stack_bottom: stack_bottom as *mut _,
             is_on: SpinLock::new(is_on),
+            handoffs: SpinLock::new(ArrayVec::new()),
+        }
+    }
+
+    /// Returns whether another handoff can be recorded.
+    pub fn handoff_available(&self) -> bool {
+        !self.handoffs.lock().is_full()
+    }
+
+    /// Records a handoff for the primary VM to retrieve.
+    pub fn push_handoff(&self, handoff: HfVCpuHandoff) -> Result<(), ()> {
+        self.handoffs.lock().try_push(handoff).map_err(|_| ())
+    }
+
+    /// Retrieves the oldest handoff not retrieved yet.
+    pub fn pop_handoff(&self) -> Option<HfVCpuHandoff> {
+        let mut handoffs = self.handoffs.lock();
+        if handoffs.is_empty() {
+            return None;
         }
+
+        Some(handoffs.remove(0))
     }
 }
 
@@ -401,6 +435,24 @@ pub unsafe fn cpu_get_buffer(cpu_id: cpu_id_t) -> &'static mut RawPage {
     &mut MESSAGE_BUFFER.get_mut()[cpu_id as usize]
 }
 
+/// Returns the index of the physical CPU executing this function, or `None` if it is not running on
+/// one of the stacks in `callstacks` (e.g. in unit tests).
+///
+/// `CpuManager::new()` hands `callstacks[i]` to the CPU of index `i`, so the stack the caller is
+/// running on identifies the CPU without reading any system register. This also works before the
+/// current vCPU is set up, e.g. during `one_time_init()`.
+pub fn cpu_index_current() -> Option<usize> {
+    let marker = 0u8;
+    let sp = &marker as *const _ as usize;
+    let stacks = unsafe { callstacks.as_ptr() } as usize;
+
+    if sp < stacks || sp >= stacks + STACK_SIZE * MAX_CPUS {
+        return None;
+    }
+
+    Some((sp - stacks) / STACK_SIZE)
+}
+
 pub struct CpuManager {
     /// State of all supported CPUs.
     cpus: ArrayVec<[Cpu; MAX_CPUS]>,
@@ -617,21 +669,47 @@ pub unsafe extern "C" fn vcpu_handle_page_fault(
     let vm = &*current.vm;
     let f = &*f;
     let mask = f.mode | Mode::INVALID;
-    let vm_inner = vm.inner.lock();
 
     // Check if this is a legitimate fault, i.e., if the page table doesn't
-    // allow the access attemped by the VM.
+    // allow the access attemped by the VM. The page table is first walked
+    // without locking the memory of the VM, so spurious faults don't wait for
+    // concurrent updates of it.
+    //
+    // Memory given to the VM lazily faults until it is cleared, which is then
+    // done for the VM to retry the access.
     //
     // Otherwise, this is a spurious fault, likely because another CPU is
     // updating the page table. It is responsible for issuing global TLB
-    // invalidations while holding the VM lock, so we don't need to do
-    // anything else to recover from it. (Acquiring/releasing the lock
-    // ensured that the invalidations have completed.)
-    let resume = vm_inner
-        .ptable
-        .get_mode(f.ipaddr, ipa_add(f.ipaddr, 1))
-        .map(|mode| mode & mask == f.mode)
-        .unwrap_or(false);
+    // invalidations, and only writes a valid entry in place of another valid
+    // one once the invalidation of the old one has completed. So if the entry
+    // seen here allows the access, no stale TLB entry can make it fault again
+    // and we don't need to do anything else to recover from it.
+    //
+    // An entry seen not to allow the access may however be one that another
+    // CPU has broken before making it again. So the walk is repeated with the
+    // memory of the VM locked, which waits for the update to complete, before
+    // the fault is considered legitimate.
+    let resume = match vm.get_mode_unlocked(f.ipaddr, ipa_add(f.ipaddr, 1)) {
+        Ok(mode) if mode.contains(Mode::UNCLEARED) => {
+            hypervisor().handle_uncleared_fault(vm, f.ipaddr)
+        }
+        Ok(mode) if mode & mask == f.mode => true,
+        _ => {
+            let mode = vm
+                .memory
+                .lock()
+                .ptable
+                .get_mode(f.ipaddr, ipa_add(f.ipaddr, 1));
+
+            match mode {
+                Ok(mode) if mode.contains(Mode::UNCLEARED) => {
+                    hypervisor().handle_uncleared_fault(vm, f.ipaddr)
+                }
+                Ok(mode) => mode & mask == f.mode,
+                Err(_) => false,
+            }
+        }
+    };
 
     if !resume {
         dlog!(
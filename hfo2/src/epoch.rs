@@ -0,0 +1,163 @@
+/*
+ * Copyright 2019 Sanguk Park.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Epoch-based reclamation of page table pages.
+//!
+//! Page tables are updated with their lock held, but some paths, such as the stage-2 page fault
+//! handler, only read them and would rather not wait for an update to finish. Such readers walk the
+//! tables without the lock while pinned with `pin()`. Pages of tables that are removed from a page
+//! table are then `retire()`d rather than freed, and only given back to their pool once every CPU
+//! that may still be walking them has unpinned.
+//!
+//! Each retirement advances a global epoch. A reader records the epoch when it pins, so a page
+//! retired at epoch `e` can no longer be reached by any reader once all the pinned CPUs have
+//! recorded an epoch later than `e`.
+
+use core::sync::atomic::{fence, spin_loop_hint, AtomicUsize, Ordering};
+
+use crate::cpu::cpu_index_current;
+use crate::mpool::MPool;
+use crate::page::*;
+use crate::spinlock::SpinLock;
+use crate::types::*;
+
+/// The epoch recorded by CPUs that are not pinned.
+const UNPINNED: usize = usize::max_value();
+
+/// The maximum number of pages waiting to be reclaimed.
+const LIMBO_CAPACITY: usize = 64;
+
+/// The global epoch, advanced whenever a page is retired.
+static EPOCH: AtomicUsize = AtomicUsize::new(0);
+
+/// The epoch recorded by each CPU when it pinned, or `UNPINNED`. These are only accessed
+/// atomically, through `pinned()`.
+static mut PINNED: [usize; MAX_CPUS] = [UNPINNED; MAX_CPUS];
+
+/// A page that has been removed from a page table, but may still be walked by pinned CPUs.
+#[derive(Clone, Copy)]
+struct Retired {
+    page: *mut RawPage,
+    epoch: usize,
+    mpool: *const MPool,
+}
+
+/// The pages waiting until no CPU can walk them.
+struct Limbo {
+    pages: [Retired; LIMBO_CAPACITY],
+    len: usize,
+}
+
+unsafe impl Send for Limbo {}
+
+static LIMBO: SpinLock<Limbo> = SpinLock::new(Limbo {
+    pages: [Retired {
+        page: 0 as *mut _,
+        epoch: 0,
+        mpool: 0 as *const _,
+    }; LIMBO_CAPACITY],
+    len: 0,
+});
+
+/// Keeps the page tables walked by the current CPU from being freed until it is dropped.
+pub struct Guard {
+    cpu: usize,
+}
+
+impl Drop for Guard {
+    fn drop(&mut self) {
+        pinned(self.cpu).store(UNPINNED, Ordering::Release);
+    }
+}
+
+fn pinned(cpu: usize) -> &'static AtomicUsize {
+    unsafe { &*(&PINNED[cpu] as *const usize as *const AtomicUsize) }
+}
+
+/// Pins the current CPU, so the page table pages it reads are not freed until the returned guard
+/// is dropped. Pins must not be nested, and must be taken on the stack of a CPU.
+pub fn pin() -> Guard {
+    // Sharing the slot of another CPU would let either unpin while the other still walks tables.
+    let cpu = cpu_index_current().expect("Pinned off the stack of a CPU");
+
+    pinned(cpu).store(EPOCH.load(Ordering::Relaxed), Ordering::Relaxed);
+
+    // Order the store of the epoch before the reads of the page tables, pairing with the fence in
+    // `retire()`: either the retiring CPU sees that this CPU is pinned, or this CPU sees the page
+    // table without the retired page.
+    fence(Ordering::SeqCst);
+
+    Guard { cpu }
+}
+
+/// Returns whether no CPU can still be walking a page retired at the given epoch.
+fn is_expired(epoch: usize) -> bool {
+    (0..MAX_CPUS).all(|cpu| {
+        let pinned = pinned(cpu).load(Ordering::Acquire);
+        pinned == UNPINNED || pinned > epoch
+    })
+}
+
+impl Limbo {
+    /// Frees the pages that no CPU can walk anymore.
+    fn reclaim(&mut self) {
+        let mut i = 0;
+
+        while i < self.len {
+            let retired = self.pages[i];
+
+            if is_expired(retired.epoch) {
+                unsafe { (*retired.mpool).free(Page::from_raw(retired.page)) };
+                self.len -= 1;
+                self.pages[i] = self.pages[self.len];
+            } else {
+                i += 1;
+            }
+        }
+    }
+}
+
+/// Frees the given page into the given memory pool once no CPU that is pinned can be walking it.
+/// The page must already be unreachable from the page tables, and the pool must outlive the page.
+pub fn retire(page: Page, mpool: &MPool) {
+    // Order the removal of the page from its table before the check of the pinned CPUs, pairing
+    // with the fence in `pin()`.
+    fence(Ordering::SeqCst);
+    let epoch = EPOCH.fetch_add(1, Ordering::SeqCst);
+
+    let mut limbo = LIMBO.lock();
+    limbo.reclaim();
+
+    // Without concurrent readers, as is the common case, the page is freed right away.
+    if limbo.len == 0 && is_expired(epoch) {
+        mpool.free(page);
+        return;
+    }
+
+    // Make room by waiting for the readers, which only pin for the duration of a walk.
+    while limbo.len == LIMBO_CAPACITY {
+        spin_loop_hint();
+        limbo.reclaim();
+    }
+
+    let len = limbo.len;
+    limbo.pages[len] = Retired {
+        page: page.into_raw(),
+        epoch,
+        mpool,
+    };
+    limbo.len += 1;
+}
@@ -14,10 +14,11 @@
  * limitations under the License.
  */
 
+use core::cmp;
 use core::mem;
 use core::ops::Deref;
 use core::ptr;
-use core::sync::atomic::Ordering;
+use core::sync::atomic::{AtomicUsize, Ordering};
 
 use crate::abi::*;
 use crate::addr::*;
@@ -25,6 +26,7 @@ use crate::arch::*;
 use crate::cpu::*;
 use crate::mm::*;
 use crate::mpool::*;
+use crate::ownership::{self, Ownership, PageState};
 use crate::page::*;
 use crate::spci::*;
 use crate::spci_architected_message::*;
@@ -34,11 +36,19 @@ use crate::types::*;
 use crate::utils::*;
 use crate::vm::*;
 
+/// The number of pages cleared and mapped in at once when a VM faults on memory given to it lazily,
+/// so that going through the memory doesn't fault on every page.
+const UNCLEARED_FAULT_PAGES: usize = 16;
+
 pub struct Hypervisor {
     pub mpool: MPool,
     pub memory_manager: MemoryManager,
     pub cpu_manager: CpuManager,
     pub vm_manager: VmManager,
+
+    /// The number of ranges of memory given lazily that may still hold uncleared pages, across all
+    /// VMs.
+    uncleared_ranges: AtomicUsize,
 }
 
 impl Hypervisor {
@@ -54,6 +64,7 @@ impl Hypervisor {
             memory_manager,
             cpu_manager,
             vm_manager,
+            uncleared_ranges: AtomicUsize::new(0),
         }
     }
 
@@ -147,6 +158,10 @@ impl Hypervisor {
     /// Switches to the primary so that it can switch to the target, or kick tit if it is already
     /// running on a different physical CPU.
     pub fn wake_up(&self, current: &mut VCpuExecutionLocked, target_vcpu: &VCpu) -> &VCpu {
+        if let Some(next) = self.handoff(current, target_vcpu, VCpuStatus::BlockedInterrupt) {
+            return next;
+        }
+
         self.switch_to_primary(
             current,
             HfVCpuRunReturn::WakeUp {
@@ -157,6 +172,63 @@ impl Hypervisor {
         )
     }
 
+    /// Switches the physical CPU from the current secondary vCPU straight to the target vCPU,
+    /// without going through the primary VM. This is only done if the VM of the target opted in to
+    /// it, and the target is ready or `blocked` on the event just delivered to it and last ran on
+    /// this physical CPU. The primary VM retrieves the handoff later with HF_VCPU_HANDOFF_GET,
+    /// rather than being returned to.
+    ///
+    /// Returns the target if it is switched to, or None if the caller should switch to the primary
+    /// VM instead.
+    fn handoff(
+        &self,
+        current: &mut VCpuExecutionLocked,
+        target_vcpu: &VCpu,
+        blocked: VCpuStatus,
+    ) -> Option<&VCpu> {
+        let cpu = current.get_inner().cpu;
+
+        if current.vm().id == HF_PRIMARY_VM_ID || !target_vcpu.vm().direct_handoff {
+            return None;
+        }
+
+        // If the target is locked, it is running or about to run on another pCPU.
+        {
+            let target_inner = target_vcpu.inner.try_lock().ok()?;
+            if target_inner.cpu != cpu
+                || (target_inner.state != VCpuStatus::Ready && target_inner.state != blocked)
+            {
+                return None;
+            }
+        }
+
+        // # Safety
+        //
+        // `cpu` is the pCPU we are running on.
+        let cpu = unsafe { &*cpu };
+        if !cpu.handoff_available() {
+            return None;
+        }
+
+        let mut target_locked = self
+            .vcpu_prepare_run(current, target_vcpu, HfVCpuRunReturn::Preempted)
+            .ok()?;
+        self.vcpu_inject_pending_timer(target_vcpu, &mut target_locked);
+
+        // Only this pCPU records handoffs, so there is still room.
+        cpu.push_handoff(HfVCpuHandoff {
+            from_vm_id: current.vm().id,
+            from_vcpu: current.index(),
+            to_vm_id: target_vcpu.vm().id,
+            to_vcpu: target_vcpu.index(),
+        })
+        .unwrap();
+
+        current.get_inner_mut().state = VCpuStatus::Ready;
+
+        Some(unsafe { &*target_locked.into_raw() })
+    }
+
     /// Aborts the vCPU and triggers its VM to abort fully.
     pub fn abort(&self, current: &mut VCpuExecutionLocked) -> &VCpu {
         let vm = current.vm();
@@ -170,11 +242,246 @@ impl Hypervisor {
 
         vm.aborting.store(true, Ordering::Relaxed);
 
-        // TODO: free resources once all vCPUs abort.
+        // Abort the other vCPUs that are not running now, so that the VM's resources can be
+        // reclaimed without waiting for the primary to run them again. Those running on other
+        // pCPUs are aborted when the primary next tries to run them.
+        for vcpu in vm.vcpus.iter() {
+            if ptr::eq(vcpu, &**current) {
+                continue;
+            }
+
+            let mut vcpu_inner = ok_or!(vcpu.inner.try_lock(), continue);
+            if vcpu_inner.state != VCpuStatus::Aborted {
+                vcpu_inner.state = VCpuStatus::Aborted;
+                mem::drop(vcpu_inner);
+                self.vcpu_aborted(vm);
+            }
+        }
 
+        // The current vCPU is counted once its registers are saved, as until then it still runs on
+        // this pCPU with the stage-2 table of the VM.
         self.switch_to_primary(current, HfVCpuRunReturn::Aborted, VCpuStatus::Aborted)
     }
 
+    /// Records that a vCPU of the given VM has reached `VCpuStatus::Aborted` and no longer runs,
+    /// and reclaims the resources of the VM once all its vCPUs have.
+    pub fn vcpu_aborted(&self, vm: &Vm) {
+        if vm.aborted_vcpus.fetch_add(1, Ordering::AcqRel) + 1 == vm.vcpus.len()
+            && self.vm_reclaim(vm).is_err()
+        {
+            vm.reclaim_pending.store(true, Ordering::Release);
+        }
+    }
+
+    /// Returns how the memory in `begin..end`, mapped with `mode` by an aborted VM, is reclaimed:
+    /// `None` if it is left as is, or whether it is cleared before it is given back to the primary.
+    fn reclaim_range(
+        primary: &Vm,
+        primary_ptable: &PageTable<Stage2>,
+        begin: usize,
+        end: usize,
+        mode: Mode,
+    ) -> Option<bool> {
+        let primary_mode = primary_ptable.get_mode(ipa_init(begin), ipa_init(end));
+
+        // The memory was given back by an earlier attempt that failed later on.
+        if primary_mode.map_or(false, Mode::valid_owned_exclusive) {
+            return None;
+        }
+
+        // Memory given to the VM lazily is cleared before the primary gets it back.
+        if mode.contains(Mode::UNCLEARED) {
+            return Some(true);
+        }
+
+        // The primary gets back memory the VM owns, and the memory it owns and lent or shared
+        // with the VM. Memory lent by other secondaries is left as is, and so is memory the VM
+        // lent or shared to others as they still have access to it.
+        if mode.contains(Mode::INVALID) {
+            return None;
+        }
+
+        if mode.contains(Mode::UNOWNED) {
+            let primary_mode = match ownership::lookup(pa_init(begin), pa_init(end)) {
+                Ok(ownership) => Ownership::state_mode(ownership, primary.id),
+                Err(_) => primary_mode.ok()?,
+            };
+            if primary_mode.contains(Mode::UNOWNED) {
+                return None;
+            }
+            return Some(false);
+        }
+
+        // Memory the VM shared with the primary becomes exclusive to the primary. Otherwise it was
+        // shared with another secondary, which still maps it.
+        if mode.contains(Mode::SHARED) {
+            let primary_mode = primary_mode.ok()?;
+            if primary_mode.contains(Mode::INVALID) || !primary_mode.contains(Mode::UNOWNED) {
+                return None;
+            }
+        }
+
+        Some(true)
+    }
+
+    /// Reclaims the resources of an aborted VM, none of whose vCPUs run or will run again.
+    ///
+    /// The memory owned by the VM, and the memory the primary lent or shared with it, is given
+    /// back to the primary. Memory the VM owned is cleared first so its data doesn't leak to the
+    /// primary. This is done without holding any lock, as the table of the VM no longer changes.
+    /// Then all tables of the VM below the root are freed once the TLB entries of the VM are
+    /// invalidated. Pages freed along the way are collected in a local pool and returned to the
+    /// hypervisor's pool at once.
+    ///
+    /// Fails if some memory can't be given back to the primary, in which case the tables of the
+    /// VM are kept so that reclaiming can be retried later. Memory given back already is skipped
+    /// then.
+    fn vm_reclaim(&self, vm: &Vm) -> Result<(), ()> {
+        let primary = self.vm_manager.get_primary();
+        let local_page_pool = MPool::new_with_fallback(&self.mpool);
+
+        dlog!("Reclaiming memory of VM {}\n", vm.id);
+
+        // The hypervisor must not access the mailbox once its pages are given to the primary. If
+        // they can't be unmapped from the hypervisor yet, the VM's table still marks them as not
+        // owned so they are skipped below, and unmapping them is retried once the tables of the VM
+        // have been freed.
+        let (mailbox_pages, mailbox_unconfigured) = {
+            let mut vm_mailbox = vm.mailbox.lock();
+            let mut vm_inner = vm.memory.lock();
+            let mailbox_pages = [
+                vm_mailbox.get_send_ptr() as usize,
+                vm_mailbox.get_recv_ptr() as usize,
+            ];
+            let mailbox_unconfigured = vm_mailbox
+                .unconfigure(
+                    &mut vm_inner,
+                    &self.memory_manager.hypervisor_ptable,
+                    &local_page_pool,
+                )
+                .is_ok();
+            (mailbox_pages, mailbox_unconfigured)
+        };
+        if !mailbox_unconfigured {
+            dlog!(
+                "Failed to unmap the mailbox of VM {}, retrying later\n",
+                vm.id
+            );
+        }
+
+        // No vCPU of the VM runs, and memory is no longer given to the VM now that the memory of
+        // the VM has been locked after it started aborting. So its table doesn't change, and is
+        // walked without the lock while memory is cleared.
+        let vm_ptable = unsafe { &vm.memory.get_unchecked().ptable };
+        vm_ptable.for_each_range(|begin, end, mode| {
+            let clear = {
+                let primary_inner = primary.memory.lock();
+                Self::reclaim_range(primary, &primary_inner.ptable, begin, end, mode)
+            };
+            if clear == Some(true) {
+                self.clear_memory(pa_init(begin), pa_init(end));
+            }
+        });
+
+        let mut vm_mailbox = vm.mailbox.lock();
+        let (mut primary_inner, mut vm_inner) = SpinLock::lock_both(&primary.memory, &vm.memory);
+
+        let mut reclaimed = 0;
+        let mut failed = false;
+        vm_inner.ptable.for_each_range(|begin, end, mode| {
+            if failed
+                || Self::reclaim_range(primary, &primary_inner.ptable, begin, end, mode).is_none()
+            {
+                return;
+            }
+
+            if primary_inner
+                .ptable
+                .identity_map(
+                    pa_init(begin),
+                    pa_init(end),
+                    Mode::R | Mode::W | Mode::X,
+                    &local_page_pool,
+                )
+                .is_err()
+            {
+                dlog!(
+                    "Failed to give back {:#x}..{:#x} to the primary\n",
+                    begin,
+                    end
+                );
+                failed = true;
+                return;
+            }
+
+            // The primary takes the place of the VM as the owner, and memory the VM borrowed from
+            // the primary, or from the hypervisor for its mailbox, is exclusive to the primary.
+            ownership::update(pa_init(begin), pa_init(end), |ownership| {
+                ownership.map(|_| Ownership::exclusive(primary.id))
+            });
+
+            reclaimed += end - begin;
+        });
+
+        if failed {
+            dlog!(
+                "Reclaimed {:#x} bytes from VM {}, retrying later\n",
+                reclaimed,
+                vm.id
+            );
+            return Err(());
+        }
+
+        vm_inner.ptable.clear(&local_page_pool);
+
+        // Freeing the tables of the VM has returned pages to the local pool, so unmapping the
+        // mailbox can now be retried before its pages are given to the primary.
+        if !mailbox_unconfigured {
+            if vm_mailbox
+                .reset(&self.memory_manager.hypervisor_ptable, &local_page_pool)
+                .is_ok()
+            {
+                for page in mailbox_pages.iter().filter(|page| **page != 0) {
+                    let begin = pa_init(*page);
+                    let end = pa_add(begin, PAGE_SIZE);
+
+                    // The page may have been given back above if the mailbox was unmapped from
+                    // the hypervisor before unconfiguring failed.
+                    let given_back = primary_inner
+                        .ptable
+                        .get_mode(ipa_from_pa(begin), ipa_from_pa(end))
+                        .map_or(false, |mode| mode.valid_owned_exclusive());
+                    if given_back {
+                        continue;
+                    }
+
+                    self.clear_memory(begin, end);
+                    if primary_inner
+                        .ptable
+                        .identity_map(begin, end, Mode::R | Mode::W | Mode::X, &local_page_pool)
+                        .is_ok()
+                    {
+                        ownership::update(begin, end, |_| Some(Ownership::exclusive(primary.id)));
+                        reclaimed += PAGE_SIZE;
+                    }
+                }
+            } else {
+                dlog!(
+                    "The mailbox of VM {} stays mapped in the hypervisor\n",
+                    vm.id
+                );
+            }
+        }
+
+        primary_inner.ptable.defrag(&local_page_pool);
+        self.uncleared_ranges
+            .fetch_sub(vm_inner.uncleared.len(), Ordering::Relaxed);
+        vm_inner.uncleared.clear();
+
+        dlog!("Reclaimed {:#x} bytes from VM {}\n", reclaimed, vm.id);
+        Ok(())
+    }
+
     /// Returns the ID of the VM.
     pub fn vm_get_id(&self, current: &VCpu) -> spci_vm_id_t {
         current.vm().id
@@ -258,6 +565,12 @@ impl Hypervisor {
             if vcpu_inner.state != VCpuStatus::Aborted {
                 dlog!("Aborting VM {} vCPU {}\n", vm.id, vcpu.index());
                 vcpu_inner.state = VCpuStatus::Aborted;
+                mem::drop(vcpu_inner);
+                self.vcpu_aborted(vm);
+            } else if vm.reclaim_pending.swap(false, Ordering::AcqRel)
+                && self.vm_reclaim(vm).is_err()
+            {
+                vm.reclaim_pending.store(true, Ordering::Release);
             }
             return Err(run_ret);
         }
@@ -269,10 +582,10 @@ impl Hypervisor {
 
             // A pending message allows the vCPU to run so the message can be delivered directly.
             // The VM needs to be locked to deliver mailbox messages.
-            // The VM lock is not needed in the common case so it must only be taken when it is
+            // The mailbox lock is not needed in the common case so it must only be taken when it is
             // going to be needed. This ensures there are no inter-vCPU dependencies in the common
             // run case meaning the sensitive context switch performance is consistent.
-            VCpuStatus::BlockedMailbox if vm.inner.lock().try_read().is_ok() => {
+            VCpuStatus::BlockedMailbox if vm.mailbox.lock().try_read().is_ok() => {
                 vcpu_inner.regs.set_retval(SpciReturn::Success as uintreg_t);
             }
 
@@ -342,13 +655,20 @@ impl Hypervisor {
 
         // Update state if allowed.
         let mut vcpu_locked = self.vcpu_prepare_run(current, vcpu, ret)?;
+        self.vcpu_inject_pending_timer(vcpu, &mut vcpu_locked);
 
+        // Switch to the vcpu.
+        Ok(vcpu_locked)
+    }
+
+    /// Injects the virtual timer interrupt into a vCPU about to be run if its timer has expired.
+    fn vcpu_inject_pending_timer(&self, vcpu: &VCpu, vcpu_locked: &mut VCpuExecutionLocked) {
         // Inject timer interrupt if timer has expired. It's safe to access vcpu->regs here because
         // vcpu_prepare_run already made sure that regs_available was true (and then set it to
         // false) before returning true.
         if vcpu_locked.get_inner().regs.timer_pending() {
             // Make virtual timer interrupt pending.
-            self.internal_interrupt_inject(&*vcpu, HF_VIRTUAL_TIMER_INTID, &mut vcpu_locked);
+            self.internal_interrupt_inject(vcpu, HF_VIRTUAL_TIMER_INTID, vcpu_locked);
 
             // Set the mask bit so the hardware interrupt doesn't fire again. Ideally we wouldn't
             // do this because it affects what the secondary vcPU sees, but if we don't then we end
@@ -356,9 +676,16 @@ impl Hypervisor {
             // vCPU.
             vcpu_locked.get_inner_mut().regs.timer_mask();
         }
+    }
 
-        // Switch to the vcpu.
-        Ok(vcpu_locked)
+    /// Retrieves the oldest handoff between secondary vCPUs on the current pCPU not retrieved yet.
+    /// Only the primary VM may retrieve them.
+    pub fn vcpu_handoff_get(&self, current: &VCpuExecutionLocked) -> Option<HfVCpuHandoff> {
+        if current.vm().id != HF_PRIMARY_VM_ID {
+            return None;
+        }
+
+        unsafe { &*current.get_inner().cpu }.pop_handoff()
     }
 
     /// Determines the value to be returned by api_vm_configure and api_mailbox_clear after they've
@@ -367,10 +694,10 @@ impl Hypervisor {
     fn waiter_result(
         &self,
         vm_id: spci_vm_id_t,
-        vm_inner: &VmInner,
+        vm_mailbox: &VmMailbox,
         current: &mut VCpuExecutionLocked,
     ) -> (i64, Option<&VCpu>) {
-        if vm_inner.is_waiter_list_empty() {
+        if vm_mailbox.is_waiter_list_empty() {
             // No waiters, nothing else to do.
             return (0, None);
         }
@@ -409,9 +736,23 @@ impl Hypervisor {
         //
         // TODO: the scope of the can be reduced but will require restructing to keep a single
         //       unlock point.
-        let mut vm_inner = vm.inner.lock();
-        if vm_inner
+        let mut vm_mailbox = vm.mailbox.lock();
+        let mut vm_memory = vm.memory.lock();
+
+        // The pages must be valid to be configured, so any given to the VM lazily are cleared.
+        for page in &[send, recv] {
+            let begin = pa_from_ipa(*page);
+            if self
+                .clear_uncleared_overlap(&mut vm_memory, begin, pa_add(begin, PAGE_SIZE))
+                .is_err()
+            {
+                return (-1, None);
+            }
+        }
+
+        if vm_mailbox
             .configure(
+                &mut vm_memory,
                 send,
                 recv,
                 &self.memory_manager.hypervisor_ptable,
@@ -422,8 +763,23 @@ impl Hypervisor {
             return (-1, None);
         }
 
+        // The hypervisor owns the mailbox pages now, and shares them with the VM.
+        for page in &[send, recv] {
+            let begin = pa_from_ipa(*page);
+            ownership::record(
+                begin,
+                pa_add(begin, PAGE_SIZE),
+                Some(Ownership::borrowed(
+                    HF_HYPERVISOR_VM_ID,
+                    PageState::Shared,
+                    vm.id,
+                )),
+            );
+        }
+        drop(vm_memory);
+
         // Tell caller about waiters, if any.
-        self.waiter_result(vm.id, &vm_inner, current)
+        self.waiter_result(vm.id, &vm_mailbox, current)
     }
 
     /// Copies data from the sender's send buffer to the recipient's receive buffer and notifies
@@ -445,7 +801,7 @@ impl Hypervisor {
         // the lock since the tx mailbox address can only be configured once.
         let from_msg = some_or!(
             // TODO(HfO2): complicated invariant...  send_ptr never changes.
-            unsafe { from.inner.lock().get_send_ptr().as_ref() },
+            unsafe { from.mailbox.lock().get_send_ptr().as_ref() },
             return (SpciReturn::InvalidParameters, None)
         );
 
@@ -475,24 +831,23 @@ impl Hypervisor {
             return (SpciReturn::InvalidParameters, None)
         );
 
-        // Hf needs to hold the lock on `to` before the mailbox state is checked. The lock on `to`
-        // must be held until the information is copied to `to` Rx buffer. Since in
-        // spci_msg_handle_architected_message we may call api_spci_share_memory which must hold
-        // the `from` lock, we must hold the `from` lock at this point to prevent a deadlock
-        // scenario.
-        let (mut to_inner, mut from_inner) = SpinLock::lock_both(&to.inner, &from.inner);
+        // Hf needs to hold the lock on `to`'s mailbox before the mailbox state is checked. The lock
+        // must be held until the information is copied to `to` Rx buffer. The lock on `from`'s
+        // mailbox is needed to wait for `to`'s mailbox. The memory of the VMs is only locked, after
+        // their mailboxes, for architected messages that share memory.
+        let (mut to_mailbox, mut from_mailbox) = SpinLock::lock_both(&to.mailbox, &from.mailbox);
 
-        if !to_inner.is_empty() || !to_inner.is_configured() {
+        if !to_mailbox.is_empty() || !to_mailbox.is_configured() {
             // Fail if the target isn't currently ready to receive data, setting up for
             // notification if requested.
             if notify {
-                let _ = from_inner.wait_for(&mut to_inner, to.id);
+                let _ = from_mailbox.wait_for(&mut to_mailbox, to.id);
             }
 
             return (SpciReturn::Busy, None);
         }
 
-        let to_msg = unsafe { &mut *to_inner.get_recv_ptr() };
+        let to_msg = unsafe { &mut *to_mailbox.get_recv_ptr() };
 
         // Handle architected messages.
         if from_msg_replica.flags.contains(SpciMessageFlags::IMPDEF) {
@@ -532,11 +887,54 @@ impl Hypervisor {
             let architected_message_replica =
                 unsafe { &*(message_buffer.as_ptr() as *const SpciArchitectedMessageHeader) };
 
+            // The memory region is parsed before the memory of the VMs is locked.
+            let constituents = some_or!(
+                spci_architected_message_constituents(
+                    architected_message_replica,
+                    from_msg_payload_length
+                ),
+                return (SpciReturn::InvalidParameters, None)
+            );
+
             // Note that message_buffer is passed as the third parameter to
             // spci_msg_handle_architected_message. The execution flow commencing at
             // spci_msg_handle_architected_message will make several accesses to fields in
             // message_buffer. The memory area message_buffer must be exclusively owned by Hf so
             // that TOCTOU issues do not arise.
+            let (mut to_inner, mut from_inner) = SpinLock::lock_both(&to.memory, &from.memory);
+
+            // Memory given to an aborting VM would never be returned. This is checked with the
+            // memory of the VM locked, so no memory is given to it once it is being reclaimed.
+            if to.aborting.load(Ordering::Relaxed) {
+                return (SpciReturn::Denied, None);
+            }
+
+            // Memory given to the sender lazily is cleared before it is shared, but only where it
+            // overlaps the constituents of the memory region.
+            for constituent in constituents {
+                let begin = constituent.address as usize;
+                let size = constituent.page_count as usize * PAGE_SIZE;
+
+                // A region this large can't be owned by the sender, so it is rejected later.
+                let end = some_or!(
+                    begin
+                        .checked_add(size)
+                        .and_then(|end| end.checked_add(PAGE_SIZE - 1)),
+                    continue
+                );
+
+                if self
+                    .clear_uncleared_overlap(
+                        &mut from_inner,
+                        pa_init(round_down(begin, PAGE_SIZE)),
+                        pa_init(round_down(end, PAGE_SIZE)),
+                    )
+                    .is_err()
+                {
+                    return (SpciReturn::NoMemory, None);
+                }
+            }
+
             let ret = spci_msg_handle_architected_message(
                 &mut to_inner,
                 &mut from_inner,
@@ -555,21 +953,31 @@ impl Hypervisor {
 
         // Messages for the primary VM are delivered directly.
         if to.id == HF_PRIMARY_VM_ID {
-            to_inner.set_read();
+            to_mailbox.set_read();
             let next = self.switch_to_primary(current, primary_ret, VCpuStatus::Ready);
             return (SpciReturn::Success, Some(next));
         }
 
-        to_inner.set_received();
+        to_mailbox.set_received();
 
-        // Return to the primary VM directly or with a switch.
-        let next = if from.id != HF_PRIMARY_VM_ID {
-            Some(self.switch_to_primary(current, primary_ret, VCpuStatus::Ready))
-        } else {
-            None
-        };
+        // Return to the primary VM directly.
+        if from.id == HF_PRIMARY_VM_ID {
+            return (SpciReturn::Success, None);
+        }
+
+        // Hand off to a vCPU of the recipient if possible, or return to the primary VM with a
+        // switch. The mailboxes are unlocked first, as the recipient reads its mailbox when it is
+        // prepared to run.
+        mem::drop(to_mailbox);
+        mem::drop(from_mailbox);
+
+        let next = to
+            .vcpus
+            .iter()
+            .find_map(|vcpu| self.handoff(current, vcpu, VCpuStatus::BlockedMailbox))
+            .unwrap_or_else(|| self.switch_to_primary(current, primary_ret, VCpuStatus::Ready));
 
-        (SpciReturn::Success, next)
+        (SpciReturn::Success, Some(next))
     }
 
     /// Receives a message from the mailbox. If one isn't available, this function can optionally
@@ -590,10 +998,10 @@ impl Hypervisor {
             return (SpciReturn::Interrupted, None);
         }
 
-        let mut vm_inner = vm.inner.lock();
+        let mut vm_mailbox = vm.mailbox.lock();
 
         // Return pending messages without blocking.
-        if vm_inner.try_read().is_ok() {
+        if vm_mailbox.try_read().is_ok() {
             return (SpciReturn::Success, None);
         }
 
@@ -630,7 +1038,7 @@ impl Hypervisor {
     /// It should be called repeatedly to retrieve a list of VMs.
     pub fn mailbox_writable_get(&self, current: &VCpu) -> Option<spci_vm_id_t> {
         let vm = current.vm();
-        vm.inner.lock().dequeue_ready_list()
+        vm.mailbox.lock().dequeue_ready_list()
     }
 
     /// Retrieves the next VM waiting to be notified that the mailbox of the specified VM became
@@ -644,14 +1052,14 @@ impl Hypervisor {
         let vm = self.vm_manager.get(vm_id)?;
 
         // Check if there are outstanding notifications from given vm.
-        let entry = unsafe { vm.inner.lock().fetch_waiter().as_mut()? };
+        let entry = unsafe { vm.mailbox.lock().fetch_waiter().as_mut()? };
 
         // Enqueue notification to waiting VM.
         let waiting_vm = unsafe { &*entry.waiting_vm };
 
-        let mut vm_inner = waiting_vm.inner.lock();
+        let mut vm_mailbox = waiting_vm.mailbox.lock();
         if !entry.is_in_ready_list() {
-            vm_inner.enqueue_ready_list(&mut *entry);
+            vm_mailbox.enqueue_ready_list(&mut *entry);
         }
 
         Some(waiting_vm.id)
@@ -669,13 +1077,13 @@ impl Hypervisor {
     ///    hf_mailbox_waiter_get.
     pub fn mailbox_clear(&self, current: &mut VCpuExecutionLocked) -> (i64, Option<&VCpu>) {
         let vm = unsafe { &*(current.vm() as *const Vm) };
-        let mut vm_inner = vm.inner.lock();
-        match vm_inner.get_state() {
+        let mut vm_mailbox = vm.mailbox.lock();
+        match vm_mailbox.get_state() {
             MailboxState::Empty => (0, None),
             MailboxState::Received => (-1, None),
             MailboxState::Read => {
-                vm_inner.set_empty();
-                self.waiter_result(vm.id, &vm_inner, current)
+                vm_mailbox.set_empty();
+                self.waiter_result(vm.id, &vm_mailbox, current)
             }
         }
     }
@@ -749,34 +1157,162 @@ impl Hypervisor {
         self.internal_interrupt_inject(target_vcpu, intid, current)
     }
 
-    /// Clears a region of physical memory by overwriting it with zeros. The data is flushed from
-    /// the cache so the memory has been cleared across the system.
-    fn clear_memory(&self, begin: paddr_t, end: paddr_t, ppool: &MPool) -> Result<(), ()> {
-        let mut hypervisor_ptable = self.memory_manager.hypervisor_ptable.lock();
-        let size = pa_difference(begin, end);
-        let region = pa_addr(begin);
+    /// Clears a region of physical memory by overwriting it with zeros. The data is written back
+    /// from the cache so the memory has been cleared across the system.
+    ///
+    /// The region is mapped a chunk at a time in the scratch window of the current CPU, so neither
+    /// the hypervisor's page table is locked nor the TLBs of other CPUs are invalidated.
+    fn clear_memory(&self, begin: paddr_t, end: paddr_t) {
+        self.memory_manager
+            .for_each_scratch_chunk(begin, end, Mode::W, |chunk, size| unsafe {
+                arch_mm_zero_memory(chunk, size);
+            });
+    }
+
+    /// Clears the pages of the VM in the given range that are still uncleared, and maps them in for
+    /// the VM to access. Contiguous uncleared pages are cleared and mapped at once.
+    fn clear_uncleared(
+        &self,
+        vm_inner: &mut VmMemory,
+        begin: paddr_t,
+        end: paddr_t,
+    ) -> Result<(), ()> {
+        let is_uncleared = |ptable: &PageTable<Stage2>, page: paddr_t| {
+            ptable
+                .get_mode(ipa_from_pa(page), ipa_from_pa(pa_add(page, PAGE_SIZE)))
+                .map(|mode| mode.contains(Mode::UNCLEARED))
+                .unwrap_or(false)
+        };
+
+        let mut page = begin;
+        while pa_addr(page) < pa_addr(end) {
+            if !is_uncleared(&vm_inner.ptable, page) {
+                page = pa_add(page, PAGE_SIZE);
+                continue;
+            }
+
+            let run_begin = page;
+            while pa_addr(page) < pa_addr(end) && is_uncleared(&vm_inner.ptable, page) {
+                page = pa_add(page, PAGE_SIZE);
+            }
+
+            self.clear_memory(run_begin, page);
+            vm_inner.ptable.identity_map(
+                run_begin,
+                page,
+                Mode::R | Mode::W | Mode::X,
+                &self.mpool,
+            )?;
+        }
+
+        Ok(())
+    }
 
-        // TODO: change this to a cpu local single page window rather than a global mapping of the
-        //       whole range. Such an approach will limit the changes to stage-1 tables and will
-        //       allow only local invalidation.
+    /// Clears the pages of the VM still uncleared in the given range, so that they can be mapped
+    /// elsewhere or shared.
+    fn clear_uncleared_overlap(
+        &self,
+        vm_inner: &mut VmMemory,
+        begin: paddr_t,
+        end: paddr_t,
+    ) -> Result<(), ()> {
+        for range in vm_inner.uncleared.clone().iter() {
+            if range.overlaps(begin, end) {
+                self.clear_uncleared(
+                    vm_inner,
+                    pa_init(cmp::max(pa_addr(range.next), pa_addr(begin))),
+                    pa_init(cmp::min(pa_addr(range.end), pa_addr(end))),
+                )?;
+            }
+        }
+
+        Ok(())
+    }
 
-        if hypervisor_ptable
-            .identity_map(begin, end, Mode::W, ppool)
+    /// Handles a stage-2 fault of the VM on memory given to it lazily, by clearing and mapping in
+    /// the aligned block of `UNCLEARED_FAULT_PAGES` pages around the faulting page. Returns whether
+    /// the VM can retry the access.
+    pub fn handle_uncleared_fault(&self, vm: &Vm, addr: ipaddr_t) -> bool {
+        let mut vm_inner = vm.memory.lock();
+        let page = round_down(ipa_addr(addr), PAGE_SIZE);
+        let block_size = UNCLEARED_FAULT_PAGES * PAGE_SIZE;
+        let mut begin = round_down(page, block_size);
+        let mut end = begin + block_size;
+
+        // The block is limited to the range the page was given in.
+        if let Some(range) = vm_inner
+            .uncleared
+            .iter()
+            .find(|range| pa_addr(range.begin) <= page && page < pa_addr(range.end))
+        {
+            begin = cmp::max(begin, pa_addr(range.begin));
+            end = cmp::min(end, pa_addr(range.end));
+        } else {
+            begin = page;
+            end = page + PAGE_SIZE;
+        }
+
+        if self
+            .clear_uncleared(&mut vm_inner, pa_init(begin), pa_init(end))
             .is_err()
         {
-            // TODO: partial defrag of failed range.
-            // Recover any memory consumed in failed mapping.
-            hypervisor_ptable.defrag(ppool);
-            return Err(());
+            dlog!(
+                "Failed to map in uncleared memory at {:#x} for VM {}\n",
+                page,
+                vm.id
+            );
+            return false;
         }
 
-        unsafe {
-            ptr::write_bytes(region as *mut u8, 0, size);
-            arch_mm_flush_dcache(region as usize, size);
+        true
+    }
+
+    /// Clears up to `budget` pages of the memory given lazily to VMs that they have not accessed
+    /// yet. Returns the number of pages cleared or found already cleared.
+    pub fn clear_uncleared_pending(&self, budget: usize) -> usize {
+        let mut remaining = budget;
+
+        for i in 0..self.vm_manager.len() {
+            if remaining == 0 || self.uncleared_ranges.load(Ordering::Relaxed) == 0 {
+                break;
+            }
+
+            let vm = some_or!(self.vm_manager.get(HF_VM_ID_OFFSET + i), continue);
+            let mut vm_inner = vm.memory.lock();
+
+            while remaining > 0 {
+                let range = *some_or!(vm_inner.uncleared.last(), break);
+                let pages = cmp::min(remaining, pa_difference(range.next, range.end) / PAGE_SIZE);
+                let next = pa_add(range.next, pages * PAGE_SIZE);
+
+                // Try again later if the page table couldn't be updated.
+                if self
+                    .clear_uncleared(&mut vm_inner, range.next, next)
+                    .is_err()
+                {
+                    return budget - remaining;
+                }
+                remaining -= pages;
+
+                if pa_addr(next) == pa_addr(range.end) {
+                    // The range is cleared, so its blocks can be merged back.
+                    vm_inner.uncleared.pop();
+                    self.uncleared_ranges.fetch_sub(1, Ordering::Relaxed);
+                    vm_inner
+                        .ptable
+                        .defrag_range(range.begin, range.end, &self.mpool);
+                } else {
+                    vm_inner.uncleared.last_mut().unwrap().next = next;
+                }
+            }
         }
 
-        hypervisor_ptable.unmap(begin, end, ppool).unwrap();
-        Ok(())
+        budget - remaining
+    }
+
+    /// Returns whether any memory given lazily to VMs may still be uncleared.
+    pub fn uncleared_pending(&self) -> bool {
+        self.uncleared_ranges.load(Ordering::Relaxed) != 0
     }
 
     /// Shares memory from the calling VM with another. The memory can be shared in different modes.
@@ -812,7 +1348,7 @@ impl Hypervisor {
         }
 
         let (from_mode, to_mode) = match share {
-            HfShare::Give => (
+            HfShare::Give | HfShare::GiveLazy => (
                 (Mode::INVALID | Mode::UNOWNED),
                 (Mode::R | Mode::W | Mode::X),
             ),
@@ -827,7 +1363,28 @@ impl Hypervisor {
         // ensure the original mapping can be restored if any stage of the process fails.
         let local_page_pool = MPool::new_with_fallback(&self.mpool);
 
-        let (mut from_inner, mut to_inner) = SpinLock::lock_both(&from.inner, &to.inner);
+        let (mut from_inner, mut to_inner) = SpinLock::lock_both(&from.memory, &to.memory);
+
+        // Memory given to an aborting VM would never be returned. This is checked with the memory
+        // of the VM locked, so no memory is given to it once it is being reclaimed.
+        if to.aborting.load(Ordering::Relaxed) {
+            return Err(());
+        }
+
+        let pa_begin = pa_from_ipa(begin);
+        let pa_end = pa_from_ipa(end);
+
+        // Memory given to the sender lazily must be cleared before it can be shared.
+        self.clear_uncleared_overlap(&mut from_inner, pa_begin, pa_end)?;
+
+        // Memory is given lazily only while the recipient can track another uncleared range.
+        // Otherwise it is cleared before it is given.
+        let lazy = share == HfShare::GiveLazy && !to_inner.uncleared.is_full();
+        let to_mode = if lazy {
+            to_mode | Mode::INVALID | Mode::UNCLEARED
+        } else {
+            to_mode
+        };
 
         // Ensure that the memory range is mapped with the same mode so that changes can be
         // reverted if the process fails.
@@ -842,38 +1399,31 @@ impl Hypervisor {
         // The sender must own the memory and have exclusive access to it in order to share it.
         // Alternatively, it is giving memory back to the owning VM.
         if orig_from_mode.contains(Mode::UNOWNED) {
-            let to_mode = to_inner.ptable.get_mode(begin, end)?;
+            let to_mode = match ownership::lookup(pa_from_ipa(begin), pa_from_ipa(end)) {
+                Ok(ownership) => Ownership::state_mode(ownership, to.id),
+                Err(_) => to_inner.ptable.get_mode(begin, end)?,
+            };
 
             if to_mode.contains(Mode::UNOWNED) {
                 return Err(());
             }
 
-            if share != HfShare::Give {
+            if share != HfShare::Give && share != HfShare::GiveLazy {
                 return Err(());
             }
         } else if orig_from_mode.contains(Mode::SHARED) {
             return Err(());
         }
 
-        let pa_begin = pa_from_ipa(begin);
-        let pa_end = pa_from_ipa(end);
-
         // First update the mapping for the sender so there is not overlap with the recipient.
         from_inner
             .ptable
             .identity_map(pa_begin, pa_end, from_mode, &local_page_pool)?;
 
-        // Clear the memory so no VM or device can see the previous contents.
-        if self
-            .clear_memory(pa_begin, pa_end, &local_page_pool)
-            .is_err()
-        {
-            from_inner
-                .ptable
-                .identity_map(pa_begin, pa_end, orig_from_mode, &local_page_pool)
-                .unwrap();
-
-            return Err(());
+        // Clear the memory so no VM or device can see the previous contents. Memory given lazily
+        // is instead cleared as the recipient first accesses it, or while the primary is idle.
+        if !lazy {
+            self.clear_memory(pa_begin, pa_end);
         }
 
         // Complete the transfer by mapping the memory into the recipient.
@@ -882,27 +1432,77 @@ impl Hypervisor {
             .identity_map(pa_begin, pa_end, to_mode, &local_page_pool)
             .is_err()
         {
-            // TODO: partial defrag of failed range.
             // Recover any memory consumed in failed mapping.
-            from_inner.ptable.defrag(&local_page_pool);
+            to_inner
+                .ptable
+                .defrag_range(pa_begin, pa_end, &local_page_pool);
             from_inner
                 .ptable
                 .identity_map(pa_begin, pa_end, orig_from_mode, &local_page_pool)
                 .unwrap();
+            from_inner
+                .ptable
+                .defrag_range(pa_begin, pa_end, &local_page_pool);
 
             return Err(());
         }
 
+        if lazy {
+            to_inner
+                .uncleared
+                .push(UnclearedRange::new(pa_begin, pa_end));
+            self.uncleared_ranges.fetch_add(1, Ordering::Relaxed);
+        }
+
+        ownership::record(
+            pa_begin,
+            pa_end,
+            Some(match share {
+                HfShare::Give | HfShare::GiveLazy => Ownership::exclusive(to.id),
+                HfShare::Lend => Ownership::borrowed(from.id, PageState::Lent, to.id),
+                HfShare::Share => Ownership::borrowed(from.id, PageState::Shared, to.id),
+            }),
+        );
+
         Ok(())
     }
 
+    /// Returns the ID of the VM owning the page at the given address, or the hypervisor's for its
+    /// own memory. Only the primary may ask.
+    pub fn memory_owner_get(&self, addr: ipaddr_t, current: &VCpu) -> Result<spci_vm_id_t, ()> {
+        if current.vm().id != HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let begin = pa_init(round_down(ipa_addr(addr), PAGE_SIZE));
+        let end = pa_add(begin, PAGE_SIZE);
+
+        if let Ok(ownership) = ownership::lookup(begin, end) {
+            return ownership.map(|ownership| ownership.owner).ok_or(());
+        }
+
+        // Ownership is no longer tracked, so look for the owner in the page tables of the VMs.
+        (0..self.vm_manager.len())
+            .filter_map(|i| self.vm_manager.get(HF_VM_ID_OFFSET + i))
+            .find(|vm| {
+                let mode = vm
+                    .memory
+                    .lock()
+                    .ptable
+                    .get_mode(ipa_from_pa(begin), ipa_from_pa(end));
+                mode.map_or(false, |mode| !mode.contains(Mode::UNOWNED))
+            })
+            .map(|vm| vm.id)
+            .ok_or(())
+    }
+
     /// Returns the version of the implemented SPCI specification.
     pub fn spci_version(&self) -> i32 {
         // Ensure that both major and minor revision representation occupies at most 15 bits.
         const_assert!(0x8000 > SPCI_VERSION_MAJOR);
         const_assert!(0x10000 > SPCI_VERSION_MINOR);
 
-        (SPCI_VERSION_MAJOR << SPCI_VERSION_MAJOR_OFFSET) | SPCI_VERSION_MINOR
+        spci_version_implemented
     }
 
     pub fn debug_log(&self, c: c_char, current: &VCpu) {
@@ -37,9 +37,6 @@ extern "C" {
     fn arch_one_time_init();
     fn dlog_enable_lock();
 
-    /// The stack to be used by the CPUs.
-    static callstacks: [[u8; STACK_SIZE]; MAX_CPUS];
-
     /// A record for boot CPU. Its field `stack_bottom` is initialized.
     /// Hafnium loader writes booted CPU ID on `cpus.id` and initializes the CPU
     /// stack by the address in `cpus.stack_bottom`.
@@ -90,11 +87,19 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     arch_one_time_init();
     arch_cpu_module_init();
 
-    let ppool = MPool::new();
+    let mut ppool = if cfg!(feature = "buddy") {
+        MPool::new_buddy()
+    } else {
+        MPool::new()
+    };
     ppool.free_pages(Pages::from_raw(
         PTABLE_BUF.get_mut().as_mut_ptr(),
         HEAP_PAGES,
     ));
+    ppool
+        .enable_magazines()
+        .expect("mpool_enable_magazines failed");
+    ppool.set_zeroed_target(ZEROED_PAGES);
 
     let mm = MemoryManager::new(&ppool).expect("mm_init failed");
 
@@ -166,7 +171,7 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     // Load all VMs.
     let primary_initrd = load_primary(
         &mut HYPERVISOR.get_mut().vm_manager,
-        &mut hypervisor_ptable,
+        &hypervisor().memory_manager,
         &cpio,
         params.kernel_arg,
         &hypervisor().mpool,
@@ -182,7 +187,7 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
 
     load_secondary(
         &mut HYPERVISOR.get_mut().vm_manager,
-        &mut hypervisor_ptable,
+        &hypervisor().memory_manager,
         &mut manifest,
         &cpio,
         &params,
@@ -50,7 +50,9 @@ mod api;
 mod arch;
 mod boot_flow;
 mod boot_params;
+mod buddy;
 mod cpu;
+mod epoch;
 mod fdt;
 mod fdt_handler;
 mod hypervisor;
@@ -61,6 +63,7 @@ mod manifest;
 mod memiter;
 mod mm;
 mod mpool;
+mod ownership;
 mod page;
 mod panic;
 mod slist;
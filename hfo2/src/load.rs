@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+use core::cmp;
 use core::mem;
 use core::ptr;
 use core::str;
@@ -28,6 +29,7 @@ use crate::manifest::*;
 use crate::memiter::*;
 use crate::mm::*;
 use crate::mpool::*;
+use crate::ownership::{self, Ownership};
 use crate::page::*;
 use crate::types::*;
 use crate::utils::*;
@@ -35,41 +37,27 @@ use crate::vm::*;
 
 use arrayvec::ArrayVec;
 
-/// Copies data to an unmapped location by mapping it for write, copying the
-/// data, then unmapping it.
+/// Copies data to an unmapped location by mapping it for write in the scratch
+/// window of the current CPU a chunk at a time, and copying the data.
 ///
 /// The data is written so that it is available to all cores with the cache
 /// disabled. When switching to the partitions, the caching is initially
 /// disabled so the data must be available without the cache.
-unsafe fn copy_to_unmapped(
-    hypervisor_ptable: &mut PageTable<Stage1>,
-    to: paddr_t,
-    from_it: &MemIter,
-    ppool: &MPool,
-) -> bool {
-    let from = from_it.get_next();
-    let size = from_it.len();
-    let to_end = pa_add(to, size);
-
-    if hypervisor_ptable
-        .identity_map(to, to_end, Mode::W, ppool)
-        .is_err()
-    {
-        return false;
-    }
-
-    ptr::copy_nonoverlapping(from, pa_addr(to) as *mut _, size);
-    arch_mm_flush_dcache(pa_addr(to), size);
-
-    hypervisor_ptable.unmap(to, to_end, ppool).unwrap();
-
-    true
+unsafe fn copy_to_unmapped(memory_manager: &MemoryManager, to: paddr_t, from_it: &MemIter) {
+    let mut from = from_it.get_next();
+    let to_end = pa_add(to, from_it.len());
+
+    memory_manager.for_each_scratch_chunk(to, to_end, Mode::W, |chunk, size| {
+        ptr::copy_nonoverlapping(from, chunk, size);
+        arch_mm_flush_dcache(chunk as usize, size);
+        from = from.add(size);
+    });
 }
 
 /// Loads the primary VM.
 pub unsafe fn load_primary(
     vm_manager: &mut VmManager,
-    hypervisor_ptable: &mut PageTable<Stage1>,
+    memory_manager: &MemoryManager,
     cpio: &MemIter,
     kernel_arg: uintreg_t,
     ppool: &MPool,
@@ -86,10 +74,7 @@ pub unsafe fn load_primary(
         pa_addr(primary_begin) as *const u8
     );
 
-    if !copy_to_unmapped(hypervisor_ptable, primary_begin, &it, ppool) {
-        dlog!("Unable to relocate kernel for primary vm.\n");
-        return Err(());
-    }
+    copy_to_unmapped(memory_manager, primary_begin, &it);
 
     let initrd = some_or!(find_file(cpio, "initrd.img\0".as_ptr()), {
         dlog!("Unable to find initrd.img\n");
@@ -110,7 +95,7 @@ pub unsafe fn load_primary(
     // Map the 1TB of memory.
     // TODO: We should do a whitelist rather than blacklist.
     if vm
-        .inner
+        .memory
         .get_mut()
         .ptable
         .identity_map(
@@ -125,11 +110,29 @@ pub unsafe fn load_primary(
         return Err(());
     }
 
-    if !mm_vm_unmap_hypervisor(&mut (*vm).inner.get_mut_unchecked().ptable, ppool) {
+    if !mm_vm_unmap_hypervisor(&mut (*vm).memory.get_mut_unchecked().ptable, ppool) {
         dlog!("Unable to unmap hypervisor from primary vm\n");
         return Err(());
     }
 
+    ownership::record(
+        pa_init(0),
+        pa_init(1024usize * 1024 * 1024 * 1024),
+        Some(Ownership::exclusive(HF_PRIMARY_VM_ID)),
+    );
+
+    for (begin, end) in &[
+        (layout_text_begin(), layout_text_end()),
+        (layout_rodata_begin(), layout_rodata_end()),
+        (layout_data_begin(), layout_data_end()),
+    ] {
+        ownership::record(
+            *begin,
+            *end,
+            Some(Ownership::exclusive(HF_HYPERVISOR_VM_ID)),
+        );
+    }
+
     vm.vcpus[0]
         .inner
         .lock() // TODO(HfO2): We can safely use get_mut() here
@@ -138,65 +141,85 @@ pub unsafe fn load_primary(
     Ok(initrd)
 }
 
+/// The largest block size of stage-2 page tables, beyond which aligning the
+/// memory of a VM is of no use.
+const MEM_ALIGNMENT_MAX: usize = 1 << 30;
+
+/// Returns the alignment to prefer for memory of the given size: the largest
+/// power of two not above the size, as larger blocks wouldn't fit in it.
+fn mem_alignment_for(size: usize) -> usize {
+    let top_bit = !(usize::max_value() >> 1);
+    let alignment = top_bit.checked_shr(size.leading_zeros()).unwrap_or(0);
+
+    cmp::max(PAGE_SIZE, cmp::min(MEM_ALIGNMENT_MAX, alignment))
+}
+
 /// Try to find a memory range of the given size within the given ranges, and
-/// remove it from them. Return true on success, or false if no large enough
+/// remove it, and any memory above it, from them. The range is aligned to the
+/// largest power of two, up to `alignment`, that the ranges allow, so the VM's
+/// memory can be mapped with the largest blocks. Memory above the range is left
+/// to the primary. Return the range on success, or an error if no large enough
 /// contiguous range is found.
 fn carve_out_mem_range(
     mem_ranges: &mut [MemRange],
     size_to_find: u64,
+    alignment: usize,
 ) -> Result<(paddr_t, paddr_t), ()> {
+    let size = size_to_find as usize;
+    let mut alignment = cmp::max(alignment, PAGE_SIZE);
+
     // TODO(b/116191358): Consider being cleverer about how we pack VMs
     // together, with a non-greedy algorithm.
-    for mem_range in mem_ranges.iter_mut() {
-        if size_to_find <= pa_difference(mem_range.begin, mem_range.end) as u64 {
-            // This range is big enough, take some of it from the end and reduce
-            // its size accordingly.
-            let found_end = mem_range.end;
-            let found_begin = pa_init(pa_addr(mem_range.end) - size_to_find as usize);
-            mem_range.end = found_begin;
-            return Ok((found_begin, found_end));
-        }
-    }
-
-    Err(())
-}
+    loop {
+        for mem_range in mem_ranges.iter_mut() {
+            let begin = pa_addr(mem_range.begin);
+            let end = pa_addr(mem_range.end);
 
-/// Given arrays of memory ranges before and after memory was removed for
-/// secondary VMs, add the difference to the reserved ranges of the given
-/// update. Return true on success, or false if there would be more than
-/// MAX_MEM_RANGES reserved ranges after adding the new ones.
-/// `before` and `after` must be arrays of exactly `mem_ranges_count` elements.
-fn update_reserved_ranges(
-    update: &mut BootParamsUpdate,
-    before: &[MemRange],
-    after: &[MemRange],
-) -> Result<(), ()> {
-    assert_eq!(before.len(), after.len());
+            if size > end - begin {
+                continue;
+            }
 
-    for (before, after) in before.iter().zip(after.iter()) {
-        if pa_addr(after.begin) > pa_addr(before.begin) {
-            if update.reserved_ranges_count >= MAX_MEM_RANGES {
-                dlog!("Too many reserved ranges after loading secondary VMs.\n");
-                return Err(());
+            // Take memory from as close to the end as the alignment allows, and
+            // reduce the size of the range accordingly.
+            let found_begin = round_down(end - size, alignment);
+            if found_begin >= begin {
+                mem_range.end = pa_init(found_begin);
+                return Ok((pa_init(found_begin), pa_init(found_begin + size)));
             }
+        }
 
-            update.reserved_ranges[update.reserved_ranges_count].begin = before.begin;
-            update.reserved_ranges[update.reserved_ranges_count].end = after.begin;
-            update.reserved_ranges_count += 1;
+        if alignment == PAGE_SIZE {
+            return Err(());
         }
 
-        if pa_addr(after.end) < pa_addr(before.end) {
-            if update.reserved_ranges_count >= MAX_MEM_RANGES {
-                dlog!("Too many reserved ranges after loading secondary VMs.\n");
-                return Err(());
-            }
+        alignment /= 2;
+    }
+}
 
-            update.reserved_ranges[update.reserved_ranges_count].begin = after.end;
-            update.reserved_ranges[update.reserved_ranges_count].end = before.end;
-            update.reserved_ranges_count += 1;
+/// Adds the given range of memory, taken for a secondary VM, to the reserved
+/// ranges of the given update. Ranges taken one below the other are merged.
+/// Return an error if there would be more than MAX_MEM_RANGES reserved ranges.
+fn add_reserved_range(
+    update: &mut BootParamsUpdate,
+    begin: paddr_t,
+    end: paddr_t,
+) -> Result<(), ()> {
+    if let Some(last) = update.reserved_ranges[..update.reserved_ranges_count].last_mut() {
+        if pa_addr(last.begin) == pa_addr(end) {
+            last.begin = begin;
+            return Ok(());
         }
     }
 
+    if update.reserved_ranges_count >= MAX_MEM_RANGES {
+        dlog!("Too many reserved ranges after loading secondary VMs.\n");
+        return Err(());
+    }
+
+    update.reserved_ranges[update.reserved_ranges_count].begin = begin;
+    update.reserved_ranges[update.reserved_ranges_count].end = end;
+    update.reserved_ranges_count += 1;
+
     Ok(())
 }
 
@@ -204,7 +227,7 @@ fn update_reserved_ranges(
 /// Memory reserved for the VMs is added to the `reserved_ranges` of `update`.
 pub unsafe fn load_secondary(
     vm_manager: &mut VmManager,
-    hypervisor_ptable: &mut PageTable<Stage1>,
+    memory_manager: &MemoryManager,
     manifest: &mut Manifest,
     cpio: &MemIter,
     params: &BootParams,
@@ -257,22 +280,29 @@ pub unsafe fn load_secondary(
             continue;
         }
 
-        let (secondary_mem_begin, secondary_mem_end) =
-            ok_or!(carve_out_mem_range(&mut mem_ranges_available, mem_size), {
+        let alignment = if manifest_vm.mem_alignment != 0 {
+            manifest_vm.mem_alignment as usize
+        } else {
+            mem_alignment_for(mem_size as usize)
+        };
+
+        let (secondary_mem_begin, secondary_mem_end) = ok_or!(
+            carve_out_mem_range(&mut mem_ranges_available, mem_size, alignment),
+            {
                 dlog!("Not enough memory ({} bytes)\n", mem_size);
                 continue;
-            });
+            }
+        );
 
-        if !copy_to_unmapped(hypervisor_ptable, secondary_mem_begin, &kernel, ppool) {
-            dlog!("Unable to copy kernel\n");
-            continue;
-        }
+        add_reserved_range(update, secondary_mem_begin, secondary_mem_end)?;
+
+        copy_to_unmapped(memory_manager, secondary_mem_begin, &kernel);
 
         let primary = vm_manager.get_mut(HF_PRIMARY_VM_ID).unwrap();
 
         // Deny the primary VM access to this memory.
         if primary
-            .inner
+            .memory
             .get_mut()
             .ptable
             .unmap(secondary_mem_begin, secondary_mem_end, ppool)
@@ -282,14 +312,18 @@ pub unsafe fn load_secondary(
             return Err(());
         }
 
+        ownership::record(secondary_mem_begin, secondary_mem_end, None);
+
         let vm = some_or!(vm_manager.new_vm(manifest_vm.vcpu_count, ppool), {
             dlog!("Unable to initialise VM\n");
             continue;
         });
 
+        vm.direct_handoff = manifest_vm.direct_handoff;
+
         // Grant the VM access to the memory.
         if vm
-            .inner
+            .memory
             .get_mut()
             .ptable
             .identity_map(
@@ -304,12 +338,25 @@ pub unsafe fn load_secondary(
             continue;
         }
 
+        ownership::record(
+            secondary_mem_begin,
+            secondary_mem_end,
+            Some(Ownership::exclusive(vm.id)),
+        );
+
         dlog!(
             "Loaded with {} vcpus, entry at 0x{:x}\n",
             manifest_vm.vcpu_count,
             pa_addr(secondary_mem_begin)
         );
 
+        let stats = vm.memory.get_mut().ptable.stats();
+        dlog!(
+            "Mapped {} KiB, {} KiB in contiguous runs\n",
+            stats.valid_bytes / 1024,
+            stats.contiguous_bytes / 1024
+        );
+
         let secondary_entry = ipa_from_pa(secondary_mem_begin);
         vcpu_secondary_reset_and_start(
             &mut vm.vcpus[0],
@@ -318,14 +365,59 @@ pub unsafe fn load_secondary(
         );
     }
 
-    // Add newly reserved areas to update params by looking at the difference
-    // between the available ranges from the original params and the updated
-    // mem_ranges_available. We assume that the number and order of available
-    // ranges is the same, i.e. we don't remove any ranges above only make them
-    // smaller.
-    update_reserved_ranges(
-        update,
-        &params.mem_ranges[0..params.mem_ranges_count],
-        &mem_ranges_available,
-    )
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    const MIB: usize = 1024 * 1024;
+
+    fn mem_range(begin: usize, end: usize) -> MemRange {
+        MemRange {
+            begin: pa_init(begin),
+            end: pa_init(end),
+        }
+    }
+
+    #[test]
+    fn mem_alignment_for_size() {
+        assert_eq!(mem_alignment_for(0), PAGE_SIZE);
+        assert_eq!(mem_alignment_for(PAGE_SIZE + 1), PAGE_SIZE);
+        assert_eq!(mem_alignment_for(3 * MIB), 2 * MIB);
+        assert_eq!(mem_alignment_for(4096 * MIB), MEM_ALIGNMENT_MAX);
+    }
+
+    /// Memory is carved out at the alignment, leaving the memory above it.
+    #[test]
+    fn carve_out_mem_range_aligned() {
+        let mut ranges = [mem_range(0x3ff0_0000, 0x4030_1000)];
+
+        assert_eq!(
+            carve_out_mem_range(&mut ranges, 2 * MIB as u64, 2 * MIB)
+                .map(|(begin, end)| (pa_addr(begin), pa_addr(end))),
+            Ok((0x4000_0000, 0x4020_0000))
+        );
+        assert_eq!(pa_addr(ranges[0].end), 0x4000_0000);
+    }
+
+    /// The alignment is lowered if no range allows it.
+    #[test]
+    fn carve_out_mem_range_lower_alignment() {
+        let mut ranges = [
+            mem_range(0x4000_1000, 0x4020_3000),
+            mem_range(0x8000_0000, 0x8000_3000),
+        ];
+
+        assert_eq!(
+            carve_out_mem_range(&mut ranges, 2 * MIB as u64, MEM_ALIGNMENT_MAX)
+                .map(|(begin, end)| (pa_addr(begin), pa_addr(end))),
+            Ok((0x4000_2000, 0x4020_2000))
+        );
+        assert_eq!(pa_addr(ranges[0].end), 0x4000_2000);
+        assert_eq!(pa_addr(ranges[1].end), 0x8000_3000);
+
+        assert!(carve_out_mem_range(&mut ranges, 2 * MIB as u64, MEM_ALIGNMENT_MAX).is_err());
+    }
 }
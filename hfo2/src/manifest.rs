@@ -39,6 +39,7 @@ pub enum Error {
     MalformedStringList,
     MalformedInteger,
     IntegerOverflow,
+    MalformedAlignment,
 }
 
 impl Into<&'static str> for Error {
@@ -58,6 +59,7 @@ impl Into<&'static str> for Error {
             MalformedStringList => "Malformed string list property",
             MalformedInteger => "Malformed integer property",
             IntegerOverflow => "Integer overflow",
+            MalformedAlignment => "Memory alignment is not a power of two",
         }
     }
 }
@@ -74,7 +76,11 @@ pub struct ManifestVm {
     // Properties specific to secondary VMs.
     pub kernel_filename: [u8; MANIFEST_MAX_STRING_LENGTH],
     pub mem_size: u64,
+    /// The preferred alignment of the memory of the VM, or 0 to let the loader choose.
+    pub mem_alignment: u64,
     pub vcpu_count: spci_vcpu_count_t,
+    /// Whether other secondary VMs may switch directly to the vCPUs of the VM.
+    pub direct_handoff: bool,
 }
 
 /// Hafnium manifest parsed from FDT.
@@ -222,21 +228,37 @@ impl ManifestVm {
 
         let mut kernel_filename: [u8; MANIFEST_MAX_STRING_LENGTH] = Default::default();
 
-        let (mem_size, vcpu_count) = if vm_id != HF_PRIMARY_VM_ID {
+        let (mem_size, mem_alignment, vcpu_count, direct_handoff) = if vm_id != HF_PRIMARY_VM_ID {
             node.read_string("kernel_filename\0".as_ptr(), &mut kernel_filename)?;
+
+            // The alignment is optional.
+            let mem_alignment = match node.read_u64("mem_alignment\0".as_ptr()) {
+                Ok(alignment) if !alignment.is_power_of_two() => {
+                    return Err(Error::MalformedAlignment)
+                }
+                Ok(alignment) => alignment,
+                Err(Error::PropertyNotFound) => 0,
+                Err(e) => return Err(e),
+            };
+
             (
                 node.read_u64("mem_size\0".as_ptr())?,
+                mem_alignment,
                 node.read_u16("vcpu_count\0".as_ptr())?,
+                // Direct handoff is opted in to by the presence of the property.
+                node.read_property("direct_handoff\0".as_ptr()).is_ok(),
             )
         } else {
-            (0, 0)
+            (0, 0, 0, false)
         };
 
         Ok(Self {
             debug_name,
             kernel_filename,
             mem_size,
+            mem_alignment,
             vcpu_count,
+            direct_handoff,
         })
     }
 }
@@ -396,6 +418,19 @@ mod test {
             self.integer_property("mem_size", value)
         }
 
+        fn mem_alignment(&mut self, value: u64) -> &mut Self {
+            self.integer_property("mem_alignment", value)
+        }
+
+        fn direct_handoff(&mut self) -> &mut Self {
+            self.boolean_property("direct_handoff")
+        }
+
+        fn boolean_property(&mut self, name: &str) -> &mut Self {
+            write!(self.dts, "{};\n", name).unwrap();
+            self
+        }
+
         fn string_property(&mut self, name: &str, value: &str) -> &mut Self {
             write!(self.dts, "{} = \"{}\";\n", name, value).unwrap();
             self
@@ -568,6 +603,29 @@ mod test {
         assert_eq!(m.init(&fdt_root).unwrap_err(), Error::IntegerOverflow);
     }
 
+    #[test]
+    fn mem_alignment_not_power_of_two() {
+        let dtb = ManifestDtBuilder::new()
+            .start_child("hypervisor")
+            .compatible_hafnium()
+            .start_child("vm1")
+            .debug_name("primary_vm")
+            .end_child()
+            .start_child("vm2")
+            .debug_name("secondary_vm")
+            .vcpu_count(1)
+            .mem_size(0x200000)
+            .mem_alignment(0x300000)
+            .kernel_filename("kernel")
+            .end_child()
+            .end_child()
+            .build();
+
+        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
+        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::MalformedAlignment);
+    }
+
     #[test]
     fn valid() {
         let dtb = ManifestDtBuilder::new()
@@ -580,7 +638,9 @@ mod test {
             .debug_name("second_secondary_vm")
             .vcpu_count(43)
             .mem_size(0x12345)
+            .mem_alignment(0x200000)
             .kernel_filename("second_kernel")
+            .direct_handoff()
             .end_child()
             .start_child("vm2")
             .debug_name("first_secondary_vm")
@@ -603,12 +663,16 @@ mod test {
         assert_eq!(as_asciz(&vm.debug_name), b"first_secondary_vm");
         assert_eq!(vm.vcpu_count, 42);
         assert_eq!(vm.mem_size, 12345);
+        assert_eq!(vm.mem_alignment, 0);
+        assert!(!vm.direct_handoff);
         assert_eq!(as_asciz(&vm.kernel_filename), b"first_kernel");
 
         let vm = &m.vms[2];
         assert_eq!(as_asciz(&vm.debug_name), b"second_secondary_vm");
         assert_eq!(vm.vcpu_count, 43);
         assert_eq!(vm.mem_size, 0x12345);
+        assert_eq!(vm.mem_alignment, 0x200000);
+        assert!(vm.direct_handoff);
         assert_eq!(as_asciz(&vm.kernel_filename), b"second_kernel");
     }
 }
@@ -31,37 +31,35 @@ use core::mem;
 use core::ops::*;
 use core::ptr;
 use core::slice;
-use core::sync::atomic::{fence, AtomicBool, Ordering};
+use core::sync::atomic::{fence, AtomicBool, AtomicU64, Ordering};
+
+use arrayvec::ArrayVec;
 use reduce::Reduce;
 
 use crate::addr::*;
+use crate::arch::mm::{self as arch_mm, CONTIGUOUS_ENTRIES};
 use crate::arch::*;
+use crate::cpu::cpu_index_current;
 use crate::init::*;
 use crate::layout::*;
 use crate::mpool::MPool;
 use crate::page::*;
 use crate::spinlock::{SpinLock, SpinLockGuard};
+use crate::std::*;
 use crate::types::*;
 use crate::utils::*;
+use crate::vm::vm_get_arch;
 
 extern "C" {
-    fn arch_mm_absent_pte(level: u8) -> pte_t;
-    fn arch_mm_table_pte(level: u8, pa: paddr_t) -> pte_t;
-    fn arch_mm_block_pte(level: u8, pa: paddr_t, attrs: u64) -> pte_t;
-
-    fn arch_mm_is_block_allowed(level: u8) -> bool;
-    fn arch_mm_pte_is_present(pte: pte_t, level: u8) -> bool;
-    fn arch_mm_pte_is_valid(pte: pte_t, level: u8) -> bool;
-    fn arch_mm_pte_is_block(pte: pte_t, level: u8) -> bool;
-    fn arch_mm_pte_is_table(pte: pte_t, level: u8) -> bool;
-
-    fn arch_mm_clear_pa(pa: paddr_t) -> paddr_t;
-    fn arch_mm_block_from_pte(pte: pte_t, level: u8) -> paddr_t;
-    fn arch_mm_table_from_pte(pte: pte_t, level: u8) -> paddr_t;
-    fn arch_mm_pte_attrs(pte: pte_t, level: u8) -> u64;
-
-    fn arch_mm_invalidate_stage1_range(begin: vaddr_t, end: vaddr_t);
-    fn arch_mm_invalidate_stage2_range(begin: ipaddr_t, end: ipaddr_t);
+    fn arch_mm_invalidate_stage1_ranges(ranges: *const TlbRange, count: size_t);
+    fn arch_mm_invalidate_stage1_range_local(va_begin: vaddr_t, va_end: vaddr_t);
+    fn arch_mm_sync_table_writes_local();
+    fn arch_mm_invalidate_stage2_ranges(
+        root: paddr_t,
+        vm: *const ArchVm,
+        ranges: *const TlbRange,
+        count: size_t,
+    );
 
     fn arch_mm_mode_to_stage1_attrs(mode: c_int) -> u64;
     fn arch_mm_mode_to_stage2_attrs(mode: c_int) -> u64;
@@ -69,6 +67,7 @@ extern "C" {
     fn arch_mm_stage2_attrs_to_mode(attrs: u64) -> c_int;
 
     pub fn arch_mm_flush_dcache(base: usize, size: size_t);
+    pub fn arch_mm_zero_memory(base: *mut u8, size: size_t);
 
     fn arch_mm_stage1_max_level() -> u8;
     fn arch_mm_stage2_max_level() -> u8;
@@ -80,8 +79,6 @@ extern "C" {
 
     fn arch_mm_enable(table: paddr_t);
 
-    fn arch_mm_combine_table_entry_attrs(table_attrs: u64, block_attrs: u64) -> u64;
-
     fn plat_console_mm_init(stage1_locked: mm_stage1_locked, mpool: *const MPool);
 }
 
@@ -114,6 +111,10 @@ bitflags! {
     ///  - !V !O !X : Invalid memory. Memory is unrelated to the VM.
     ///
     ///  Modes are selected so that owner of exclusive memory is the default.
+    ///
+    /// Memory given to a VM that has not been cleared yet is additionally marked uncleared. It is
+    /// owned and exclusive to the VM but invalid, so that it is cleared and mapped in when the VM
+    /// first accesses it.
     #[repr(C)]
     pub struct Mode: u32 {
         /// Read
@@ -136,6 +137,9 @@ bitflags! {
 
         /// Shared
         const SHARED  = 0b0100_0000;
+
+        /// Uncleared
+        const UNCLEARED = 0b1000_0000;
     }
 }
 
@@ -220,8 +224,9 @@ pub trait Stage {
     /// Returns the number of root-level tables.
     fn root_table_count() -> u8;
 
-    /// Invalidates the TLB for the given address range.
-    fn invalidate_tlb(begin: ptable_addr_t, end: ptable_addr_t);
+    /// Invalidates the TLB for the given address ranges of the table with the given root, waiting
+    /// for the completion of all of them at once.
+    fn invalidate_tlb(root: paddr_t, ranges: &[TlbRange]);
 
     /// Converts the mode into attributes for a block PTE.
     fn mode_to_attrs(mode: Mode) -> u64;
@@ -249,9 +254,9 @@ impl Stage for Stage1 {
         unsafe { arch_mm_stage1_root_table_count() }
     }
 
-    fn invalidate_tlb(begin: usize, end: usize) {
+    fn invalidate_tlb(_root: paddr_t, ranges: &[TlbRange]) {
         unsafe {
-            arch_mm_invalidate_stage1_range(va_init(begin), va_init(end));
+            arch_mm_invalidate_stage1_ranges(ranges.as_ptr(), ranges.len());
         }
     }
 
@@ -276,15 +281,26 @@ impl Stage for Stage2 {
         unsafe { arch_mm_stage2_root_table_count() }
     }
 
-    fn invalidate_tlb(begin: usize, end: usize) {
-        if hypervisor()
+    fn invalidate_tlb(root: paddr_t, ranges: &[TlbRange]) {
+        let hypervisor = hypervisor();
+
+        if !hypervisor
             .memory_manager
             .stage2_invalidate
             .load(Ordering::Relaxed)
         {
-            unsafe {
-                arch_mm_invalidate_stage2_range(ipa_init(begin), ipa_init(end));
-            }
+            return;
+        }
+
+        // The TLB entries of a VM are tagged with the VMIDs of its vCPUs, which are kept with the
+        // VM's arch-specific information.
+        let vm = hypervisor
+            .vm_manager
+            .find_by_ptable(root)
+            .map_or(ptr::null(), |vm| unsafe { vm_get_arch(vm) } as *const _);
+
+        unsafe {
+            arch_mm_invalidate_stage2_ranges(root, vm, ranges.as_ptr(), ranges.len());
         }
     }
 
@@ -297,6 +313,126 @@ impl Stage for Stage2 {
     }
 }
 
+/// The number of disjoint ranges a `TlbGather` keeps before it merges them.
+const TLB_GATHER_RANGES: usize = 8;
+
+/// The number of deferred writes, or frees, a `TlbGather` keeps before it is flushed.
+const TLB_GATHER_ENTRIES: usize = 32;
+
+/// A range of addresses whose TLB entries are to be invalidated.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct TlbRange {
+    begin: ptable_addr_t,
+    end: ptable_addr_t,
+}
+
+/// Gathers the TLB invalidations needed by an update of a page table, so that they are issued
+/// together with a single wait for their completion.
+///
+/// The second half of a break-before-make sequence, writing the new entry, is deferred until the
+/// TLB entries of the old one are invalidated. So is freeing the tables that are no longer referred
+/// to, as the TLB may still hold walks through them. An entry with a deferred write must not be
+/// read or written until the gather is flushed.
+struct TlbGather {
+    root: paddr_t,
+    ranges: ArrayVec<[TlbRange; TLB_GATHER_RANGES]>,
+    writes: ArrayVec<[(*mut PageTableEntry, PageTableEntry); TLB_GATHER_ENTRIES]>,
+    frees: ArrayVec<[(PageTableEntry, u8); TLB_GATHER_ENTRIES]>,
+}
+
+impl TlbGather {
+    /// Creates a gather for an update of the table with the given root.
+    fn new(root: paddr_t) -> Self {
+        Self {
+            root,
+            ranges: ArrayVec::new(),
+            writes: ArrayVec::new(),
+            frees: ArrayVec::new(),
+        }
+    }
+
+    /// Adds the given range to those to be invalidated. Ranges are mostly added in increasing
+    /// order, so a range is merged with the last one if they overlap or are adjacent, or if there is
+    /// no room left for it; invalidating more than needed is harmless.
+    fn add(&mut self, begin: ptable_addr_t, end: ptable_addr_t) {
+        let full = self.ranges.is_full();
+
+        if let Some(last) = self.ranges.last_mut() {
+            if (begin <= last.end && last.begin <= end) || full {
+                last.begin = cmp::min(last.begin, begin);
+                last.end = cmp::max(last.end, end);
+                return;
+            }
+        }
+
+        self.ranges.push(TlbRange { begin, end });
+    }
+
+    /// Writes an absent value to the given entry, which maps `begin` at the given level, and defers
+    /// writing `new_pte` to it until the TLB entries of the old value are invalidated.
+    fn break_before_make<S: Stage>(
+        &mut self,
+        pte: &mut PageTableEntry,
+        new_pte: PageTableEntry,
+        begin: ptable_addr_t,
+        level: u8,
+        mpool: &MPool,
+    ) {
+        if self.writes.is_full() {
+            self.flush::<S>(mpool);
+        }
+
+        let old_pte = mem::replace(pte, PageTableEntry::absent(level));
+        self.add(begin, begin + addr::entry_size(level));
+        self.writes.push((pte as *mut _, new_pte));
+        self.free::<S>(old_pte, level, mpool);
+    }
+
+    /// Frees all page-table-related memory associated with the given pte, which is no longer in a
+    /// page table, once the TLB is invalidated.
+    fn free<S: Stage>(&mut self, pte: PageTableEntry, level: u8, mpool: &MPool) {
+        if !pte.is_table(level) {
+            pte.drop(level, mpool);
+            return;
+        }
+
+        if self.frees.is_full() {
+            self.flush::<S>(mpool);
+        }
+        self.frees.push((pte, level));
+    }
+
+    /// Invalidates the gathered ranges, then completes the deferred writes and frees.
+    fn flush<S: Stage>(&mut self, mpool: &MPool) {
+        if self.ranges.is_empty() {
+            return;
+        }
+
+        S::invalidate_tlb(self.root, &self.ranges);
+        self.ranges.clear();
+
+        for (pte, new_pte) in self.writes.drain(..) {
+            unsafe { ptr::write(pte, new_pte) };
+        }
+        for (pte, level) in self.frees.drain(..) {
+            pte.drop(level, mpool);
+        }
+    }
+}
+
+/// What a table entry records about the entries of the table it references, so that whether the
+/// table is empty or can be merged into a block is known without scanning it.
+#[derive(Clone, Copy)]
+struct TableMeta {
+    /// The number of present entries.
+    present: usize,
+
+    /// Whether all the entries are blocks with the same attributes, or are all absent. It is only
+    /// set when this is known without a scan, so a table may become uniform without the mark.
+    uniform: bool,
+}
+
 /// Page table entry.
 #[repr(C)]
 struct PageTableEntry {
@@ -315,16 +451,16 @@ impl PageTableEntry {
     }
 
     fn absent(level: u8) -> Self {
-        unsafe { Self::from_raw(arch_mm_absent_pte(level)) }
+        unsafe { Self::from_raw(arch_mm::absent_pte(level)) }
     }
 
     fn block(level: u8, begin: paddr_t, attrs: u64) -> Self {
-        unsafe { Self::from_raw(arch_mm_block_pte(level, begin, attrs)) }
+        unsafe { Self::from_raw(arch_mm::block_pte(level, begin, attrs)) }
     }
 
     fn table(level: u8, node: PageTableNode) -> Self {
         unsafe {
-            Self::from_raw(arch_mm_table_pte(
+            Self::from_raw(arch_mm::table_pte(
                 level,
                 pa_init(node.into_page() as uintpaddr_t),
             ))
@@ -332,23 +468,78 @@ impl PageTableEntry {
     }
 
     fn is_present(&self, level: u8) -> bool {
-        unsafe { arch_mm_pte_is_present(self.inner, level) }
+        arch_mm::pte_is_present(self.inner, level)
     }
 
     fn is_valid(&self, level: u8) -> bool {
-        unsafe { arch_mm_pte_is_valid(self.inner, level) }
+        arch_mm::pte_is_valid(self.inner, level)
     }
 
     fn is_block(&self, level: u8) -> bool {
-        unsafe { arch_mm_pte_is_block(self.inner, level) }
+        arch_mm::pte_is_block(self.inner, level)
     }
 
     fn is_table(&self, level: u8) -> bool {
-        unsafe { arch_mm_pte_is_table(self.inner, level) }
+        arch_mm::pte_is_table(self.inner, level)
     }
 
     fn attrs(&self, level: u8) -> u64 {
-        unsafe { arch_mm_pte_attrs(self.inner, level) }
+        arch_mm::pte_attrs(self.inner, level)
+    }
+
+    /// Reads the inner value of the entry at once, as it may be written concurrently when the page
+    /// table is walked without its lock.
+    fn load(&self) -> pte_t {
+        unsafe { (*(&self.inner as *const pte_t as *const AtomicU64)).load(Ordering::Relaxed) }
+    }
+
+    /// Writes the inner value of the entry at once, as it may be read concurrently when the page
+    /// table is walked without its lock.
+    fn store(&mut self, inner: pte_t) {
+        unsafe {
+            (*(&self.inner as *const pte_t as *const AtomicU64)).store(inner, Ordering::Relaxed)
+        }
+    }
+
+    /// Returns whether the entry references a table that may have changed since it was last
+    /// defragmented.
+    fn is_dirty(&self, level: u8) -> bool {
+        self.is_table(level) && arch_mm::table_pte_is_dirty(self.inner, level)
+    }
+
+    /// Marks the table referenced by the entry as changed or not since it was last defragmented.
+    /// The mark is ignored by the hardware, so this needs no break-before-make sequence.
+    fn set_dirty(&mut self, level: u8, dirty: bool) {
+        if self.is_table(level) {
+            self.store(arch_mm::table_pte_set_dirty(self.inner, level, dirty));
+        }
+    }
+
+    /// Returns what the entry records about the table it references.
+    fn table_meta(&self, level: u8) -> TableMeta {
+        TableMeta {
+            present: arch_mm::table_pte_present_count(self.inner, level),
+            uniform: arch_mm::table_pte_is_uniform(self.inner, level),
+        }
+    }
+
+    /// Records the given information about the table referenced by the entry. It is ignored by the
+    /// hardware, so this needs no break-before-make sequence.
+    fn set_table_meta(&mut self, level: u8, meta: TableMeta) {
+        if self.is_table(level) {
+            let inner = arch_mm::table_pte_set_present_count(self.inner, level, meta.present);
+            self.store(arch_mm::table_pte_set_uniform(inner, level, meta.uniform));
+        }
+    }
+
+    /// Returns whether the entry is a block in a run of entries with the contiguous hint.
+    fn is_contiguous(&self, level: u8) -> bool {
+        self.is_block(level) && arch_mm::pte_is_contiguous(self.inner, level)
+    }
+
+    /// Sets or clears the contiguous hint of a block entry.
+    fn set_contiguous(&mut self, level: u8, contiguous: bool) {
+        self.inner = arch_mm::pte_set_contiguous(self.inner, level, contiguous);
     }
 
     fn as_block(&self, level: u8) -> Result<paddr_t, ()> {
@@ -360,12 +551,12 @@ impl PageTableEntry {
     }
 
     unsafe fn as_block_unchecked(&self, level: u8) -> paddr_t {
-        arch_mm_block_from_pte(self.inner, level)
+        arch_mm::block_from_pte(self.inner, level)
     }
 
     fn as_table(&self, level: u8) -> Result<&RawPageTable, ()> {
         if self.is_table(level) {
-            unsafe { Ok(&*(pa_addr(arch_mm_table_from_pte(self.inner, level)) as *const _)) }
+            unsafe { Ok(&*(pa_addr(arch_mm::table_from_pte(self.inner, level)) as *const _)) }
         } else {
             Err(())
         }
@@ -373,7 +564,7 @@ impl PageTableEntry {
 
     fn as_table_mut(&mut self, level: u8) -> Result<&mut RawPageTable, ()> {
         if self.is_table(level) {
-            unsafe { Ok(&mut *(pa_addr(arch_mm_table_from_pte(self.inner, level)) as *mut _)) }
+            unsafe { Ok(&mut *(pa_addr(arch_mm::table_from_pte(self.inner, level)) as *mut _)) }
         } else {
             Err(())
         }
@@ -383,7 +574,7 @@ impl PageTableEntry {
         let ret = if self.is_table(level) {
             unsafe {
                 Ok(PageTableNode::from_raw(
-                    pa_addr(arch_mm_table_from_pte(self.inner, level)) as *mut _,
+                    pa_addr(arch_mm::table_from_pte(self.inner, level)) as *mut _,
                 ))
             }
         } else {
@@ -402,28 +593,36 @@ impl PageTableEntry {
         }
     }
 
-    /// Replaces a page table entry with the given value. If both old and new values are valid, it
-    /// performs a break-before-make sequence where it first writes an invalid value to the PTE,
-    /// flushes the TLB, then writes the actual new value.  This is to prevent cases where CPUs have
-    /// different 'valid' values in their TLBs, which may result in issues for example in cache
-    /// coherency.
+    /// Replaces a page table entry with the given value. If the old value is valid, its TLB entries
+    /// are invalidated through `tlb`. If both old and new values are valid, it performs a
+    /// break-before-make sequence where it first writes an invalid value to the PTE, and writes the
+    /// actual new value once `tlb` is flushed.  This is to prevent cases where CPUs have different
+    /// 'valid' values in their TLBs, which may result in issues for example in cache coherency.
     fn replace<S: Stage>(
         &mut self,
         new_pte: PageTableEntry,
         begin: ptable_addr_t,
         level: u8,
+        tlb: &mut TlbGather,
         mpool: &MPool,
     ) {
-        // We need to do the break-before-make sequence if both values are present and the TLB is
-        // being invalidated.
-        if self.is_valid(level) && new_pte.is_valid(level) {
-            unsafe { ptr::write(self, Self::absent(level)) };
-            S::invalidate_tlb(begin, begin + addr::entry_size(level));
+        // Invalid entries are not cached in the TLB.
+        if !self.is_valid(level) {
+            let old_pte = mem::replace(self, new_pte);
+            old_pte.drop(level, mpool);
+            return;
+        }
+
+        // We need to do the break-before-make sequence if both values are valid.
+        if new_pte.is_valid(level) {
+            tlb.break_before_make::<S>(self, new_pte, begin, level, mpool);
+            return;
         }
 
         // Assign the new pte.
         let old_pte = mem::replace(self, new_pte);
-        old_pte.drop(level, mpool);
+        tlb.add(begin, begin + addr::entry_size(level));
+        tlb.free::<S>(old_pte, level, mpool);
     }
 
     /// Populates the provided page table entry with a reference to another table if needed, that
@@ -434,6 +633,7 @@ impl PageTableEntry {
         &mut self,
         begin: ptable_addr_t,
         level: u8,
+        tlb: &mut TlbGather,
         mpool: &MPool,
     ) -> Result<(), ()> {
         // Just return if it's already populated.
@@ -441,14 +641,22 @@ impl PageTableEntry {
             return Ok(());
         }
 
-        // Allocate a new table.
-        let page = mpool
-            .alloc()
-            .map_err(|_| dlog!("Failed to allocate memory for page table\n"))?;
+        // Allocate a new table. A table of absent entries needs no initialisation if absent entries
+        // are all zeroes, as long as the page is zeroed, preferably in advance.
+        let level_below = level - 1;
+        let is_block = self.is_block(level);
+        let zeroed = !is_block && arch_mm::absent_pte(level_below) == 0;
+        let page = if zeroed {
+            mpool.alloc_zeroed()
+        } else {
+            mpool.alloc()
+        }
+        .map_err(|_| dlog!("Failed to allocate memory for page table\n"))?;
 
         // Initialise entries in the new table.
-        let level_below = level - 1;
-        let table = if self.is_block(level) {
+        let table = if zeroed {
+            unsafe { PageTableNode::from_raw(page.into_raw() as *mut RawPageTable) }
+        } else if is_block {
             let attrs = self.attrs(level);
             let entry_size = addr::entry_size(level_below);
 
@@ -463,63 +671,142 @@ impl PageTableEntry {
             PageTableNode::new(page, |_| Self::absent(level_below))
         };
 
-        // Ensure initialisation is visible before updating the pte.
+        // Ensure initialisation is visible before updating the pte, also to CPUs walking the table
+        // without its lock (see `get_attrs_level()`).
         //
         // TODO(@jeehoonkang): very suspicious..
         fence(Ordering::Release);
 
-        // Replace the pte entry, doing a break-before-make if needed.
-        let table = Self::table(level, table);
-        self.replace::<S>(table, begin, level, mpool);
+        // Replace the pte entry, doing a break-before-make if needed. The new table is dirty, as it
+        // may be merged back into a block. It is to be walked right away, so the break-before-make
+        // is completed now.
+        let mut table = Self::table(level, table);
+        table.set_dirty(level, true);
+        table.set_table_meta(
+            level,
+            TableMeta {
+                present: if is_block { PTE_PER_PAGE } else { 0 },
+                uniform: true,
+            },
+        );
+        let was_valid = self.is_valid(level);
+        self.replace::<S>(table, begin, level, tlb, mpool);
+        if was_valid {
+            tlb.flush::<S>(mpool);
+        }
 
         Ok(())
     }
 
-    /// Defragments the given PTE by recursively replacing any tables with blocks or absent entries
-    /// where possible.
-    fn defrag(&mut self, level: u8, mpool: &MPool) -> Result<u64, ()> {
-        let attrs = self.attrs(level);
+    /// Returns the attributes of the entry if it is a block, without defragmenting it.
+    fn block_attrs(&self, level: u8) -> Result<u64, ()> {
+        if self.is_block(level) {
+            Ok(self.attrs(level))
+        } else {
+            Err(())
+        }
+    }
 
+    /// Defragments the given PTE, mapping the addresses from `entry_begin`, by recursively
+    /// replacing any tables with blocks or absent entries where possible.
+    ///
+    /// Only the entries mapping addresses in `[begin, end)` are revisited, and only if they are
+    /// dirty. Returns the attributes of the entry if it is now a block.
+    fn defrag(
+        &mut self,
+        begin: ptable_addr_t,
+        end: ptable_addr_t,
+        entry_begin: ptable_addr_t,
+        level: u8,
+        mpool: &MPool,
+    ) -> Result<u64, ()> {
         if self.is_block(level) {
-            return Ok(attrs);
+            return Ok(self.attrs(level));
         }
 
+        // A clean table was not mergeable when it was last defragmented, and has not changed since.
+        if !self.is_dirty(level) {
+            return Err(());
+        }
+
+        let attrs = self.attrs(level);
+        let mut meta = self.table_meta(level);
         let table = self.as_table_mut(level)?;
+        let entry_size = addr::entry_size(level - 1);
+
+        // An empty or uniform table is known to be mergeable without a scan. Otherwise, first try to
+        // defrag the entries in the range, in case they are subtables. Then check if all entries
+        // are blocks with the same flags or are all absent, recounting the present entries on the
+        // way. It assumes addresses are contiguous due to identity mapping.
+        let children_attrs = if meta.present == 0 {
+            Ok(arch_mm::absent_pte(level - 1))
+        } else if meta.uniform {
+            table[0].block_attrs(level - 1)
+        } else {
+            let mut present = 0;
+            let children_attrs = table
+                .iter_mut()
+                .enumerate()
+                .map(|(i, pte)| {
+                    let pte_begin = entry_begin + i * entry_size;
+                    let attrs = if pte_begin < end && begin < pte_begin + entry_size {
+                        pte.defrag(begin, end, pte_begin, level - 1, mpool)
+                    } else {
+                        pte.block_attrs(level - 1)
+                    };
+                    if pte.is_present(level - 1) {
+                        present += 1;
+                    }
+                    attrs
+                })
+                .reduce(|l, r| if l == r { l } else { Err(()) })
+                .ok_or(())?;
+
+            meta = TableMeta {
+                present,
+                uniform: present == 0 || children_attrs.is_ok(),
+            };
+            children_attrs
+        };
 
-        // First try to defrag the entry, in case it is a subtable. Then check if all entries are
-        // blocks with the same flags or are all absent. It assumes addresses are contiguous due to
-        // identity mapping.
-        let children_attrs = table
-            .iter_mut()
-            .map(|pte| pte.defrag(level - 1, mpool))
-            .reduce(|l, r| if l == r { l } else { Err(()) })
-            .ok_or(())??;
+        let children_attrs = match children_attrs {
+            _ if meta.present == 0 => arch_mm::absent_pte(level - 1),
+            Ok(children_attrs) if arch_mm::is_block_allowed(level) => children_attrs,
+            _ => {
+                // The table stays. It need not be revisited until it changes, unless some of its
+                // subtables were skipped because they are out of the range.
+                let clean = table.iter().all(|pte| !pte.is_dirty(level - 1));
+                self.set_table_meta(level, meta);
+                if clean {
+                    self.set_dirty(level, false);
+                }
+                return Err(());
+            }
+        };
+
+        // The table is retired only once it is unlinked, as it may be walked without the lock.
+        let page = unsafe { Page::from_raw(table as *mut _ as *mut _) };
 
         // If the table's all the entries are absent, free the table and return an absent entry.
         unsafe {
-            if !arch_mm_pte_is_present(children_attrs, level - 1) {
-                mpool.free(Page::from_raw(table as *mut _ as *mut _));
+            if meta.present == 0 {
                 ptr::write(self, Self::absent(level));
+                mpool.retire(page);
                 return Ok(self.attrs(level));
             }
         }
 
-        // Bail out if block is not allowed in the current level.
-        if unsafe { !arch_mm_is_block_allowed(level) } {
-            return Err(());
-        }
-
         // Merge table into a single block with equivalent attributes.
         let block_address = unsafe { table.get_unchecked(0).as_block_unchecked(level - 1) };
-        let combined_attrs = unsafe { arch_mm_combine_table_entry_attrs(attrs, children_attrs) };
+        let combined_attrs = arch_mm::combine_table_entry_attrs(attrs, children_attrs);
 
-        mpool.free(unsafe { Page::from_raw(table as *mut _ as *mut _) });
         unsafe {
             ptr::write(
                 self,
                 PageTableEntry::block(level, block_address, combined_attrs),
             );
         }
+        mpool.retire(page);
 
         Ok(combined_attrs)
     }
@@ -564,7 +851,12 @@ impl Iterator for BlockIter {
 /// Number of page table entries in a page table.
 pub const PTE_PER_PAGE: usize = (PAGE_SIZE / mem::size_of::<PageTableEntry>());
 
-#[repr(align(4096))]
+#[cfg_attr(
+    not(any(feature = "granule-16k", feature = "granule-64k")),
+    repr(align(4096))
+)]
+#[cfg_attr(feature = "granule-16k", repr(align(16384)))]
+#[cfg_attr(feature = "granule-64k", repr(align(65536)))]
 struct RawPageTable {
     entries: [PageTableEntry; PTE_PER_PAGE],
 }
@@ -587,17 +879,18 @@ impl DerefMut for RawPageTable {
 }
 
 impl RawPageTable {
-    /// Returns whether all entries in this table are absent.
-    fn is_empty(&self, level: u8) -> bool {
-        self.iter().all(|pte| !pte.is_present(level))
-    }
-
     /// Updates the page table at the given level to map the given address range to a physical range
     /// using the provided (architecture-specific) attributes. Or if MM_FLAG_UNMAP is set, unmap the
     /// given range instead.
     ///
     /// This function calls itself recursively if it needs to update additional levels, but the
     /// recursion is bound by the maximum number of levels in a page table.
+    ///
+    /// The TLB invalidations are gathered in `tlb`. Writes that wait for them are to entries that
+    /// this function has already passed, so they are not needed to carry on.
+    ///
+    /// `meta` is what the entry referencing the table records about it, and is kept up to date with
+    /// the changes to the table's entries.
     fn map_level<S: Stage>(
         &mut self,
         begin: ptable_addr_t,
@@ -605,22 +898,40 @@ impl RawPageTable {
         attrs: u64,
         level: u8,
         flags: Flags,
+        meta: &mut TableMeta,
+        tlb: &mut TlbGather,
         mpool: &MPool,
     ) -> Result<(), ()> {
         let entry_size = addr::entry_size(level);
         let commit = flags.contains(Flags::COMMIT);
         let unmap = flags.contains(Flags::UNMAP);
+        let level_end = cmp::min(end, addr::level_end(begin, level));
 
-        let ptes = self[addr::index(begin, level)..].iter_mut();
-        let begins = BlockIter::new(
-            begin,
-            // Cap end so that we don't go over the current level max.
-            cmp::min(end, addr::level_end(begin, level)),
-            entry_size,
-        );
+        // Whether aligned runs of blocks are to be marked contiguous. Only runs that are invalid and
+        // mapped as a whole get the hint, as giving it to live entries would need breaking them
+        // while the VM or the hypervisor may be accessing them.
+        let contiguous = commit
+            && !unmap
+            && arch_mm::is_contiguous_allowed(level)
+            && arch_mm::pte_is_valid(arch_mm::block_pte(level, pa_init(0), attrs), level);
+        let mut fresh_run = false;
+
+        // Whether the whole table is updated with blocks or absent entries, making it uniform.
+        let mut whole_table =
+            addr::index(begin, level) == 0 && addr::level_end(begin, level) <= end;
 
         // Fill each entry in the table.
-        for (pte, begin) in ptes.zip(begins) {
+        for begin in BlockIter::new(begin, level_end, entry_size) {
+            let index = addr::index(begin, level);
+
+            // If the whole run of the entry is newly mapped, the entries are given the contiguous
+            // hint as they are written, without a break-before-make sequence.
+            if contiguous && index % CONTIGUOUS_ENTRIES == 0 {
+                fresh_run = self.is_fresh_run(index, begin, end, level);
+            }
+
+            let pte = &self[index];
+
             // If the entry is already mapped with the right attributes, or already absent in the
             // case of unmapping, no need to do anything; carry on to the next entry.
             if unmap && !pte.is_present(level) {
@@ -632,43 +943,190 @@ impl RawPageTable {
 
             // If the entire entry is within the region we want to map, map/unmap the whole entry.
             if end - begin >= entry_size
-                && (unmap || unsafe { arch_mm_is_block_allowed(level) })
+                && (unmap || arch_mm::is_block_allowed(level))
                 && (begin & (entry_size - 1) == 0)
             {
                 if commit {
-                    let new_pte = if unmap {
+                    self.break_contiguous::<S>(index, begin, level, tlb, mpool);
+
+                    let mut new_pte = if unmap {
                         PageTableEntry::absent(level)
                     } else {
                         PageTableEntry::block(level, pa_init(begin), attrs)
                     };
-                    pte.replace::<S>(new_pte, begin, level, mpool);
+                    if fresh_run {
+                        new_pte.set_contiguous(level, true);
+                    }
+                    let was_present = self[index].is_present(level);
+                    let is_present = new_pte.is_present(level);
+                    self[index].replace::<S>(new_pte, begin, level, tlb, mpool);
+
+                    meta.present = meta.present + is_present as usize - was_present as usize;
+                    meta.uniform = false;
                 }
 
                 continue;
             }
 
+            whole_table = false;
+
             // If the entry is already a subtable get it; otherwise replace it with an equivalent
             // subtable and get that.
-            pte.populate_table::<S>(begin, level, mpool)?;
+            self.break_contiguous::<S>(index, begin, level, tlb, mpool);
+            let pte = &mut self[index];
+            let was_present = pte.is_present(level);
+            pte.populate_table::<S>(begin, level, tlb, mpool)?;
+            meta.present += !was_present as usize;
+            meta.uniform = false;
 
             // Since `pte` is just populated, it should be a table.
+            let mut table_meta = pte.table_meta(level);
             let new_table = pte.as_table_mut(level).unwrap();
 
             // Recurse to map/unmap the appropriate entries within the subtable.
-            new_table.map_level::<S>(begin, end, attrs, level - 1, flags, mpool)?;
+            let result = new_table.map_level::<S>(
+                begin,
+                end,
+                attrs,
+                level - 1,
+                flags,
+                &mut table_meta,
+                tlb,
+                mpool,
+            );
+            pte.set_table_meta(level, table_meta);
+            result?;
 
             // If the subtable is now empty, replace it with an absent entry at this level. We never
             // need to do break-before-makes here because we are assigning an absent value.
             //
             // TODO(@jeehoonkang): I think we should do break-before-makes here due to reordering.
-            if commit && unmap && new_table.is_empty(level - 1) {
-                pte.replace::<S>(PageTableEntry::absent(level), begin, level, mpool);
+            if commit && unmap && table_meta.present == 0 {
+                pte.replace::<S>(PageTableEntry::absent(level), begin, level, tlb, mpool);
+                meta.present -= 1;
+            }
+
+            // The subtable may now be mergeable.
+            if commit {
+                pte.set_dirty(level, true);
             }
         }
 
+        if commit && (whole_table || meta.present == 0) {
+            meta.uniform = true;
+        }
+
         Ok(())
     }
 
+    /// Makes the entry for `begin` at level 1 reference a new table of absent pages, populating the
+    /// tables on the way down from this table, whose entries are at the given level. Returns the
+    /// new table.
+    ///
+    /// The entry is left clean and counted as full, so that the table is never merged or freed by
+    /// `defrag()`. The addresses it maps must not be updated with `identity_map()` or `unmap()`.
+    fn install_page_table<S: Stage>(
+        &mut self,
+        begin: ptable_addr_t,
+        level: u8,
+        meta: &mut TableMeta,
+        tlb: &mut TlbGather,
+        mpool: &MPool,
+    ) -> Result<*mut RawPageTable, ()> {
+        let pte = &mut self[addr::index(begin, level)];
+        let was_present = pte.is_present(level);
+
+        if level == 1 {
+            let page = mpool
+                .alloc()
+                .map_err(|_| dlog!("Failed to allocate memory for page table\n"))?;
+            let node = PageTableNode::new(page, |_| PageTableEntry::absent(0));
+            let table = node.ptr;
+
+            let mut new_pte = PageTableEntry::table(1, node);
+            new_pte.set_table_meta(
+                1,
+                TableMeta {
+                    present: PTE_PER_PAGE,
+                    uniform: false,
+                },
+            );
+            pte.replace::<S>(new_pte, begin, 1, tlb, mpool);
+            meta.present += !was_present as usize;
+            meta.uniform = false;
+
+            return Ok(table);
+        }
+
+        pte.populate_table::<S>(begin, level, tlb, mpool)?;
+        meta.present += !was_present as usize;
+        meta.uniform = false;
+
+        let mut table_meta = pte.table_meta(level);
+        let result = pte.as_table_mut(level).unwrap().install_page_table::<S>(
+            begin,
+            level - 1,
+            &mut table_meta,
+            tlb,
+            mpool,
+        );
+        pte.set_table_meta(level, table_meta);
+        pte.set_dirty(level, true);
+
+        result
+    }
+
+    /// Returns whether the entries of the run containing the given index are all invalid and about
+    /// to be mapped as a whole by an update of `[begin, end)` at the given level.
+    fn is_fresh_run(
+        &self,
+        index: usize,
+        begin: ptable_addr_t,
+        end: ptable_addr_t,
+        level: u8,
+    ) -> bool {
+        let run_size = addr::entry_size(level) * CONTIGUOUS_ENTRIES;
+        let run_begin = round_down(begin, run_size);
+        let first = round_down(index, CONTIGUOUS_ENTRIES);
+
+        run_begin == begin
+            && end - begin >= run_size
+            && self[first..first + CONTIGUOUS_ENTRIES]
+                .iter()
+                .all(|pte| !pte.is_valid(level))
+    }
+
+    /// Clears the contiguous hint of the run containing the entry at the given index, mapping
+    /// `begin`, so that the entries can be updated one by one.
+    ///
+    /// The TLB may hold a single entry for the whole run, so all its entries are broken before the
+    /// hint is cleared. The entries are updated right after, so the sequence is completed now.
+    fn break_contiguous<S: Stage>(
+        &mut self,
+        index: usize,
+        begin: ptable_addr_t,
+        level: u8,
+        tlb: &mut TlbGather,
+        mpool: &MPool,
+    ) {
+        if !self[index].is_contiguous(level) {
+            return;
+        }
+
+        let entry_size = addr::entry_size(level);
+        let run_begin = round_down(begin, entry_size * CONTIGUOUS_ENTRIES);
+        let first = round_down(index, CONTIGUOUS_ENTRIES);
+        let run = &mut self[first..first + CONTIGUOUS_ENTRIES];
+
+        for (i, pte) in run.iter_mut().enumerate() {
+            let new_pte = unsafe {
+                PageTableEntry::from_raw(arch_mm::pte_set_contiguous(pte.inner, level, false))
+            };
+            tlb.break_before_make::<S>(pte, new_pte, run_begin + i * entry_size, level, mpool);
+        }
+        tlb.flush::<S>(mpool);
+    }
+
     /// Gets the attributes applied to the given range of stage-2 addresses at the given level.
     ///
     /// The `got_attrs` argument is initially passed as false until `attrs` contains attributes of
@@ -677,6 +1135,9 @@ impl RawPageTable {
     /// The value returned in `attrs` is only valid if the function returns true.
     ///
     /// Returns true if the whole range has the same attributes and false otherwise.
+    ///
+    /// The table may be walked without its lock, by a CPU pinned with `epoch::pin()`, so each entry
+    /// is read once and subtables are only read after their initialisation.
     pub fn get_attrs_level(
         &self,
         begin: ptable_addr_t,
@@ -694,15 +1155,57 @@ impl RawPageTable {
         // Check that each entry is owned.
         ptes.zip(begins)
             .map(|(pte, begin)| {
-                if let Ok(table) = pte.as_table(level) {
+                let inner = pte.load();
+                if arch_mm::pte_is_table(inner, level) {
+                    // Pairs with the fence in `populate_table()`.
+                    fence(Ordering::Acquire);
+                    let table = unsafe {
+                        &*(pa_addr(arch_mm::table_from_pte(inner, level)) as *const RawPageTable)
+                    };
                     table.get_attrs_level(begin, end, level - 1)
                 } else {
-                    Ok(pte.attrs(level))
+                    Ok(arch_mm::pte_attrs(inner, level))
                 }
             })
             .res_reduce(|l, r| if l == r { Ok(l) } else { Err(()) })
     }
 
+    /// Calls `f` with the address, size and attributes of each present block in the table, in
+    /// increasing order of addresses, calling itself recursively for sub-tables. `begin` is the
+    /// address mapped by the first entry.
+    fn for_each_block<F>(&self, begin: ptable_addr_t, level: u8, f: &mut F)
+    where
+        F: FnMut(ptable_addr_t, usize, u64),
+    {
+        let entry_size = addr::entry_size(level);
+
+        for (i, pte) in self.iter().enumerate() {
+            let begin = begin + i * entry_size;
+
+            if let Ok(table) = pte.as_table(level) {
+                table.for_each_block(begin, level - 1, f);
+            } else if pte.is_present(level) {
+                f(begin, entry_size, pte.attrs(level));
+            }
+        }
+    }
+
+    /// Adds the memory mapped by the table to `stats`, calling itself recursively for sub-tables.
+    fn add_stats(&self, level: u8, stats: &mut PageTableStats) {
+        let entry_size = addr::entry_size(level);
+
+        for pte in self.iter() {
+            if let Ok(table) = pte.as_table(level) {
+                table.add_stats(level - 1, stats);
+            } else if pte.is_valid(level) {
+                stats.valid_bytes += entry_size;
+                if pte.is_contiguous(level) {
+                    stats.contiguous_bytes += entry_size;
+                }
+            }
+        }
+    }
+
     /// Writes the given table to the debug log, calling itself recursively to write sub-tables.
     fn dump(&self, level: u8, max_level: u8) {
         for (i, pte) in self.iter().enumerate() {
@@ -779,8 +1282,8 @@ impl PageTableNode {
             self.deref_mut().drop(level, mpool);
         }
 
-        // Free the table itself.
-        mpool.free(unsafe { Page::from_raw(self.ptr as *mut _) });
+        // Free the table itself once no CPU walking the page table without its lock can reach it.
+        mpool.retire(unsafe { Page::from_raw(self.ptr as *mut _) });
         mem::forget(self);
     }
 }
@@ -804,6 +1307,17 @@ impl Drop for PageTableNode {
     }
 }
 
+/// Statistics of the memory mapped by a page table.
+#[repr(C)]
+#[derive(Default)]
+pub struct PageTableStats {
+    /// The number of bytes mapped by valid entries.
+    pub valid_bytes: usize,
+
+    /// The number of bytes mapped by entries in contiguous runs, which the TLB may cache as one.
+    pub contiguous_bytes: usize,
+}
+
 /// Page table.
 #[repr(C)]
 pub struct PageTable<S: Stage> {
@@ -895,6 +1409,7 @@ impl<S: Stage> PageTable<S> {
         attrs: u64,
         root_level: u8,
         flags: Flags,
+        tlb: &mut TlbGather,
         mpool: &MPool,
     ) -> Result<(), ()> {
         let root_table_size = addr::entry_size(root_level);
@@ -903,12 +1418,52 @@ impl<S: Stage> PageTable<S> {
         let begins = BlockIter::new(begin, end, root_table_size);
 
         for (table, begin) in tables.zip(begins) {
-            table.map_level::<S>(begin, end, attrs, root_level - 1, flags, mpool)?;
+            // Root tables are never merged, so what is known about them is not kept. Counting from a
+            // full table keeps the count from underflowing.
+            let mut meta = TableMeta {
+                present: PTE_PER_PAGE,
+                uniform: false,
+            };
+
+            table.map_level::<S>(
+                begin,
+                end,
+                attrs,
+                root_level - 1,
+                flags,
+                &mut meta,
+                tlb,
+                mpool,
+            )?;
         }
 
         Ok(())
     }
 
+    /// Returns the maximum number of tables that `map_root()` may allocate to update the given
+    /// address range.
+    ///
+    /// A new table is needed only for an entry that is partially covered by the range, which is
+    /// the case for at most the first and last entries of each level, or for an entry at a level
+    /// where blocks are not allowed.
+    fn table_pages_bound(begin: ptable_addr_t, end: ptable_addr_t) -> usize {
+        if begin >= end {
+            return 0;
+        }
+
+        (1..=S::max_level())
+            .map(|level| {
+                let entry_size = addr::entry_size(level);
+                let entries = (end - 1) / entry_size - begin / entry_size + 1;
+                if arch_mm::is_block_allowed(level) {
+                    cmp::min(entries, 2)
+                } else {
+                    entries
+                }
+            })
+            .sum()
+    }
+
     /// Updates the given table such that the given physical address range is mapped or not mapped
     /// into the address space with the architecture-agnostic mode provided.
     fn identity_update(
@@ -922,18 +1477,161 @@ impl<S: Stage> PageTable<S> {
         let root_level = S::max_level() + 1;
         let ptable_end = S::ptable_addr_space_end();
         let end = cmp::min(addr::round_up_to_page(pa_addr(end)), ptable_end);
-        let begin = pa_addr(unsafe { arch_mm_clear_pa(begin) });
+        let begin = pa_addr(arch_mm::clear_pa(begin));
+
+        // The range is empty if it is reversed or lies beyond the end of the address space, which
+        // may be past the last root table.
+        if begin >= end {
+            return Ok(());
+        }
+
+        // The TLB entries of the old mappings are invalidated together once the update is done,
+        // including on failure as some entries may have been replaced already.
+        let mut tlb = TlbGather::new(self.root);
+
+        // Reserve the pages for the tables that may be needed up front, so that a single committing
+        // pass cannot fail halfway. The pages left unused go back to `mpool` when `reserved` is
+        // dropped.
+        //
+        // Tables are only allocated by `populate_table()`, which `map_level()` calls for an entry
+        // that the range doesn't cover as a whole, or that can't be a block. Those are the entries
+        // counted by `table_pages_bound()`, so the reserved pages cover every allocation of the
+        // committing pass. Running out of them would leave the table partially updated, so it is a
+        // bug that must not go unnoticed.
+        let result = match mpool.reserve(Self::table_pages_bound(begin, end)) {
+            Ok(reserved) => {
+                if self
+                    .map_root(
+                        begin,
+                        end,
+                        attrs,
+                        root_level,
+                        flags | Flags::COMMIT,
+                        &mut tlb,
+                        &reserved,
+                    )
+                    .is_err()
+                {
+                    panic!(
+                        "Reserved pages ran out while updating {:#x}..{:#x}",
+                        begin, end
+                    );
+                }
+                Ok(())
+            }
 
-        // Do it in two steps to prevent leaving the table in a halfway updated state. In such a
-        // two-step implementation, the table may be left with extra internal tables, but no
-        // different mapping on failure.
-        self.map_root(begin, end, attrs, root_level, flags, mpool)?;
-        self.map_root(begin, end, attrs, root_level, flags | Flags::COMMIT, mpool)?;
+            // The worst case may need more pages than available. Do it in two steps to prevent
+            // leaving the table in a halfway updated state. In such a two-step implementation, the
+            // table may be left with extra internal tables, but no different mapping on failure.
+            Err(_) => self
+                .map_root(begin, end, attrs, root_level, flags, &mut tlb, mpool)
+                .and_then(|_| {
+                    self.map_root(
+                        begin,
+                        end,
+                        attrs,
+                        root_level,
+                        flags | Flags::COMMIT,
+                        &mut tlb,
+                        mpool,
+                    )
+                }),
+        };
 
         // Invalidate the tlb.
-        S::invalidate_tlb(begin, end);
+        tlb.flush::<S>(mpool);
 
-        Ok(())
+        result
+    }
+
+    /// Installs a table of absent pages for the addresses from `begin` covered by an entry at level
+    /// 1, and returns it. See `RawPageTable::install_page_table()`.
+    fn install_page_table(
+        &mut self,
+        begin: ptable_addr_t,
+        mpool: &MPool,
+    ) -> Result<*mut RawPageTable, ()> {
+        let level = S::max_level();
+        let root_level = level + 1;
+        let mut tlb = TlbGather::new(self.root);
+        let mut meta = TableMeta {
+            present: PTE_PER_PAGE,
+            uniform: false,
+        };
+
+        let result = self.deref_mut()[addr::index(begin, root_level)]
+            .install_page_table::<S>(begin, level, &mut meta, &mut tlb, mpool);
+        tlb.flush::<S>(mpool);
+
+        result
+    }
+
+    /// Calls `f` with each maximal range of present addresses mapped with the same mode, in
+    /// increasing order of addresses.
+    pub fn for_each_range<F>(&self, mut f: F)
+    where
+        F: FnMut(ptable_addr_t, ptable_addr_t, Mode),
+    {
+        let max_level = S::max_level();
+        let root_table_size = addr::entry_size(max_level + 1);
+        let mut range: Option<(ptable_addr_t, ptable_addr_t, Mode)> = None;
+
+        for (i, table) in self.deref().iter().enumerate() {
+            table.for_each_block(i * root_table_size, max_level, &mut |begin, size, attrs| {
+                let mode = S::attrs_to_mode(attrs);
+                match &mut range {
+                    Some((_, end, range_mode)) if *end == begin && *range_mode == mode => {
+                        *end += size;
+                    }
+                    _ => {
+                        if let Some((begin, end, mode)) = range.take() {
+                            f(begin, end, mode);
+                        }
+                        range = Some((begin, begin + size, mode));
+                    }
+                }
+            });
+        }
+
+        if let Some((begin, end, mode)) = range {
+            f(begin, end, mode);
+        }
+    }
+
+    /// Frees all tables below the root, leaving every address unmapped.
+    ///
+    /// The tables are only freed once the TLB entries of the whole table are invalidated, as walks
+    /// may have cached them even if no CPU will use the table for translation again, such as
+    /// those of aborted VMs.
+    pub fn clear(&mut self, mpool: &MPool) {
+        let level = S::max_level();
+        let mut tlb = TlbGather::new(self.root);
+        let mut begin = 0;
+
+        for page_table in self.deref_mut().iter_mut() {
+            for pte in page_table.iter_mut() {
+                let old_pte = mem::replace(pte, PageTableEntry::absent(level));
+                if old_pte.is_present(level) {
+                    tlb.add(begin, begin + addr::entry_size(level));
+                    tlb.free::<S>(old_pte, level, mpool);
+                }
+                begin += addr::entry_size(level);
+            }
+        }
+
+        tlb.flush::<S>(mpool);
+    }
+
+    /// Returns how much memory the table maps, and how much of it is in contiguous runs.
+    pub fn stats(&self) -> PageTableStats {
+        let max_level = S::max_level();
+        let mut stats = PageTableStats::default();
+
+        for table in self.deref().iter() {
+            table.add_stats(max_level, &mut stats);
+        }
+
+        stats
     }
 
     /// Writes the given table to the debug log.
@@ -947,14 +1645,48 @@ impl<S: Stage> PageTable<S> {
 
     /// Defragments the given page table by converting page table references to blocks whenever
     /// possible.
+    ///
+    /// Subtables that have not changed since they were last defragmented are skipped.
     pub fn defrag(&mut self, mpool: &MPool) {
+        self.defrag_root(0, S::ptable_addr_space_end(), mpool);
+    }
+
+    /// Defragments the part of the given page table mapping the given physical address range, e.g.
+    /// the range of a failed or undone update. Subtables outside the range are not visited.
+    pub fn defrag_range(&mut self, begin: paddr_t, end: paddr_t, mpool: &MPool) {
+        let end = cmp::min(
+            addr::round_up_to_page(pa_addr(end)),
+            S::ptable_addr_space_end(),
+        );
+        let begin = pa_addr(arch_mm::clear_pa(begin));
+
+        if begin < end {
+            self.defrag_root(begin, end, mpool);
+        }
+    }
+
+    /// Defragments the entries of the root tables mapping the given address range.
+    fn defrag_root(&mut self, begin: ptable_addr_t, end: ptable_addr_t, mpool: &MPool) {
         let level = S::max_level();
+        let root_level = level + 1;
+        let entry_size = addr::entry_size(level);
+
+        let tables = self.deref_mut()[addr::index(begin, root_level)..].iter_mut();
+        let begins = BlockIter::new(begin, end, addr::entry_size(root_level));
 
-        // Loop through each entry in the table. If it points to another table, check if that table
+        // Loop through each entry in the range. If it points to another table, check if that table
         // can be replaced by a block or an absent entry.
-        for page_table in self.deref_mut().iter_mut() {
-            for pte in page_table.iter_mut() {
-                let _ = pte.defrag(level, mpool);
+        for (page_table, table_begin) in tables.zip(begins) {
+            let ptes = page_table[addr::index(table_begin, level)..].iter_mut();
+            let pte_begins = BlockIter::new(
+                table_begin,
+                cmp::min(end, addr::level_end(table_begin, level)),
+                entry_size,
+            );
+
+            for (pte, pte_begin) in ptes.zip(pte_begins) {
+                let pte_begin = round_down(pte_begin, entry_size);
+                let _ = pte.defrag(begin, end, pte_begin, level, mpool);
             }
         }
     }
@@ -1079,10 +1811,88 @@ impl<'s> Into<SpinLockGuard<'s, PageTable<Stage1>>> for mm_stage1_locked {
     }
 }
 
+/// The number of pages that the scratch window of a CPU maps at a time. The windows of all CPUs
+/// share a table of pages.
+pub const SCRATCH_WINDOW_PAGES: usize = PTE_PER_PAGE / MAX_CPUS;
+const_assert_eq!(PTE_PER_PAGE % MAX_CPUS, 0);
+
+/// Ranges of virtual addresses, one per CPU, through which the hypervisor accesses physical memory
+/// outside of its identity map a chunk at a time, e.g. to clear memory donated between VMs.
+///
+/// The windows are mapped by a table of pages, installed at boot for the last addresses of the
+/// hypervisor's address space, which the identity map does not reach. A CPU only writes the entries
+/// of its own window, so this does not take the lock of the hypervisor's page table. It only
+/// invalidates the TLB entries of the window locally, as no other CPU accesses the window. The
+/// hypervisor is not preempted, so a CPU does not use its window twice at the same time.
+struct ScratchWindows {
+    /// The first address of the window of the first CPU.
+    begin: ptable_addr_t,
+
+    /// The table of pages mapping the windows.
+    table: *mut RawPageTable,
+}
+
+impl ScratchWindows {
+    fn new(ptable: &mut PageTable<Stage1>, mpool: &MPool) -> Result<Self, ()> {
+        let begin = Stage1::ptable_addr_space_end() - addr::entry_size(1);
+        let table = ptable.install_page_table(begin, mpool)?;
+
+        Ok(Self { begin, table })
+    }
+
+    /// Maps `[begin, end)` into the window of the current CPU with the given mode, one chunk at a
+    /// time, and calls `f` with the virtual address and size of each chunk. `begin` must be aligned
+    /// to pages.
+    fn for_each_chunk<F>(&self, begin: paddr_t, end: paddr_t, mode: Mode, mut f: F)
+    where
+        F: FnMut(*mut u8, usize),
+    {
+        debug_assert!(is_aligned(pa_addr(begin), PAGE_SIZE));
+
+        // Sharing the window of another CPU would let either remap the other's chunk under it.
+        let cpu = cpu_index_current().expect("Scratch window used off the stack of a CPU");
+        let window = self.begin + cpu * SCRATCH_WINDOW_PAGES * PAGE_SIZE;
+        let table = unsafe { &mut *self.table };
+        let ptes = &mut table[cpu * SCRATCH_WINDOW_PAGES..];
+        let attrs = Stage1::mode_to_attrs(mode);
+
+        let mut chunk_begin = pa_addr(begin);
+        let end = pa_addr(end);
+        while chunk_begin < end {
+            let size = cmp::min(end - chunk_begin, SCRATCH_WINDOW_PAGES * PAGE_SIZE);
+            let pages = addr::round_up_to_page(size) / PAGE_SIZE;
+
+            // The entries are absent, so they are not cached in the TLB and can be written right
+            // away.
+            for (i, pte) in ptes[..pages].iter_mut().enumerate() {
+                pte.inner = arch_mm::block_pte(0, pa_init(chunk_begin + i * PAGE_SIZE), attrs);
+            }
+            unsafe { arch_mm_sync_table_writes_local() };
+
+            f(window as *mut u8, size);
+
+            for pte in ptes[..pages].iter_mut() {
+                pte.inner = arch_mm::absent_pte(0);
+            }
+            unsafe {
+                arch_mm_invalidate_stage1_range_local(
+                    va_init(window),
+                    va_init(window + pages * PAGE_SIZE),
+                );
+            }
+
+            chunk_begin += size;
+        }
+    }
+}
+
 pub struct MemoryManager {
     /// The hypervisor page table.
     pub hypervisor_ptable: SpinLock<PageTable<Stage1>>,
 
+    /// The scratch windows of the CPUs.
+    scratch_windows: ScratchWindows,
+
     /// Is stage2 invalidation enabled?
     pub stage2_invalidate: AtomicBool,
 }
@@ -1147,8 +1957,13 @@ impl MemoryManager {
             }
         }
 
+        let scratch_windows = ScratchWindows::new(page_table.get_mut(), mpool)
+            .map_err(|_| dlog!("Unable to allocate memory for scratch windows.\n"))
+            .ok()?;
+
         Some(Self {
             hypervisor_ptable: page_table,
+            scratch_windows,
             stage2_invalidate: AtomicBool::new(false),
         })
     }
@@ -1165,6 +1980,19 @@ impl MemoryManager {
         arch_mm_enable(self.get_raw_ptable())
     }
 
+    /// Maps `[begin, end)` of physical memory with the given mode into the scratch window of the
+    /// current CPU, a chunk at a time, and calls `f` with the virtual address and size of each
+    /// chunk. `begin` must be aligned to pages.
+    ///
+    /// This neither takes the lock of the hypervisor's page table nor invalidates the TLBs of other
+    /// CPUs.
+    pub fn for_each_scratch_chunk<F>(&self, begin: paddr_t, end: paddr_t, mode: Mode, f: F)
+    where
+        F: FnMut(*mut u8, usize),
+    {
+        self.scratch_windows.for_each_chunk(begin, end, mode, f);
+    }
+
     pub fn vm_unmap_hypervisor(ptable: &mut PageTable<Stage2>, mpool: &MPool) -> Result<(), ()> {
         // TODO: If we add pages dynamically, they must be included here too.
         ptable.unmap(
@@ -1266,6 +2094,18 @@ pub unsafe extern "C" fn mm_vm_defrag(t: *mut PageTable<Stage2>, mpool: *const M
     t.defrag(mpool);
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn mm_vm_defrag_range(
+    t: *mut PageTable<Stage2>,
+    begin: paddr_t,
+    end: paddr_t,
+    mpool: *const MPool,
+) {
+    let t = &mut *t;
+    let mpool = &*mpool;
+    t.defrag_range(begin, end, mpool);
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn mm_vm_get_mode(
     t: *mut PageTable<Stage2>,
@@ -1277,6 +2117,12 @@ pub unsafe extern "C" fn mm_vm_get_mode(
     t.get_mode(begin, end).map(|m| *mode = m).is_ok()
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn mm_vm_get_stats(t: *const PageTable<Stage2>, stats: *mut PageTableStats) {
+    let t = &*t;
+    *stats = t.stats();
+}
+
 #[no_mangle]
 pub extern "C" fn mm_ptable_addr_space_end(flags: u32) -> ptable_addr_t {
     if Flags::from_bits_truncate(flags).contains(Flags::STAGE1) {
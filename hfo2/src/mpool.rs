@@ -14,13 +14,19 @@
  * limitations under the License.
  */
 
+use core::cmp;
 use core::mem;
 use core::ops::DerefMut;
 use core::ptr;
+use core::sync::atomic::{AtomicBool, Ordering};
 
+use crate::buddy::Buddy;
+use crate::cpu::cpu_index_current;
+use crate::epoch;
+use crate::mm::arch_mm_zero_memory;
 use crate::page::*;
 use crate::slist::{IsElement, List, ListEntry};
-use crate::spinlock::SpinLock;
+use crate::spinlock::{SpinLock, SpinLockGuard};
 use crate::types::*;
 use crate::utils::*;
 
@@ -74,19 +80,54 @@ impl IsElement<Entry> for Entry {
     }
 }
 
+/// How a page pool keeps track of free ranges of pages.
+#[repr(C)]
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Backend {
+    /// A list of free ranges ("chunks") sorted by address, where adjacent ranges are merged on
+    /// free. `alloc_pages()` takes the first chunk that fits.
+    List,
+
+    /// A buddy-system allocator, which merges freed neighbours and allocates and frees in
+    /// `O(log n)` time.
+    Buddy,
+}
+
 /// Page pool.
 #[repr(C)]
 pub struct Pool {
     chunk_list: List<Chunk>,
+
+    /// Pages freed one by one. They are allocated first, in LIFO order, with both backends.
     entry_list: List<Entry>,
+
+    backend: Backend,
+
+    /// Free ranges of pages, if `backend` is `Backend::Buddy`.
+    buddy: Buddy,
+
+    /// Number of times the lock of this pool was acquired by `MPool`.
+    lock_acquired: usize,
+
+    /// Number of times the lock of this pool was found to be held by another CPU.
+    lock_contended: usize,
 }
 
 impl Pool {
     /// Creates a new page pool.
     pub const fn new() -> Self {
+        Self::with_backend(Backend::List)
+    }
+
+    /// Creates a new page pool with the given backend.
+    pub const fn with_backend(backend: Backend) -> Self {
         Self {
             chunk_list: List::new(),
             entry_list: List::new(),
+            backend,
+            buddy: Buddy::new(),
+            lock_acquired: 0,
+            lock_contended: 0,
         }
     }
 
@@ -97,6 +138,11 @@ impl Pool {
             return Ok(unsafe { Page::from_raw(entry as *mut RawPage) });
         }
 
+        if self.backend == Backend::Buddy {
+            let page = self.buddy.alloc(1, 1).ok_or(())?;
+            return Ok(unsafe { Page::from_raw(page as *mut RawPage) });
+        }
+
         let chunk = self.chunk_list.pop().ok_or(())?;
         let size = unsafe { (*chunk).size };
         debug_assert_ne!(size, 0);
@@ -121,6 +167,31 @@ impl Pool {
                 .map(|page| unsafe { Pages::from_raw(page.into_raw(), 1) });
         }
 
+        if let Ok(pages) = self.alloc_pages_from_ranges(size, align) {
+            return Ok(pages);
+        }
+
+        // Pages freed one by one are not merged with their neighbours until they are freed as
+        // ranges. Do so, and try again.
+        if self.entry_list.is_empty() {
+            return Err(());
+        }
+
+        while let Some(entry) = self.entry_list.pop() {
+            self.free_pages(unsafe { Pages::from_raw(entry as *mut RawPage, 1) });
+        }
+
+        self.alloc_pages_from_ranges(size, align)
+    }
+
+    /// Allocates a number of contiguous and aligned pages from the free ranges of pages, not
+    /// including the pages freed one by one.
+    fn alloc_pages_from_ranges(&mut self, size: usize, align: usize) -> Result<Pages, ()> {
+        if self.backend == Backend::Buddy {
+            let start = self.buddy.alloc(size, align).ok_or(())?;
+            return Ok(unsafe { Pages::from_raw(start as *mut RawPage, size) });
+        }
+
         let (chunk, (chunk_start, chunk_end, start, end)) = unsafe {
             self.chunk_list
                 .pop_if_some(|chunk| {
@@ -141,23 +212,30 @@ impl Pool {
                 .ok_or(())?
         };
 
+        debug_assert_eq!(chunk as usize, chunk_start);
+
         // Adds `[chunk_start, start)` back to the pool.
         if chunk_start < start {
-            let chunk = unsafe { &mut *(chunk as *mut Chunk) };
-            chunk.size = (start - chunk_start) / PAGE_SIZE;
-            unsafe { self.chunk_list.push(chunk) };
+            unsafe { self.insert_chunk(chunk_start, (start - chunk_start) / PAGE_SIZE) };
         }
 
         // Adds `[end, chunk_end)` back to the pool.
         if end < chunk_end {
-            let new_chunk = unsafe { &mut *(end as *mut Chunk) };
-            new_chunk.size = (chunk_end - end) / PAGE_SIZE;
-            unsafe { self.chunk_list.push(new_chunk) };
+            unsafe { self.insert_chunk(end, (chunk_end - end) / PAGE_SIZE) };
         }
 
         Ok(unsafe { Pages::from_raw(start as *mut RawPage, size) })
     }
 
+    /// Inserts a chunk into `chunk_list`, which is kept sorted by address, without merging it with
+    /// its neighbours.
+    unsafe fn insert_chunk(&mut self, start: usize, size: usize) {
+        let chunk = &mut *(start as *mut Chunk);
+        chunk.size = size;
+        self.chunk_list
+            .insert_before(chunk, |next| next as *const _ as usize > start);
+    }
+
     /// Frees a page back into the given page pool, making it available for reuse.
     ///
     /// This is meant to be used for freeing single pages. To free multiple pages, call
@@ -171,12 +249,216 @@ impl Pool {
     /// Frees a number of contiguous pages to the given page pool.
     pub fn free_pages(&mut self, pages: Pages) {
         let size = pages.len();
-        let chunk = unsafe { &mut *(pages.into_raw() as *mut Chunk) };
-        chunk.size = size;
-        unsafe { self.chunk_list.push(chunk) };
+
+        if self.backend == Backend::Buddy {
+            unsafe { self.buddy.free(pages.into_raw() as usize, size) };
+            return;
+        }
+
+        let mut start = pages.into_raw() as usize;
+        let mut end = start + size * PAGE_SIZE;
+
+        // Merge with the chunks right before and after the freed pages.
+        unsafe {
+            if let Some((prev, prev_size)) = self.chunk_list.pop_if_some(|chunk| {
+                let size = chunk.size;
+                if chunk as *const _ as usize + size * PAGE_SIZE == start {
+                    Some(size)
+                } else {
+                    None
+                }
+            }) {
+                start = prev as usize;
+                end = start + (prev_size + size) * PAGE_SIZE;
+            }
+
+            if let Some((_, next_size)) = self.chunk_list.pop_if_some(|chunk| {
+                if chunk as *const _ as usize == end {
+                    Some(chunk.size)
+                } else {
+                    None
+                }
+            }) {
+                end += next_size * PAGE_SIZE;
+            }
+
+            self.insert_chunk(start, (end - start) / PAGE_SIZE);
+        }
+    }
+
+    /// Returns the fragmentation of free pages, as `(free_pages, free_ranges, largest_range)`,
+    /// where a range is a chunk or block of contiguous free pages known to the pool.
+    fn fragmentation(&self) -> (usize, usize, usize) {
+        let mut free_pages = 0;
+        let mut free_ranges = 0;
+        let mut largest_range = 0;
+        let mut add = |size: usize| {
+            free_pages += size;
+            free_ranges += 1;
+            largest_range = cmp::max(largest_range, size);
+        };
+
+        self.entry_list.iter().for_each(|_| add(1));
+        self.chunk_list.iter().for_each(|chunk| add(chunk.size));
+        self.buddy.for_each_block(|_, size| add(size));
+
+        (free_pages, free_ranges, largest_range)
+    }
+
+    /// Moves all free pages to `other`.
+    fn drain_into(&mut self, other: &mut Pool) {
+        unsafe {
+            while let Some(entry) = self.entry_list.pop() {
+                other.free(Page::from_raw(entry as *mut RawPage));
+            }
+
+            while let Some(chunk) = self.chunk_list.pop() {
+                let size = (*chunk).size;
+                other.free_pages(Pages::from_raw(chunk as *mut RawPage, size));
+            }
+
+            while let Some((start, size)) = self.buddy.pop() {
+                other.free_pages(Pages::from_raw(start as *mut RawPage, size));
+            }
+        }
+    }
+}
+
+/// The number of pages a per-CPU magazine may hold before it spills to the shared pool.
+const MAGAZINE_CAPACITY: usize = 8;
+
+/// The number of pages moved between a magazine and the shared pool at a time. A refill fills an
+/// empty magazine up to this number, and a spill leaves this number of pages in the magazine.
+const MAGAZINE_BATCH: usize = MAGAZINE_CAPACITY / 2;
+
+/// Per-CPU cache of free pages, placed in front of the shared pool of an `MPool`.
+///
+/// Single-page allocations and frees are served from the magazine of the current CPU, and only
+/// refilling an empty magazine or spilling a full one takes the lock of the shared pool, moving
+/// `MAGAZINE_BATCH` pages at a time.
+struct Magazine {
+    entry_list: List<Entry>,
+    count: usize,
+
+    /// Number of allocations and frees served without touching the shared pool.
+    hits: usize,
+
+    /// Number of times the magazine was refilled from the shared pool.
+    refills: usize,
+
+    /// Number of times the magazine spilled pages to the shared pool.
+    spills: usize,
+}
+
+impl Magazine {
+    const fn new() -> Self {
+        Self {
+            entry_list: List::new(),
+            count: 0,
+            hits: 0,
+            refills: 0,
+            spills: 0,
+        }
+    }
+
+    fn push(&mut self, mut page: Page) {
+        let entry = unsafe { &*(page.deref_mut() as *mut RawPage as *mut Entry) };
+        mem::forget(page);
+        unsafe { self.entry_list.push(entry) };
+        self.count += 1;
+    }
+
+    fn pop(&mut self) -> Option<Page> {
+        let entry = self.entry_list.pop()?;
+        self.count -= 1;
+
+        #[allow(clippy::cast_ptr_alignment)]
+        Some(unsafe { Page::from_raw(entry as *mut RawPage) })
+    }
+}
+
+/// The magazines of all CPUs, followed by one shared by the code not running on the stack of a
+/// CPU, e.g. unit tests. They are stored in a page taken from the pool they serve.
+type Magazines = [SpinLock<Magazine>; MAX_CPUS + 1];
+const_assert!(mem::size_of::<Magazines>() <= mem::size_of::<RawPage>());
+
+/// Pages known to be filled with zeroes, so that they can be allocated without clearing them. Only
+/// the link to the next page in the list is not zero, and it is cleared when the page is taken.
+struct Zeroed {
+    entry_list: List<Entry>,
+    count: usize,
+
+    /// The number of pages `MPool::refill_zeroed()` keeps zeroed in advance.
+    target: usize,
+
+    /// Number of zeroed allocations served from this list.
+    hits: usize,
+
+    /// Number of zeroed allocations that had to clear a page on demand.
+    misses: usize,
+}
+
+impl Zeroed {
+    const fn new() -> Self {
+        Self {
+            entry_list: List::new(),
+            count: 0,
+            target: 0,
+            hits: 0,
+            misses: 0,
+        }
+    }
+
+    fn push(&mut self, mut page: Page) {
+        let entry = unsafe { &*(page.deref_mut() as *mut RawPage as *mut Entry) };
+        mem::forget(page);
+        unsafe { self.entry_list.push(entry) };
+        self.count += 1;
+    }
+
+    fn pop(&mut self) -> Option<Page> {
+        let entry = self.entry_list.pop()?;
+        self.count -= 1;
+
+        // Clear the link, which is the only part of the page that is not zero.
+        unsafe { ptr::write_bytes(entry as *mut u8, 0, mem::size_of::<Entry>()) };
+
+        #[allow(clippy::cast_ptr_alignment)]
+        Some(unsafe { Page::from_raw(entry as *mut RawPage) })
+    }
+
+    fn is_wanted(&self) -> bool {
+        self.count < self.target
     }
 }
 
+/// Statistics of a memory pool, to observe how much its lock is contended and how effective the
+/// per-CPU magazines are.
+#[repr(C)]
+#[derive(Default, Clone, Copy, Debug)]
+pub struct MPoolStats {
+    pub lock_acquired: usize,
+    pub lock_contended: usize,
+    pub magazine_hits: usize,
+    pub magazine_refills: usize,
+    pub magazine_spills: usize,
+
+    /// The number of free pages, including those in the magazines.
+    pub free_pages: usize,
+
+    /// The number of ranges of contiguous free pages known to the pool. The pages freed one by one
+    /// and those in the magazines are counted as ranges of their own.
+    pub free_ranges: usize,
+
+    /// The number of pages in the largest range of free pages.
+    pub largest_free_range: usize,
+
+    /// The number of pages zeroed in advance. They are included in `free_pages`.
+    pub zeroed_pages: usize,
+    pub zeroed_hits: usize,
+    pub zeroed_misses: usize,
+}
+
 /// Memory pool equipped with spinlock and fallback pool.
 /// TODO(HfO2): Make a trait, which generalizes Pool (linked list) and a pair of
 /// (pool, fallback) (#35.)
@@ -184,6 +466,15 @@ impl Pool {
 pub struct MPool {
     pool: SpinLock<Pool>,
     fallback: *const MPool,
+
+    /// Per-CPU magazines, or null if they are not enabled for this pool.
+    magazines: *const Magazines,
+
+    /// Pages zeroed in advance, for allocations that need zeroed pages such as page tables.
+    zeroed: SpinLock<Zeroed>,
+
+    /// Whether `zeroed` holds fewer pages than its target, read without taking its lock.
+    zeroed_wanted: AtomicBool,
 }
 
 unsafe impl Sync for MPool {}
@@ -197,6 +488,21 @@ impl MPool {
         Self {
             pool: SpinLock::new(Pool::new()),
             fallback: ptr::null(),
+            magazines: ptr::null(),
+            zeroed: SpinLock::new(Zeroed::new()),
+            zeroed_wanted: AtomicBool::new(false),
+        }
+    }
+
+    /// Initialises the given memory pool, using a buddy-system allocator to keep track of free
+    /// pages.
+    pub const fn new_buddy() -> Self {
+        Self {
+            pool: SpinLock::new(Pool::with_backend(Backend::Buddy)),
+            fallback: ptr::null(),
+            magazines: ptr::null(),
+            zeroed: SpinLock::new(Zeroed::new()),
+            zeroed_wanted: AtomicBool::new(false),
         }
     }
 
@@ -204,9 +510,18 @@ impl MPool {
     /// chunk and free lists from `from`, consuming all its resources and making them available via
     /// the new memory pool.
     pub fn new_from(from: &Self) -> Self {
+        from.drain_magazines();
+        from.drain_zeroed();
+
+        let mut from_pool = from.pool.lock();
+        let backend = from_pool.backend;
+
         Self {
-            pool: SpinLock::new(mem::replace(&mut from.pool.lock(), Pool::new())),
+            pool: SpinLock::new(mem::replace(&mut from_pool, Pool::with_backend(backend))),
             fallback: from.fallback,
+            magazines: ptr::null(),
+            zeroed: SpinLock::new(Zeroed::new()),
+            zeroed_wanted: AtomicBool::new(false),
         }
 
         // TODO(@jeehoonkang): it's different from the original C implementation, where
@@ -214,20 +529,308 @@ impl MPool {
     }
 
     /// Initialises the given memory pool with a fallback memory pool if this pool runs out of
-    /// memory.
+    /// memory. The new pool uses the same backend as the fallback.
     pub fn new_with_fallback(fallback: *const Self) -> Self {
-        let mut pool = Self::new();
-        pool.fallback = fallback;
+        let backend = unsafe { fallback.as_ref() }
+            .map(|fallback| fallback.pool.lock().backend)
+            .unwrap_or(Backend::List);
+
+        Self {
+            pool: SpinLock::new(Pool::with_backend(backend)),
+            fallback,
+            magazines: ptr::null(),
+            zeroed: SpinLock::new(Zeroed::new()),
+            zeroed_wanted: AtomicBool::new(false),
+        }
+    }
+
+    /// Enables per-CPU magazines in front of the shared pool. This is meant for pools that are
+    /// used concurrently by many CPUs, such as the hypervisor's page pool. The magazines are stored
+    /// in a page allocated from this pool.
+    pub fn enable_magazines(&mut self) -> Result<(), ()> {
+        if !self.magazines.is_null() {
+            return Ok(());
+        }
+
+        let page = self.alloc()?;
+        let magazines = page.into_raw() as *mut Magazines;
+        for magazine in unsafe { (*magazines).iter_mut() } {
+            unsafe { ptr::write(magazine, SpinLock::new(Magazine::new())) };
+        }
+
+        self.magazines = magazines;
+        Ok(())
+    }
+
+    /// Returns the magazine of the current CPU, if magazines are enabled.
+    fn magazine(&self) -> Option<&SpinLock<Magazine>> {
+        let magazines = unsafe { self.magazines.as_ref()? };
+
+        // Each magazine is protected by its own lock, so the code sharing the last magazine when
+        // the current CPU is not known is safe, and doesn't slow down the magazine of a CPU.
+        Some(&magazines[cpu_index_current().unwrap_or(MAX_CPUS)])
+    }
+
+    /// Locks the shared pool, counting whether the lock was contended.
+    fn lock_pool(&self) -> SpinLockGuard<Pool> {
+        let mut pool = self.pool.try_lock().unwrap_or_else(|_| {
+            let mut pool = self.pool.lock();
+            pool.lock_contended += 1;
+            pool
+        });
+        pool.lock_acquired += 1;
         pool
     }
 
+    /// Allocates a page from the given magazine, refilling it from the shared pool if it is empty.
+    fn alloc_from_magazine(&self, magazine: &SpinLock<Magazine>) -> Result<Page, ()> {
+        let mut magazine = magazine.lock();
+
+        if magazine.count == 0 {
+            let mut pool = self.lock_pool();
+            while magazine.count < MAGAZINE_BATCH {
+                let page = ok_or!(pool.alloc(), break);
+                magazine.push(page);
+            }
+            if magazine.count != 0 {
+                magazine.refills += 1;
+            }
+        } else {
+            magazine.hits += 1;
+        }
+
+        magazine.pop().ok_or(())
+    }
+
+    /// Moves all pages in the magazines back to the shared pool. Returns whether any page was
+    /// moved.
+    fn drain_magazines(&self) -> bool {
+        let magazines = some_or!(unsafe { self.magazines.as_ref() }, return false);
+        let mut drained = false;
+
+        for magazine in magazines.iter() {
+            let mut magazine = magazine.lock();
+            if magazine.count == 0 {
+                continue;
+            }
+
+            let mut pool = self.lock_pool();
+            while let Some(page) = magazine.pop() {
+                pool.free(page);
+            }
+            drained = true;
+        }
+
+        drained
+    }
+
+    /// Moves all zeroed pages back to the shared pool, so that they can be allocated as any other
+    /// page. Returns whether any page was moved.
+    fn drain_zeroed(&self) -> bool {
+        let mut zeroed = self.zeroed.lock();
+        if zeroed.count == 0 {
+            return false;
+        }
+
+        let mut pool = self.lock_pool();
+        while let Some(page) = zeroed.pop() {
+            pool.free(page);
+        }
+        self.zeroed_wanted
+            .store(zeroed.is_wanted(), Ordering::Relaxed);
+
+        true
+    }
+
+    /// Sets the number of pages that `refill_zeroed()` keeps zeroed in advance.
+    pub fn set_zeroed_target(&self, target: usize) {
+        let mut zeroed = self.zeroed.lock();
+        zeroed.target = target;
+        self.zeroed_wanted
+            .store(zeroed.is_wanted(), Ordering::Relaxed);
+    }
+
+    /// Returns whether fewer pages than the target are zeroed in advance.
+    pub fn zeroed_wanted(&self) -> bool {
+        self.zeroed_wanted.load(Ordering::Relaxed)
+    }
+
+    /// Zeroes up to `budget` free pages of the shared pool in advance, until the target is met.
+    /// This is meant to be called off the hot paths, e.g. while a CPU is idle. Returns the number
+    /// of pages zeroed.
+    ///
+    /// The pages are cleared without holding any lock. CPUs refilling concurrently may exceed the
+    /// target by a few pages.
+    pub fn refill_zeroed(&self, budget: usize) -> usize {
+        let mut refilled = 0;
+
+        while refilled < budget && self.zeroed.lock().is_wanted() {
+            let mut page = ok_or!(self.lock_pool().alloc(), break);
+
+            // The page is zeroed by the architecture, e.g. with `DC ZVA`, rather than with stores.
+            unsafe {
+                arch_mm_zero_memory(page.as_mut_ptr(), PAGE_SIZE);
+            }
+
+            let mut zeroed = self.zeroed.lock();
+            zeroed.push(page);
+            self.zeroed_wanted
+                .store(zeroed.is_wanted(), Ordering::Relaxed);
+            refilled += 1;
+        }
+
+        refilled
+    }
+
+    /// Takes a page zeroed in advance from this pool or its fallbacks.
+    fn pop_zeroed(&self) -> Option<Page> {
+        let mut mpool = self;
+        loop {
+            let mut zeroed = mpool.zeroed.lock();
+            if let Some(page) = zeroed.pop() {
+                zeroed.hits += 1;
+                mpool
+                    .zeroed_wanted
+                    .store(zeroed.is_wanted(), Ordering::Relaxed);
+                return Some(page);
+            }
+            drop(zeroed);
+
+            mpool = unsafe { mpool.fallback.as_ref()? };
+        }
+    }
+
+    /// Allocates a page filled with zeroes. The page is taken from the pages zeroed in advance if
+    /// there are any, in this pool or its fallbacks, and is otherwise allocated and cleared.
+    pub fn alloc_zeroed(&self) -> Result<Page, ()> {
+        if let Some(page) = self.pop_zeroed() {
+            return Ok(page);
+        }
+
+        let mut page = self.alloc()?;
+        unsafe {
+            arch_mm_zero_memory(page.as_mut_ptr(), PAGE_SIZE);
+        }
+        self.zeroed.lock().misses += 1;
+        Ok(page)
+    }
+
+    /// Returns the statistics of this memory pool, not including its fallback.
+    pub fn stats(&self) -> MPoolStats {
+        let mut stats = {
+            let pool = self.pool.lock();
+            let (free_pages, free_ranges, largest_free_range) = pool.fragmentation();
+            MPoolStats {
+                lock_acquired: pool.lock_acquired,
+                lock_contended: pool.lock_contended,
+                free_pages,
+                free_ranges,
+                largest_free_range,
+                ..Default::default()
+            }
+        };
+
+        {
+            let zeroed = self.zeroed.lock();
+            stats.zeroed_pages = zeroed.count;
+            stats.zeroed_hits = zeroed.hits;
+            stats.zeroed_misses = zeroed.misses;
+            stats.free_pages += zeroed.count;
+            stats.free_ranges += zeroed.count;
+            if zeroed.count != 0 {
+                stats.largest_free_range = cmp::max(stats.largest_free_range, 1);
+            }
+        }
+
+        if let Some(magazines) = unsafe { self.magazines.as_ref() } {
+            for magazine in magazines.iter() {
+                let magazine = magazine.lock();
+                stats.magazine_hits += magazine.hits;
+                stats.magazine_refills += magazine.refills;
+                stats.magazine_spills += magazine.spills;
+                stats.free_pages += magazine.count;
+                stats.free_ranges += magazine.count;
+                if magazine.count != 0 {
+                    stats.largest_free_range = cmp::max(stats.largest_free_range, 1);
+                }
+            }
+        }
+
+        stats
+    }
+
+    /// Reserves `count` pages up front, so that allocating them later cannot fail. Returns a local
+    /// pool holding the reserved pages that falls back to this pool. Dropping it gives the pages
+    /// that were not used back to this pool.
+    ///
+    /// The pages are taken from the shared pool in a single lock acquisition, unless the magazines
+    /// or the fallback pool have to be used as well. On failure, no page is reserved.
+    pub fn reserve(&self, count: usize) -> Result<MPool, ()> {
+        let reserved = MPool::new_with_fallback(self);
+
+        let taken = self.reserve_into(&mut reserved.pool.lock(), count);
+        if taken < count {
+            dlog!("Failed to reserve {} pages\n", count);
+            return Err(());
+        }
+
+        Ok(reserved)
+    }
+
+    /// Moves up to `count` pages from this pool, or its fallback, to `local`. Returns the number of
+    /// pages moved.
+    fn reserve_into(&self, local: &mut Pool, count: usize) -> usize {
+        let mut taken = 0;
+
+        for attempt in 0..2 {
+            let mut pool = self.lock_pool();
+            while taken < count {
+                let page = ok_or!(pool.alloc(), break);
+                local.free(page);
+                taken += 1;
+            }
+            drop(pool);
+
+            // The magazines and the zeroed pages may hold the missing pages.
+            if taken == count || attempt == 1 || !(self.drain_magazines() | self.drain_zeroed()) {
+                break;
+            }
+        }
+
+        if taken < count {
+            if let Some(fallback) = unsafe { self.fallback.as_ref() } {
+                taken += fallback.reserve_into(local, count - taken);
+            }
+        }
+
+        taken
+    }
+
     /// Allocates an entry from the given memory pool, if one is available. If there isn't one
     /// available, try and allocate from the fallback if there is one.
     pub fn alloc(&self) -> Result<Page, ()> {
-        if let Ok(result) = self.pool.lock().alloc() {
+        if let Some(magazine) = self.magazine() {
+            if let Ok(result) = self.alloc_from_magazine(magazine) {
+                return Ok(result);
+            }
+
+            // The shared pool is exhausted, but other CPUs' magazines may still hold pages.
+            if self.drain_magazines() {
+                if let Ok(result) = self.lock_pool().alloc() {
+                    return Ok(result);
+                }
+            }
+        } else if let Ok(result) = self.lock_pool().alloc() {
             return Ok(result);
         }
 
+        // Pages zeroed in advance are given up rather than failing the allocation.
+        if self.drain_zeroed() {
+            if let Ok(result) = self.lock_pool().alloc() {
+                return Ok(result);
+            }
+        }
+
         if let Some(fallback) = unsafe { self.fallback.as_ref() } {
             return fallback.alloc();
         }
@@ -244,10 +847,17 @@ impl MPool {
     ///
     /// The caller can enventually free the returned entries by calling mpool_add_chunk.
     pub fn alloc_pages(&self, count: usize, align: usize) -> Result<Pages, ()> {
-        if let Ok(result) = self.pool.lock().alloc_pages(count, align) {
+        if let Ok(result) = self.lock_pool().alloc_pages(count, align) {
             return Ok(result);
         }
 
+        // Pages cached in the magazines or zeroed in advance may be needed to satisfy the request.
+        if self.drain_magazines() | self.drain_zeroed() {
+            if let Ok(result) = self.lock_pool().alloc_pages(count, align) {
+                return Ok(result);
+            }
+        }
+
         if let Some(fallback) = unsafe { self.fallback.as_ref() } {
             return fallback.alloc_pages(count, align);
         }
@@ -260,7 +870,36 @@ impl MPool {
     /// This is meant to be used for freeing single entries. To free multiple entries, one must call
     /// mpool_add_chunk instead.
     pub fn free(&self, page: Page) {
-        self.pool.lock().free(page);
+        let magazine = some_or!(self.magazine(), {
+            self.lock_pool().free(page);
+            return;
+        });
+
+        let mut magazine = magazine.lock();
+        magazine.push(page);
+
+        if magazine.count <= MAGAZINE_CAPACITY {
+            magazine.hits += 1;
+            return;
+        }
+
+        let mut pool = self.lock_pool();
+        while magazine.count > MAGAZINE_BATCH {
+            pool.free(magazine.pop().unwrap());
+        }
+        magazine.spills += 1;
+    }
+
+    /// Frees a page of a page table that may still be walked by CPUs without the table's lock. The
+    /// page is given back to the root of the chain of fallbacks, which outlives the local pools, once
+    /// no such CPU can be walking it.
+    pub fn retire(&self, page: Page) {
+        let mut root = self;
+        while let Some(fallback) = unsafe { root.fallback.as_ref() } {
+            root = fallback;
+        }
+
+        epoch::retire(page, root);
     }
 
     /// Adds a contiguous chunk of memory to the given memory pool. The chunk will eventually be
@@ -271,28 +910,27 @@ impl MPool {
     /// Returns true if at least a portion of the chunk was added to pool, or false if none of the
     /// buffer was usable in the pool.
     pub fn free_pages(&self, pages: Pages) {
-        self.pool.lock().free_pages(pages);
+        self.lock_pool().free_pages(pages);
     }
 }
 
 impl Drop for MPool {
     /// Finishes the given memory pool, giving all free memory to the fallback pool if there is one.
     fn drop(&mut self) {
-        if let Some(fallback) = unsafe { self.fallback.as_ref() } {
-            let mut pool = self.pool.lock();
-            let mut pool_fallback = fallback.pool.lock();
+        self.drain_zeroed();
 
-            unsafe {
-                // Merge the freelist into the fallback.
-                while let Some(entry) = pool.entry_list.pop() {
-                    pool_fallback.entry_list.push(&*entry);
-                }
+        // Return the pages in the magazines, and the page holding the magazines, to the pool.
+        if !self.magazines.is_null() {
+            self.drain_magazines();
+            let magazines = mem::replace(&mut self.magazines, ptr::null());
+            self.pool
+                .lock()
+                .free(unsafe { Page::from_raw(magazines as *mut RawPage) });
+        }
 
-                // Merge the chunk list into the fallback.
-                while let Some(chunk) = pool.chunk_list.pop() {
-                    pool_fallback.chunk_list.push(&*chunk);
-                }
-            }
+        if let Some(fallback) = unsafe { self.fallback.as_ref() } {
+            // Merge the free pages into the fallback.
+            self.pool.lock().drain_into(&mut fallback.pool.lock());
 
             // TODO(@jeehoonkang): it's different from the original C implementation, where
             // `self.pool.fallback` is re-initialized. But it seems the difference doesn't matter.
@@ -310,6 +948,12 @@ pub unsafe extern "C" fn mpool_init(p: *mut MPool, entry_size: size_t) {
     ptr::write(p, MPool::new());
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn mpool_init_buddy(p: *mut MPool, entry_size: size_t) {
+    assert_eq!(PAGE_SIZE, entry_size as usize);
+    ptr::write(p, MPool::new_buddy());
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn mpool_init_from(p: *mut MPool, from: *mut MPool) {
     ptr::write(p, MPool::new_from(&*from));
@@ -327,6 +971,26 @@ pub unsafe extern "C" fn mpool_fini(p: *mut MPool) {
     (*p).fallback = ptr::null();
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn mpool_enable_magazines(p: *mut MPool) -> bool {
+    (*p).enable_magazines().is_ok()
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn mpool_set_zeroed_target(p: *mut MPool, target: size_t) {
+    (*p).set_zeroed_target(target as usize);
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn mpool_refill_zeroed(p: *mut MPool, budget: size_t) -> size_t {
+    (*p).refill_zeroed(budget as usize)
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn mpool_get_stats(p: *const MPool, stats: *mut MPoolStats) {
+    ptr::write(stats, (*p).stats());
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn mpool_add_chunk(p: *mut MPool, begin: *mut c_void, size: size_t) -> bool {
     Pages::from_raw_u8(begin as *mut u8, size)
@@ -341,6 +1005,13 @@ pub unsafe extern "C" fn mpool_alloc(p: *mut MPool) -> *mut c_void {
         .unwrap_or(ptr::null_mut())
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn mpool_alloc_zeroed(p: *mut MPool) -> *mut c_void {
+    (*p).alloc_zeroed()
+        .map(|page| page.into_raw() as *mut c_void)
+        .unwrap_or(ptr::null_mut())
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn mpool_alloc_contiguous(
     p: *mut MPool,
@@ -0,0 +1,424 @@
+/*
+ * Copyright 2019 Sanguk Park.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! A database of the ownership of physical memory.
+//!
+//! Who owns memory, and whom it was lent to or shared with, is otherwise only known by walking the
+//! stage-2 page tables of every VM involved. The database records it for runs of physical pages, so
+//! the memory sharing APIs can tell the state of memory for the recipient without walking its page
+//! table, and the primary can ask who owns a page.
+//!
+//! The page tables stay authoritative. The database is updated along with them, with the memory of
+//! the VMs involved locked, and memory that is not recorded is owned by no one. Should the database
+//! run out of room, it stops tracking ownership altogether and lookups fail, so callers fall back to
+//! walking the page tables.
+
+use core::cmp;
+
+use crate::addr::*;
+use crate::mm::Mode;
+use crate::spinlock::SpinLock;
+use crate::types::*;
+
+/// The maximum number of runs of pages with the same ownership.
+const RUNS_CAPACITY: usize = 256;
+
+// The borrowers are a bitmask indexed by VM ID.
+const_assert!(MAX_VMS + (HF_VM_ID_OFFSET as usize) <= 32);
+
+/// How the owner of memory uses it.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum PageState {
+    /// The owner has exclusive access to the memory.
+    Exclusive,
+
+    /// The owner lent the memory to the borrowers, and has no access to it.
+    Lent,
+
+    /// The owner shares access to the memory with the borrowers.
+    Shared,
+}
+
+/// The owner of a run of memory and the VMs borrowing it.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub struct Ownership {
+    pub owner: spci_vm_id_t,
+    pub state: PageState,
+    borrowers: u32,
+}
+
+impl Ownership {
+    /// Memory the owner has exclusive access to.
+    pub const fn exclusive(owner: spci_vm_id_t) -> Self {
+        Self {
+            owner,
+            state: PageState::Exclusive,
+            borrowers: 0,
+        }
+    }
+
+    /// Memory the owner lent or shared with a single borrower.
+    pub fn borrowed(owner: spci_vm_id_t, state: PageState, borrower: spci_vm_id_t) -> Self {
+        Self {
+            owner,
+            state,
+            borrowers: 1 << borrower,
+        }
+    }
+
+    /// The same memory, given to another owner.
+    pub fn with_owner(self, owner: spci_vm_id_t) -> Self {
+        Self { owner, ..self }
+    }
+
+    pub fn is_borrower(&self, vm_id: spci_vm_id_t) -> bool {
+        self.borrowers & (1 << vm_id) != 0
+    }
+
+    /// Returns the state of memory for the given VM, as the `Mode::INVALID`, `Mode::UNOWNED` and
+    /// `Mode::SHARED` bits the VM maps it with in its stage-2 page table.
+    pub fn state_mode(ownership: Option<Self>, vm_id: spci_vm_id_t) -> Mode {
+        match ownership {
+            Some(ownership) if ownership.owner == vm_id => match ownership.state {
+                PageState::Exclusive => Mode::empty(),
+                PageState::Lent => Mode::INVALID,
+                PageState::Shared => Mode::SHARED,
+            },
+            Some(ownership) if ownership.is_borrower(vm_id) => match ownership.state {
+                PageState::Shared => Mode::UNOWNED | Mode::SHARED,
+                _ => Mode::UNOWNED,
+            },
+            _ => Mode::INVALID | Mode::UNOWNED,
+        }
+    }
+}
+
+/// Pages of `begin..end` with the same ownership.
+#[derive(Clone, Copy)]
+struct Run {
+    begin: usize,
+    end: usize,
+    ownership: Ownership,
+}
+
+/// The runs of recorded memory, sorted by address. Adjacent runs have different ownership.
+struct Database {
+    runs: [Run; RUNS_CAPACITY],
+    len: usize,
+    tracking: bool,
+}
+
+static DATABASE: SpinLock<Database> = SpinLock::new(Database::new());
+
+impl Database {
+    const fn new() -> Self {
+        Self {
+            runs: [Run {
+                begin: 0,
+                end: 0,
+                ownership: Ownership::exclusive(0),
+            }; RUNS_CAPACITY],
+            len: 0,
+            tracking: true,
+        }
+    }
+
+    /// Returns the index of the first run that ends after the given address.
+    fn find(&self, addr: usize) -> usize {
+        let (mut low, mut high) = (0, self.len);
+
+        while low < high {
+            let mid = (low + high) / 2;
+            if self.runs[mid].end <= addr {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        low
+    }
+
+    fn insert(&mut self, index: usize, run: Run) -> Result<(), ()> {
+        if self.len == RUNS_CAPACITY {
+            return Err(());
+        }
+
+        self.runs.copy_within(index..self.len, index + 1);
+        self.runs[index] = run;
+        self.len += 1;
+        Ok(())
+    }
+
+    fn remove(&mut self, index: usize) {
+        self.runs.copy_within(index + 1..self.len, index);
+        self.len -= 1;
+    }
+
+    /// Splits the run containing the given address, so that a run begins at it.
+    fn split(&mut self, addr: usize) -> Result<(), ()> {
+        let index = self.find(addr);
+
+        if index < self.len && self.runs[index].begin < addr {
+            let mut upper = self.runs[index];
+            upper.begin = addr;
+            self.runs[index].end = addr;
+            self.insert(index + 1, upper)?;
+        }
+
+        Ok(())
+    }
+
+    /// Coalesces adjacent runs with the same ownership.
+    fn coalesce(&mut self) {
+        let mut len = 0;
+
+        for i in 0..self.len {
+            let run = self.runs[i];
+
+            if len > 0
+                && self.runs[len - 1].end == run.begin
+                && self.runs[len - 1].ownership == run.ownership
+            {
+                self.runs[len - 1].end = run.end;
+            } else {
+                self.runs[len] = run;
+                len += 1;
+            }
+        }
+
+        self.len = len;
+    }
+
+    fn lookup(&self, begin: usize, end: usize) -> Result<Option<Ownership>, ()> {
+        if !self.tracking {
+            return Err(());
+        }
+
+        let index = self.find(begin);
+        if index == self.len || self.runs[index].begin >= end {
+            return Ok(None);
+        }
+
+        let run = &self.runs[index];
+        if run.begin <= begin && end <= run.end {
+            Ok(Some(run.ownership))
+        } else {
+            Err(())
+        }
+    }
+
+    fn update<F>(&mut self, begin: usize, end: usize, mut f: F) -> Result<(), ()>
+    where
+        F: FnMut(Option<Ownership>) -> Option<Ownership>,
+    {
+        self.split(begin)?;
+        self.split(end)?;
+
+        let mut index = self.find(begin);
+        let mut addr = begin;
+
+        while addr < end {
+            if index < self.len && self.runs[index].begin == addr {
+                addr = self.runs[index].end;
+
+                match f(Some(self.runs[index].ownership)) {
+                    Some(ownership) => {
+                        self.runs[index].ownership = ownership;
+                        index += 1;
+                    }
+                    None => self.remove(index),
+                }
+            } else {
+                let gap_end = if index < self.len {
+                    cmp::min(self.runs[index].begin, end)
+                } else {
+                    end
+                };
+
+                if let Some(ownership) = f(None) {
+                    self.insert(
+                        index,
+                        Run {
+                            begin: addr,
+                            end: gap_end,
+                            ownership,
+                        },
+                    )?;
+                    index += 1;
+                }
+
+                addr = gap_end;
+            }
+        }
+
+        self.coalesce();
+        Ok(())
+    }
+}
+
+/// Returns the ownership of the memory in `begin..end`, or `None` if no one owns it. Fails if the
+/// memory doesn't have the same ownership throughout or ownership is no longer tracked, in which
+/// case the page tables must be walked instead.
+pub fn lookup(begin: paddr_t, end: paddr_t) -> Result<Option<Ownership>, ()> {
+    DATABASE.lock().lookup(pa_addr(begin), pa_addr(end))
+}
+
+/// Updates the ownership of each run of memory in `begin..end` with the given function, which is
+/// called with `None` for memory that no one owns.
+pub fn update<F>(begin: paddr_t, end: paddr_t, f: F)
+where
+    F: FnMut(Option<Ownership>) -> Option<Ownership>,
+{
+    let mut database = DATABASE.lock();
+
+    if !database.tracking {
+        return;
+    }
+
+    if database.update(pa_addr(begin), pa_addr(end), f).is_err() {
+        dlog!("Ownership database is full, no longer tracking the ownership of memory\n");
+        database.tracking = false;
+        database.len = 0;
+    }
+}
+
+/// Records the ownership of the memory in `begin..end`.
+pub fn record(begin: paddr_t, end: paddr_t, ownership: Option<Ownership>) {
+    update(begin, end, |_| ownership);
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    const PRIMARY: spci_vm_id_t = HF_PRIMARY_VM_ID;
+    const SECONDARY: spci_vm_id_t = HF_PRIMARY_VM_ID + 1;
+
+    fn record(database: &mut Database, begin: usize, end: usize, ownership: Option<Ownership>) {
+        database.update(begin, end, |_| ownership).unwrap();
+    }
+
+    /// Memory that was never recorded is owned by no one.
+    #[test]
+    fn ownership_lookup_unrecorded() {
+        let mut database = Database::new();
+        assert_eq!(database.lookup(0, 0x1000), Ok(None));
+
+        record(
+            &mut database,
+            0x4000,
+            0x8000,
+            Some(Ownership::exclusive(PRIMARY)),
+        );
+        assert_eq!(database.lookup(0, 0x4000), Ok(None));
+        assert_eq!(database.lookup(0x8000, 0x9000), Ok(None));
+    }
+
+    /// Lending part of a run splits it, and a range across runs of different ownership is unknown.
+    #[test]
+    fn ownership_lend_splits_run() {
+        let mut database = Database::new();
+        let lent = Ownership::borrowed(PRIMARY, PageState::Lent, SECONDARY);
+
+        record(
+            &mut database,
+            0,
+            0x10000,
+            Some(Ownership::exclusive(PRIMARY)),
+        );
+        record(&mut database, 0x4000, 0x6000, Some(lent));
+
+        assert_eq!(database.len, 3);
+        assert_eq!(database.lookup(0x4000, 0x6000), Ok(Some(lent)));
+        assert_eq!(
+            database.lookup(0x6000, 0x10000),
+            Ok(Some(Ownership::exclusive(PRIMARY)))
+        );
+        assert_eq!(database.lookup(0x3000, 0x5000), Err(()));
+        assert_eq!(database.lookup(0x3000, 0x11000), Err(()));
+
+        assert_eq!(Ownership::state_mode(Some(lent), PRIMARY), Mode::INVALID);
+        assert_eq!(Ownership::state_mode(Some(lent), SECONDARY), Mode::UNOWNED);
+    }
+
+    /// Giving memory back merges it with the runs around it.
+    #[test]
+    fn ownership_give_back_coalesces() {
+        let mut database = Database::new();
+
+        record(
+            &mut database,
+            0,
+            0x10000,
+            Some(Ownership::exclusive(PRIMARY)),
+        );
+        record(
+            &mut database,
+            0x4000,
+            0x6000,
+            Some(Ownership::borrowed(PRIMARY, PageState::Shared, SECONDARY)),
+        );
+        record(
+            &mut database,
+            0x4000,
+            0x6000,
+            Some(Ownership::exclusive(PRIMARY)),
+        );
+
+        assert_eq!(database.len, 1);
+        assert_eq!(
+            database.lookup(0, 0x10000),
+            Ok(Some(Ownership::exclusive(PRIMARY)))
+        );
+    }
+
+    /// Updates are applied to each run and gap of the range separately.
+    #[test]
+    fn ownership_update_runs_and_gaps() {
+        let mut database = Database::new();
+
+        record(
+            &mut database,
+            0x2000,
+            0x4000,
+            Some(Ownership::exclusive(SECONDARY)),
+        );
+        database
+            .update(0, 0x8000, |ownership| match ownership {
+                Some(ownership) => Some(ownership.with_owner(PRIMARY)),
+                None => Some(Ownership::exclusive(HF_HYPERVISOR_VM_ID)),
+            })
+            .unwrap();
+
+        assert_eq!(database.len, 3);
+        assert_eq!(
+            database.lookup(0, 0x2000),
+            Ok(Some(Ownership::exclusive(HF_HYPERVISOR_VM_ID)))
+        );
+        assert_eq!(
+            database.lookup(0x2000, 0x4000),
+            Ok(Some(Ownership::exclusive(PRIMARY)))
+        );
+        assert_eq!(
+            database.lookup(0x4000, 0x8000),
+            Ok(Some(Ownership::exclusive(HF_HYPERVISOR_VM_ID)))
+        );
+
+        record(&mut database, 0, 0x8000, None);
+        assert_eq!(database.len, 0);
+    }
+}
@@ -20,11 +20,29 @@ use core::ptr;
 
 use crate::utils::*;
 
+/// The translation granule is selected at build time. It is 4KiB unless one of the `granule-16k`
+/// and `granule-64k` features is enabled.
+#[cfg(not(any(feature = "granule-16k", feature = "granule-64k")))]
 pub const PAGE_BITS: usize = 12;
+#[cfg(feature = "granule-16k")]
+pub const PAGE_BITS: usize = 14;
+#[cfg(feature = "granule-64k")]
+pub const PAGE_BITS: usize = 16;
+
+#[cfg(all(feature = "granule-16k", feature = "granule-64k"))]
+compile_error!("Only one of the granule-16k and granule-64k features can be enabled.");
+
 pub const PAGE_SIZE: usize = 1 << PAGE_BITS;
-pub const PAGE_LEVEL_BITS: usize = 9;
 
-#[repr(C, align(4096))]
+/// Each level of the page table resolves as many bits as fit 8-byte entries in a page.
+pub const PAGE_LEVEL_BITS: usize = PAGE_BITS - 3;
+
+#[cfg_attr(
+    not(any(feature = "granule-16k", feature = "granule-64k")),
+    repr(C, align(4096))
+)]
+#[cfg_attr(feature = "granule-16k", repr(C, align(16384)))]
+#[cfg_attr(feature = "granule-64k", repr(C, align(65536)))]
 pub struct RawPage {
     inner: [u8; PAGE_SIZE],
 }
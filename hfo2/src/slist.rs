@@ -148,6 +148,11 @@ impl<T, C: IsElement<T>> List<T, C> {
         self.head.push::<T, C>(element);
     }
 
+    /// Returns whether the list is empty.
+    pub fn is_empty(&self) -> bool {
+        self.head.next.get().is_null()
+    }
+
     pub fn pop(&mut self) -> Option<*mut T> {
         let head = self.head.next.get();
         if head.is_null() {
@@ -159,6 +164,36 @@ impl<T, C: IsElement<T>> List<T, C> {
         Some(unsafe { C::element_of(&*head) } as *const _ as *mut _)
     }
 
+    /// Inserts `element` before the first element satisfying `cond`, or at the tail if there is
+    /// none. This keeps the list sorted if `cond` tells whether an element is greater than
+    /// `element`.
+    ///
+    /// # Safety
+    ///
+    /// The same as `push()`.
+    pub unsafe fn insert_before<F>(&mut self, element: &T, cond: F)
+    where
+        F: Fn(&T) -> bool,
+    {
+        let mut prev = &self.head as *const ListEntry;
+        let mut curr = self.head.next.get();
+
+        while !curr.is_null() && !cond(C::element_of(&*curr)) {
+            prev = curr;
+            curr = (*curr).next.get();
+        }
+
+        (*prev).push::<T, C>(element);
+    }
+
+    /// Returns an iterator over the elements of the list.
+    pub fn iter(&self) -> Iter<T, C> {
+        Iter {
+            curr: self.head.next.get(),
+            _marker: PhantomData,
+        }
+    }
+
     pub unsafe fn pop_if_some<R, F>(&mut self, cond: F) -> Option<(*mut T, R)>
     where
         F: Fn(&T) -> Option<R>,
@@ -179,3 +214,19 @@ impl<T, C: IsElement<T>> List<T, C> {
         None
     }
 }
+
+/// An iterator over the elements of a `List`.
+pub struct Iter<'a, T, C: IsElement<T> = T> {
+    curr: *const ListEntry,
+    _marker: PhantomData<(&'a T, C)>,
+}
+
+impl<'a, T: 'a, C: IsElement<T>> Iterator for Iter<'a, T, C> {
+    type Item = &'a T;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let curr = unsafe { self.curr.as_ref()? };
+        self.curr = curr.next.get();
+        Some(unsafe { C::element_of(curr) })
+    }
+}
@@ -24,6 +24,12 @@ pub const SPCI_VERSION_MAJOR: i32 = 0x0;
 pub const SPCI_VERSION_MINOR: i32 = 0x9;
 pub const SPCI_VERSION_MAJOR_OFFSET: usize = 16;
 
+/// The version of the implemented SPCI specification. It is exported so that the hypercall fast
+/// path in exceptions.S can return it without calling any handler.
+#[no_mangle]
+pub static spci_version_implemented: i32 =
+    (SPCI_VERSION_MAJOR << SPCI_VERSION_MAJOR_OFFSET) | SPCI_VERSION_MINOR;
+
 /// Return type of SPCI functions.
 /// TODO: Reuse `SpciReturn` type on all SPCI functions declarations.
 #[repr(i32)]
@@ -16,20 +16,25 @@
 
 use core::mem;
 use core::ptr;
+use core::slice;
 
 use crate::addr::*;
 use crate::mm::*;
 use crate::mpool::*;
+use crate::ownership::{self, Ownership, PageState};
 use crate::page::*;
 use crate::spci::*;
 use crate::std::*;
+use crate::types::*;
 use crate::vm::*;
 
 /// Check if the message length and the number of memory region constituents match, if the check is
 /// correct call the memory sharing routine.
 fn spci_validate_call_share_memory(
-    to_inner: &mut VmInner,
-    from_inner: &mut VmInner,
+    to_id: spci_vm_id_t,
+    to_inner: &mut VmMemory,
+    from_id: spci_vm_id_t,
+    from_inner: &mut VmMemory,
     memory_region: &SpciMemoryRegion,
     memory_share_size: usize,
     memory_to_attributes: Mode,
@@ -47,7 +52,9 @@ fn spci_validate_call_share_memory(
     }
 
     spci_share_memory(
+        to_id,
         to_inner,
+        from_id,
         from_inner,
         memory_region,
         memory_to_attributes,
@@ -56,11 +63,49 @@ fn spci_validate_call_share_memory(
     )
 }
 
+/// Returns the constituents of the memory region of the architected message, or `None` if the
+/// message length and the number of constituents don't match.
+pub fn spci_architected_message_constituents(
+    architected_message_replica: &SpciArchitectedMessageHeader,
+    from_msg_payload_length: usize,
+) -> Option<&[SpciMemoryRegionConstituent]> {
+    let payload_length =
+        from_msg_payload_length.checked_sub(mem::size_of::<SpciArchitectedMessageHeader>())?;
+
+    #[allow(clippy::cast_ptr_alignment)]
+    let (memory_region, memory_share_size) = match architected_message_replica.r#type {
+        SpciMemoryShare::Donate | SpciMemoryShare::Relinquish => (
+            unsafe { &*(architected_message_replica.payload.as_ptr() as *const SpciMemoryRegion) },
+            payload_length,
+        ),
+        SpciMemoryShare::Lend => {
+            let lend_descriptor = unsafe {
+                &*(architected_message_replica.payload.as_ptr() as *const SpciMemoryLend)
+            };
+
+            (
+                unsafe { &*(lend_descriptor.payload.as_ptr() as *const SpciMemoryRegion) },
+                payload_length.checked_sub(mem::size_of::<SpciMemoryLend>())?,
+            )
+        }
+    };
+
+    let count = memory_region.count as usize;
+    if memory_share_size
+        != mem::size_of::<SpciMemoryRegion>()
+            + mem::size_of::<SpciMemoryRegionConstituent>() * count
+    {
+        return None;
+    }
+
+    Some(unsafe { slice::from_raw_parts(memory_region.constituents.as_ptr(), count) })
+}
+
 /// Performs initial architected message information parsing. Calls the corresponding api functions
 /// implementing the functionality requested in the architected message.
 pub fn spci_msg_handle_architected_message(
-    to_inner: &mut VmInner,
-    from_inner: &mut VmInner,
+    to_inner: &mut VmMemory,
+    from_inner: &mut VmMemory,
     architected_message_replica: &SpciArchitectedMessageHeader,
     from_msg_replica: &SpciMessage,
     to_msg: &mut SpciMessage,
@@ -82,7 +127,9 @@ pub fn spci_msg_handle_architected_message(
             let to_mode = Mode::R | Mode::W | Mode::X;
 
             spci_validate_call_share_memory(
+                from_msg_replica.target_vm_id,
                 to_inner,
+                from_msg_replica.source_vm_id,
                 from_inner,
                 memory_region,
                 memory_share_size,
@@ -102,7 +149,9 @@ pub fn spci_msg_handle_architected_message(
             let to_mode = Mode::R | Mode::W | Mode::X;
 
             spci_validate_call_share_memory(
+                from_msg_replica.target_vm_id,
                 to_inner,
+                from_msg_replica.source_vm_id,
                 from_inner,
                 memory_region,
                 memory_share_size,
@@ -130,7 +179,9 @@ pub fn spci_msg_handle_architected_message(
             let to_mode = spci_memory_attrs_to_mode(borrower_attributes as _);
 
             spci_validate_call_share_memory(
+                from_msg_replica.target_vm_id,
                 to_inner,
+                from_msg_replica.source_vm_id,
                 from_inner,
                 memory_region,
                 memory_share_size,
@@ -203,8 +254,9 @@ fn spci_msg_get_next_state(
 ///  4) The requested share type was not handled.
 /// Success is indicated by true.
 pub fn spci_msg_check_transition(
-    to_inner: &VmInner,
-    from_inner: &VmInner,
+    to_id: spci_vm_id_t,
+    to_inner: &VmMemory,
+    from_inner: &VmMemory,
     share: SpciMemoryShare,
     begin: ipaddr_t,
     end: ipaddr_t,
@@ -290,9 +342,13 @@ pub fn spci_msg_check_transition(
         return Err(());
     }
 
-    // Ensure that the memory range is mapped with the same mode.
+    // Ensure that the memory range is mapped with the same mode. The state of the memory for the
+    // recipient is known from the ownership database, unless it no longer tracks the range.
     let orig_from_mode = from_inner.ptable.get_mode(begin, end)?;
-    let orig_to_mode = to_inner.ptable.get_mode(begin, end)?;
+    let orig_to_mode = match ownership::lookup(pa_from_ipa(begin), pa_from_ipa(end)) {
+        Ok(ownership) => Ownership::state_mode(ownership, to_id),
+        Err(_) => to_inner.ptable.get_mode(begin, end)?,
+    };
 
     let mem_transition_table: &[SpciMemTransitions] = match share {
         SpciMemoryShare::Donate => &donate_transitions,
@@ -320,8 +376,10 @@ pub fn spci_msg_check_transition(
 ///   2) SPCI_NO_MEMORY - Hf did not have sufficient memory to complete the request.
 ///  Success is indicated by SPCI_SUCCESS.
 pub fn spci_share_memory(
-    to_inner: &mut VmInner,
-    from_inner: &mut VmInner,
+    to_id: spci_vm_id_t,
+    to_inner: &mut VmMemory,
+    from_id: spci_vm_id_t,
+    from_inner: &mut VmMemory,
     memory_region: &SpciMemoryRegion,
     memory_to_attributes: Mode,
     share: SpciMemoryShare,
@@ -349,6 +407,7 @@ pub fn spci_share_memory(
     // shared are at the same state.
     let (orig_from_mode, from_mode, to_mode) = ok_or!(
         spci_msg_check_transition(
+            to_id,
             to_inner,
             from_inner,
             share,
@@ -378,17 +437,30 @@ pub fn spci_share_memory(
         .identity_map(pa_begin, pa_end, to_mode, &local_page_pool)
         .is_err()
     {
-        // TODO: partial defrag of failed range.
         // Recover any memory consumed in failed mapping.
-        from_inner.ptable.defrag(&local_page_pool);
+        to_inner
+            .ptable
+            .defrag_range(pa_begin, pa_end, &local_page_pool);
 
         from_inner
             .ptable
             .identity_map(pa_begin, pa_end, orig_from_mode, &local_page_pool)
             .unwrap();
+        from_inner
+            .ptable
+            .defrag_range(pa_begin, pa_end, &local_page_pool);
 
         return SpciReturn::NoMemory;
     }
 
+    ownership::record(
+        pa_begin,
+        pa_end,
+        Some(match share {
+            SpciMemoryShare::Donate | SpciMemoryShare::Relinquish => Ownership::exclusive(to_id),
+            SpciMemoryShare::Lend => Ownership::borrowed(from_id, PageState::Shared, to_id),
+        }),
+    );
+
     SpciReturn::Success
 }
@@ -61,6 +61,9 @@ pub const HF_VIRTUAL_TIMER_INTID: intid_t = 3;
 // //project/reference/BUILD.gn.)
 pub const HEAP_PAGES: usize = 60;
 
+/// The number of pages of the hypervisor's page pool kept zeroed in advance for page tables.
+pub const ZEROED_PAGES: usize = 8;
+
 #[cfg(target_arch = "x86_64")]
 pub const MAX_CPUS: usize = 4;
 
@@ -77,6 +80,9 @@ pub const MAX_VMS: usize = 16;
 /// The offset is needed because VM ID 0 is reserved.
 pub const HF_VM_ID_OFFSET: spci_vm_id_t = 1;
 
+/// The ID reserved for the hypervisor itself.
+pub const HF_HYPERVISOR_VM_ID: spci_vm_id_t = 0;
+
 /// The ID of the primary VM which is responsible for scheduling.
 ///
 /// Starts at the offset because ID 0 is reserved for the hypervisor itself.
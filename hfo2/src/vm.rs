@@ -17,7 +17,7 @@
 use core::mem::{self, MaybeUninit};
 use core::ptr;
 use core::str;
-use core::sync::atomic::AtomicBool;
+use core::sync::atomic::{AtomicBool, AtomicUsize};
 
 use arrayvec::ArrayVec;
 use scopeguard::guard;
@@ -25,6 +25,7 @@ use scopeguard::guard;
 use crate::addr::*;
 use crate::arch::*;
 use crate::cpu::*;
+use crate::epoch;
 use crate::list::*;
 use crate::mm::*;
 use crate::mpool::*;
@@ -36,6 +37,10 @@ use crate::types::*;
 
 const LOG_BUFFER_SIZE: usize = 256;
 
+/// The maximum number of ranges of memory given lazily to a VM that may still hold uncleared
+/// pages. Memory given while as many ranges are tracked is cleared before it is given.
+pub const MAX_UNCLEARED_RANGES: usize = 8;
+
 #[repr(C)]
 #[derive(PartialEq, Debug, Clone, Copy)]
 pub enum MailboxState {
@@ -167,9 +172,8 @@ impl Mailbox {
             .identity_map(pa_send_begin, pa_send_end, Mode::R, local_page_pool)
             .is_err()
         {
-            // TODO: partial defrag of failed range.
             // Recover any memory consumed in failed mapping.
-            ptable.defrag(local_page_pool);
+            ptable.defrag_range(pa_send_begin, pa_send_end, local_page_pool);
             return Err(());
         }
 
@@ -185,9 +189,8 @@ impl Mailbox {
             .identity_map(pa_recv_begin, pa_recv_end, Mode::W, local_page_pool)
             .is_err()
         {
-            // TODO: parital defrag of failed range.
             // Recover any memory consumed in failed mapping.
-            ptable.defrag(local_page_pool);
+            ptable.defrag_range(pa_recv_begin, pa_recv_end, local_page_pool);
             return Err(());
         }
 
@@ -200,6 +203,28 @@ impl Mailbox {
         Ok(())
     }
 
+    /// Unmaps the send and receive pages from the hypervisor's stage-1 page table, and forgets them
+    /// along with any message in the mailbox.
+    pub fn reset_stage1(
+        &mut self,
+        hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+        local_page_pool: &MPool,
+    ) -> Result<(), ()> {
+        let mut hypervisor_ptable = hypervisor_ptable.lock();
+
+        for page in [self.send as usize, self.recv as usize].iter() {
+            if *page != 0 {
+                let begin = pa_init(*page);
+                hypervisor_ptable.unmap(begin, pa_add(begin, PAGE_SIZE), local_page_pool)?;
+            }
+        }
+
+        self.state = MailboxState::Empty;
+        self.send = ptr::null();
+        self.recv = ptr::null_mut();
+        Ok(())
+    }
+
     pub fn get_send_ptr(&self) -> *const SpciMessage {
         self.send
     }
@@ -209,33 +234,71 @@ impl Mailbox {
     }
 }
 
-pub struct VmInner {
-    log_buffer: ArrayVec<[c_char; LOG_BUFFER_SIZE]>,
+/// A range of memory given lazily to a VM. The pages before `next` have been cleared, and those
+/// after it may still be uncleared unless the VM has accessed them.
+#[derive(Clone, Copy)]
+pub struct UnclearedRange {
+    pub begin: paddr_t,
+    pub next: paddr_t,
+    pub end: paddr_t,
+}
+
+impl UnclearedRange {
+    pub fn new(begin: paddr_t, end: paddr_t) -> Self {
+        Self {
+            begin,
+            next: begin,
+            end,
+        }
+    }
+
+    /// Returns whether the range overlaps with the range from `begin` to `end`.
+    pub fn overlaps(&self, begin: paddr_t, end: paddr_t) -> bool {
+        pa_addr(self.next) < pa_addr(end) && pa_addr(begin) < pa_addr(self.end)
+    }
+}
+
+/// The memory state of a VM.
+pub struct VmMemory {
     pub ptable: PageTable<Stage2>,
+    arch: ArchVm,
+
+    /// The ranges of memory given lazily to the VM that may still hold uncleared pages.
+    pub uncleared: ArrayVec<[UnclearedRange; MAX_UNCLEARED_RANGES]>,
+}
+
+impl VmMemory {
+    /// Initializes VmMemory.
+    pub unsafe fn init(&mut self, ppool: &MPool) -> Result<(), ()> {
+        if !mm_vm_init(&mut self.ptable, ppool) {
+            return Err(());
+        }
+
+        ptr::write(&mut self.uncleared, ArrayVec::new());
+
+        Ok(())
+    }
+}
+
+/// The mailbox state of a VM.
+pub struct VmMailbox {
     mailbox: Mailbox,
 
     /// Wait entries to be used when waiting on other VM mailboxes.
     wait_entries: [WaitEntry; MAX_VMS],
-    arch: ArchVm,
 }
 
-impl VmInner {
-    /// Initializes VmInner.
-    pub unsafe fn init(&mut self, vm: *mut Vm, ppool: &MPool) -> Result<(), ()> {
+impl VmMailbox {
+    /// Initializes VmMailbox.
+    pub unsafe fn init(&mut self, vm: *mut Vm) {
         self.mailbox.init();
 
-        if !mm_vm_init(&mut self.ptable, ppool) {
-            return Err(());
-        }
-
         // Initialise waiter entries.
         for i in 0..MAX_VMS {
             self.wait_entries[i].waiting_vm = vm;
             list_init(&mut self.wait_entries[i].wait_links);
             list_init(&mut self.wait_entries[i].ready_links);
         }
-
-        Ok(())
     }
 
     /// Retrieves the next waiter and removes it from the wait list if the VM's
@@ -272,6 +335,7 @@ impl VmInner {
     #[inline]
     fn configure_pages(
         &mut self,
+        memory: &mut VmMemory,
         pa_send_begin: paddr_t,
         pa_send_end: paddr_t,
         orig_send_mode: Mode,
@@ -285,7 +349,7 @@ impl VmInner {
         // thread. This is to ensure the original mapping can be restored if
         // any stage of the process fails.
         let local_page_pool: MPool = MPool::new_with_fallback(fallback_mpool);
-        let mut ptable = guard(&mut self.ptable, |_| ());
+        let mut ptable = guard(&mut memory.ptable, |_| ());
 
         // Take memory ownership away from the VM and mark as shared.
         ptable.identity_map(
@@ -309,9 +373,8 @@ impl VmInner {
                 &local_page_pool,
             )
             .map_err(|_| {
-                // TODO: partial defrag of failed range.
                 // Recover any memory consumed in failed mapping.
-                ptable.defrag(&local_page_pool);
+                ptable.defrag_range(pa_recv_begin, pa_recv_end, &local_page_pool);
             })?;
 
         let ptable = guard(ptable, |mut ptable| {
@@ -341,6 +404,7 @@ impl VmInner {
     ///  - Some(()) on success.
     pub fn configure(
         &mut self,
+        memory: &mut VmMemory,
         send: ipaddr_t,
         recv: ipaddr_t,
         hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
@@ -370,17 +434,18 @@ impl VmInner {
 
         // Ensure the pages are valid, owned and exclusive to the VM and that
         // the VM has the required access to the memory.
-        let orig_send_mode = self.ptable.get_mode(send, ipa_add(send, PAGE_SIZE))?;
+        let orig_send_mode = memory.ptable.get_mode(send, ipa_add(send, PAGE_SIZE))?;
         if !(orig_send_mode.valid_owned_exclusive() && orig_send_mode.contains(Mode::R | Mode::W)) {
             return Err(());
         }
 
-        let orig_recv_mode = self.ptable.get_mode(recv, ipa_add(recv, PAGE_SIZE))?;
+        let orig_recv_mode = memory.ptable.get_mode(recv, ipa_add(recv, PAGE_SIZE))?;
         if !(orig_recv_mode.valid_owned_exclusive() && orig_recv_mode.contains(Mode::R)) {
             return Err(());
         }
 
         self.configure_pages(
+            memory,
             pa_send_begin,
             pa_send_end,
             orig_send_mode,
@@ -392,6 +457,46 @@ impl VmInner {
         )
     }
 
+    /// Unconfigures the send and receive pages, unmapping them from the hypervisor address space
+    /// and giving them back to the VM with exclusive access.
+    pub fn unconfigure(
+        &mut self,
+        memory: &mut VmMemory,
+        hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+        local_page_pool: &MPool,
+    ) -> Result<(), ()> {
+        let pages = [
+            self.mailbox.get_send_ptr() as usize,
+            self.mailbox.get_recv_ptr() as usize,
+        ];
+
+        self.mailbox
+            .reset_stage1(hypervisor_ptable, local_page_pool)?;
+
+        for page in pages.iter().filter(|page| **page != 0) {
+            let begin = pa_init(*page);
+            memory.ptable.identity_map(
+                begin,
+                pa_add(begin, PAGE_SIZE),
+                Mode::R | Mode::W,
+                local_page_pool,
+            )?;
+        }
+
+        Ok(())
+    }
+
+    /// Unmaps the send and receive pages from the hypervisor address space, without giving them
+    /// back to the VM. Used when the VM is reclaimed and its table is gone.
+    pub fn reset(
+        &mut self,
+        hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+        local_page_pool: &MPool,
+    ) -> Result<(), ()> {
+        self.mailbox
+            .reset_stage1(hypervisor_ptable, local_page_pool)
+    }
+
     /// Checks whether `configure` is called before.
     pub fn is_configured(&self) -> bool {
         !self.mailbox.send.is_null() && !self.mailbox.recv.is_null()
@@ -455,37 +560,41 @@ impl VmInner {
     pub fn get_recv_ptr(&self) -> *mut SpciMessage {
         self.mailbox.get_recv_ptr()
     }
-
-    pub fn debug_log(&mut self, id: spci_vm_id_t, c: c_char) {
-        let flush = if c == b'\n' || c == b'\0' {
-            true
-        } else {
-            self.log_buffer.push(c);
-            self.log_buffer.is_full()
-        };
-
-        if flush {
-            let log = str::from_utf8(&self.log_buffer).unwrap_or("non-UTF8 bytes");
-            dlog!("VM {}: {}\n", id, log);
-            self.log_buffer.clear();
-        }
-    }
 }
 
+#[repr(C)]
 pub struct Vm {
+    /// `id` is read at a fixed offset by the hypercall fast path in exceptions.S.
     pub id: spci_vm_id_t,
 
     /// VCpus of this vm.
     /// Note: This field is regarded as a kind of mutable states of Vm, but is
-    /// not contained in VmInner, because
+    /// not contained in VmMemory or VmMailbox, because
     ///   1. Mutable inner fields are contained in VCpuState.
     ///   2. VCpuState has higher lock order than one of Vm. It is nonsense to
-    ///      lock VmInner to acquire VCpuState.
+    ///      lock the VM to acquire VCpuState.
     pub vcpus: ArrayVec<[VCpu; MAX_CPUS]>,
 
-    /// See api.c for the partial ordering on locks.
-    pub inner: SpinLock<VmInner>,
+    /// The memory and mailbox states are locked separately, so that messages can be passed while
+    /// the memory of the VM is being updated. See api.rs for the partial ordering on locks.
+    pub memory: SpinLock<VmMemory>,
+    pub mailbox: SpinLock<VmMailbox>,
+
+    /// Characters logged by the VM that are not printed yet.
+    log_buffer: SpinLock<ArrayVec<[c_char; LOG_BUFFER_SIZE]>>,
     pub aborting: AtomicBool,
+
+    /// The number of vCPUs that have reached `VCpuStatus::Aborted`. Once it reaches the number of
+    /// vCPUs, the resources of the VM are reclaimed.
+    pub aborted_vcpus: AtomicUsize,
+
+    /// Whether reclaiming the resources of the VM failed and is to be retried the next time the
+    /// primary tries to run one of its vCPUs.
+    pub reclaim_pending: AtomicBool,
+
+    /// Whether vCPUs of other secondary VMs may switch directly to the vCPUs of this VM when they
+    /// wake them up or send them a message, instead of going through the primary VM.
+    pub direct_handoff: bool,
 }
 
 impl Vm {
@@ -506,9 +615,13 @@ impl Vm {
             self.vcpus.set_len(0);
         }
         self.aborting = AtomicBool::new(false);
+        self.aborted_vcpus = AtomicUsize::new(0);
+        self.reclaim_pending = AtomicBool::new(false);
+        self.direct_handoff = false;
         unsafe {
             let self_ptr = self as *mut _;
-            self.inner.get_mut().init(self_ptr, ppool)?;
+            self.memory.get_mut().init(ppool)?;
+            self.mailbox.get_mut().init(self_ptr);
 
             for _ in 0..vcpu_count {
                 // self.vcpus.push(VCpu::new(self_ptr));
@@ -522,16 +635,41 @@ impl Vm {
     }
 
     /// Returns the root address of the page table of this VM. It is safe not to
-    /// lock `self.inner` because the value of `ptable.as_raw()` doesn't change
+    /// lock `self.memory` because the value of `ptable.as_raw()` doesn't change
     /// after `ptable` is initialized. Of course, actual page table may vary
     /// during running. That's why this function returns `paddr_t` rather than
     /// `&[RawPageTable]`.
     pub fn get_ptable_raw(&self) -> paddr_t {
-        unsafe { self.inner.get_unchecked().ptable.as_raw() }
+        unsafe { self.memory.get_unchecked().ptable.as_raw() }
+    }
+
+    /// Gets the mode of the given range of addresses in the stage-2 page table without locking
+    /// `self.memory`. Like `get_ptable_raw()`, this relies on the root of the page table not
+    /// changing after it is initialized. The tables below it may be updated concurrently, so the
+    /// mode is a snapshot that may already be stale, but the tables being walked are not freed
+    /// until the walk is over.
+    pub fn get_mode_unlocked(&self, begin: ipaddr_t, end: ipaddr_t) -> Result<Mode, ()> {
+        let _guard = epoch::pin();
+        unsafe { self.memory.get_unchecked() }
+            .ptable
+            .get_mode(begin, end)
     }
 
     pub fn debug_log(&self, c: c_char) {
-        self.inner.lock().debug_log(self.id, c)
+        let mut log_buffer = self.log_buffer.lock();
+
+        let flush = if c == b'\n' || c == b'\0' {
+            true
+        } else {
+            log_buffer.push(c);
+            log_buffer.is_full()
+        };
+
+        if flush {
+            let log = str::from_utf8(&log_buffer).unwrap_or("non-UTF8 bytes");
+            dlog!("VM {}: {}\n", self.id, log);
+            log_buffer.clear();
+        }
     }
 }
 
@@ -579,6 +717,14 @@ impl VmManager {
         self.vms.get_mut(Self::get_vm_index(id))
     }
 
+    /// Returns the VM whose stage-2 page table has the given root. The root is set when the VM is
+    /// initialised and never changes, so it is read without locking the memory of the VMs.
+    pub fn find_by_ptable(&self, root: paddr_t) -> Option<&Vm> {
+        self.vms.iter().find(|vm| {
+            pa_addr(unsafe { vm.memory.get_unchecked() }.ptable.as_raw()) == pa_addr(root)
+        })
+    }
+
     pub fn get_primary(&self) -> &Vm {
         // # Safety
         //
@@ -607,7 +753,7 @@ pub unsafe extern "C" fn vm_get_id(vm: *const Vm) -> spci_vm_id_t {
 
 #[no_mangle]
 pub unsafe extern "C" fn vm_get_arch(vm: *const Vm) -> *mut ArchVm {
-    &mut (*vm).inner.get_mut_unchecked().arch
+    &mut (*vm).memory.get_mut_unchecked().arch
 }
 
 #[no_mangle]
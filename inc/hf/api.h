@@ -31,6 +31,7 @@ uint64_t api_vcpu_run(spci_vm_id_t vm_id,
 				       spci_vcpu_index_t vcpu_idx,
 				       const struct vcpu *current,
 				       struct vcpu **next);
+int64_t api_vcpu_handoff_get(const struct vcpu *current);
 int64_t api_vm_configure(ipaddr_t send, ipaddr_t recv, struct vcpu *current,
 			 struct vcpu **next);
 int64_t api_mailbox_clear(struct vcpu *current, struct vcpu **next);
@@ -38,6 +39,7 @@ int64_t api_mailbox_writable_get(const struct vcpu *current);
 int64_t api_mailbox_waiter_get(spci_vm_id_t vm_id, const struct vcpu *current);
 int64_t api_share_memory(spci_vm_id_t vm_id, ipaddr_t addr, size_t size,
 			 enum hf_share share, struct vcpu *current);
+int64_t api_memory_owner_get(ipaddr_t addr, struct vcpu *current);
 int64_t api_debug_log(char c, struct vcpu *current);
 
 struct vcpu *api_preempt(struct vcpu *current);
@@ -46,6 +48,11 @@ struct vcpu *api_vcpu_off(struct vcpu *current);
 struct vcpu *api_abort(struct vcpu *current);
 struct vcpu *api_wake_up(struct vcpu *current, struct vcpu *target_vcpu);
 
+bool api_refill_zeroed_pages(void);
+bool api_zeroed_pages_wanted(void);
+bool api_clear_uncleared_memory(void);
+bool api_uncleared_memory_pending(void);
+
 int64_t api_interrupt_enable(uint32_t intid, bool enable, struct vcpu *current);
 uint32_t api_interrupt_get(struct vcpu *current);
 int64_t api_interrupt_inject(spci_vm_id_t target_vm_id,
@@ -21,6 +21,8 @@
 
 #include "hf/addr.h"
 
+struct arch_vm;
+
 /*
  * A page table entry (PTE) will take one of the following forms:
  *
@@ -30,6 +32,15 @@
  *  4. table         : Represents a reference to a table of PTEs.
  */
 
+/**
+ * A range of addresses, at either stage, of which TLB entries are to be
+ * invalidated.
+ */
+struct arch_mm_tlb_range {
+	uintptr_t begin;
+	uintptr_t end;
+};
+
 /**
  * Creates an absent PTE.
  */
@@ -74,6 +85,37 @@ bool arch_mm_pte_is_block(pte_t pte, uint8_t level);
  */
 bool arch_mm_pte_is_table(pte_t pte, uint8_t level);
 
+/**
+ * Determines if a PTE is a block with the contiguous hint, i.e. it is one of an
+ * aligned run of entries with the same attributes that the TLB may cache as
+ * one.
+ */
+bool arch_mm_pte_is_contiguous(pte_t pte, uint8_t level);
+
+/**
+ * Determines if a table PTE is marked dirty, i.e. the table it references may
+ * have changed since it was last defragmented. The mark is ignored by the
+ * hardware.
+ */
+bool arch_mm_table_pte_is_dirty(pte_t pte, uint8_t level);
+
+/**
+ * Returns the table PTE with the dirty mark set or cleared.
+ */
+pte_t arch_mm_table_pte_set_dirty(pte_t pte, uint8_t level, bool dirty);
+
+/**
+ * Returns the number of present entries in the table referenced by a table
+ * PTE, as recorded in bits of the PTE that are ignored by the hardware.
+ */
+size_t arch_mm_table_pte_present_count(pte_t pte, uint8_t level);
+
+/**
+ * Determines if a table PTE is marked uniform, i.e. all the entries of the
+ * table it references are blocks with the same attributes or are all absent.
+ */
+bool arch_mm_table_pte_is_uniform(pte_t pte, uint8_t level);
+
 /**
  * Clears the bits of an address that are ignored by the page table. In effect,
  * the address is rounded down to the start of the corresponding PTE range.
@@ -107,10 +149,38 @@ uint64_t arch_mm_combine_table_entry_attrs(uint64_t table_attrs,
 void arch_mm_invalidate_stage1_range(vaddr_t va_begin, vaddr_t va_end);
 
 /**
- * Invalidates the given range of stage-2 TLB.
+ * Invalidates the given ranges of stage-1 TLB, with a single wait for the
+ * completion of all of them.
+ */
+void arch_mm_invalidate_stage1_ranges(const struct arch_mm_tlb_range *ranges,
+				      size_t count);
+
+/**
+ * Invalidates the given range of stage-1 TLB on the current CPU only.
+ */
+void arch_mm_invalidate_stage1_range_local(vaddr_t va_begin, vaddr_t va_end);
+
+/**
+ * Makes the preceding writes to page tables visible to the table walks of the
+ * current CPU.
+ */
+void arch_mm_sync_table_writes_local(void);
+
+/**
+ * Invalidates the given range of stage-2 TLB, for the VM currently running on
+ * the CPU.
  */
 void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end);
 
+/**
+ * Invalidates the given ranges of stage-2 TLB of the VM with the given root
+ * table, with a single wait for the completion of all of them. If `vm` is NULL,
+ * they are invalidated for the VM currently running on the CPU instead.
+ */
+void arch_mm_invalidate_stage2_ranges(paddr_t root, const struct arch_vm *vm,
+				      const struct arch_mm_tlb_range *ranges,
+				      size_t count);
+
 /**
  * Writes back the given range of virtual memory to such a point that all cores
  * and devices will see the updated values. The corresponding cache lines are
@@ -118,6 +188,12 @@ void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end);
  */
 void arch_mm_flush_dcache(void *base, size_t size);
 
+/**
+ * Zeroes the given range of virtual memory such that all cores and devices,
+ * including those with their caches disabled, will see zeroes.
+ */
+void arch_mm_zero_memory(void *base, size_t size);
+
 /**
  * Gets the maximum level allowed in the page table for stage-1.
  */
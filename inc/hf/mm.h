@@ -65,10 +65,15 @@
  *  - !V !O !X : Invalid memory. Memory is unrelated to the VM.
  *
  *  Modes are selected so that owner of exclusive memory is the default.
+ *
+ * Memory given to a VM that has not been cleared yet is additionally marked
+ * uncleared. It is owned and exclusive to the VM but invalid, so that it is
+ * cleared and mapped in when the VM first accesses it.
  */
-#define MM_MODE_INVALID 0x0010
-#define MM_MODE_UNOWNED 0x0020
-#define MM_MODE_SHARED  0x0040
+#define MM_MODE_INVALID   0x0010
+#define MM_MODE_UNOWNED   0x0020
+#define MM_MODE_SHARED    0x0040
+#define MM_MODE_UNCLEARED 0x0080
 
 #define MM_FLAG_COMMIT  0x01
 #define MM_FLAG_UNMAP   0x02
@@ -92,6 +97,15 @@ struct mm_ptable {
 /** The type of addresses stored in the page table. */
 typedef uintvaddr_t ptable_addr_t;
 
+/** Statistics of the memory mapped by a page table. */
+struct mm_ptable_stats {
+	/** The number of bytes mapped by valid entries. */
+	size_t valid_bytes;
+
+	/** The number of bytes mapped by entries in contiguous runs. */
+	size_t contiguous_bytes;
+};
+
 /** Represents the currently locked stage-1 page table of the hypervisor. */
 struct mm_stage1_locked {
 	struct mm_ptable *ptable;
@@ -108,8 +122,12 @@ bool mm_vm_unmap(struct mm_ptable *t, paddr_t begin, paddr_t end,
 		 struct mpool *ppool);
 bool mm_vm_unmap_hypervisor(struct mm_ptable *t, struct mpool *ppool);
 void mm_vm_defrag(struct mm_ptable *t, struct mpool *ppool);
+void mm_vm_defrag_range(struct mm_ptable *t, paddr_t begin, paddr_t end,
+			struct mpool *ppool);
 bool mm_vm_get_mode(struct mm_ptable *t, ipaddr_t begin, ipaddr_t end,
 		    int *mode);
+void mm_vm_get_stats(const struct mm_ptable *t,
+		     struct mm_ptable_stats *stats);
 
 struct mm_stage1_locked mm_lock_stage1(void);
 void mm_unlock_stage1(struct mm_stage1_locked *lock);
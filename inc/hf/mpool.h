@@ -21,18 +21,63 @@
 
 #include "hf/spinlock.h"
 
+/** The number of block orders of the buddy-system backend. */
+#define MPOOL_BUDDY_ORDERS 12
+
+/** How a memory pool keeps track of free pages. */
+enum mpool_backend {
+	MPOOL_BACKEND_LIST,
+	MPOOL_BACKEND_BUDDY,
+};
+
 struct mpool {
 	struct spinlock lock;
 	struct mpool_chunk *chunk_list;
 	struct mpool_entry *entry_list;
+	enum mpool_backend backend;
+	struct mpool_buddy_block *buddy_free[MPOOL_BUDDY_ORDERS];
+	size_t lock_acquired;
+	size_t lock_contended;
 	struct mpool *fallback;
+	struct mpool_magazines *magazines;
+	struct spinlock zeroed_lock;
+	struct mpool_entry *zeroed_list;
+	size_t zeroed_count;
+	size_t zeroed_target;
+	size_t zeroed_hits;
+	size_t zeroed_misses;
+	bool zeroed_wanted;
+};
+
+/**
+ * Lock contention, per-CPU magazine, fragmentation and zeroed page statistics
+ * of a pool.
+ */
+struct mpool_stats {
+	size_t lock_acquired;
+	size_t lock_contended;
+	size_t magazine_hits;
+	size_t magazine_refills;
+	size_t magazine_spills;
+	size_t free_pages;
+	size_t free_ranges;
+	size_t largest_free_range;
+	size_t zeroed_pages;
+	size_t zeroed_hits;
+	size_t zeroed_misses;
 };
 
 void mpool_init(struct mpool *p, size_t entry_size);
+void mpool_init_buddy(struct mpool *p, size_t entry_size);
 void mpool_init_from(struct mpool *p, struct mpool *from);
 void mpool_init_with_fallback(struct mpool *p, struct mpool *fallback);
 void mpool_fini(struct mpool *p);
+bool mpool_enable_magazines(struct mpool *p);
+void mpool_set_zeroed_target(struct mpool *p, size_t target);
+size_t mpool_refill_zeroed(struct mpool *p, size_t budget);
+void mpool_get_stats(struct mpool *p, struct mpool_stats *stats);
 bool mpool_add_chunk(struct mpool *p, void *begin, size_t size);
 void *mpool_alloc(struct mpool *p);
+void *mpool_alloc_zeroed(struct mpool *p);
 void *mpool_alloc_contiguous(struct mpool *p, size_t count, size_t align);
 void mpool_free(struct mpool *p, void *ptr);
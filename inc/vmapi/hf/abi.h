@@ -101,6 +101,18 @@ struct hf_vcpu_run_return {
 	};
 };
 
+/**
+ * A direct switch from one secondary vCPU to another on a physical CPU, without
+ * going through the primary VM. The scheduler retrieves these with
+ * `hf_vcpu_handoff_get` to account for the time each vCPU ran.
+ */
+struct hf_vcpu_handoff {
+	spci_vm_id_t from_vm_id;
+	spci_vcpu_index_t from_vcpu;
+	spci_vm_id_t to_vm_id;
+	spci_vcpu_index_t to_vcpu;
+};
+
 enum hf_share {
 	/**
 	 * Relinquish ownership and access to the memory and pass them to the
@@ -119,6 +131,13 @@ enum hf_share {
 	 * recipient.
 	 */
 	HF_MEMORY_SHARE,
+
+	/**
+	 * As HF_MEMORY_GIVE, but return before the memory is cleared. The
+	 * recipient has the memory cleared as it first accesses it, and the
+	 * hypervisor clears the rest while the primary VM is idle.
+	 */
+	HF_MEMORY_GIVE_LAZY,
 };
 
 /**
@@ -149,3 +168,18 @@ static inline struct hf_vcpu_run_return hf_vcpu_run_return_decode(uint64_t res)
 
 	return ret;
 }
+
+/**
+ * Decode an hf_vcpu_handoff struct from the 64-bit packing ABI.
+ */
+static inline struct hf_vcpu_handoff hf_vcpu_handoff_decode(uint64_t res)
+{
+	struct hf_vcpu_handoff ret;
+
+	ret.from_vm_id = res >> 48;
+	ret.from_vcpu = (res >> 32) & 0xffff;
+	ret.to_vm_id = (res >> 16) & 0xffff;
+	ret.to_vcpu = res & 0xffff;
+
+	return ret;
+}
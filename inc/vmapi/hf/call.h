@@ -36,6 +36,8 @@
 #define HF_INTERRUPT_GET        0xff0c
 #define HF_INTERRUPT_INJECT     0xff0d
 #define HF_SHARE_MEMORY         0xff0e
+#define HF_MEMORY_OWNER_GET     0xff0f
+#define HF_VCPU_HANDOFF_GET     0xff10
 
 /* This matches what Trusty and its ATF module currently use. */
 #define HF_DEBUG_LOG            0xbd000000
@@ -84,6 +86,23 @@ static inline struct hf_vcpu_run_return hf_vcpu_run(spci_vm_id_t vm_id,
 		hf_call(HF_VCPU_RUN, vm_id, vcpu_idx, 0));
 }
 
+/**
+ * Retrieves the next direct handoff that took place on the calling physical
+ * CPU. When a secondary vCPU wakes up or sends a message to a vCPU of a VM that
+ * opted in to direct handoff, Hafnium may switch to that vCPU straight away
+ * rather than returning to the scheduler. The result of `hf_vcpu_run` then
+ * describes the last vCPU the CPU was handed off to, and the vCPUs handed off
+ * from are ready to run. Only primary VMs are allowed to call this, and should
+ * do so repeatedly after each `hf_vcpu_run` returns.
+ *
+ * Returns -1 if there are no more handoffs, or the handoff encoded as for
+ * `hf_vcpu_handoff_decode` otherwise.
+ */
+static inline int64_t hf_vcpu_handoff_get(void)
+{
+	return hf_call(HF_VCPU_HANDOFF_GET, 0, 0, 0);
+}
+
 /**
  * Hints that the vcpu is willing to yield its current use of the physical CPU.
  * This call always returns SPCI_SUCCESS.
@@ -247,6 +266,18 @@ static inline int64_t hf_share_memory(spci_vm_id_t vm_id, hf_ipaddr_t addr,
 		       size);
 }
 
+/**
+ * Looks up which VM owns the page at the given address. Only primary VMs are
+ * allowed to call this.
+ *
+ * Returns the ID of the owning VM, 0 if the page belongs to Hafnium itself, or
+ * -1 if no VM owns the page or the caller is not the primary VM.
+ */
+static inline int64_t hf_memory_owner_get(hf_ipaddr_t addr)
+{
+	return hf_call(HF_MEMORY_OWNER_GET, addr, 0, 0);
+}
+
 /**
  * Sends a character to the debug log for the VM.
  *
@@ -61,6 +61,15 @@ $TIMEOUT 30s $OUT/host_fake_clang/unit_tests \
   --gtest_output="xml:$OUT/kokoro_log/unit_tests/sponge_log.xml" \
   | tee $OUT/kokoro_log/unit_tests/sponge_log.log
 
+# Run them again for each of the larger translation granules.
+for GRANULE in 16k 64k
+do
+  mkdir -p $OUT/kokoro_log/unit_tests_$GRANULE
+  $TIMEOUT 30s $OUT/host_fake_${GRANULE}_clang/unit_tests \
+    --gtest_output="xml:$OUT/kokoro_log/unit_tests_$GRANULE/sponge_log.xml" \
+    | tee $OUT/kokoro_log/unit_tests_$GRANULE/sponge_log.log
+done
+
 RUSTFLAGS="-L ../$OUT/host_fake_clang/obj/src -C link-arg=-no-pie" cargo test --manifest-path=hfo2/Cargo.toml
 
 $HFTEST arch_test
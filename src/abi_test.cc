@@ -109,4 +109,17 @@ TEST(abi, hf_vcpu_run_return_decode_aborted)
 	EXPECT_THAT(res.code, Eq(HF_VCPU_RUN_ABORTED));
 }
 
+/**
+ * Decode a handoff into the vCPUs it switched between.
+ */
+TEST(abi, hf_vcpu_handoff_decode)
+{
+	struct hf_vcpu_handoff res =
+		hf_vcpu_handoff_decode(0x1234abcd5678ef01);
+	EXPECT_THAT(res.from_vm_id, Eq(0x1234));
+	EXPECT_THAT(res.from_vcpu, Eq(0xabcd));
+	EXPECT_THAT(res.to_vm_id, Eq(0x5678));
+	EXPECT_THAT(res.to_vcpu, Eq(0xef01));
+}
+
 } /* namespace */
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fpsimd.h"
+
+#include "hf/arch/barriers.h"
+
+#include "hf/vm.h"
+
+#include "msr.h"
+
+/**
+ * Traps accesses to SIMD and floating point registers at all ELs.
+ */
+#define CPTR_EL2_TFP (1u << 10)
+
+/*
+ * The floating point registers are switched lazily. A vCPU runs with accesses
+ * to them trapped unless the registers of the CPU already hold its state, and
+ * takes them over on its first access. So vCPUs that don't use floating point
+ * never have it saved or restored.
+ *
+ * The state of a secondary vCPU is saved when it is switched out if it took
+ * the registers over, as it may next run on another CPU. The vCPUs of the
+ * primary only run on their own CPU, so their state is left in the registers
+ * until another vCPU takes them over.
+ *
+ * This relies on the hypervisor itself never using the registers, so both its
+ * C and Rust code are built without floating point and SIMD. Otherwise it
+ * would trap on them while the registers aren't owned, and would clobber the
+ * state of the owner while they are.
+ */
+
+/**
+ * The vCPU whose floating point state is held in the registers of each CPU and
+ * may have changed since it was saved, or NULL. Each element is only accessed
+ * by the CPU it belongs to.
+ */
+static struct vcpu *fpsimd_owner[MAX_CPUS];
+
+/**
+ * Returns the owner of the floating point registers of the CPU the vCPU is
+ * running on.
+ */
+static struct vcpu **fpsimd_owner_of_cpu(struct vcpu *vcpu)
+{
+	return &fpsimd_owner[cpu_index(vcpu_get_cpu(vcpu))];
+}
+
+/**
+ * Sets whether accesses to floating point registers are trapped in the current
+ * context.
+ */
+static void fpsimd_set_trap(bool trap)
+{
+	uintreg_t cptr_el2 = read_msr(cptr_el2);
+
+	write_msr(cptr_el2, trap ? cptr_el2 | CPTR_EL2_TFP
+				 : cptr_el2 & ~CPTR_EL2_TFP);
+	isb();
+}
+
+/**
+ * Traps accesses of the vCPU about to be run to floating point registers,
+ * unless the registers of the CPU already hold its state.
+ */
+void fpsimd_update_trap(struct vcpu *vcpu)
+{
+	struct arch_regs *regs = vcpu_get_regs(vcpu);
+
+	if (*fpsimd_owner_of_cpu(vcpu) == vcpu) {
+		regs->lazy.cptr_el2 &= ~CPTR_EL2_TFP;
+	} else {
+		regs->lazy.cptr_el2 |= CPTR_EL2_TFP;
+	}
+}
+
+/**
+ * Gives the floating point registers of the CPU to the current vCPU, which
+ * trapped on accessing them, after saving the state of their previous owner.
+ */
+void fpsimd_take_over(struct vcpu *vcpu)
+{
+	struct vcpu **owner = fpsimd_owner_of_cpu(vcpu);
+
+	fpsimd_set_trap(false);
+
+	if (*owner == vcpu) {
+		return;
+	}
+
+	if (*owner != NULL) {
+		fpsimd_save_state(*owner);
+	}
+
+	fpsimd_restore_state(vcpu);
+	*owner = vcpu;
+}
+
+/**
+ * Saves the floating point state of a secondary vCPU being switched out if it
+ * took over the registers, as it may next run on another CPU.
+ */
+void fpsimd_switch_out(struct vcpu *vcpu)
+{
+	struct vcpu **owner = fpsimd_owner_of_cpu(vcpu);
+
+	if (*owner != vcpu ||
+	    vm_get_id(vcpu_get_vm(vcpu)) == HF_PRIMARY_VM_ID) {
+		return;
+	}
+
+	/* The registers are accessible as the vCPU owns them. */
+	fpsimd_save_state(vcpu);
+	*owner = NULL;
+}
+
+/**
+ * Saves the floating point state held in the registers of the CPU the current
+ * vCPU runs on, before the CPU is powered down and may lose it. The current
+ * vCPU takes the registers over again on its next access if it keeps running.
+ */
+void fpsimd_release(struct vcpu *vcpu)
+{
+	struct vcpu **owner = fpsimd_owner_of_cpu(vcpu);
+
+	if (*owner == NULL) {
+		return;
+	}
+
+	fpsimd_set_trap(false);
+	fpsimd_save_state(*owner);
+	*owner = NULL;
+	fpsimd_set_trap(true);
+}
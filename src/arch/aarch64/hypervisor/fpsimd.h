@@ -0,0 +1,27 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "hf/cpu.h"
+
+void fpsimd_save_state(struct vcpu *vcpu);
+void fpsimd_restore_state(struct vcpu *vcpu);
+
+void fpsimd_update_trap(struct vcpu *vcpu);
+void fpsimd_take_over(struct vcpu *vcpu);
+void fpsimd_switch_out(struct vcpu *vcpu);
+void fpsimd_release(struct vcpu *vcpu);
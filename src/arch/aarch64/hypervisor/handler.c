@@ -19,6 +19,7 @@
 #include "hf/arch/barriers.h"
 #include "hf/arch/init.h"
 #include "hf/arch/mm.h"
+#include "hf/arch/std.h"
 
 #include "hf/api.h"
 #include "hf/check.h"
@@ -31,12 +32,15 @@
 #include "vmapi/hf/call.h"
 
 #include "debug_el1.h"
+#include "fpsimd.h"
 #include "msr.h"
+#include "vmid.h"
 #include "psci.h"
 #include "psci_handler.h"
 #include "smc.h"
 
 #define HCR_EL2_VI (1u << 7)
+#define HCR_EL2_TWI (1u << 13)
 
 /**
  * Gets the Exception Class from the ESR.
@@ -63,7 +67,8 @@ static struct vcpu *current(void)
 }
 
 /**
- * Saves the state of per-vCPU peripherals, such as the virtual timer, and
+ * Saves the state of per-vCPU peripherals, such as the virtual timer, and the
+ * floating point state of a secondary vCPU that may run elsewhere next, and
  * informs the arch-independent sections that registers have been saved.
  */
 void complete_saving_state(struct vcpu *vcpu)
@@ -71,6 +76,8 @@ void complete_saving_state(struct vcpu *vcpu)
 	vcpu_get_regs(vcpu)->peripherals.cntv_cval_el0 = read_msr(cntv_cval_el0);
 	vcpu_get_regs(vcpu)->peripherals.cntv_ctl_el0 = read_msr(cntv_ctl_el0);
 
+	fpsimd_switch_out(vcpu);
+
 	api_regs_state_saved(vcpu);
 
 	/*
@@ -93,7 +100,47 @@ void complete_saving_state(struct vcpu *vcpu)
 }
 
 /**
- * Restores the state of per-vCPU peripherals, such as the virtual timer.
+ * Whether WFI of the primary VM is trapped in the hcr_el2 of each CPU while the
+ * primary runs on it. Each element is only accessed by the CPU it belongs to.
+ */
+static bool primary_wfi_trapped[MAX_CPUS];
+
+/**
+ * Returns whether WFI of the primary VM should be trapped, which it is only
+ * while the hypervisor's pool of zeroed pages needs refilling or memory given
+ * lazily to VMs is still uncleared. That work is then done while the primary is
+ * idle, and WFI is otherwise not trapped at all.
+ */
+static bool primary_wfi_trap_wanted(void)
+{
+	return api_zeroed_pages_wanted() || api_uncleared_memory_pending();
+}
+
+/**
+ * Traps WFI of the primary VM, which is running on the current CPU, if it is
+ * wanted. hcr_el2 is only accessed if that changed since it was last set.
+ */
+static void update_primary_wfi_trap(struct vcpu *vcpu)
+{
+	size_t index = cpu_index(vcpu_get_cpu(vcpu));
+	bool trap = primary_wfi_trap_wanted();
+	uintreg_t hcr_el2;
+
+	if (trap == primary_wfi_trapped[index]) {
+		return;
+	}
+
+	hcr_el2 = read_msr(hcr_el2);
+	write_msr(hcr_el2,
+		  trap ? hcr_el2 | HCR_EL2_TWI : hcr_el2 & ~HCR_EL2_TWI);
+	primary_wfi_trapped[index] = trap;
+}
+
+/**
+ * Restores the state of per-vCPU peripherals, such as the virtual timer, traps
+ * floating point accesses unless the registers hold the vCPU's state, and sets
+ * the VMID of the vCPU in its vttbr_el2 before it is restored. WFI of the
+ * primary is trapped if there is work to do while it is idle.
  */
 void begin_restoring_state(struct vcpu *vcpu)
 {
@@ -112,65 +159,22 @@ void begin_restoring_state(struct vcpu *vcpu)
 	 * virtual timer is now running for the primary again.
 	 */
 	if (vm_get_id(vcpu_get_vm(vcpu)) == HF_PRIMARY_VM_ID) {
+		struct arch_regs *r = vcpu_get_regs(vcpu);
+		bool trap = primary_wfi_trap_wanted();
+
 		write_msr(cnthp_ctl_el2, 0);
 		write_msr(cnthp_cval_el2, 0);
-	}
-}
-
-/**
- * Invalidate all stage 1 TLB entries on the current (physical) CPU for the
- * current VMID.
- */
-static void invalidate_vm_tlb(void)
-{
-	/*
-	 * Ensure that the last VTTBR write has taken effect so we invalidate
-	 * the right set of TLB entries.
-	 */
-	isb();
-
-	__asm__ volatile("tlbi vmalle1");
-
-	/*
-	 * Ensure that no instructions are fetched for the VM until after the
-	 * TLB invalidation has taken effect.
-	 */
-	isb();
-
-	/*
-	 * Ensure that no data reads or writes for the VM happen until after the
-	 * TLB invalidation has taken effect. Non-sharable is enough because the
-	 * TLB is local to the CPU.
-	 */
-	dsb(nsh);
-}
-
-/**
- * Invalidates the TLB if a different vCPU is being run than the last vCPU of
- * the same VM which was run on the current pCPU.
- *
- * This is necessary because VMs may (contrary to the architecture
- * specification) use inconsistent ASIDs across vCPUs. c.f. KVM's similar
- * workaround:
- * https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/commit/?id=94d0e5980d6791b9
- */
-void maybe_invalidate_tlb(struct vcpu *vcpu)
-{
-	size_t current_cpu_index = cpu_index(vcpu_get_cpu(vcpu));
-	spci_vcpu_index_t new_vcpu_index = vcpu_index(vcpu);
-
-	if (vm_get_arch(vcpu_get_vm(vcpu))->last_vcpu_on_cpu[current_cpu_index] !=
-	    new_vcpu_index) {
-		/*
-		 * The vCPU has changed since the last time this VM was run on
-		 * this pCPU, so we need to invalidate the TLB.
-		 */
-		invalidate_vm_tlb();
 
-		/* Record the fact that this vCPU is now running on this CPU. */
-		vm_get_arch(vcpu_get_vm(vcpu))->last_vcpu_on_cpu[current_cpu_index] =
-			new_vcpu_index;
+		if (trap) {
+			r->lazy.hcr_el2 |= HCR_EL2_TWI;
+		} else {
+			r->lazy.hcr_el2 &= ~HCR_EL2_TWI;
+		}
+		primary_wfi_trapped[cpu_index(vcpu_get_cpu(vcpu))] = trap;
 	}
+
+	fpsimd_update_trap(vcpu);
+	vmid_update(vcpu);
 }
 
 noreturn void irq_current_exception(uintreg_t elr, uintreg_t spsr)
@@ -202,6 +206,7 @@ noreturn void sync_current_exception(uintreg_t elr, uintreg_t spsr)
 	uintreg_t esr = read_msr(esr_el2);
 	uintreg_t ec = GET_EC(esr);
 
+	(void)elr; /* Only used for logging. */
 	(void)spsr;
 
 	switch (ec) {
@@ -359,13 +364,192 @@ static bool smc_handler(struct vcpu *vcpu, smc_res_t *ret, struct vcpu **next)
 	return smc_forwarder(vcpu, ret);
 }
 
+/**
+ * Handles a Hafnium hypercall, given its arguments. Returns the value for x0,
+ * and sets `next` to the vCPU to switch to if there is one.
+ */
+typedef uintreg_t (*hf_hvc_fn)(uintreg_t arg1, uintreg_t arg2, uintreg_t arg3,
+			       struct vcpu **next);
+
+static uintreg_t hvc_vm_get_id(uintreg_t arg1, uintreg_t arg2, uintreg_t arg3,
+			       struct vcpu **next)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_vm_get_id(current());
+}
+
+static uintreg_t hvc_vm_get_count(uintreg_t arg1, uintreg_t arg2,
+				  uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_vm_get_count();
+}
+
+static uintreg_t hvc_vcpu_get_count(uintreg_t arg1, uintreg_t arg2,
+				    uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_vcpu_get_count(arg1, current());
+}
+
+static uintreg_t hvc_vcpu_run(uintreg_t arg1, uintreg_t arg2, uintreg_t arg3,
+			      struct vcpu **next)
+{
+	(void)arg3;
+
+	return api_vcpu_run(arg1, arg2, current(), next);
+}
+
+static uintreg_t hvc_vm_configure(uintreg_t arg1, uintreg_t arg2,
+				  uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg3;
+
+	return api_vm_configure(ipa_init(arg1), ipa_init(arg2), current(),
+				next);
+}
+
+static uintreg_t hvc_mailbox_clear(uintreg_t arg1, uintreg_t arg2,
+				   uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+
+	return api_mailbox_clear(current(), next);
+}
+
+static uintreg_t hvc_mailbox_writable_get(uintreg_t arg1, uintreg_t arg2,
+					  uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_mailbox_writable_get(current());
+}
+
+static uintreg_t hvc_mailbox_waiter_get(uintreg_t arg1, uintreg_t arg2,
+					uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_mailbox_waiter_get(arg1, current());
+}
+
+static uintreg_t hvc_interrupt_enable(uintreg_t arg1, uintreg_t arg2,
+				      uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg3;
+	(void)next;
+
+	return api_interrupt_enable(arg1, arg2, current());
+}
+
+static uintreg_t hvc_interrupt_get(uintreg_t arg1, uintreg_t arg2,
+				   uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_interrupt_get(current());
+}
+
+static uintreg_t hvc_interrupt_inject(uintreg_t arg1, uintreg_t arg2,
+				      uintreg_t arg3, struct vcpu **next)
+{
+	return api_interrupt_inject(arg1, arg2, arg3, current(), next);
+}
+
+static uintreg_t hvc_share_memory(uintreg_t arg1, uintreg_t arg2,
+				  uintreg_t arg3, struct vcpu **next)
+{
+	(void)next;
+
+	return api_share_memory(arg1 >> 32, ipa_init(arg2), arg3,
+				arg1 & 0xffffffff, current());
+}
+
+static uintreg_t hvc_memory_owner_get(uintreg_t arg1, uintreg_t arg2,
+				      uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_memory_owner_get(ipa_init(arg1), current());
+}
+
+static uintreg_t hvc_vcpu_handoff_get(uintreg_t arg1, uintreg_t arg2,
+				      uintreg_t arg3, struct vcpu **next)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)next;
+
+	return api_vcpu_handoff_get(current());
+}
+
+/**
+ * Handlers of the Hafnium hypercalls, indexed by their function ID less
+ * HF_VM_GET_ID. The IDs are contiguous so that a call is found with a single
+ * bounds check and load, before the PSCI and SPCI calls are considered. Calls
+ * which only read state are also served by the fast path in exceptions.S,
+ * without reaching here.
+ */
+static const hf_hvc_fn hf_hvc_table[] = {
+	[HF_VM_GET_ID - HF_VM_GET_ID] = hvc_vm_get_id,
+	[HF_VM_GET_COUNT - HF_VM_GET_ID] = hvc_vm_get_count,
+	[HF_VCPU_GET_COUNT - HF_VM_GET_ID] = hvc_vcpu_get_count,
+	[HF_VCPU_RUN - HF_VM_GET_ID] = hvc_vcpu_run,
+	[HF_VM_CONFIGURE - HF_VM_GET_ID] = hvc_vm_configure,
+	[HF_MAILBOX_CLEAR - HF_VM_GET_ID] = hvc_mailbox_clear,
+	[HF_MAILBOX_WRITABLE_GET - HF_VM_GET_ID] = hvc_mailbox_writable_get,
+	[HF_MAILBOX_WAITER_GET - HF_VM_GET_ID] = hvc_mailbox_waiter_get,
+	[HF_INTERRUPT_ENABLE - HF_VM_GET_ID] = hvc_interrupt_enable,
+	[HF_INTERRUPT_GET - HF_VM_GET_ID] = hvc_interrupt_get,
+	[HF_INTERRUPT_INJECT - HF_VM_GET_ID] = hvc_interrupt_inject,
+	[HF_SHARE_MEMORY - HF_VM_GET_ID] = hvc_share_memory,
+	[HF_MEMORY_OWNER_GET - HF_VM_GET_ID] = hvc_memory_owner_get,
+	[HF_VCPU_HANDOFF_GET - HF_VM_GET_ID] = hvc_vcpu_handoff_get,
+};
+
 struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 				      uintreg_t arg2, uintreg_t arg3)
 {
 	struct hvc_handler_return ret;
+	uint32_t index = (uint32_t)arg0 - HF_VM_GET_ID;
 
 	ret.new = NULL;
 
+	if (vm_get_id(vcpu_get_vm(current())) == HF_PRIMARY_VM_ID) {
+		update_primary_wfi_trap(current());
+	}
+
+	if (index < ARRAY_SIZE(hf_hvc_table) && hf_hvc_table[index] != NULL) {
+		ret.user_ret.res0 =
+			hf_hvc_table[index](arg1, arg2, arg3, &ret.new);
+		update_vi(ret.new);
+		return ret;
+	}
+
 	if (psci_handler(current(), arg0, arg1, arg2, arg3, &ret.user_ret.res0,
 			 &ret.new)) {
 		return ret;
@@ -378,58 +562,6 @@ struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 	}
 
 	switch ((uint32_t)arg0) {
-	case HF_VM_GET_ID:
-		ret.user_ret.res0 = api_vm_get_id(current());
-		break;
-
-	case HF_VM_GET_COUNT:
-		ret.user_ret.res0 = api_vm_get_count();
-		break;
-
-	case HF_VCPU_GET_COUNT:
-		ret.user_ret.res0 = api_vcpu_get_count(arg1, current());
-		break;
-
-	case HF_VCPU_RUN:
-		ret.user_ret.res0 = api_vcpu_run(arg1, arg2, current(), &ret.new);
-		break;
-
-	case HF_VM_CONFIGURE:
-		ret.user_ret.res0 = api_vm_configure(
-			ipa_init(arg1), ipa_init(arg2), current(), &ret.new);
-		break;
-
-	case HF_MAILBOX_CLEAR:
-		ret.user_ret.res0 = api_mailbox_clear(current(), &ret.new);
-		break;
-
-	case HF_MAILBOX_WRITABLE_GET:
-		ret.user_ret.res0 = api_mailbox_writable_get(current());
-		break;
-
-	case HF_MAILBOX_WAITER_GET:
-		ret.user_ret.res0 = api_mailbox_waiter_get(arg1, current());
-		break;
-
-	case HF_INTERRUPT_ENABLE:
-		ret.user_ret.res0 = api_interrupt_enable(arg1, arg2, current());
-		break;
-
-	case HF_INTERRUPT_GET:
-		ret.user_ret.res0 = api_interrupt_get(current());
-		break;
-
-	case HF_INTERRUPT_INJECT:
-		ret.user_ret.res0 = api_interrupt_inject(arg1, arg2, arg3,
-							 current(), &ret.new);
-		break;
-
-	case HF_SHARE_MEMORY:
-		ret.user_ret.res0 =
-			api_share_memory(arg1 >> 32, ipa_init(arg2), arg3,
-					 arg1 & 0xffffffff, current());
-		break;
-
 	case HF_DEBUG_LOG:
 		ret.user_ret.res0 = api_debug_log(arg1, current());
 		break;
@@ -521,8 +653,22 @@ struct vcpu *sync_lower_exception(uintreg_t esr)
 			return new_vcpu;
 		}
 		/* WFI */
+		if (vm_get_id(vcpu_get_vm(vcpu)) == HF_PRIMARY_VM_ID) {
+			/*
+			 * The primary is idle. WFI may complete early, so
+			 * return to it once some pages were zeroed or cleared.
+			 */
+			api_refill_zeroed_pages();
+			api_clear_uncleared_memory();
+			update_primary_wfi_trap(vcpu);
+			return NULL;
+		}
 		return api_wait_for_interrupt(vcpu);
 
+	case 0x07: /* EC = 000111, SIMD or floating point access. */
+		fpsimd_take_over(vcpu);
+		return NULL;
+
 	case 0x24: /* EC = 100100, Data abort. */
 		info = fault_info_init(
 			esr, vcpu, (esr & (1u << 6)) ? MM_MODE_W : MM_MODE_R);
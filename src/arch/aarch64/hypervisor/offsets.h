@@ -19,9 +19,11 @@
 /* These are checked in offset.c. */
 #define CPU_ID 0
 #define CPU_STACK_BOTTOM 8
+#define VCPU_VM 0
 #define VCPU_REGS 32
 #define VCPU_LAZY (VCPU_REGS + 264)
 #define VCPU_FREGS (VCPU_LAZY + 248)
+#define VM_ID 0
 
 #if GIC_VERSION == 3 || GIC_VERSION == 4
 #define VCPU_GIC (VCPU_FREGS + 528)
@@ -27,6 +27,7 @@
 #include "hf/spci.h"
 #include "hf/vm.h"
 
+#include "fpsimd.h"
 #include "psci.h"
 #include "smc.h"
 
@@ -169,6 +170,7 @@ bool psci_primary_vm_handler(struct vcpu *vcpu, uint32_t func, uintreg_t arg0,
 		 * vcpu registers will be ignored.
 		 */
 		arch_regs_set_pc_arg(vcpu_get_regs(vcpu), ipa_init(arg1), arg2);
+		fpsimd_release(vcpu);
 		smc_res = smc64(PSCI_CPU_SUSPEND, arg0, (uintreg_t)&cpu_entry,
 				(uintreg_t)vcpu_get_cpu(vcpu), 0, 0, 0,
 				SMCCC_CALLER_HYPERVISOR);
@@ -177,6 +179,7 @@ bool psci_primary_vm_handler(struct vcpu *vcpu, uint32_t func, uintreg_t arg0,
 	}
 
 	case PSCI_CPU_OFF:
+		fpsimd_release(vcpu);
 		cpu_off(vcpu_get_cpu(vcpu));
 		smc32(PSCI_CPU_OFF, 0, 0, 0, 0, 0, 0, SMCCC_CALLER_HYPERVISOR);
 		panic("CPU off failed");
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vmid.h"
+
+#include <stdatomic.h>
+
+#include "hf/arch/barriers.h"
+
+#include "hf/spinlock.h"
+#include "hf/std.h"
+#include "hf/vm.h"
+
+#include "msr.h"
+
+/*
+ * Each vCPU is given its own VMID, so the stage-1 TLB entries of vCPUs of a VM
+ * which use inconsistent ASIDs never alias, and a CPU doesn't need to
+ * invalidate its TLB when it switches between vCPUs of the same VM. The VMIDs
+ * are recorded in the VM's struct arch_vm, so that stage-2 invalidations can
+ * cover all of them, see arch_mm_invalidate_stage2_ranges().
+ *
+ * VMIDs are allocated in generations, like ASIDs in Linux. A vCPU keeps its
+ * VMID for as long as the generation it was allocated in lasts. When all VMIDs
+ * have been allocated, a new generation starts in which the vCPUs running at
+ * that point keep their VMIDs and all others are free again, and each CPU
+ * invalidates its TLB before it next runs a vCPU. So TLBs are only invalidated
+ * on rollover, and any number of VMs can have live TLB entries at a time.
+ */
+
+/**
+ * The largest number of bits of a VMID, which is also the position of the
+ * generation in the bits above it.
+ */
+#define VMID_MAX_BITS 16
+#define VMID_MASK ((UINT64_C(1) << VMID_MAX_BITS) - 1)
+#define VMID_GENERATION_STEP (UINT64_C(1) << VMID_MAX_BITS)
+
+/** Enables 16-bit VMIDs, if set by arch_mm_init(). */
+#define VTCR_EL2_VS (UINT64_C(1) << 19)
+
+#define VTTBR_EL2_VMID_SHIFT 48
+
+/** Protects the allocation of VMIDs and the start of new generations. */
+static struct spinlock vmid_lock = SPINLOCK_INIT;
+
+/** The current generation, in the bits above the VMID. */
+static _Atomic uint64_t vmid_generation = VMID_GENERATION_STEP;
+
+/** The VMIDs allocated in the current generation. */
+static uint64_t vmid_map[(UINT64_C(1) << VMID_MAX_BITS) / 64];
+
+/** Where to look for the next free VMID from. */
+static uint64_t vmid_next = 1;
+
+/**
+ * The generation and VMID the last vCPU run on each CPU is using, or 0 if a new
+ * generation started since. Only reset by the CPU starting a new generation and
+ * otherwise only written by the CPU it belongs to.
+ */
+static _Atomic uint64_t vmid_active[MAX_CPUS];
+
+/**
+ * The generation and VMID each CPU was using when the current generation
+ * started, which the vCPU using it keeps.
+ */
+static uint64_t vmid_reserved[MAX_CPUS];
+
+/** Whether each CPU has yet to invalidate its TLB for this generation. */
+static bool vmid_flush_pending[MAX_CPUS];
+
+/**
+ * Returns the number of VMIDs supported.
+ */
+static uint64_t vmid_count(void)
+{
+	return (read_msr(vtcr_el2) & VTCR_EL2_VS) ? UINT64_C(1) << 16
+						   : UINT64_C(1) << 8;
+}
+
+/**
+ * Returns whether the generation and VMID are of the current generation.
+ */
+static bool vmid_is_current(uint64_t vmid)
+{
+	uint64_t generation =
+		atomic_load_explicit(&vmid_generation, memory_order_relaxed);
+
+	return ((vmid ^ generation) >> VMID_MAX_BITS) == 0;
+}
+
+/**
+ * Marks the VMID as allocated, returning whether it already was.
+ */
+static bool vmid_test_and_set(uint64_t index)
+{
+	uint64_t bit = UINT64_C(1) << (index % 64);
+	bool was_set = (vmid_map[index / 64] & bit) != 0;
+
+	vmid_map[index / 64] |= bit;
+	return was_set;
+}
+
+/**
+ * Returns the first VMID from the given one which isn't allocated, or `count`
+ * if they all are.
+ */
+static uint64_t vmid_find_free(uint64_t from, uint64_t count)
+{
+	uint64_t index;
+
+	for (index = from; index < count; index++) {
+		if (!(vmid_map[index / 64] & (UINT64_C(1) << (index % 64)))) {
+			break;
+		}
+	}
+
+	return index;
+}
+
+/**
+ * Starts a new generation, keeping the VMIDs the CPUs are using. Returns the
+ * new generation.
+ */
+static uint64_t vmid_rollover(void)
+{
+	uint64_t generation =
+		atomic_fetch_add_explicit(&vmid_generation,
+					  VMID_GENERATION_STEP,
+					  memory_order_relaxed) +
+		VMID_GENERATION_STEP;
+	size_t i;
+
+	memset_s(vmid_map, sizeof(vmid_map), 0, sizeof(vmid_map));
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		uint64_t vmid = atomic_exchange_explicit(
+			&vmid_active[i], 0, memory_order_relaxed);
+
+		/*
+		 * If the CPU started running a vCPU since the last rollover
+		 * without a new VMID, it is still using the one it had then.
+		 */
+		if (vmid == 0) {
+			vmid = vmid_reserved[i];
+		}
+
+		vmid_test_and_set(vmid & VMID_MASK);
+		vmid_reserved[i] = vmid;
+		vmid_flush_pending[i] = true;
+	}
+
+	/* VMID 0 is never allocated. */
+	vmid_next = 1;
+
+	return generation;
+}
+
+/**
+ * Allocates a VMID of the current generation for a vCPU whose VMID is of an
+ * older one, keeping the same VMID if possible.
+ */
+static uint64_t vmid_new(uint64_t vmid)
+{
+	uint64_t generation =
+		atomic_load_explicit(&vmid_generation, memory_order_relaxed);
+	uint64_t count = vmid_count();
+	uint64_t index = vmid & VMID_MASK;
+	bool reserved = false;
+	size_t i;
+
+	if (vmid != 0 && index < count) {
+		/*
+		 * Keep the VMID if the vCPU was running when the generation
+		 * started, as its TLB entries may be live. Several CPUs may
+		 * have run it last, if it moved between them.
+		 */
+		for (i = 0; i < MAX_CPUS; i++) {
+			if (vmid_reserved[i] == vmid) {
+				vmid_reserved[i] = generation | index;
+				reserved = true;
+			}
+		}
+
+		/* Otherwise keep it if no other vCPU has taken it yet. */
+		if (reserved || !vmid_test_and_set(index)) {
+			return generation | index;
+		}
+	}
+
+	index = vmid_find_free(vmid_next, count);
+	if (index == count) {
+		generation = vmid_rollover();
+		index = vmid_find_free(1, count);
+	}
+
+	vmid_test_and_set(index);
+	vmid_next = index;
+
+	return generation | index;
+}
+
+/**
+ * Sets the VMID in the vttbr_el2 of the vCPU.
+ */
+static void vmid_set_vttbr(struct arch_regs *regs, uint64_t vmid)
+{
+	regs->lazy.vttbr_el2 =
+		(regs->lazy.vttbr_el2 & ~(VMID_MASK << VTTBR_EL2_VMID_SHIFT)) |
+		((vmid & VMID_MASK) << VTTBR_EL2_VMID_SHIFT);
+}
+
+/**
+ * Makes sure the vCPU about to be run has a VMID of the current generation and
+ * sets it in the vttbr_el2 of the vCPU, and invalidates the TLB of the CPU if
+ * it has yet to do so for the current generation.
+ */
+void vmid_update(struct vcpu *vcpu)
+{
+	struct arch_regs *regs = vcpu_get_regs(vcpu);
+	_Atomic uint64_t *vcpu_vmid =
+		&vm_get_arch(vcpu_get_vm(vcpu))->vmid[vcpu_index(vcpu)];
+	size_t index = cpu_index(vcpu_get_cpu(vcpu));
+	uint64_t vmid = atomic_load_explicit(vcpu_vmid, memory_order_relaxed);
+	uint64_t active =
+		atomic_load_explicit(&vmid_active[index], memory_order_relaxed);
+
+	/*
+	 * The lock can be skipped if the VMID is of the current generation and
+	 * no rollover has reset the active VMID of the CPU since, as the CPU
+	 * would then have to invalidate its TLB first. The exchange fails if a
+	 * concurrent rollover resets it, so the rollover either sees the new
+	 * active VMID or the CPU takes the lock.
+	 */
+	if (active != 0 && vmid_is_current(vmid) &&
+	    atomic_compare_exchange_strong_explicit(
+		    &vmid_active[index], &active, vmid, memory_order_relaxed,
+		    memory_order_relaxed)) {
+		vmid_set_vttbr(regs, vmid);
+		return;
+	}
+
+	sl_lock(&vmid_lock);
+
+	if (!vmid_is_current(vmid)) {
+		vmid = vmid_new(vmid);
+		atomic_store_explicit(vcpu_vmid, vmid, memory_order_relaxed);
+
+		/*
+		 * Make sure stage-2 invalidations by other CPUs either see the
+		 * new VMID, or update the tables before the vCPU walks them.
+		 * They read the VMIDs after a barrier too.
+		 */
+		dsb(ish);
+	}
+
+	if (vmid_flush_pending[index]) {
+		/* Invalidate the entries of all VMIDs on this CPU. */
+		__asm__ volatile("tlbi alle1");
+		dsb(nsh);
+		isb();
+		vmid_flush_pending[index] = false;
+	}
+
+	atomic_store_explicit(&vmid_active[index], vmid, memory_order_relaxed);
+
+	sl_unlock(&vmid_lock);
+
+	vmid_set_vttbr(regs, vmid);
+}
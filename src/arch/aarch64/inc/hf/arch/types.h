@@ -17,13 +17,20 @@
 #pragma once
 
 #include <stdalign.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include "hf/spci.h"
 #include "hf/static_assert.h"
 
+/*
+ * The translation granule is chosen by the build, as 12, 14 or 16 page bits for
+ * the 4KB, 16KB or 64KB granule, and must match the one of libhfo2.
+ */
+#ifndef PAGE_BITS
 #define PAGE_BITS 12
-#define PAGE_LEVEL_BITS 9
+#endif
+#define PAGE_LEVEL_BITS (PAGE_BITS - 3)
 #define STACK_ALIGN 16
 #define FLOAT_REG_BYTES 16
 #define NUM_GP_REGS 31
@@ -59,12 +66,11 @@ static_assert(sizeof(struct float_reg) == FLOAT_REG_BYTES,
 /** Arch-specifc information about a VM. */
 struct arch_vm {
 	/**
-	 * The index of the last vCPU of this VM which ran on each pCPU. Each
-	 * element of this array should only be read or written by code running
-	 * on that CPU, which avoids contention and so no lock is needed to
-	 * access this field.
+	 * The generation and VMID allocated to each vCPU of the VM, by vCPU
+	 * index, with the VMID in the low 16 bits. See
+	 * src/arch/aarch64/hypervisor/vmid.c.
 	 */
-	spci_vcpu_index_t last_vcpu_on_cpu[MAX_CPUS];
+	_Atomic uint64_t vmid[MAX_CPUS];
 };
 
 /** Type to represent the register state of a vCPU.  */
@@ -20,6 +20,7 @@
 #include "hf/arch/cpu.h"
 
 #include "hf/dlog.h"
+#include "hf/std.h"
 
 #include "msr.h"
 
@@ -30,9 +31,11 @@
 #define OUTER_SHAREABLE UINT64_C(2)
 #define INNER_SHAREABLE UINT64_C(3)
 
+/*
+ * Page table entries are encoded in hfo2/src/arch/aarch64/mm.rs. Keep the bits
+ * shared with it the same.
+ */
 #define PTE_VALID        (UINT64_C(1) << 0)
-#define PTE_LEVEL0_BLOCK (UINT64_C(1) << 1)
-#define PTE_TABLE        (UINT64_C(1) << 1)
 
 #define STAGE1_XN          (UINT64_C(1) << 54)
 #define STAGE1_PXN         (UINT64_C(1) << 53)
@@ -67,16 +70,10 @@
 #define STAGE2_EXECUTE_EL1  UINT64_C(3)
 #define STAGE2_EXECUTE_MASK UINT64_C(3)
 
-/* Table attributes only apply to stage 1 translations. */
-#define TABLE_NSTABLE  (UINT64_C(1) << 63)
-#define TABLE_APTABLE1 (UINT64_C(1) << 62)
-#define TABLE_APTABLE0 (UINT64_C(1) << 61)
-#define TABLE_XNTABLE  (UINT64_C(1) << 60)
-#define TABLE_PXNTABLE (UINT64_C(1) << 59)
-
 /* The following are stage-2 software defined attributes. */
 #define STAGE2_SW_OWNED     (UINT64_C(1) << 55)
 #define STAGE2_SW_EXCLUSIVE (UINT64_C(1) << 56)
+#define STAGE2_SW_UNCLEARED (UINT64_C(1) << 57)
 
 /* The following are stage-2 memory attributes for normal memory. */
 #define STAGE2_NONCACHEABLE UINT64_C(1)
@@ -90,6 +87,9 @@
 
 #define CACHE_WORD_SIZE 4
 
+/* DC ZVA is prohibited if set. */
+#define DCZID_EL0_DZP (UINT64_C(1) << 4)
+
 /**
  * Threshold number of pages in TLB to invalidate after which we invalidate all
  * TLB entries on a given level.
@@ -97,6 +97,47 @@
  */
 #define MAX_TLBI_OPS  MM_PTE_PER_PAGE
 
+/**
+ * Number of pages from which a range invalidation can't be split into at most
+ * one operation per scale, so all TLB entries are invalidated instead.
+ */
+#define MAX_TLBI_RANGE_PAGES (UINT64_C(1) << 21)
+
+/*
+ * The ARMv8.4 range invalidation instructions are encoded as `sys` so they can
+ * be assembled without targeting ARMv8.4.
+ */
+#define TLBI_RVAE1IS    "sys #0, c8, c2, #1"
+#define TLBI_RVAE2IS    "sys #4, c8, c2, #1"
+#define TLBI_RIPAS2E1IS "sys #4, c8, c0, #2"
+
+/* The VMID in vttbr_el2, which is the low bits of those in struct arch_vm. */
+#define VTTBR_EL2_VMID_SHIFT 48
+#define VTTBR_EL2_VMID_MASK  UINT64_C(0xffff)
+
+/*
+ * The encodings of the translation granule in TCR_EL2.TG0 and VTCR_EL2.TG0, and
+ * in the TG field of range TLB invalidations. Stage 1 has 3 levels, or 2 with
+ * the 64KB granule, for an address space of 39, 47 or 42 bits.
+ */
+#if PAGE_BITS == 12
+#define TCR_TG0         UINT64_C(0)
+#define TLBI_RANGE_TG   UINT64_C(1)
+#define STAGE1_MAX_LEVEL 2
+#elif PAGE_BITS == 14
+#define TCR_TG0         UINT64_C(2)
+#define TLBI_RANGE_TG   UINT64_C(2)
+#define STAGE1_MAX_LEVEL 2
+#elif PAGE_BITS == 16
+#define TCR_TG0         UINT64_C(1)
+#define TLBI_RANGE_TG   UINT64_C(3)
+#define STAGE1_MAX_LEVEL 1
+#else
+#error "Unsupported translation granule."
+#endif
+
+#define STAGE1_ADDR_BITS (PAGE_BITS + (STAGE1_MAX_LEVEL + 1) * PAGE_LEVEL_BITS)
+
 /* clang-format on */
 
 #define tlbi(op)                               \
@@ -107,14 +148,12 @@
 	do {                                                           \
 		__asm__ __volatile__("tlbi " #op ", %0" : : "r"(reg)); \
 	} while (0)
+#define tlbi_sys_reg(insn, reg)                               \
+	do {                                                  \
+		__asm__ __volatile__(insn ", %0" : : "r"(reg)); \
+	} while (0)
 
-/** Mask for the address bits of the pte. */
-#define PTE_ADDR_MASK \
-	(((UINT64_C(1) << 48) - 1) & ~((UINT64_C(1) << PAGE_BITS) - 1))
-
-/** Mask for the attribute bits of the pte. */
-#define PTE_ATTR_MASK (~(PTE_ADDR_MASK | (UINT64_C(1) << 1)))
-
+static bool mm_tlbi_range;
 static uint8_t mm_s2_max_level;
 static uint8_t mm_s2_root_table_count;
 
@@ -124,234 +163,343 @@ static uintreg_t mm_tcr_el2;
 static uintreg_t mm_sctlr_el2;
 
 /**
- * Returns the encoding of a page table entry that isn't present.
+ * Returns the number of pages in the given range, rounded up to an even number
+ * as that is the granularity of range invalidations.
  */
-pte_t arch_mm_absent_pte(uint8_t level)
+static uint64_t tlbi_range_pages(uint64_t begin, uint64_t end)
 {
-	(void)level;
-	return 0;
+	return (((end - begin) >> PAGE_BITS) + 1) & ~UINT64_C(1);
 }
 
 /**
- * Converts a physical address to a table PTE.
- *
- * The spec says that 'Table descriptors for stage 2 translations do not
- * include any attribute field', so we don't take any attributes as arguments.
+ * Invalidates TLB entries of the given number of pages from the given address
+ * with ARMv8.4 range operations, which each cover (NUM + 1) << (5 * SCALE + 1)
+ * pages. The even number of pages is split into 5-bit digits, one operation
+ * per non-zero digit, so it must be less than MAX_TLBI_RANGE_PAGES.
  */
-pte_t arch_mm_table_pte(uint8_t level, paddr_t pa)
+static void tlbi_range(uint64_t begin, uint64_t pages, bool stage2)
 {
-	/* This is the same for all levels on aarch64. */
-	(void)level;
-	return pa_addr(pa) | PTE_TABLE | PTE_VALID;
+	uint64_t scale;
+
+	for (scale = 0; pages != 0; scale++) {
+		uint64_t shift = 5 * scale + 1;
+		uint64_t num = (pages >> shift) & 0x1f;
+		uint64_t base =
+			(begin >> PAGE_BITS) & ((UINT64_C(1) << 37) - 1);
+		uintreg_t arg;
+
+		if (num == 0) {
+			continue;
+		}
+
+		arg = (TLBI_RANGE_TG << 46) | /* TG, granule size. */
+		      (scale << 44) |	      /* SCALE. */
+		      ((num - 1) << 39) |     /* NUM. */
+		      base;		      /* BaseADDR. */
+
+		if (stage2) {
+			tlbi_sys_reg(TLBI_RIPAS2E1IS, arg);
+		} else if (VM_TOOLCHAIN == 1) {
+			tlbi_sys_reg(TLBI_RVAE1IS, arg);
+		} else {
+			tlbi_sys_reg(TLBI_RVAE2IS, arg);
+		}
+
+		begin += num << (shift + PAGE_BITS);
+		pages -= num << shift;
+	}
 }
 
 /**
- * Converts a physical address to a block PTE.
- *
- * The level must allow block entries.
+ * Issues the TLB invalidations of stage-1 entries referring to the given
+ * virtual address range, without any barrier.
  */
-pte_t arch_mm_block_pte(uint8_t level, paddr_t pa, uint64_t attrs)
+static void tlbi_stage1(uintvaddr_t begin, uintvaddr_t end)
 {
-	pte_t pte = pa_addr(pa) | attrs;
+	uint64_t pages = tlbi_range_pages(begin, end);
+	uintvaddr_t it;
 
-	if (level == 0) {
-		/* A level 0 'block' is actually a page entry. */
-		pte |= PTE_LEVEL0_BLOCK;
+	/*
+	 * Revisions prior to ARMv8.4 do not support invalidating a range of
+	 * addresses, which means we have to loop over individual pages. If
+	 * there are too many, it is quicker to invalidate all TLB entries.
+	 */
+	if (mm_tlbi_range && pages < MAX_TLBI_RANGE_PAGES) {
+		tlbi_range(begin, pages, false);
+	} else if ((end - begin) > (MAX_TLBI_OPS * PAGE_SIZE)) {
+		if (VM_TOOLCHAIN == 1) {
+			tlbi(vmalle1is);
+		} else {
+			tlbi(alle2is);
+		}
+	} else {
+		begin >>= 12;
+		end >>= 12;
+		/* Invalidate stage-1 TLB, one page from the range at a time. */
+		for (it = begin; it < end;
+		     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
+			if (VM_TOOLCHAIN == 1) {
+				tlbi_reg(vae1is, it);
+			} else {
+				tlbi_reg(vae2is, it);
+			}
+		}
 	}
-	return pte;
 }
 
 /**
- * Specifies whether block mappings are acceptable at the given level.
+ * Issues the TLB invalidations of stage-2 entries referring to the given
+ * intermediate physical address range, without any barrier.
  *
- * Level 0 must allow block entries.
+ * Returns true if all stage-1 and stage-2 entries of the current VMID were
+ * invalidated instead.
  */
-bool arch_mm_is_block_allowed(uint8_t level)
+static bool tlbi_stage2(uintpaddr_t begin, uintpaddr_t end)
 {
-	return level <= 2;
-}
+	uint64_t pages = tlbi_range_pages(begin, end);
+	bool range = mm_tlbi_range && pages < MAX_TLBI_RANGE_PAGES;
+	uintpaddr_t it;
 
-/**
- * Determines if the given pte is present, i.e., if it is valid or it is invalid
- * but still holds state about the memory so needs to be present in the table.
- */
-bool arch_mm_pte_is_present(pte_t pte, uint8_t level)
-{
-	return arch_mm_pte_is_valid(pte, level) || (pte & STAGE2_SW_OWNED) != 0;
-}
+	/*
+	 * Revisions prior to ARMv8.4 do not support invalidating a range of
+	 * addresses, which means we have to loop over individual pages. If
+	 * there are too many, it is quicker to invalidate all TLB entries.
+	 */
+	if (!range && (end - begin) > (MAX_TLBI_OPS * PAGE_SIZE)) {
+		/*
+		 * Invalidate all stage-1 and stage-2 entries of the TLB for
+		 * the current VMID.
+		 */
+		tlbi(vmalls12e1is);
+		return true;
+	}
 
-/**
- * Determines if the given pte is valid, i.e., if it points to another table,
- * to a page, or a block of pages that can be accessed.
- */
-bool arch_mm_pte_is_valid(pte_t pte, uint8_t level)
-{
-	(void)level;
-	return (pte & PTE_VALID) != 0;
-}
+	/*
+	 * Invalidate stage-2 TLB, with range operations or one page from the
+	 * range at a time. Note that this has no effect if the CPU has a TLB
+	 * with combined stage-1/stage-2 translation.
+	 */
+	if (range) {
+		tlbi_range(begin, pages, true);
+	} else {
+		begin >>= 12;
+		end >>= 12;
 
-/**
- * Determines if the given pte references a block of pages.
- */
-bool arch_mm_pte_is_block(pte_t pte, uint8_t level)
-{
-	/* We count pages at level 0 as blocks. */
-	return arch_mm_is_block_allowed(level) &&
-	       (level == 0 ? (pte & PTE_LEVEL0_BLOCK) != 0
-			   : arch_mm_pte_is_present(pte, level) &&
-				     !arch_mm_pte_is_table(pte, level));
+		for (it = begin; it < end;
+		     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
+			tlbi_reg(ipas2e1is, it);
+		}
+	}
+
+	return false;
 }
 
 /**
- * Determines if the given pte references another table.
+ * Invalidates stage-1 TLB entries referring to the given virtual address range.
  */
-bool arch_mm_pte_is_table(pte_t pte, uint8_t level)
+void arch_mm_invalidate_stage1_range(vaddr_t va_begin, vaddr_t va_end)
 {
-	return level != 0 && arch_mm_pte_is_valid(pte, level) &&
-	       (pte & PTE_TABLE) != 0;
-}
+	struct arch_mm_tlb_range range = {
+		.begin = va_addr(va_begin),
+		.end = va_addr(va_end),
+	};
 
-static uint64_t pte_addr(pte_t pte)
-{
-	return pte & PTE_ADDR_MASK;
+	arch_mm_invalidate_stage1_ranges(&range, 1);
 }
 
 /**
- * Clears the given physical address, i.e., clears the bits of the address that
- * are not used in the pte.
+ * Invalidates stage-1 TLB entries referring to the given virtual address
+ * ranges, waiting for the completion of all of them at once.
  */
-paddr_t arch_mm_clear_pa(paddr_t pa)
+void arch_mm_invalidate_stage1_ranges(const struct arch_mm_tlb_range *ranges,
+				      size_t count)
 {
-	return pa_init(pte_addr(pa_addr(pa)));
-}
+	size_t i;
 
-/**
- * Extracts the physical address of the block referred to by the given page
- * table entry.
- */
-paddr_t arch_mm_block_from_pte(pte_t pte, uint8_t level)
-{
-	(void)level;
-	return pa_init(pte_addr(pte));
-}
+	/* Sync with page table updates. */
+	dsb(ishst);
 
-/**
- * Extracts the physical address of the page table referred to by the given page
- * table entry.
- */
-paddr_t arch_mm_table_from_pte(pte_t pte, uint8_t level)
-{
-	(void)level;
-	return pa_init(pte_addr(pte));
-}
+	for (i = 0; i < count; ++i) {
+		tlbi_stage1(ranges[i].begin, ranges[i].end);
+	}
 
-/**
- * Extracts the architecture specific attributes applies to the given page table
- * entry.
- */
-uint64_t arch_mm_pte_attrs(pte_t pte, uint8_t level)
-{
-	(void)level;
-	return pte & PTE_ATTR_MASK;
+	/* Sync data accesses with TLB invalidation completion. */
+	dsb(ish);
+
+	/* Sync instruction fetches with TLB invalidation completion. */
+	isb();
 }
 
 /**
- * Invalidates stage-1 TLB entries referring to the given virtual address range.
+ * Invalidates stage-1 TLB entries referring to the given virtual address range
+ * on the current CPU only, without broadcasting the invalidation to the inner
+ * shareable domain.
  */
-void arch_mm_invalidate_stage1_range(vaddr_t va_begin, vaddr_t va_end)
+void arch_mm_invalidate_stage1_range_local(vaddr_t va_begin, vaddr_t va_end)
 {
 	uintvaddr_t begin = va_addr(va_begin);
 	uintvaddr_t end = va_addr(va_end);
 	uintvaddr_t it;
 
 	/* Sync with page table updates. */
-	dsb(ishst);
+	dsb(nshst);
 
-	/*
-	 * Revisions prior to ARMv8.4 do not support invalidating a range of
-	 * addresses, which means we have to loop over individual pages. If
-	 * there are too many, it is quicker to invalidate all TLB entries.
-	 */
 	if ((end - begin) > (MAX_TLBI_OPS * PAGE_SIZE)) {
 		if (VM_TOOLCHAIN == 1) {
-			tlbi(vmalle1is);
+			tlbi(vmalle1);
 		} else {
-			tlbi(alle2is);
+			tlbi(alle2);
 		}
 	} else {
 		begin >>= 12;
 		end >>= 12;
-		/* Invalidate stage-1 TLB, one page from the range at a time. */
 		for (it = begin; it < end;
 		     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
 			if (VM_TOOLCHAIN == 1) {
-				tlbi_reg(vae1is, it);
+				tlbi_reg(vae1, it);
 			} else {
-				tlbi_reg(vae2is, it);
+				tlbi_reg(vae2, it);
 			}
 		}
 	}
 
 	/* Sync data accesses with TLB invalidation completion. */
-	dsb(ish);
+	dsb(nsh);
 
 	/* Sync instruction fetches with TLB invalidation completion. */
 	isb();
 }
 
+/**
+ * Makes the preceding writes to page tables visible to the table walks of the
+ * current CPU.
+ */
+void arch_mm_sync_table_writes_local(void)
+{
+	dsb(nshst);
+	isb();
+}
+
 /**
  * Invalidates stage-2 TLB entries referring to the given intermediate physical
- * address range.
+ * address range, for the VMID in vttbr_el2 of the current CPU.
  */
 void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end)
 {
-	uintpaddr_t begin = ipa_addr(va_begin);
-	uintpaddr_t end = ipa_addr(va_end);
-	uintpaddr_t it;
+	struct arch_mm_tlb_range range = {
+		.begin = ipa_addr(va_begin),
+		.end = ipa_addr(va_end),
+	};
 
-	/* TODO: This only applies to the current VMID. */
+	arch_mm_invalidate_stage2_ranges(pa_init(0), NULL, &range, 1);
+}
 
-	/* Sync with page table updates. */
-	dsb(ishst);
+/**
+ * Switches vttbr_el2 to the given value, so that TLB maintenance by VMID
+ * applies to its VMID. The translations of EL2 don't depend on it.
+ */
+static void tlbi_set_vttbr(uintreg_t vttbr)
+{
+	write_msr(vttbr_el2, vttbr);
+	isb();
+}
+
+/**
+ * Issues the TLB invalidations of stage-2 entries referring to the given
+ * intermediate physical address ranges for the VMID in vttbr_el2, without any
+ * barrier.
+ *
+ * Returns true if all stage-1 and stage-2 entries of the VMID were invalidated
+ * instead.
+ */
+static bool tlbi_stage2_ranges(const struct arch_mm_tlb_range *ranges,
+			       size_t count)
+{
+	bool all = false;
+	size_t i;
+
+	for (i = 0; i < count && !all; ++i) {
+		all = tlbi_stage2(ranges[i].begin, ranges[i].end);
+	}
+
+	return all;
+}
+
+/**
+ * Invalidates stage-2 TLB entries referring to the given intermediate physical
+ * address ranges of the VM with the given root table, waiting for the
+ * completion of all of them at once.
+ *
+ * Each vCPU of the VM has its own VMID, see hypervisor/vmid.c, and invalidation
+ * by address only applies to the VMID in vttbr_el2. So vttbr_el2 is switched to
+ * each of the VMIDs in turn, and restored after. If `vm` is NULL, the entries
+ * of the VMID in vttbr_el2 are invalidated instead.
+ */
+void arch_mm_invalidate_stage2_ranges(paddr_t root, const struct arch_vm *vm,
+				      const struct arch_mm_tlb_range *ranges,
+				      size_t count)
+{
+	uintreg_t vttbrs[MAX_CPUS];
+	bool all[MAX_CPUS];
+	uintreg_t vttbr = 0;
+	size_t vttbr_count = 1;
+	size_t i;
 
 	/*
-	 * Revisions prior to ARMv8.4 do not support invalidating a range of
-	 * addresses, which means we have to loop over individual pages. If
-	 * there are too many, it is quicker to invalidate all TLB entries.
+	 * Sync with page table updates. This also orders them before the reads
+	 * of the VMIDs, so that a vCPU given a new VMID meanwhile either has it
+	 * invalidated or only walks the updated tables, see vmid_update().
 	 */
-	if ((end - begin) > (MAX_TLBI_OPS * PAGE_SIZE)) {
-		/*
-		 * Invalidate all stage-1 and stage-2 entries of the TLB for
-		 * the current VMID.
-		 */
-		tlbi(vmalls12e1is);
-	} else {
-		begin >>= 12;
-		end >>= 12;
+	dsb(ish);
 
-		/*
-		 * Invalidate stage-2 TLB, one page from the range at a time.
-		 * Note that this has no effect if the CPU has a TLB with
-		 * combined stage-1/stage-2 translation.
-		 */
-		for (it = begin; it < end;
-		     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
-			tlbi_reg(ipas2e1is, it);
+	if (vm != NULL) {
+		vttbr = read_msr(vttbr_el2);
+		vttbr_count = 0;
+
+		/* VMID 0 is never allocated, so the vCPU hasn't run yet. */
+		for (i = 0; i < MAX_CPUS; ++i) {
+			uint64_t vmid = atomic_load_explicit(
+						&vm->vmid[i],
+						memory_order_relaxed) &
+					VTTBR_EL2_VMID_MASK;
+
+			if (vmid != 0) {
+				vttbrs[vttbr_count++] =
+					pa_addr(root) |
+					(vmid << VTTBR_EL2_VMID_SHIFT);
+			}
 		}
+	}
 
-		/*
-		 * Ensure completion of stage-2 invalidation in case a page
-		 * table walk on another CPU refilled the TLB with a complete
-		 * stage-1 + stage-2 walk based on the old stage-2 mapping.
-		 */
-		dsb(ish);
+	for (i = 0; i < vttbr_count; ++i) {
+		if (vm != NULL) {
+			tlbi_set_vttbr(vttbrs[i]);
+		}
+		all[i] = tlbi_stage2_ranges(ranges, count);
+	}
 
-		/*
-		 * Invalidate all stage-1 TLB entries. If the CPU has a combined
-		 * TLB for stage-1 and stage-2, this will invalidate stage-2 as
-		 * well.
-		 */
-		tlbi(vmalle1is);
+	/*
+	 * Ensure completion of stage-2 invalidation in case a page table walk
+	 * on another CPU refilled the TLB with a complete stage-1 + stage-2
+	 * walk based on the old stage-2 mapping.
+	 */
+	dsb(ish);
+
+	/*
+	 * Invalidate all stage-1 TLB entries. If the CPU has a combined TLB for
+	 * stage-1 and stage-2, this will invalidate stage-2 as well.
+	 */
+	for (i = 0; i < vttbr_count; ++i) {
+		if (!all[i]) {
+			if (vm != NULL) {
+				tlbi_set_vttbr(vttbrs[i]);
+			}
+			tlbi(vmalle1is);
+		}
+	}
+
+	if (vm != NULL) {
+		write_msr(vttbr_el2, vttbr);
 	}
 
 	/* Sync data accesses with TLB invalidation completion. */
@@ -384,6 +532,50 @@ void arch_mm_flush_dcache(void *base, size_t size)
 	dsb(sy);
 }
 
+/**
+ * Returns the size of the blocks zeroed by DC ZVA, or 0 if it is prohibited.
+ */
+static size_t arch_mm_zva_block_size(void)
+{
+	uintreg_t dczid = read_msr(DCZID_EL0);
+
+	if (dczid & DCZID_EL0_DZP) {
+		return 0;
+	}
+
+	return CACHE_WORD_SIZE << (dczid & 0xf);
+}
+
+void arch_mm_zero_memory(void *base, size_t size)
+{
+	size_t block_size = arch_mm_zva_block_size();
+	uintptr_t begin = (uintptr_t)base;
+	uintptr_t end = begin + size;
+	uintptr_t it;
+
+	/*
+	 * Zero the range with stores, and clean and invalidate it, if DC ZVA is
+	 * prohibited or the range is not made of whole blocks.
+	 */
+	if (block_size == 0 || ((begin | end) & (block_size - 1)) != 0) {
+		memset_s(base, size, 0, size);
+		arch_mm_flush_dcache(base, size);
+		return;
+	}
+
+	/* Zero a block at a time, without reading the memory first. */
+	for (it = begin; it < end; it += block_size) {
+		__asm__ volatile("dc zva, %0" : : "r"(it));
+	}
+
+	/*
+	 * Clean and invalidate the zeroed lines, as for stores, so that a
+	 * recipient accessing the memory with its caches disabled or with
+	 * different attributes doesn't hit stale lines.
+	 */
+	arch_mm_flush_dcache(base, size);
+}
+
 uint64_t arch_mm_mode_to_stage1_attrs(int mode)
 {
 	uint64_t attrs = 0;
@@ -464,6 +656,11 @@ uint64_t arch_mm_mode_to_stage2_attrs(int mode)
 		attrs |= STAGE2_SW_EXCLUSIVE;
 	}
 
+	/* Mark memory that must be cleared before it is accessed. */
+	if (mode & MM_MODE_UNCLEARED) {
+		attrs |= STAGE2_SW_UNCLEARED;
+	}
+
 	/* Define the valid bit. */
 	if (!(mode & MM_MODE_INVALID)) {
 		attrs |= PTE_VALID;
@@ -497,6 +694,10 @@ int arch_mm_stage2_attrs_to_mode(uint64_t attrs)
 		mode |= MM_MODE_SHARED;
 	}
 
+	if (attrs & STAGE2_SW_UNCLEARED) {
+		mode |= MM_MODE_UNCLEARED;
+	}
+
 	if (!(attrs & PTE_VALID)) {
 		mode |= MM_MODE_INVALID;
 	}
@@ -507,11 +708,11 @@ int arch_mm_stage2_attrs_to_mode(uint64_t attrs)
 uint8_t arch_mm_stage1_max_level(void)
 {
 	/*
-	 * For stage 1 we hard-code this to 2 for now so that we can
-	 * save one page table level at the expense of limiting the
-	 * physical memory to 512GB.
+	 * For stage 1 we hard-code this to 2 for now, or 1 with the 64KB
+	 * granule, so that we can save one page table level at the expense of
+	 * limiting the physical memory to 512GB, 128TB or 4TB.
 	 */
-	return 2;
+	return STAGE1_MAX_LEVEL;
 }
 
 uint8_t arch_mm_stage2_max_level(void)
@@ -530,17 +731,36 @@ uint8_t arch_mm_stage2_root_table_count(void)
 	return mm_s2_root_table_count;
 }
 
+/**
+ * Returns whether the translation granule is supported according to the given
+ * value of id_aa64mmfr0_el1.
+ */
+static bool arch_mm_granule_supported(uint64_t features)
+{
+#if PAGE_BITS == 12
+	/* TGran4 is 0b0000 if supported. */
+	return ((features >> 28) & 0xf) == 0;
+#elif PAGE_BITS == 14
+	/* TGran16 is 0b0000 if not supported. */
+	return ((features >> 20) & 0xf) != 0;
+#else
+	/* TGran64 is 0b0000 if supported. */
+	return ((features >> 24) & 0xf) == 0;
+#endif
+}
+
 bool arch_mm_init(void)
 {
 	static const int pa_bits_table[16] = {32, 36, 40, 42, 44, 48};
 	uint64_t features = read_msr(id_aa64mmfr0_el1);
 	int pa_bits = pa_bits_table[features & 0xf];
+	int level_end_bits;
 	int extend_bits;
 	int sl0;
 
-	/* Check that 4KB granules are supported. */
-	if ((features >> 28) & 0xf) {
-		dlog("4KB granules are not supported\n");
+	/* Check that the translation granule is supported. */
+	if (!arch_mm_granule_supported(features)) {
+		dlog("%dKB granules are not supported\n", PAGE_SIZE / 1024);
 		return false;
 	}
 
@@ -554,24 +774,39 @@ bool arch_mm_init(void)
 	dlog("Supported bits in physical address: %d\n", pa_bits);
 
 	/*
-	 * Determine sl0, starting level of the page table, based on the number
-	 * of bits. The value is chosen to give the shallowest tree by making
-	 * use of concatenated translation tables.
+	 * Check whether range TLB invalidation of ARMv8.4 is supported, i.e.
+	 * id_aa64isar0_el1.TLB is 0b0010.
+	 */
+	mm_tlbi_range = ((read_msr(id_aa64isar0_el1) >> 56) & 0xf) >= 2;
+	if (mm_tlbi_range) {
+		dlog("Range TLB invalidation is supported\n");
+	}
+
+	/*
+	 * Determine the starting level of the page table based on the number
+	 * of bits. It is chosen to give the shallowest tree by making use of
+	 * up to 16 concatenated translation tables, i.e. up to 4 bits more
+	 * than a level resolves.
+	 */
+	mm_s2_max_level = 0;
+	level_end_bits = PAGE_BITS + PAGE_LEVEL_BITS;
+	while (pa_bits > level_end_bits + 4) {
+		mm_s2_max_level++;
+		level_end_bits += PAGE_LEVEL_BITS;
+	}
+
+	/*
+	 * Encode the starting level as sl0, whose meaning depends on the
+	 * granule. With the 4KB granule:
 	 *
 	 *  - 0 => start at level 1
 	 *  - 1 => start at level 2
 	 *  - 2 => start at level 3
+	 *
+	 * With the 16KB and 64KB granules, each value starts one level lower,
+	 * so sl0 is the starting level itself.
 	 */
-	if (pa_bits >= 44) {
-		sl0 = 2;
-		mm_s2_max_level = 3;
-	} else if (pa_bits >= 35) {
-		sl0 = 1;
-		mm_s2_max_level = 2;
-	} else {
-		sl0 = 0;
-		mm_s2_max_level = 1;
-	}
+	sl0 = (PAGE_BITS == 12) ? mm_s2_max_level - 1 : mm_s2_max_level;
 
 	/*
 	 * Since the shallowest possible tree is used, the maximum number of
@@ -590,7 +825,7 @@ bool arch_mm_init(void)
 
 	mm_vtcr_el2 = (1u << 31) |		 /* RES1. */
 		      ((features & 0xf) << 16) | /* PS, matching features. */
-		      (0 << 14) |		 /* TG0: 4 KB granule. */
+		      (TCR_TG0 << 14) |	 /* TG0: granule size. */
 		      (3 << 12) |		 /* SH0: inner shareable. */
 		      (1 << 10) |	     /* ORGN0: normal, cacheable ... */
 		      (1 << 8) |	      /* IRGN0: normal, cacheable ... */
@@ -598,6 +833,16 @@ bool arch_mm_init(void)
 		      ((64 - pa_bits) << 0) | /* T0SZ: dependent on PS. */
 		      0;
 
+	/*
+	 * Use 16-bit VMIDs if they are supported, i.e. VMIDBits of
+	 * id_aa64mmfr1_el1 is 0b0010, so more VMs can have a VMID before they
+	 * are all reused.
+	 */
+	if (((read_msr(id_aa64mmfr1_el1) >> 4) & 0xf) == 2) {
+		mm_vtcr_el2 |= UINT64_C(1) << 19; /* VS: 16-bit VMIDs. */
+		dlog("16-bit VMIDs are supported\n");
+	}
+
 	/*
 	 * 0    -> Device-nGnRnE memory
 	 * 0xff -> Normal memory, Inner/Outer Write-Back Non-transient,
@@ -611,11 +856,11 @@ bool arch_mm_init(void)
 	 */
 	mm_tcr_el2 = (1 << 20) |		/* TBI, top byte ignored. */
 		     ((features & 0xf) << 16) | /* PS. */
-		     (0 << 14) |		/* TG0, granule size, 4KB. */
+		     (TCR_TG0 << 14) |		/* TG0, granule size. */
 		     (3 << 12) |		/* SH0, inner shareable. */
 		     (1 << 10) | /* ORGN0, normal mem, WB RA WA Cacheable. */
 		     (1 << 8) |  /* IRGN0, normal mem, WB RA WA Cacheable. */
-		     (25 << 0) | /* T0SZ, input address is 2^39 bytes. */
+		     ((64 - STAGE1_ADDR_BITS) << 0) | /* T0SZ. */
 		     0;
 
 	mm_sctlr_el2 = (1 << 0) |  /* M, enable stage 1 EL2 MMU. */
@@ -650,32 +895,3 @@ void arch_mm_enable(paddr_t table)
 	isb();
 }
 
-/**
- * Given the attrs from a table at some level and the attrs from all the blocks
- * in that table, returns equivalent attrs to use for a block which will replace
- * the entire table.
- */
-uint64_t arch_mm_combine_table_entry_attrs(uint64_t table_attrs,
-					   uint64_t block_attrs)
-{
-	/*
-	 * Only stage 1 table descriptors have attributes, but the bits are res0
-	 * for stage 2 table descriptors so this code is safe for both.
-	 */
-	if (table_attrs & TABLE_NSTABLE) {
-		block_attrs |= STAGE1_NS;
-	}
-	if (table_attrs & TABLE_APTABLE1) {
-		block_attrs |= STAGE1_AP2;
-	}
-	if (table_attrs & TABLE_APTABLE0) {
-		block_attrs &= ~STAGE1_AP1;
-	}
-	if (table_attrs & TABLE_XNTABLE) {
-		block_attrs |= STAGE1_XN;
-	}
-	if (table_attrs & TABLE_PXNTABLE) {
-		block_attrs |= STAGE1_PXN;
-	}
-	return block_attrs;
-}
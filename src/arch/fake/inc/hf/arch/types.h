@@ -19,8 +19,14 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/*
+ * The translation granule is chosen by the build, as 12, 14 or 16 page bits for
+ * the 4KB, 16KB or 64KB granule, and must match the one of libhfo2.
+ */
+#ifndef PAGE_BITS
 #define PAGE_BITS 12
-#define PAGE_LEVEL_BITS 9
+#endif
+#define PAGE_LEVEL_BITS (PAGE_BITS - 3)
 #define STACK_ALIGN 64
 
 /** The type of a page table entry (PTE). */
@@ -17,123 +17,83 @@
 #include "hf/arch/mm.h"
 
 #include "hf/mm.h"
+#include "hf/std.h"
 
 /*
  * The fake architecture uses the mode flags to represent the attributes applied
  * to memory. The flags are shifted to avoid equality of modes and attributes.
+ * Page table entries are encoded in hfo2/src/arch/fake/mm.rs, which must agree
+ * with this.
  */
 #define PTE_ATTR_MODE_SHIFT 48
-#define PTE_ATTR_MODE_MASK                                              \
-	((uint64_t)(MM_MODE_R | MM_MODE_W | MM_MODE_X | MM_MODE_D |     \
-		    MM_MODE_INVALID | MM_MODE_UNOWNED | MM_MODE_SHARED) \
+#define PTE_ATTR_MODE_MASK                                                  \
+	((uint64_t)(MM_MODE_R | MM_MODE_W | MM_MODE_X | MM_MODE_D |         \
+		    MM_MODE_INVALID | MM_MODE_UNOWNED | MM_MODE_SHARED |    \
+		    MM_MODE_UNCLEARED)                                      \
 	 << PTE_ATTR_MODE_SHIFT)
 
-/* The bit to distinguish a table from a block is the highest of the page bits.
- */
-#define PTE_TABLE (UINT64_C(1) << (PAGE_BITS - 1))
-
-/* Mask for the address part of an entry. */
-#define PTE_ADDR_MASK (~(PTE_ATTR_MODE_MASK | (UINT64_C(1) << PAGE_BITS) - 1))
-
-/* Offset the bits of each level so they can't be misued. */
-#define PTE_LEVEL_SHIFT(lvl) ((lvl)*2)
-
-pte_t arch_mm_absent_pte(uint8_t level)
-{
-	return ((uint64_t)(MM_MODE_INVALID | MM_MODE_UNOWNED | MM_MODE_SHARED)
-		<< PTE_ATTR_MODE_SHIFT) >>
-	       PTE_LEVEL_SHIFT(level);
-}
-
-pte_t arch_mm_table_pte(uint8_t level, paddr_t pa)
-{
-	return (pa_addr(pa) | PTE_TABLE) >> PTE_LEVEL_SHIFT(level);
-}
-
-pte_t arch_mm_block_pte(uint8_t level, paddr_t pa, uint64_t attrs)
-{
-	return (pa_addr(pa) | attrs) >> PTE_LEVEL_SHIFT(level);
-}
-
-bool arch_mm_is_block_allowed(uint8_t level)
-{
-	(void)level;
-	return true;
-}
-
-bool arch_mm_pte_is_present(pte_t pte, uint8_t level)
-{
-	return arch_mm_pte_is_valid(pte, level) ||
-	       !(((pte << PTE_LEVEL_SHIFT(level)) >> PTE_ATTR_MODE_SHIFT) &
-		 MM_MODE_UNOWNED);
-}
-
-bool arch_mm_pte_is_valid(pte_t pte, uint8_t level)
-{
-	return !(((pte << PTE_LEVEL_SHIFT(level)) >> PTE_ATTR_MODE_SHIFT) &
-		 MM_MODE_INVALID);
-}
-
-bool arch_mm_pte_is_block(pte_t pte, uint8_t level)
-{
-	return arch_mm_pte_is_present(pte, level) &&
-	       !arch_mm_pte_is_table(pte, level);
-}
-
-bool arch_mm_pte_is_table(pte_t pte, uint8_t level)
+void arch_mm_invalidate_stage1_range(vaddr_t va_begin, vaddr_t va_end)
 {
-	return (pte << PTE_LEVEL_SHIFT(level)) & PTE_TABLE;
+	/* There's no modelling of the stage-1 TLB. */
 }
 
-paddr_t arch_mm_clear_pa(paddr_t pa)
+void arch_mm_invalidate_stage1_ranges(const struct arch_mm_tlb_range *ranges,
+				      size_t count)
 {
-	return pa_init(pa_addr(pa) & PTE_ADDR_MASK);
+	/* There's no modelling of the stage-1 TLB. */
 }
 
-paddr_t arch_mm_block_from_pte(pte_t pte, uint8_t level)
+void arch_mm_invalidate_stage1_range_local(vaddr_t va_begin, vaddr_t va_end)
 {
-	return pa_init((pte << PTE_LEVEL_SHIFT(level)) & PTE_ADDR_MASK);
+	/* There's no modelling of the stage-1 TLB. */
 }
 
-paddr_t arch_mm_table_from_pte(pte_t pte, uint8_t level)
+void arch_mm_sync_table_writes_local(void)
 {
-	return pa_init((pte << PTE_LEVEL_SHIFT(level)) & PTE_ADDR_MASK);
+	/* There's no modelling of the table walks. */
 }
 
-uint64_t arch_mm_pte_attrs(pte_t pte, uint8_t level)
+void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end)
 {
-	return (pte << PTE_LEVEL_SHIFT(level)) & PTE_ATTR_MODE_MASK;
+	/* There's no modelling of the stage-2 TLB. */
 }
 
-uint64_t arch_mm_combine_table_entry_attrs(uint64_t table_attrs,
-					   uint64_t block_attrs)
+void arch_mm_invalidate_stage2_ranges(paddr_t root, const struct arch_vm *vm,
+				      const struct arch_mm_tlb_range *ranges,
+				      size_t count)
 {
-	return table_attrs | block_attrs;
-}
-
-void arch_mm_invalidate_stage1_range(vaddr_t va_begin, vaddr_t va_end)
-{
-	/* There's no modelling of the stage-1 TLB. */
+	/* There's no modelling of the stage-2 TLB. */
 }
 
-void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end)
+void arch_mm_flush_dcache(void *base, size_t size)
 {
-	/* There's no modelling of the stage-2 TLB. */
+	/* There's no modelling of the cache. */
 }
 
-void arch_mm_flush_dcache(void *base, size_t size)
+void arch_mm_zero_memory(void *base, size_t size)
 {
 	/* There's no modelling of the cache. */
+	memset_s(base, size, 0, size);
 }
 
+/*
+ * The address space must fit in the 48 bits of the address of an entry, so the
+ * larger granules use one level less.
+ */
+#if PAGE_BITS == 12
+#define FAKE_MAX_LEVEL 2
+#else
+#define FAKE_MAX_LEVEL 1
+#endif
+
 uint8_t arch_mm_stage1_max_level(void)
 {
-	return 2;
+	return FAKE_MAX_LEVEL;
 }
 
 uint8_t arch_mm_stage2_max_level(void)
 {
-	return 2;
+	return FAKE_MAX_LEVEL;
 }
 
 uint8_t arch_mm_stage1_root_table_count(void)
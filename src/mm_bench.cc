@@ -0,0 +1,130 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures how fast page tables are walked. A large range is mapped with
+ * page-sized entries only, and then its mode is looked up as a whole and page
+ * by page.
+ */
+
+extern "C" {
+#include "hf/arch/mm.h"
+
+#include "hf/mm.h"
+#include "hf/mpool.h"
+}
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+namespace
+{
+constexpr size_t ENTRY_SIZE_L1 = PAGE_SIZE << PAGE_LEVEL_BITS;
+constexpr size_t MAP_SIZE = 256 * ENTRY_SIZE_L1;
+constexpr size_t TABLE_PAGES = 2 * MAP_SIZE / ENTRY_SIZE_L1;
+constexpr size_t ENTRIES = MAP_SIZE / PAGE_SIZE;
+constexpr int ROUNDS = 50;
+constexpr int MODE = MM_MODE_R | MM_MODE_W;
+constexpr int OTHER_MODE = MM_MODE_R;
+
+struct alignas(PAGE_SIZE) raw_page {
+	char data[PAGE_SIZE];
+};
+
+template <typename F>
+void measure(const char *name, F f)
+{
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < ROUNDS; ++i) {
+		if (!f()) {
+			printf("%s: failed\n", name);
+			exit(1);
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(end - begin)
+			    .count();
+
+	printf("%-12s %8.2f ns/entry\n", name, ns / ROUNDS / ENTRIES);
+}
+
+} /* namespace */
+
+int main()
+{
+	std::unique_ptr<raw_page[]> heap(new raw_page[TABLE_PAGES]);
+	struct mpool ppool;
+	struct mm_ptable ptable;
+	const paddr_t begin = pa_init(0);
+	const paddr_t end = pa_init(MAP_SIZE);
+
+	mpool_init(&ppool, sizeof(struct mm_page_table));
+	mpool_add_chunk(&ppool, heap.get(), TABLE_PAGES * PAGE_SIZE);
+
+	if (!mm_vm_init(&ptable, &ppool) ||
+	    !mm_vm_identity_map(&ptable, begin, end, MODE, nullptr, &ppool)) {
+		printf("setup failed\n");
+		return 1;
+	}
+
+	/*
+	 * Split every level 1 block into pages by changing the mode of one page
+	 * and back again.
+	 */
+	for (size_t addr = 0; addr < MAP_SIZE; addr += ENTRY_SIZE_L1) {
+		paddr_t page = pa_init(addr);
+		paddr_t page_end = pa_add(page, PAGE_SIZE);
+
+		if (!mm_vm_identity_map(&ptable, page, page_end, OTHER_MODE,
+					nullptr, &ppool) ||
+		    !mm_vm_identity_map(&ptable, page, page_end, MODE, nullptr,
+					&ppool)) {
+			printf("setup failed\n");
+			return 1;
+		}
+	}
+
+	printf("walking %zu page entries, %d rounds\n", ENTRIES, ROUNDS);
+
+	measure("get_mode", [&] {
+		int mode;
+		return mm_vm_get_mode(&ptable, ipa_from_pa(begin),
+				      ipa_from_pa(end), &mode) &&
+		       mode == MODE;
+	});
+
+	measure("lookup", [&] {
+		for (size_t addr = 0; addr < MAP_SIZE; addr += PAGE_SIZE) {
+			int mode;
+			ipaddr_t ipa = ipa_init(addr);
+
+			ipaddr_t ipa_end = ipa_add(ipa, PAGE_SIZE);
+
+			if (!mm_vm_get_mode(&ptable, ipa, ipa_end, &mode) ||
+			    mode != MODE) {
+				return false;
+			}
+		}
+		return true;
+	});
+
+	mm_vm_fini(&ptable, &ppool);
+	mpool_fini(&ppool);
+
+	return 0;
+}
@@ -39,9 +39,13 @@ using ::testing::Eq;
 using ::testing::SizeIs;
 using ::testing::Truly;
 
+/*
+ * The geometry of the page table depends on the translation granule the tests
+ * are built for, so the tests are written in terms of it.
+ */
 constexpr size_t TEST_HEAP_SIZE = PAGE_SIZE * 16;
 const int TOP_LEVEL = arch_mm_stage2_max_level();
-const paddr_t VM_MEM_END = pa_init(0x200'0000'0000);
+const size_t ROOT_TABLE_COUNT = arch_mm_stage2_root_table_count();
 
 struct alignas(PAGE_SIZE) raw_page {
 	char data[PAGE_SIZE];
@@ -56,6 +60,10 @@ size_t mm_entry_size(int level)
 	return UINT64_C(1) << (PAGE_BITS + level * PAGE_LEVEL_BITS);
 }
 
+/** The size of the address space represented by each root table. */
+const size_t ROOT_TABLE_SIZE = mm_entry_size(TOP_LEVEL + 1);
+const paddr_t VM_MEM_END = pa_init(ROOT_TABLE_SIZE * ROOT_TABLE_COUNT);
+
 /**
  * Checks whether the address is mapped in the address space.
  */
@@ -76,6 +84,35 @@ std::span<pte_t, MM_PTE_PER_PAGE> get_table(paddr_t pa)
 	return std::span<pte_t>(table->entries, std::end(table->entries));
 }
 
+/**
+ * Checks that the given table only maps the page at the given address, through
+ * a single table at each level down to the page.
+ */
+void expect_only_page_mapped(std::span<pte_t, MM_PTE_PER_PAGE> table,
+			     int level, paddr_t page)
+{
+	for (;; --level) {
+		size_t index = (pa_addr(page) / mm_entry_size(level)) %
+			       MM_PTE_PER_PAGE;
+
+		EXPECT_THAT(table.first(index),
+			    Each(arch_mm_absent_pte(level)));
+		EXPECT_THAT(table.subspan(index + 1),
+			    Each(arch_mm_absent_pte(level)));
+
+		if (level == 0) {
+			ASSERT_TRUE(arch_mm_pte_is_block(table[index], level));
+			EXPECT_THAT(pa_addr(arch_mm_block_from_pte(table[index],
+								   level)),
+				    Eq(pa_addr(page)));
+			return;
+		}
+
+		ASSERT_TRUE(arch_mm_pte_is_table(table[index], level));
+		table = get_table(arch_mm_table_from_pte(table[index], level));
+	}
+}
+
 /**
  * Get an STL representation of the ptable.
  */
@@ -91,6 +128,26 @@ std::vector<std::span<pte_t, MM_PTE_PER_PAGE>> get_ptable(
 	return all;
 }
 
+/**
+ * Gets the entry at the given level that maps the given address, following the
+ * tables from the root.
+ */
+pte_t *get_pte(const struct mm_ptable &ptable, paddr_t pa, int level)
+{
+	auto table = get_ptable(ptable)[pa_addr(pa) / ROOT_TABLE_SIZE];
+
+	for (int l = TOP_LEVEL;; --l) {
+		size_t index =
+			(pa_addr(pa) / mm_entry_size(l)) % MM_PTE_PER_PAGE;
+
+		if (l == level) {
+			return &table[index];
+		}
+
+		table = get_table(arch_mm_table_from_pte(table[index], l));
+	}
+}
+
 class mm : public ::testing::Test
 {
 	void SetUp() override
@@ -117,9 +174,9 @@ TEST_F(mm, ptable_init_empty)
 {
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -130,9 +187,9 @@ TEST_F(mm, ptable_init_concatenated_empty)
 {
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -150,30 +207,44 @@ TEST_F(mm, map_first_page)
 				       nullptr, &ppool));
 
 	auto tables = get_ptable(ptable);
-	EXPECT_THAT(tables, SizeIs(4));
-	ASSERT_THAT(TOP_LEVEL, Eq(2));
+	EXPECT_THAT(tables, SizeIs(ROOT_TABLE_COUNT));
 
 	/* Check that the first page is mapped and nothing else. */
-	EXPECT_THAT(std::span(tables).last(3),
+	EXPECT_THAT(std::span(tables).subspan(1),
 		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
+	expect_only_page_mapped(tables.front(), TOP_LEVEL, page_begin);
+
+	mm_vm_fini(&ptable, &ppool);
+}
 
-	auto table_l2 = tables.front();
-	EXPECT_THAT(table_l2.subspan(1), Each(arch_mm_absent_pte(TOP_LEVEL)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l2[0], TOP_LEVEL));
+/**
+ * Pages reserved for tables that turn out not to be needed are given back to
+ * the pool.
+ */
+TEST_F(mm, map_returns_unused_table_pages)
+{
+	constexpr int mode = 0;
+	const paddr_t page_begin = pa_init(0);
+	struct mm_ptable ptable;
+	struct mpool_stats before;
+	struct mpool_stats after;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
 
-	auto table_l1 =
-		get_table(arch_mm_table_from_pte(table_l2[0], TOP_LEVEL));
-	EXPECT_THAT(table_l1.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l1[0], TOP_LEVEL - 1));
+	/* Mapping the first page needs a table for each level below the top. */
+	mpool_get_stats(&ppool, &before);
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin,
+				       pa_add(page_begin, PAGE_SIZE), mode,
+				       nullptr, &ppool));
+	mpool_get_stats(&ppool, &after);
+	EXPECT_THAT(after.free_pages, Eq(before.free_pages - TOP_LEVEL));
 
-	auto table_l0 =
-		get_table(arch_mm_table_from_pte(table_l1[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table_l0.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
-	ASSERT_TRUE(arch_mm_pte_is_block(table_l0[0], TOP_LEVEL - 2));
-	EXPECT_THAT(pa_addr(arch_mm_block_from_pte(table_l0[0], TOP_LEVEL - 2)),
-		    Eq(pa_addr(page_begin)));
+	/* The second page is mapped in the same tables. */
+	before = after;
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_add(page_begin, PAGE_SIZE),
+				       pa_add(page_begin, 2 * PAGE_SIZE), mode,
+				       nullptr, &ppool));
+	mpool_get_stats(&ppool, &after);
+	EXPECT_THAT(after.free_pages, Eq(before.free_pages));
 
 	mm_vm_fini(&ptable, &ppool);
 }
@@ -185,7 +256,7 @@ TEST_F(mm, map_first_page)
 TEST_F(mm, map_round_to_page)
 {
 	constexpr int mode = 0;
-	const paddr_t map_begin = pa_init(0x200'0000'0000 - PAGE_SIZE + 23);
+	const paddr_t map_begin = pa_init(pa_addr(VM_MEM_END) - PAGE_SIZE + 23);
 	const paddr_t map_end = pa_add(map_begin, 268);
 	ipaddr_t ipa = ipa_init(-1);
 	struct mm_ptable ptable;
@@ -195,32 +266,13 @@ TEST_F(mm, map_round_to_page)
 	EXPECT_THAT(ipa_addr(ipa), Eq(pa_addr(map_begin)));
 
 	auto tables = get_ptable(ptable);
-	EXPECT_THAT(tables, SizeIs(4));
-	ASSERT_THAT(TOP_LEVEL, Eq(2));
+	EXPECT_THAT(tables, SizeIs(ROOT_TABLE_COUNT));
 
 	/* Check that the last page is mapped, and nothing else. */
-	EXPECT_THAT(std::span(tables).first(3),
+	EXPECT_THAT(std::span(tables).first(ROOT_TABLE_COUNT - 1),
 		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
-
-	auto table_l2 = tables.back();
-	EXPECT_THAT(table_l2.first(table_l2.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l2.last(1)[0], TOP_LEVEL));
-
-	auto table_l1 = get_table(
-		arch_mm_table_from_pte(table_l2.last(1)[0], TOP_LEVEL));
-	EXPECT_THAT(table_l1.first(table_l1.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l1.last(1)[0], TOP_LEVEL - 1));
-
-	auto table_l0 = get_table(
-		arch_mm_table_from_pte(table_l1.last(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table_l0.first(table_l0.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
-	ASSERT_TRUE(arch_mm_pte_is_block(table_l0.last(1)[0], TOP_LEVEL - 2));
-	EXPECT_THAT(pa_addr(arch_mm_block_from_pte(table_l0.last(1)[0],
-						   TOP_LEVEL - 2)),
-		    Eq(0x200'0000'0000 - PAGE_SIZE));
+	expect_only_page_mapped(tables.back(), TOP_LEVEL,
+				pa_init(pa_addr(VM_MEM_END) - PAGE_SIZE));
 
 	mm_vm_fini(&ptable, &ppool);
 }
@@ -231,7 +283,7 @@ TEST_F(mm, map_round_to_page)
 TEST_F(mm, map_across_tables)
 {
 	constexpr int mode = 0;
-	const paddr_t map_begin = pa_init(0x80'0000'0000 - PAGE_SIZE);
+	const paddr_t map_begin = pa_init(ROOT_TABLE_SIZE - PAGE_SIZE);
 	const paddr_t map_end = pa_add(map_begin, 2 * PAGE_SIZE);
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
@@ -239,51 +291,16 @@ TEST_F(mm, map_across_tables)
 				       nullptr, &ppool));
 
 	auto tables = get_ptable(ptable);
-	EXPECT_THAT(tables, SizeIs(4));
-	EXPECT_THAT(std::span(tables).last(2),
+	EXPECT_THAT(tables, SizeIs(ROOT_TABLE_COUNT));
+	EXPECT_THAT(std::span(tables).subspan(2),
 		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
-	ASSERT_THAT(TOP_LEVEL, Eq(2));
 
 	/* Check only the last page of the first table is mapped. */
-	auto table0_l2 = tables.front();
-	EXPECT_THAT(table0_l2.first(table0_l2.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table0_l2.last(1)[0], TOP_LEVEL));
-
-	auto table0_l1 = get_table(
-		arch_mm_table_from_pte(table0_l2.last(1)[0], TOP_LEVEL));
-	EXPECT_THAT(table0_l1.first(table0_l1.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table0_l1.last(1)[0], TOP_LEVEL - 1));
-
-	auto table0_l0 = get_table(
-		arch_mm_table_from_pte(table0_l1.last(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table0_l0.first(table0_l0.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
-	ASSERT_TRUE(arch_mm_pte_is_block(table0_l0.last(1)[0], TOP_LEVEL - 2));
-	EXPECT_THAT(pa_addr(arch_mm_block_from_pte(table0_l0.last(1)[0],
-						   TOP_LEVEL - 2)),
-		    Eq(pa_addr(map_begin)));
-
-	/* Checl only the first page of the second table is mapped. */
-	auto table1_l2 = tables[1];
-	EXPECT_THAT(table1_l2.subspan(1), Each(arch_mm_absent_pte(TOP_LEVEL)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table1_l2[0], TOP_LEVEL));
-
-	auto table1_l1 =
-		get_table(arch_mm_table_from_pte(table1_l2[0], TOP_LEVEL));
-	EXPECT_THAT(table1_l1.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table1_l1[0], TOP_LEVEL - 1));
-
-	auto table1_l0 =
-		get_table(arch_mm_table_from_pte(table1_l1[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table1_l0.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
-	ASSERT_TRUE(arch_mm_pte_is_block(table1_l0[0], TOP_LEVEL - 2));
-	EXPECT_THAT(
-		pa_addr(arch_mm_block_from_pte(table1_l0[0], TOP_LEVEL - 2)),
-		Eq(pa_addr(pa_add(map_begin, PAGE_SIZE))));
+	expect_only_page_mapped(tables[0], TOP_LEVEL, map_begin);
+
+	/* Check only the first page of the second table is mapped. */
+	expect_only_page_mapped(tables[1], TOP_LEVEL,
+				pa_add(map_begin, PAGE_SIZE));
 
 	mm_vm_fini(&ptable, &ppool);
 }
@@ -299,10 +316,10 @@ TEST_F(mm, map_all_at_top_level)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
 				       nullptr, &ppool));
 	auto tables = get_ptable(ptable);
-	EXPECT_THAT(
-		tables,
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(tables,
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	for (uint64_t i = 0; i < tables.size(); ++i) {
 		for (uint64_t j = 0; j < MM_PTE_PER_PAGE; ++j) {
 			EXPECT_THAT(pa_addr(arch_mm_block_from_pte(tables[i][j],
@@ -330,10 +347,10 @@ TEST_F(mm, map_already_mapped)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), pa_init(PAGE_SIZE),
 				       mode, &ipa, &ppool));
 	EXPECT_THAT(ipa_addr(ipa), Eq(0));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -350,9 +367,9 @@ TEST_F(mm, map_reverse_range)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0x1234'5678),
 				       pa_init(0x5000), mode, &ipa, &ppool));
 	EXPECT_THAT(ipa_addr(ipa), Eq(0x1234'5678));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -394,9 +411,9 @@ TEST_F(mm, map_last_address_quirk)
 		pa_init(std::numeric_limits<uintpaddr_t>::max()), mode, &ipa,
 		&ppool));
 	EXPECT_THAT(ipa_addr(ipa), Eq(0));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -412,10 +429,10 @@ TEST_F(mm, map_clamp_to_range)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0),
 				       pa_init(0xf32'0000'0000'0000), mode,
 				       nullptr, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -433,9 +450,9 @@ TEST_F(mm, map_ignore_out_of_range)
 				       pa_init(0xf0'0000'0000'0000), mode, &ipa,
 				       &ppool));
 	EXPECT_THAT(ipa_addr(ipa), Eq(pa_addr(VM_MEM_END)));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -454,10 +471,10 @@ TEST_F(mm, map_block_replaces_table)
 				       nullptr, &ppool));
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
 				       nullptr, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -478,7 +495,7 @@ TEST_F(mm, map_does_not_defrag)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
 				       nullptr, &ppool));
 	EXPECT_THAT(get_ptable(ptable),
-		    AllOf(SizeIs(4),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
 			  Each(Each(Truly(std::bind(arch_mm_pte_is_present, _1,
 						    TOP_LEVEL)))),
 			  Contains(Contains(Truly(std::bind(
@@ -496,9 +513,9 @@ TEST_F(mm, vm_unmap_hypervisor_not_mapped)
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
 	EXPECT_TRUE(mm_vm_unmap_hypervisor(&ptable, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -511,9 +528,9 @@ TEST_F(mm, unmap_not_mapped)
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
 	EXPECT_TRUE(
 		mm_vm_unmap(&ptable, pa_init(12345), pa_init(987652), &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -534,9 +551,9 @@ TEST_F(mm, unmap_all)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, l1_begin, l1_end, mode, nullptr,
 				       &ppool));
 	EXPECT_TRUE(mm_vm_unmap(&ptable, pa_init(0), VM_MEM_END, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -546,7 +563,8 @@ TEST_F(mm, unmap_all)
 TEST_F(mm, unmap_round_to_page)
 {
 	constexpr int mode = 0;
-	const paddr_t map_begin = pa_init(0x160'0000'0000 + PAGE_SIZE);
+	const paddr_t map_begin =
+		pa_init(pa_addr(VM_MEM_END) / 16 * 11 + PAGE_SIZE);
 	const paddr_t map_end = pa_add(map_begin, PAGE_SIZE);
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
@@ -554,9 +572,9 @@ TEST_F(mm, unmap_round_to_page)
 				       nullptr, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, pa_add(map_begin, 93),
 				pa_add(map_begin, 99), &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -566,16 +584,17 @@ TEST_F(mm, unmap_round_to_page)
 TEST_F(mm, unmap_across_tables)
 {
 	constexpr int mode = 0;
-	const paddr_t map_begin = pa_init(0x180'0000'0000 - PAGE_SIZE);
+	const paddr_t map_begin =
+		pa_init((ROOT_TABLE_COUNT - 1) * ROOT_TABLE_SIZE - PAGE_SIZE);
 	const paddr_t map_end = pa_add(map_begin, 2 * PAGE_SIZE);
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, map_begin, map_end, mode,
 				       nullptr, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, map_begin, map_end, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -589,12 +608,12 @@ TEST_F(mm, unmap_out_of_range)
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
 				       nullptr, &ppool));
-	ASSERT_TRUE(mm_vm_unmap(&ptable, VM_MEM_END, pa_init(0x4000'0000'0000),
-				&ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	ASSERT_TRUE(mm_vm_unmap(&ptable, VM_MEM_END,
+				pa_add(VM_MEM_END, ROOT_TABLE_SIZE), &ppool));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -611,10 +630,10 @@ TEST_F(mm, unmap_reverse_range)
 				       nullptr, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, pa_init(0x80'a000'0000), pa_init(27),
 				&ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -628,7 +647,7 @@ TEST_F(mm, unmap_reverse_range)
 TEST_F(mm, unmap_reverse_range_quirk)
 {
 	constexpr int mode = 0;
-	const paddr_t page_begin = pa_init(0x180'0000'0000);
+	const paddr_t page_begin = pa_init(pa_addr(VM_MEM_END) / 16 * 12);
 	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
@@ -636,9 +655,9 @@ TEST_F(mm, unmap_reverse_range_quirk)
 				       nullptr, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, pa_add(page_begin, 100),
 				pa_add(page_begin, 50), &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -659,10 +678,10 @@ TEST_F(mm, unmap_last_address_quirk)
 	ASSERT_TRUE(mm_vm_unmap(
 		&ptable, pa_init(0),
 		pa_init(std::numeric_limits<uintpaddr_t>::max()), &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -684,9 +703,9 @@ TEST_F(mm, unmap_does_not_defrag)
 				       &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, l0_begin, l0_end, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, l1_begin, l1_end, &ppool));
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -715,7 +734,8 @@ TEST_F(mm, is_mapped_all)
 				       nullptr, &ppool));
 	EXPECT_TRUE(mm_vm_is_mapped(&ptable, ipa_init(0)));
 	EXPECT_TRUE(mm_vm_is_mapped(&ptable, ipa_init(0xf247'a7b3)));
-	EXPECT_TRUE(mm_vm_is_mapped(&ptable, ipa_init(0x1ff'7bfa'983b)));
+	EXPECT_TRUE(mm_vm_is_mapped(
+		&ptable, ipa_init(pa_addr(VM_MEM_END) - 0x8405'67c5)));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -725,7 +745,7 @@ TEST_F(mm, is_mapped_all)
 TEST_F(mm, is_mapped_page)
 {
 	constexpr int mode = 0;
-	const paddr_t page_begin = pa_init(0x100'0000'0000);
+	const paddr_t page_begin = pa_init(pa_addr(VM_MEM_END) / 2);
 	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
@@ -749,7 +769,8 @@ TEST_F(mm, is_mapped_out_of_range)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
 				       nullptr, &ppool));
 	EXPECT_FALSE(mm_vm_is_mapped(&ptable, ipa_from_pa(VM_MEM_END)));
-	EXPECT_FALSE(mm_vm_is_mapped(&ptable, ipa_init(0x1000'adb7'8123)));
+	EXPECT_FALSE(mm_vm_is_mapped(
+		&ptable, ipa_from_pa(pa_add(VM_MEM_END, 0xadb7'8123))));
 	EXPECT_FALSE(mm_vm_is_mapped(
 		&ptable, ipa_init(std::numeric_limits<uintpaddr_t>::max())));
 	mm_vm_fini(&ptable, &ppool);
@@ -778,8 +799,9 @@ TEST_F(mm, get_mode_empty)
 	EXPECT_THAT(read_mode, Eq(default_mode));
 
 	read_mode = 0;
-	EXPECT_TRUE(mm_vm_get_mode(&ptable, ipa_init(0x5f'ffff'ffff),
-				   ipa_init(0x1ff'ffff'ffff), &read_mode));
+	EXPECT_TRUE(mm_vm_get_mode(
+		&ptable, ipa_init(pa_addr(VM_MEM_END) / 16 * 3 - 1),
+		ipa_init(pa_addr(VM_MEM_END) - 1), &read_mode));
 	EXPECT_THAT(read_mode, Eq(default_mode));
 
 	mm_vm_fini(&ptable, &ppool);
@@ -792,7 +814,8 @@ TEST_F(mm, get_mode_empty)
 TEST_F(mm, get_mode_pages_across_tables)
 {
 	constexpr int mode = MM_MODE_INVALID | MM_MODE_SHARED;
-	const paddr_t map_begin = pa_init(0x180'0000'0000 - PAGE_SIZE);
+	const paddr_t map_begin =
+		pa_init((ROOT_TABLE_COUNT - 1) * ROOT_TABLE_SIZE - PAGE_SIZE);
 	const paddr_t map_end = pa_add(map_begin, 2 * PAGE_SIZE);
 	struct mm_ptable ptable;
 	int read_mode;
@@ -847,9 +870,9 @@ TEST_F(mm, defrag_empty)
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
 	mm_vm_defrag(&ptable, &ppool);
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -873,9 +896,9 @@ TEST_F(mm, defrag_empty_subtables)
 	ASSERT_TRUE(mm_vm_unmap(&ptable, l0_begin, l0_end, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, l1_begin, l1_end, &ppool));
 	mm_vm_defrag(&ptable, &ppool);
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -886,7 +909,7 @@ TEST_F(mm, defrag_empty_subtables)
 TEST_F(mm, defrag_block_subtables)
 {
 	constexpr int mode = 0;
-	const paddr_t begin = pa_init(39456 * mm_entry_size(1));
+	const paddr_t begin = pa_init(1456 * mm_entry_size(1));
 	const paddr_t middle = pa_add(begin, 67 * PAGE_SIZE);
 	const paddr_t end = pa_add(begin, 4 * mm_entry_size(1));
 	struct mm_ptable ptable;
@@ -899,10 +922,190 @@ TEST_F(mm, defrag_block_subtables)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, middle, end, mode, nullptr,
 				       &ppool));
 	mm_vm_defrag(&ptable, &ppool);
-	EXPECT_THAT(
-		get_ptable(ptable),
-		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
-							   _1, TOP_LEVEL))))));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Defragging a range only merges the subtables in that range. The others are
+ * left for a later defrag.
+ */
+TEST_F(mm, defrag_range)
+{
+	constexpr int mode = 0;
+	const paddr_t begin = pa_init(1456 * mm_entry_size(1));
+	const paddr_t end = pa_add(begin, 4 * mm_entry_size(1));
+	const paddr_t other_begin = pa_add(begin, 5 * mm_entry_size(TOP_LEVEL));
+	const paddr_t other_end = pa_add(other_begin, 4 * mm_entry_size(1));
+	const size_t index = pa_addr(begin) / mm_entry_size(TOP_LEVEL);
+	const size_t other_index = index + 5;
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
+				       nullptr, &ppool));
+	for (paddr_t b : {begin, other_begin}) {
+		paddr_t middle = pa_add(b, 67 * PAGE_SIZE);
+		paddr_t e = pa_add(b, 4 * mm_entry_size(1));
+		ASSERT_TRUE(mm_vm_unmap(&ptable, b, e, &ppool));
+		ASSERT_TRUE(mm_vm_identity_map(&ptable, b, middle, mode,
+					       nullptr, &ppool));
+		ASSERT_TRUE(mm_vm_identity_map(&ptable, middle, e, mode,
+					       nullptr, &ppool));
+	}
+
+	mm_vm_defrag_range(&ptable, begin, end, &ppool);
+	auto tables = get_ptable(ptable);
+	EXPECT_TRUE(arch_mm_pte_is_block(tables[0][index], TOP_LEVEL));
+	EXPECT_TRUE(arch_mm_pte_is_table(tables[0][other_index], TOP_LEVEL));
+
+	mm_vm_defrag_range(&ptable, other_begin, other_end, &ppool);
+	tables = get_ptable(ptable);
+	EXPECT_TRUE(arch_mm_pte_is_block(tables[0][other_index], TOP_LEVEL));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Defragging the whole table after defragging part of it still merges the
+ * subtables that were left out.
+ */
+TEST_F(mm, defrag_after_defrag_range)
+{
+	constexpr int mode = 0;
+	const paddr_t page_begin = pa_init(12000 * PAGE_SIZE);
+	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
+	const paddr_t other_begin =
+		pa_add(page_begin, 5 * mm_entry_size(TOP_LEVEL));
+	const paddr_t other_end = pa_add(other_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
+				       nullptr, &ppool));
+	ASSERT_TRUE(mm_vm_unmap(&ptable, page_begin, page_end, &ppool));
+	ASSERT_TRUE(mm_vm_unmap(&ptable, other_begin, other_end, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
+				       nullptr, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, other_begin, other_end, mode,
+				       nullptr, &ppool));
+	mm_vm_defrag_range(&ptable, page_begin, page_end, &ppool);
+	mm_vm_defrag(&ptable, &ppool);
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(Truly(std::bind(arch_mm_pte_is_block, _1,
+						    TOP_LEVEL))))));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+
+/**
+ * Aligned runs of pages that are mapped as a whole are given the contiguous
+ * hint.
+ */
+TEST_F(mm, map_contiguous_runs)
+{
+	constexpr int mode = 0;
+	const paddr_t map_begin = pa_init(mm_entry_size(1));
+	const paddr_t map_end = pa_add(map_begin, 64 * PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_ptable_stats stats;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, map_begin, map_end, mode,
+				       nullptr, &ppool));
+
+	auto table_l0 = get_table(
+		arch_mm_table_from_pte(*get_pte(ptable, map_begin, 1), 1));
+	EXPECT_THAT(table_l0.first(64),
+		    Each(Truly(std::bind(arch_mm_pte_is_contiguous, _1, 0))));
+
+	mm_vm_get_stats(&ptable, &stats);
+	EXPECT_THAT(stats.valid_bytes, Eq(64 * PAGE_SIZE));
+	EXPECT_THAT(stats.contiguous_bytes, Eq(64 * PAGE_SIZE));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Only the runs that are entirely mapped are given the contiguous hint.
+ */
+TEST_F(mm, map_unaligned_contiguous_runs)
+{
+	constexpr int mode = 0;
+	const paddr_t map_begin = pa_init(mm_entry_size(1) + 8 * PAGE_SIZE);
+	const paddr_t map_end = pa_add(map_begin, 40 * PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_ptable_stats stats;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, map_begin, map_end, mode,
+				       nullptr, &ppool));
+	mm_vm_get_stats(&ptable, &stats);
+	EXPECT_THAT(stats.valid_bytes, Eq(40 * PAGE_SIZE));
+	EXPECT_THAT(stats.contiguous_bytes, Eq(32 * PAGE_SIZE));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Unmapping a page breaks the contiguous run it is part of. Remapping it does
+ * not give the run the hint again, as its other entries are live.
+ */
+TEST_F(mm, unmap_breaks_contiguous_run)
+{
+	constexpr int mode = 0;
+	const paddr_t map_begin = pa_init(mm_entry_size(1));
+	const paddr_t map_end = pa_add(map_begin, 64 * PAGE_SIZE);
+	const paddr_t page_begin = pa_add(map_begin, 21 * PAGE_SIZE);
+	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_ptable_stats stats;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, map_begin, map_end, mode,
+				       nullptr, &ppool));
+	ASSERT_TRUE(mm_vm_unmap(&ptable, page_begin, page_end, &ppool));
+	mm_vm_get_stats(&ptable, &stats);
+	EXPECT_THAT(stats.valid_bytes, Eq(63 * PAGE_SIZE));
+	EXPECT_THAT(stats.contiguous_bytes, Eq(48 * PAGE_SIZE));
+
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
+				       nullptr, &ppool));
+	mm_vm_get_stats(&ptable, &stats);
+	EXPECT_THAT(stats.valid_bytes, Eq(64 * PAGE_SIZE));
+	EXPECT_THAT(stats.contiguous_bytes, Eq(48 * PAGE_SIZE));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Table entries record the number of present entries of the table they
+ * reference, so tables are freed as soon as their last entry is unmapped.
+ */
+TEST_F(mm, table_counts_present_entries)
+{
+	constexpr int mode = 0;
+	const paddr_t map_begin = pa_init(mm_entry_size(1));
+	const paddr_t map_end = pa_add(map_begin, 64 * PAGE_SIZE);
+	const paddr_t page_begin = pa_add(map_begin, 21 * PAGE_SIZE);
+	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, map_begin, map_end, mode,
+				       nullptr, &ppool));
+
+	for (int level = TOP_LEVEL; level > 1; --level) {
+		pte_t pte = *get_pte(ptable, map_begin, level);
+		EXPECT_THAT(arch_mm_table_pte_present_count(pte, level), Eq(1));
+		EXPECT_FALSE(arch_mm_table_pte_is_uniform(pte, level));
+	}
+
+	pte_t *pte_l1 = get_pte(ptable, map_begin, 1);
+	EXPECT_THAT(arch_mm_table_pte_present_count(*pte_l1, 1), Eq(64));
+	EXPECT_FALSE(arch_mm_table_pte_is_uniform(*pte_l1, 1));
+
+	ASSERT_TRUE(mm_vm_unmap(&ptable, page_begin, page_end, &ppool));
+	EXPECT_THAT(arch_mm_table_pte_present_count(*pte_l1, 1), Eq(63));
+
+	ASSERT_TRUE(mm_vm_unmap(&ptable, map_begin, map_end, &ppool));
+	EXPECT_THAT(get_ptable(ptable),
+		    AllOf(SizeIs(ROOT_TABLE_COUNT),
+			  Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
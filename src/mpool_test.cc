@@ -26,7 +26,9 @@ extern "C" {
 namespace
 {
 using ::testing::Eq;
+using ::testing::Gt;
 using ::testing::IsNull;
+using ::testing::Ne;
 using ::testing::NotNull;
 
 struct alignas(PAGE_SIZE) raw_page {
@@ -84,10 +86,26 @@ static void add_chunks(std::vector<std::unique_ptr<raw_page[]>>& chunks,
 	}
 }
 
+/**
+ * Runs the tests against each backend of the memory pool.
+ */
+class mpool_test : public ::testing::TestWithParam<enum mpool_backend>
+{
+       protected:
+	void init(struct mpool* p)
+	{
+		if (GetParam() == MPOOL_BACKEND_BUDDY) {
+			mpool_init_buddy(p, PAGE_SIZE);
+		} else {
+			mpool_init(p, PAGE_SIZE);
+		}
+	}
+};
+
 /**
  * Validates allocations from a memory pool.
  */
-TEST(mpool, allocation)
+TEST_P(mpool_test, allocation)
 {
 	struct mpool p;
 	constexpr size_t entry_size = PAGE_SIZE;
@@ -97,7 +115,7 @@ TEST(mpool, allocation)
 	std::vector<uintptr_t> allocs;
 	void* ret;
 
-	mpool_init(&p, entry_size);
+	init(&p);
 
 	/* Allocate from an empty pool. */
 	EXPECT_THAT(mpool_alloc(&p), IsNull());
@@ -125,7 +143,7 @@ TEST(mpool, allocation)
 /**
  * Validates frees into a memory pool.
  */
-TEST(mpool, freeing)
+TEST_P(mpool_test, freeing)
 {
 	struct mpool p;
 	constexpr size_t entry_size = PAGE_SIZE;
@@ -137,7 +155,7 @@ TEST(mpool, freeing)
 	alignas(entry_size) char entry[entry_size];
 	void* ret;
 
-	mpool_init(&p, entry_size);
+	init(&p);
 
 	/* Allocate from an empty pool. */
 	EXPECT_THAT(mpool_alloc(&p), IsNull());
@@ -188,7 +206,7 @@ TEST(mpool, freeing)
 /**
  * Initialises a memory pool from an existing one.
  */
-TEST(mpool, init_from)
+TEST_P(mpool_test, init_from)
 {
 	struct mpool p, q;
 	constexpr size_t entry_size = PAGE_SIZE;
@@ -199,7 +217,7 @@ TEST(mpool, init_from)
 	size_t i;
 	void* ret;
 
-	mpool_init(&p, entry_size);
+	init(&p);
 
 	/* Allocate a number of chunks and add them to the pool. */
 	add_chunks(chunks, &p, chunk_count, entries_per_chunk);
@@ -236,7 +254,7 @@ TEST(mpool, init_from)
 /**
  * Initialises a memory pool from an existing one.
  */
-TEST(mpool, alloc_contiguous)
+TEST_P(mpool_test, alloc_contiguous)
 {
 	struct mpool p;
 	constexpr size_t entry_size = PAGE_SIZE;
@@ -248,7 +266,7 @@ TEST(mpool, alloc_contiguous)
 	void* ret;
 	uintptr_t next;
 
-	mpool_init(&p, entry_size);
+	init(&p);
 
 	/* Allocate a number of chunks and add them to the pool. */
 	add_chunks(chunks, &p, chunk_count, entries_per_chunk);
@@ -267,7 +285,12 @@ TEST(mpool, alloc_contiguous)
 	/* Allocate 5 entries with an alignment of 4. So two must be skipped. */
 	ret = mpool_alloc_contiguous(&p, 5, 4);
 	ASSERT_THAT(ret, NotNull());
-	ASSERT_THAT((uintptr_t)ret, (next + 2) * entry_size);
+	if (GetParam() == MPOOL_BACKEND_LIST) {
+		ASSERT_THAT((uintptr_t)ret, (next + 2) * entry_size);
+	} else {
+		/* The buddy backend may take the entries from anywhere. */
+		ASSERT_THAT((uintptr_t)ret % (4 * entry_size), Eq(0));
+	}
 	for (i = 0; i < 5; i++) {
 		allocs.push_back((uintptr_t)ret + i * entry_size);
 	}
@@ -295,7 +318,7 @@ TEST(mpool, alloc_contiguous)
 		    true);
 }
 
-TEST(mpool, allocation_with_fallback)
+TEST_P(mpool_test, allocation_with_fallback)
 {
 	struct mpool fallback;
 	struct mpool p;
@@ -306,7 +329,7 @@ TEST(mpool, allocation_with_fallback)
 	std::vector<uintptr_t> allocs;
 	void* ret;
 
-	mpool_init(&fallback, entry_size);
+	init(&fallback);
 	mpool_init_with_fallback(&p, &fallback);
 
 	/* Allocate from an empty pool. */
@@ -325,18 +348,17 @@ TEST(mpool, allocation_with_fallback)
 		    true);
 }
 
-TEST(mpool, free_with_fallback)
+TEST_P(mpool_test, free_with_fallback)
 {
 	struct mpool fallback;
 	struct mpool p;
-	constexpr size_t entry_size = PAGE_SIZE;
 	constexpr size_t entries_per_chunk = 1;
 	constexpr size_t chunk_count = 1;
 	std::vector<std::unique_ptr<raw_page[]>> chunks;
 	std::vector<uintptr_t> allocs;
 	void* ret;
 
-	mpool_init(&fallback, entry_size);
+	init(&fallback);
 	mpool_init_with_fallback(&p, &fallback);
 
 	/* Allocate a number of chunks and add them to the fallback pool. */
@@ -360,4 +382,264 @@ TEST(mpool, free_with_fallback)
 	EXPECT_THAT(mpool_alloc(&fallback), Eq(ret));
 }
 
+/**
+ * Validates allocations and frees through the per-CPU magazines.
+ */
+TEST_P(mpool_test, magazines)
+{
+	struct mpool fallback;
+	struct mpool p;
+	struct mpool_stats stats;
+	constexpr size_t entry_size = PAGE_SIZE;
+	constexpr size_t entries_per_chunk = 10;
+	constexpr size_t chunk_count = 10;
+	std::vector<std::unique_ptr<raw_page[]>> chunks;
+	std::vector<uintptr_t> allocs;
+	size_t lock_acquired;
+	size_t i;
+	void* ret;
+
+	init(&fallback);
+	mpool_init_with_fallback(&p, &fallback);
+
+	/* The magazines need a page of the pool. */
+	EXPECT_THAT(mpool_enable_magazines(&p), false);
+	add_chunks(chunks, &p, chunk_count, entries_per_chunk);
+	ASSERT_THAT(mpool_enable_magazines(&p), true);
+
+	/* A page freed to the magazine is allocated back without locking. */
+	ret = mpool_alloc(&p);
+	ASSERT_THAT(ret, NotNull());
+	mpool_get_stats(&p, &stats);
+	lock_acquired = stats.lock_acquired;
+	mpool_free(&p, ret);
+	EXPECT_THAT(mpool_alloc(&p), Eq(ret));
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.lock_acquired, Eq(lock_acquired));
+	EXPECT_THAT(stats.magazine_hits, Eq(2));
+	mpool_free(&p, ret);
+
+	/* Allocate, free and allocate again until we run out of memory. */
+	while ((ret = mpool_alloc(&p))) {
+		allocs.push_back((uintptr_t)ret);
+	}
+	EXPECT_THAT(allocs.size(), Eq(chunk_count * entries_per_chunk - 1));
+	for (i = 0; i < allocs.size(); i++) {
+		mpool_free(&p, (void*)allocs[i]);
+	}
+	allocs.clear();
+	while ((ret = mpool_alloc(&p))) {
+		allocs.push_back((uintptr_t)ret);
+	}
+	EXPECT_THAT(allocs.size(), Eq(chunk_count * entries_per_chunk - 1));
+
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.magazine_refills, Gt(0));
+	EXPECT_THAT(stats.magazine_spills, Gt(0));
+
+	/*
+	 * Finishing the pool returns all pages to the fallback, including those
+	 * in the magazines and the page holding them.
+	 */
+	for (i = 0; i < allocs.size(); i++) {
+		mpool_free(&p, (void*)allocs[i]);
+	}
+	allocs.clear();
+	mpool_fini(&p);
+	while ((ret = mpool_alloc(&fallback))) {
+		allocs.push_back((uintptr_t)ret);
+	}
+	ASSERT_THAT(check_allocs(chunks, allocs, entries_per_chunk, entry_size),
+		    true);
+}
+
+/**
+ * Checks that the given page is filled with zeroes.
+ */
+bool is_zeroed(const void* page)
+{
+	const char* data = (const char*)page;
+	size_t i;
+
+	for (i = 0; i < PAGE_SIZE; i++) {
+		if (data[i] != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Validates allocations of zeroed pages, from the pages zeroed in advance and
+ * otherwise.
+ */
+TEST_P(mpool_test, zeroed)
+{
+	struct mpool p;
+	struct mpool local;
+	struct mpool_stats stats;
+	constexpr size_t entries_per_chunk = 8;
+	auto chunk = std::make_unique<raw_page[]>(entries_per_chunk);
+	std::vector<uintptr_t> allocs;
+	size_t i;
+	void* ret;
+
+	init(&p);
+	memset(chunk.get(), 0xff, entries_per_chunk * PAGE_SIZE);
+	mpool_add_chunk(&p, chunk.get(), entries_per_chunk * PAGE_SIZE);
+
+	/* Pages are only zeroed in advance up to the target. */
+	EXPECT_THAT(mpool_refill_zeroed(&p, 4), Eq(0));
+	mpool_set_zeroed_target(&p, 4);
+	EXPECT_THAT(mpool_refill_zeroed(&p, 3), Eq(3));
+	EXPECT_THAT(mpool_refill_zeroed(&p, 3), Eq(1));
+	EXPECT_THAT(mpool_refill_zeroed(&p, 3), Eq(0));
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.zeroed_pages, Eq(4));
+	EXPECT_THAT(stats.free_pages, Eq(entries_per_chunk));
+
+	/* A zeroed page is taken from the pages zeroed in advance. */
+	ret = mpool_alloc_zeroed(&p);
+	ASSERT_THAT(ret, NotNull());
+	EXPECT_THAT(is_zeroed(ret), true);
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.zeroed_pages, Eq(3));
+	EXPECT_THAT(stats.zeroed_hits, Eq(1));
+
+	/* Local pools take them from their fallback. */
+	mpool_init_with_fallback(&local, &p);
+	ret = mpool_alloc_zeroed(&local);
+	ASSERT_THAT(ret, NotNull());
+	EXPECT_THAT(is_zeroed(ret), true);
+	mpool_fini(&local);
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.zeroed_pages, Eq(2));
+	EXPECT_THAT(stats.zeroed_hits, Eq(2));
+
+	/* The pages zeroed in advance are given up when the pool runs out. */
+	while ((ret = mpool_alloc(&p))) {
+		allocs.push_back((uintptr_t)ret);
+	}
+	EXPECT_THAT(allocs.size(), Eq(entries_per_chunk - 2));
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.zeroed_pages, Eq(0));
+
+	/* Otherwise, zeroed pages are cleared when they are allocated. */
+	for (i = 0; i < allocs.size(); i++) {
+		memset((void*)allocs[i], 0xff, PAGE_SIZE);
+		mpool_free(&p, (void*)allocs[i]);
+	}
+	ret = mpool_alloc_zeroed(&p);
+	ASSERT_THAT(ret, NotNull());
+	EXPECT_THAT(is_zeroed(ret), true);
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.zeroed_misses, Eq(1));
+
+	mpool_fini(&p);
+}
+
+/**
+ * Validates that adjacent ranges of free entries are merged, both when freed
+ * and when merged into the fallback.
+ */
+TEST_P(mpool_test, coalescing)
+{
+	struct mpool fallback;
+	struct mpool p;
+	struct mpool_stats stats;
+	constexpr size_t entry_size = PAGE_SIZE;
+	constexpr size_t entries_per_chunk = 16;
+	auto mem = std::make_unique<raw_page[]>(2 * entries_per_chunk);
+	raw_page* chunk;
+	uintptr_t ret[4];
+	size_t i;
+
+	/* Use a chunk aligned to its size, so it is a single buddy block. */
+	chunk = (raw_page*)(((uintptr_t)mem.get() +
+			     entries_per_chunk * entry_size - 1) &
+			    ~(entries_per_chunk * entry_size - 1));
+
+	init(&fallback);
+	mpool_init_with_fallback(&p, &fallback);
+	mpool_add_chunk(&p, chunk, entries_per_chunk * entry_size);
+
+	/* Split the chunk in four, and free the pieces out of order. */
+	for (i = 0; i < 4; i++) {
+		ret[i] = (uintptr_t)mpool_alloc_contiguous(&p, 4, 1);
+		ASSERT_THAT(ret[i], Ne(0));
+	}
+	EXPECT_THAT(mpool_alloc(&p), IsNull());
+	for (int j : {2, 0, 3, 1}) {
+		mpool_add_chunk(&p, (void*)ret[j], 4 * entry_size);
+	}
+
+	mpool_get_stats(&p, &stats);
+	EXPECT_THAT(stats.free_pages, Eq(entries_per_chunk));
+	EXPECT_THAT(stats.free_ranges, Eq(1));
+	EXPECT_THAT(stats.largest_free_range, Eq(entries_per_chunk));
+
+	/* The whole chunk can be allocated again. */
+	EXPECT_THAT(mpool_alloc_contiguous(&p, entries_per_chunk, 1),
+		    Eq((void*)chunk));
+
+	/* Pieces returned to the fallback are merged there. */
+	for (i = 0; i < 4; i++) {
+		mpool_add_chunk(&p, (void*)(chunk + 4 * i),
+				4 * entry_size);
+		mpool_fini(&p);
+		mpool_init_with_fallback(&p, &fallback);
+	}
+
+	mpool_get_stats(&fallback, &stats);
+	EXPECT_THAT(stats.free_pages, Eq(entries_per_chunk));
+	EXPECT_THAT(stats.free_ranges, Eq(1));
+	EXPECT_THAT(mpool_alloc_contiguous(&fallback, entries_per_chunk, 1),
+		    Eq((void*)chunk));
+}
+
+/**
+ * Validates that the buddy backend merges pages freed one by one.
+ */
+TEST(mpool_buddy, coalescing)
+{
+	struct mpool p;
+	constexpr size_t entry_size = PAGE_SIZE;
+	constexpr size_t entries_per_chunk = 16;
+	std::vector<std::unique_ptr<raw_page[]>> chunks;
+	std::vector<uintptr_t> allocs;
+	size_t i;
+	void* ret;
+
+	mpool_init_buddy(&p, entry_size);
+	add_chunks(chunks, &p, 1, entries_per_chunk);
+
+	/* Split the chunk into single entries and free them all. */
+	while ((ret = mpool_alloc(&p))) {
+		allocs.push_back((uintptr_t)ret);
+	}
+	ASSERT_THAT(allocs.size(), Eq(entries_per_chunk));
+	for (i = 0; i < allocs.size(); i++) {
+		mpool_free(&p, (void*)allocs[i]);
+	}
+
+	/* The whole chunk can be allocated again. */
+	ret = mpool_alloc_contiguous(&p, entries_per_chunk, 1);
+	EXPECT_THAT(ret, Eq((void*)chunks[0].get()));
+	EXPECT_THAT(mpool_alloc(&p), IsNull());
+	mpool_add_chunk(&p, ret, entries_per_chunk * entry_size);
+
+	/* The remainder of a block is given back, and merged again on free. */
+	ret = mpool_alloc_contiguous(&p, 3, 2);
+	ASSERT_THAT(ret, NotNull());
+	EXPECT_THAT((uintptr_t)ret % (2 * entry_size), Eq(0));
+	mpool_add_chunk(&p, ret, 3 * entry_size);
+	EXPECT_THAT(mpool_alloc_contiguous(&p, entries_per_chunk, 1),
+		    Eq((void*)chunks[0].get()));
+}
+
+INSTANTIATE_TEST_SUITE_P(backends, mpool_test,
+			 ::testing::Values(MPOOL_BACKEND_LIST,
+					   MPOOL_BACKEND_BUDDY));
+
 } /* namespace */
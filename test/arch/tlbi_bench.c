@@ -0,0 +1,91 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures the cost of TLB invalidation for ranges of 16KiB to 1GiB. The ranges
+ * are first invalidated before arch_mm_init() has detected the features of the
+ * CPU, i.e. one page at a time or all entries at once, and then again with the
+ * range operations of ARMv8.4 if the CPU supports them.
+ */
+
+#include "hf/arch/mm.h"
+
+#include "hf/dlog.h"
+#include "hf/std.h"
+
+#include "hftest.h"
+#include "msr.h"
+
+#define NANOS_PER_UNIT 1000000000
+#define ROUNDS 64
+#define BENCH_BASE 0x40000000
+
+static const size_t range_sizes[] = {
+	16 * 1024,	   64 * 1024,	      256 * 1024,
+	1024 * 1024,	   2 * 1024 * 1024,   16 * 1024 * 1024,
+	128 * 1024 * 1024, 1024 * 1024 * 1024,
+};
+
+static uint64_t now_ticks(void)
+{
+	__asm__ volatile("isb");
+	return read_msr(cntpct_el0);
+}
+
+/**
+ * Logs the average time, in nanoseconds, to invalidate each range size at both
+ * stages.
+ */
+static void measure(const char *name)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < ARRAY_SIZE(range_sizes); ++i) {
+		size_t size = range_sizes[i];
+		uint64_t stage1;
+		uint64_t stage2;
+		uint64_t begin;
+
+		begin = now_ticks();
+		for (j = 0; j < ROUNDS; ++j) {
+			arch_mm_invalidate_stage1_range(
+				va_init(BENCH_BASE),
+				va_init(BENCH_BASE + size));
+		}
+		stage1 = now_ticks() - begin;
+
+		begin = now_ticks();
+		for (j = 0; j < ROUNDS; ++j) {
+			arch_mm_invalidate_stage2_range(
+				ipa_init(BENCH_BASE),
+				ipa_init(BENCH_BASE + size));
+		}
+		stage2 = now_ticks() - begin;
+
+		dlog("%s %8u KiB: stage-1 %8u ns, stage-2 %8u ns\n", name,
+		     size / 1024,
+		     stage1 * NANOS_PER_UNIT / read_msr(cntfrq_el0) / ROUNDS,
+		     stage2 * NANOS_PER_UNIT / read_msr(cntfrq_el0) / ROUNDS);
+	}
+}
+
+TEST(tlbi, range_bench)
+{
+	measure("per-page");
+	ASSERT_TRUE(arch_mm_init());
+	measure("detected");
+}
@@ -22,6 +22,7 @@
 
 #include "vmapi/hf/call.h"
 
+#include "../msr.h"
 #include "hftest.h"
 
 /**
@@ -157,3 +158,42 @@ TEST(fp, fp)
 	EXPECT_TRUE(b == 8.0);
 	EXPECT_TRUE(result == 8.0);
 }
+
+/**
+ * Returns the average number of counter ticks taken by a hypercall with the
+ * given function ID and no arguments.
+ */
+static uint64_t hypercall_ticks(uint64_t func, uint32_t calls)
+{
+	uint64_t begin;
+	uint32_t i;
+
+	__asm__ volatile("isb");
+	begin = read_msr(cntvct_el0);
+	for (i = 0; i < calls; ++i) {
+		hf_call(func, 0, 0, 0);
+	}
+	__asm__ volatile("isb");
+
+	return (read_msr(cntvct_el0) - begin) / calls;
+}
+
+/**
+ * Measures the latency of the hypercalls served by the fast path in the
+ * exception vector, HF_VM_GET_ID and SPCI_VERSION, against ones dispatched to
+ * the C handler. Timings are only logged.
+ */
+TEST(hypercall, latency)
+{
+	const uint32_t calls = 10000;
+
+	dlog("Hypercall latency in ticks (%u ticks per second):\n",
+	     read_msr(cntfrq_el0));
+	dlog("  HF_VM_GET_ID: %u\n", hypercall_ticks(HF_VM_GET_ID, calls));
+	dlog("  SPCI_VERSION: %u\n", hypercall_ticks(SPCI_VERSION_32, calls));
+	dlog("  HF_VM_GET_COUNT: %u\n",
+	     hypercall_ticks(HF_VM_GET_COUNT, calls));
+	dlog("  HF_INTERRUPT_GET: %u\n",
+	     hypercall_ticks(HF_INTERRUPT_GET, calls));
+	dlog("  SPCI_YIELD: %u\n", hypercall_ticks(SPCI_YIELD_32, calls));
+}
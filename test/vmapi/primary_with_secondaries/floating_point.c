@@ -17,6 +17,7 @@
 #include "hf/arch/std.h"
 #include "hf/arch/vm/registers.h"
 
+#include "hf/dlog.h"
 #include "hf/spci.h"
 
 #include "vmapi/hf/call.h"
@@ -50,6 +51,37 @@ TEST(floating_point, fp_fill)
 	EXPECT_EQ(check_fp_register(second), true);
 }
 
+/**
+ * Test that the floating point registers of vCPUs of different VMs run one
+ * after another on the same CPU are kept apart, and that the hypervisor doesn't
+ * change them while it handles their calls.
+ */
+TEST(floating_point, fp_fill_two_vms)
+{
+	const double value = -3.5;
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM0, "fp_fill_vm_value", mb.send);
+	SERVICE_SELECT(SERVICE_VM1, "fp_fill_vm_value", mb.send);
+	fill_fp_registers(value);
+
+	/* Each VM fills the registers with its own value and yields. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+	EXPECT_EQ(check_fp_register(value), true);
+	run_res = hf_vcpu_run(SERVICE_VM1, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+	EXPECT_EQ(check_fp_register(value), true);
+
+	/* Each VM checks that it still has its own value. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+	run_res = hf_vcpu_run(SERVICE_VM1, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+	EXPECT_EQ(check_fp_register(value), true);
+}
+
 /**
  * Test that the floating point control register is restored correctly
  * on full context switch when needed by changing it in the service.
@@ -71,3 +103,52 @@ TEST(floating_point, fp_fpcr)
 	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
 	EXPECT_EQ(read_msr(fpcr), value);
 }
+
+/**
+ * Returns the average number of counter ticks taken to run the vCPU of the VM
+ * until it yields.
+ */
+static uint64_t round_trip_ticks(spci_vm_id_t vm_id, uint32_t round_trips)
+{
+	struct hf_vcpu_run_return run_res;
+	uint64_t begin;
+	uint32_t i;
+
+	__asm__ volatile("isb");
+	begin = read_msr(cntvct_el0);
+	for (i = 0; i < round_trips; ++i) {
+		run_res = hf_vcpu_run(vm_id, 0);
+		EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+	}
+	__asm__ volatile("isb");
+
+	return (read_msr(cntvct_el0) - begin) / round_trips;
+}
+
+/**
+ * Measures the cost of running a secondary which doesn't use floating point,
+ * whose floating point state is never switched, against one that does, whose
+ * state is switched on every round trip. The difference is what the lazy
+ * switching saves for each call to hf_vcpu_run. Timings are only logged.
+ */
+TEST(floating_point, fp_round_trip_cost)
+{
+	const double value = 1.2;
+	const uint32_t round_trips = 1000;
+	uint64_t without_fp;
+	uint64_t with_fp;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM0, "yield_loop", mb.send);
+	SERVICE_SELECT(SERVICE_VM1, "fp_yield_loop", mb.send);
+
+	fill_fp_registers(value);
+	without_fp = round_trip_ticks(SERVICE_VM0, round_trips);
+	with_fp = round_trip_ticks(SERVICE_VM1, round_trips);
+	EXPECT_EQ(check_fp_register(value), true);
+
+	dlog("hf_vcpu_run round trip: %u ticks without floating point, %u "
+	     "ticks with it, %d ticks saved (%u ticks per second)\n",
+	     without_fp, with_fp, (int)(with_fp - without_fp),
+	     read_msr(cntfrq_el0));
+}
@@ -189,6 +189,65 @@ TEST(mailbox, relay)
 	EXPECT_EQ(hf_mailbox_clear(), 0);
 }
 
+/**
+ * Relay a message through a VM which opted in to direct handoff. The CPU is
+ * handed straight to it when the message is sent to it, so the primary VM is
+ * only returned to with the final message and retrieves the handoff afterwards.
+ */
+TEST(mailbox, relay_with_direct_handoff)
+{
+	const char message[] = "Hand this straight over!";
+	struct hf_vcpu_run_return run_res;
+	struct hf_vcpu_handoff handoff;
+	struct mailbox_buffers mb = set_up_mailbox();
+	int64_t res;
+
+	SERVICE_SELECT(SERVICE_VM0, "relay", mb.send);
+	SERVICE_SELECT(SERVICE_VM3, "relay", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+	EXPECT_EQ(hf_vcpu_handoff_get(), -1);
+
+	/*
+	 * Build the message chain so the message is sent from here to
+	 * SERVICE_VM0, then to SERVICE_VM3 and finally back to here.
+	 */
+	{
+		spci_vm_id_t *chain = (spci_vm_id_t *)mb.send->payload;
+		*chain++ = htole32(SERVICE_VM3);
+		*chain++ = htole32(HF_PRIMARY_VM_ID);
+		memcpy_s(chain,
+			 SPCI_MSG_PAYLOAD_MAX - (2 * sizeof(spci_vm_id_t)),
+			 message, sizeof(message));
+
+		spci_message_init(mb.send,
+				  sizeof(message) + (2 * sizeof(spci_vm_id_t)),
+				  SERVICE_VM0, HF_PRIMARY_VM_ID);
+		EXPECT_EQ(spci_msg_send(0), 0);
+	}
+
+	/* SERVICE_VM0 hands the CPU to SERVICE_VM3, which sends it here. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(run_res.message.vm_id, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(mb.recv->length, sizeof(message));
+	EXPECT_EQ(memcmp(mb.recv->payload, message, sizeof(message)), 0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+
+	/* The handoff is recorded for the scheduler. */
+	res = hf_vcpu_handoff_get();
+	ASSERT_NE(res, -1);
+	handoff = hf_vcpu_handoff_decode(res);
+	EXPECT_EQ(handoff.from_vm_id, SERVICE_VM0);
+	EXPECT_EQ(handoff.from_vcpu, 0);
+	EXPECT_EQ(handoff.to_vm_id, SERVICE_VM3);
+	EXPECT_EQ(handoff.to_vcpu, 0);
+	EXPECT_EQ(hf_vcpu_handoff_get(), -1);
+}
+
 /**
  * Send a message before the secondary VM is configured, but do not register
  * for notification. Ensure we're not notified.
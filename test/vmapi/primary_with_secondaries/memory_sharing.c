@@ -27,6 +27,12 @@
 
 alignas(PAGE_SIZE) static uint8_t page[PAGE_SIZE];
 
+/*
+ * More pages than the 8 ranges of memory given lazily that a VM can have
+ * uncleared at a time.
+ */
+alignas(PAGE_SIZE) static uint8_t lazy_pages[10][PAGE_SIZE];
+
 /**
  * Tries sharing memory in different modes with different VMs and asserts that
  * it will fail.
@@ -35,7 +41,7 @@ void check_cannot_share_memory(void *ptr, size_t size)
 {
 	uint32_t vms[] = {SERVICE_VM0, SERVICE_VM1};
 	enum hf_share modes[] = {HF_MEMORY_GIVE, HF_MEMORY_LEND,
-				 HF_MEMORY_SHARE};
+				 HF_MEMORY_SHARE, HF_MEMORY_GIVE_LAZY};
 	int i;
 	int j;
 
@@ -376,6 +382,200 @@ TEST(memory_sharing, give_and_get_back)
 	EXPECT_EQ(run_res.code, HF_VCPU_RUN_ABORTED);
 }
 
+/**
+ * Memory given to a VM which then aborts is cleared before it is given back to
+ * the primary.
+ */
+TEST(memory_sharing, give_and_reclaim_on_abort)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	uint8_t *ptr = page;
+
+	SERVICE_SELECT(SERVICE_VM0, "memory_fill_and_abort", mb.send);
+
+	ASSERT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_GIVE),
+		  0);
+	memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, &ptr, sizeof(ptr));
+	spci_message_init(mb.send, sizeof(ptr), SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	/* The memory is reclaimed once the VM has aborted. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_ABORTED);
+	for (int i = 0; i < PAGE_SIZE; ++i) {
+		ASSERT_EQ(ptr[i], 0);
+	}
+}
+
+/**
+ * Memory given away lazily is cleared as the recipient accesses it, and can be
+ * given back.
+ */
+TEST(memory_sharing, give_lazily_and_get_back)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	uint8_t *ptr = page;
+
+	SERVICE_SELECT(SERVICE_VM0, "memory_return", mb.send);
+
+	/* Dirty the memory before giving it. */
+	memset_s(ptr, sizeof(page), 'b', PAGE_SIZE);
+	ASSERT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_GIVE_LAZY),
+		  0);
+
+	memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, &ptr, sizeof(ptr));
+	spci_message_init(mb.send, sizeof(ptr), SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	/* Let the memory be returned. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	for (int i = 0; i < PAGE_SIZE; ++i) {
+		ASSERT_EQ(ptr[i], 0);
+	}
+
+	/* Observe the service faulting when accessing the memory. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_ABORTED);
+}
+
+/**
+ * Memory given away lazily is cleared while the primary is idle, so the WFI of
+ * the primary is trapped and completes even without an interrupt to wake it.
+ */
+TEST(memory_sharing, give_lazily_and_clear_on_wfi)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	uint8_t *ptr = page;
+
+	SERVICE_SELECT(SERVICE_VM0, "memory_return", mb.send);
+
+	/* Dirty the memory before giving it. */
+	memset_s(ptr, sizeof(page), 'b', PAGE_SIZE);
+	ASSERT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_GIVE_LAZY),
+		  0);
+
+	memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, &ptr, sizeof(ptr));
+	spci_message_init(mb.send, sizeof(ptr), SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	/* A single page is cleared by the first WFI. */
+	__asm__ volatile("wfi");
+
+	/* Let the memory be returned. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	for (int i = 0; i < PAGE_SIZE; ++i) {
+		ASSERT_EQ(ptr[i], 0);
+	}
+}
+
+/**
+ * Memory given away lazily once the recipient can't track any more uncleared
+ * ranges is cleared before it is given instead, so it is still given.
+ */
+TEST(memory_sharing, give_lazily_more_ranges_than_tracked)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	size_t i;
+
+	SERVICE_SELECT(SERVICE_VM0, "memory_return", mb.send);
+
+	/* Dirty the memory, and give each page lazily as a range of its own. */
+	memset_s(lazy_pages, sizeof(lazy_pages), 'b', sizeof(lazy_pages));
+	for (i = 0; i < ARRAY_SIZE(lazy_pages); ++i) {
+		ASSERT_EQ(hf_share_memory(SERVICE_VM0,
+					  (hf_ipaddr_t)lazy_pages[i], PAGE_SIZE,
+					  HF_MEMORY_GIVE_LAZY),
+			  0);
+	}
+
+	/* Let each page be returned, whichever way it was cleared. */
+	for (i = 0; i < ARRAY_SIZE(lazy_pages); ++i) {
+		uint8_t *ptr = lazy_pages[i];
+
+		memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, &ptr,
+			 sizeof(ptr));
+		spci_message_init(mb.send, sizeof(ptr), SERVICE_VM0,
+				  HF_PRIMARY_VM_ID);
+		EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+		run_res = hf_vcpu_run(SERVICE_VM0, 0);
+		EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+		for (int j = 0; j < PAGE_SIZE; ++j) {
+			ASSERT_EQ(ptr[j], 0);
+		}
+		EXPECT_EQ(hf_mailbox_clear(), 0);
+	}
+}
+
+/**
+ * Memory given away lazily is cleared before the recipient donates it on with
+ * an SPCI message, even if the recipient never accessed it.
+ */
+TEST(memory_sharing, give_lazily_and_spci_donate_back)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	uint8_t *ptr = page;
+
+	SERVICE_SELECT(SERVICE_VM0, "spci_donate_back_untouched", mb.send);
+
+	/* Dirty the memory before giving it. */
+	memset_s(ptr, sizeof(page), 'b', PAGE_SIZE);
+	ASSERT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_GIVE_LAZY),
+		  0);
+
+	memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, &ptr, sizeof(ptr));
+	spci_message_init(mb.send, sizeof(ptr), SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	for (int i = 0; i < PAGE_SIZE; ++i) {
+		ASSERT_EQ(ptr[i], 0);
+	}
+}
+
+/**
+ * Memory given away lazily is cleared when the recipient tries to use it as its
+ * mailbox. The VM configured its mailbox when it booted, so configuring it
+ * again fails, but only after the pages have been checked.
+ */
+TEST(memory_sharing, give_lazily_and_configure_mailbox)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	uint8_t *ptr = lazy_pages[0];
+
+	SERVICE_SELECT(SERVICE_VM0, "memory_configure_mailbox", mb.send);
+
+	/* Dirty the memory before giving it. */
+	memset_s(lazy_pages, sizeof(lazy_pages), 'b', 2 * PAGE_SIZE);
+	ASSERT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)ptr, 2 * PAGE_SIZE,
+				  HF_MEMORY_GIVE_LAZY),
+		  0);
+
+	memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, &ptr, sizeof(ptr));
+	spci_message_init(mb.send, sizeof(ptr), SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	/* Let the memory be returned. */
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	for (int i = 0; i < 2 * PAGE_SIZE; ++i) {
+		ASSERT_EQ(ptr[i], 0);
+	}
+}
+
 /**
  * Memory that has been lent can be returned to the owner.
  */
@@ -34,6 +34,22 @@ TEST_SERVICE(fp_fill)
 	spci_yield();
 }
 
+/**
+ * Fills the floating point registers with a value that depends on the VM, so
+ * that VMs running this service one after another on a CPU can tell whether
+ * they see each other's state.
+ */
+TEST_SERVICE(fp_fill_vm_value)
+{
+	const double value = hf_vm_get_id() + 0.25;
+
+	fill_fp_registers(value);
+	EXPECT_EQ(spci_yield(), SPCI_SUCCESS);
+
+	ASSERT_TRUE(check_fp_register(value));
+	spci_yield();
+}
+
 TEST_SERVICE(fp_fpcr)
 {
 	uintreg_t value = 3 << 22; /* Set RMode to RZ */
@@ -43,3 +59,21 @@ TEST_SERVICE(fp_fpcr)
 	ASSERT_EQ(read_msr(fpcr), value);
 	spci_yield();
 }
+
+TEST_SERVICE(yield_loop)
+{
+	for (;;) {
+		spci_yield();
+	}
+}
+
+TEST_SERVICE(fp_yield_loop)
+{
+	double value = 0.75;
+
+	for (;;) {
+		fill_fp_registers(value);
+		spci_yield();
+		value += 1.0;
+	}
+}
@@ -56,6 +56,25 @@ TEST_SERVICE(memory_increment)
 	}
 }
 
+TEST_SERVICE(memory_fill_and_abort)
+{
+	uint8_t *ptr;
+	size_t i;
+	/* Not using NULL so static analysis doesn't complain. */
+	int *p = (int *)1;
+
+	EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), 0);
+	ptr = *(uint8_t **)SERVICE_RECV_BUFFER()->payload;
+	hf_mailbox_clear();
+
+	/* Fill the memory with data the primary must not see. */
+	for (i = 0; i < PAGE_SIZE; ++i) {
+		ptr[i] = 'x';
+	}
+
+	*p = 12;
+}
+
 TEST_SERVICE(memory_lend_relinquish_spci)
 {
 	/* Loop, giving memory back to the sender. */
@@ -209,6 +228,46 @@ TEST_SERVICE(spci_memory_return)
 	}
 }
 
+TEST_SERVICE(spci_donate_back_untouched)
+{
+	uint8_t *ptr;
+
+	EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), 0);
+	ptr = *(uint8_t **)SERVICE_RECV_BUFFER()->payload;
+	hf_mailbox_clear();
+
+	/* Donate the memory back without accessing it. */
+	struct spci_memory_region_constituent constituents[] = {
+		{.address = (uint64_t)ptr, .page_count = 1},
+	};
+
+	spci_memory_donate(SERVICE_SEND_BUFFER(), HF_PRIMARY_VM_ID,
+			   hf_vm_get_id(), constituents, 1, 0);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+}
+
+TEST_SERVICE(memory_configure_mailbox)
+{
+	uint8_t *ptr;
+
+	EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), 0);
+	ptr = *(uint8_t **)SERVICE_RECV_BUFFER()->payload;
+	hf_mailbox_clear();
+
+	/* The mailbox can only be configured once. */
+	EXPECT_EQ(hf_vm_configure((hf_ipaddr_t)ptr,
+				  (hf_ipaddr_t)ptr + PAGE_SIZE),
+		  -1);
+
+	/* Give the memory back and notify the sender. */
+	ASSERT_EQ(hf_share_memory(HF_PRIMARY_VM_ID, (hf_ipaddr_t)ptr,
+				  2 * PAGE_SIZE, HF_MEMORY_GIVE),
+		  0);
+	spci_message_init(SERVICE_SEND_BUFFER(), 0, HF_PRIMARY_VM_ID,
+			  hf_vm_get_id());
+	EXPECT_EQ(spci_msg_send(0), 0);
+}
+
 TEST_SERVICE(spci_donate_check_upper_bound)
 {
 	EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), 0);